@@ -7,6 +7,7 @@
 #include "Types.h"
 
 class IPipeThrottler;
+class IFsFile;
 
 class IPipe : public IObject
 {
@@ -44,6 +45,14 @@ public:
 	virtual void resetTransferedBytes(void)=0;
 
 	virtual _i64 getRealTransferredBytes() { return 0; }
+
+	/**
+	* Writes header followed by bsize bytes of file starting at offset,
+	* without copying the file data through user space.
+	* Only supported if canWriteFromFile() returns true (plain sockets)
+	**/
+	virtual bool canWriteFromFile() { return false; }
+	virtual bool WriteFromFile(const char* header, size_t header_size, IFsFile* file, _i64 offset, size_t bsize, int timeoutms=-1) { return false; }
 };
 
 #endif //IPIPE_H
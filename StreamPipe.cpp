@@ -24,8 +24,12 @@
 #include <memory.h>
 #include <errno.h>
 #endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #include "Server.h"
 #include "Interface/PipeThrottler.h"
+#include "Interface/File.h"
 #include "stringtools.h"
 
 CStreamPipe::CStreamPipe( SOCKET pSocket)
@@ -226,6 +230,84 @@ bool CStreamPipe::Write(const std::string &str, int timeoutms, bool flush)
 	return Write(&str[0], str.size(), timeoutms, flush);
 }
 
+bool CStreamPipe::canWriteFromFile()
+{
+#ifdef __linux__
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool CStreamPipe::WriteFromFile(const char* header, size_t header_size, IFsFile* file, _i64 offset, size_t bsize, int timeoutms)
+{
+#ifdef __linux__
+	size_t written=0;
+	while(written<header_size)
+	{
+		int rc = selectSocketWrite(s, timeoutms);
+		if(rc<=0)
+		{
+			has_error=true;
+			return false;
+		}
+
+		rc=send(s, header+written, (int)(header_size-written), MSG_NOSIGNAL|MSG_MORE);
+		if(rc<0)
+		{
+			if(errno==EINTR || errno==EAGAIN || errno==EWOULDBLOCK)
+			{
+				continue;
+			}
+			has_error=true;
+			return false;
+		}
+
+		doThrottle(rc, true, true);
+		written+=rc;
+	}
+
+	int fd = file->getOsHandle();
+	off_t foffset = static_cast<off_t>(offset);
+	written=0;
+	while(written<bsize)
+	{
+		int rc = selectSocketWrite(s, timeoutms);
+		if(rc<=0)
+		{
+			has_error=true;
+			return false;
+		}
+
+		ssize_t sent=sendfile(s, fd, &foffset, bsize-written);
+		if(sent<0)
+		{
+			if(errno==EINTR || errno==EAGAIN || errno==EWOULDBLOCK)
+			{
+				continue;
+			}
+			Server->Log("Error sending file data via sendfile. Errno: "+convert(errno), LL_DEBUG);
+			has_error=true;
+			return false;
+		}
+		else if(sent==0)
+		{
+			//File got shorter. Header was already sent, so the stream is broken
+			Server->Log("Unexpected end of file in sendfile at offset "+convert(static_cast<_i64>(foffset)), LL_DEBUG);
+			has_error=true;
+			return false;
+		}
+
+		doThrottle(sent, true, true);
+		written+=sent;
+	}
+
+	return true;
+#else
+	return false;
+#endif
+}
+
 size_t CStreamPipe::Read(std::string *ret, int timeoutms)
 {
 	char buffer[8192];
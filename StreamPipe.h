@@ -36,6 +36,9 @@ public:
 
 	virtual bool Flush( int timeoutms=-1 );
 
+	virtual bool canWriteFromFile();
+	virtual bool WriteFromFile(const char* header, size_t header_size, IFsFile* file, _i64 offset, size_t bsize, int timeoutms);
+
 	bool doThrottle(size_t new_bytes, bool outgoing, bool wait);
 
 private:
@@ -31,6 +31,26 @@ adler32.c -- compute the Adler-32 checksum of a data stream
 
 /* @(#) $Id$ */
 
+/*
+ SSE2/AVX2 kernels are based on the vectorized Adler-32 in Chromium's zlib
+ (adler32_simd.c), adapted to runtime CPU dispatch.
+ */
+
+#if !defined(NO_ADLER32_SIMD) && (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+#	if defined(_MSC_VER) && _MSC_VER >= 1800
+#		define ADLER32_SIMD_AVAILABLE
+#		define ADLER32_TARGET_SSE2
+#		define ADLER32_TARGET_AVX2
+#		include <intrin.h>
+#		include <immintrin.h>
+#	elif defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#		define ADLER32_SIMD_AVAILABLE
+#		define ADLER32_TARGET_SSE2 __attribute__((target("sse2")))
+#		define ADLER32_TARGET_AVX2 __attribute__((target("avx2")))
+#		include <immintrin.h>
+#	endif
+#endif
+
 #define BASE 65521      /* largest prime smaller than 65536 */
 #define NMAX 5552
 /* NMAX is the largest n such that 255n(n+1)/2 + (n+1)(BASE-1) <= 2^32-1 */
@@ -47,7 +67,7 @@ adler32.c -- compute the Adler-32 checksum of a data stream
 #  define MOD63(a) a %= BASE
 
 /* ========================================================================= */
-unsigned int urb_adler32(unsigned int adler, const char* pbuf, unsigned int len)
+static unsigned int adler32_scalar(unsigned int adler, const char* pbuf, unsigned int len)
 {
 	const unsigned char* buf = reinterpret_cast<const unsigned char*>(pbuf);
     unsigned int sum2;
@@ -115,6 +135,220 @@ unsigned int urb_adler32(unsigned int adler, const char* pbuf, unsigned int len)
     return adler | (sum2 << 16);
 }
 
+#ifdef ADLER32_SIMD_AVAILABLE
+
+namespace
+{
+	/* Sums up the four 32-bit lanes */
+	ADLER32_TARGET_SSE2 inline unsigned int hsum_epi32(__m128i v)
+	{
+		v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+		v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+		return static_cast<unsigned int>(_mm_cvtsi128_si32(v));
+	}
+
+	/*
+	 Processes 16 byte blocks. Per block s1 += sum(b_i), s2 += 16*s1 + sum((16-i)*b_i).
+	 The 16*s1 part is accumulated in v_ps and multiplied at the end of every NMAX run.
+	 */
+	ADLER32_TARGET_SSE2 unsigned int adler32_sse2(unsigned int adler, const unsigned char* buf, unsigned int len)
+	{
+		const unsigned int block_size = 16;
+
+		unsigned int s1 = adler & 0xffff;
+		unsigned int s2 = (adler >> 16) & 0xffff;
+
+		unsigned int blocks = len / block_size;
+		len -= blocks * block_size;
+
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i weights_lo = _mm_set_epi16(9, 10, 11, 12, 13, 14, 15, 16);
+		const __m128i weights_hi = _mm_set_epi16(1, 2, 3, 4, 5, 6, 7, 8);
+
+		while (blocks)
+		{
+			unsigned int n = NMAX / block_size;
+			if (n > blocks)
+				n = blocks;
+			blocks -= n;
+
+			__m128i v_ps = _mm_set_epi32(0, 0, 0, s1 * n);
+			__m128i v_s2 = _mm_set_epi32(0, 0, 0, s2);
+			__m128i v_s1 = zero;
+
+			do
+			{
+				__m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf));
+
+				v_ps = _mm_add_epi32(v_ps, v_s1);
+				v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes, zero));
+
+				v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_unpacklo_epi8(bytes, zero), weights_lo));
+				v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_unpackhi_epi8(bytes, zero), weights_hi));
+
+				buf += block_size;
+			} while (--n);
+
+			v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 4));
+
+			s1 += hsum_epi32(v_s1);
+			s2 = hsum_epi32(v_s2);
+
+			MOD(s1);
+			MOD(s2);
+		}
+
+		adler = s1 | (s2 << 16);
+
+		if (len)
+		{
+			return adler32_scalar(adler, reinterpret_cast<const char*>(buf), len);
+		}
+
+		return adler;
+	}
+
+	ADLER32_TARGET_AVX2 inline unsigned int hsum_epi32_avx2(__m256i v)
+	{
+		__m128i sum = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+		sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+		sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+		return static_cast<unsigned int>(_mm_cvtsi128_si32(sum));
+	}
+
+	/*
+	 Same as the SSE2 variant with 32 byte blocks. The weighted sum uses
+	 maddubs (max. 255*32+255*31 fits into a signed 16-bit integer).
+	 */
+	ADLER32_TARGET_AVX2 unsigned int adler32_avx2(unsigned int adler, const unsigned char* buf, unsigned int len)
+	{
+		const unsigned int block_size = 32;
+
+		unsigned int s1 = adler & 0xffff;
+		unsigned int s2 = (adler >> 16) & 0xffff;
+
+		unsigned int blocks = len / block_size;
+		len -= blocks * block_size;
+
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i ones = _mm256_set1_epi16(1);
+		const __m256i weights = _mm256_set_epi8(1, 2, 3, 4, 5, 6, 7, 8,
+			9, 10, 11, 12, 13, 14, 15, 16,
+			17, 18, 19, 20, 21, 22, 23, 24,
+			25, 26, 27, 28, 29, 30, 31, 32);
+
+		while (blocks)
+		{
+			unsigned int n = NMAX / block_size;
+			if (n > blocks)
+				n = blocks;
+			blocks -= n;
+
+			__m256i v_ps = _mm256_set_epi32(0, 0, 0, 0, 0, 0, 0, s1 * n);
+			__m256i v_s2 = _mm256_set_epi32(0, 0, 0, 0, 0, 0, 0, s2);
+			__m256i v_s1 = zero;
+
+			do
+			{
+				__m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(buf));
+
+				v_ps = _mm256_add_epi32(v_ps, v_s1);
+				v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(bytes, zero));
+
+				v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes, weights), ones));
+
+				buf += block_size;
+			} while (--n);
+
+			v_s2 = _mm256_add_epi32(v_s2, _mm256_slli_epi32(v_ps, 5));
+
+			s1 += hsum_epi32_avx2(v_s1);
+			s2 = hsum_epi32_avx2(v_s2);
+
+			MOD(s1);
+			MOD(s2);
+		}
+
+		adler = s1 | (s2 << 16);
+
+		if (len)
+		{
+			return adler32_scalar(adler, reinterpret_cast<const char*>(buf), len);
+		}
+
+		return adler;
+	}
+
+	enum EAdler32Impl
+	{
+		EAdler32Impl_Unknown = 0,
+		EAdler32Impl_Scalar,
+		EAdler32Impl_SSE2,
+		EAdler32Impl_AVX2
+	};
+
+	/* Detection is idempotent, so a race on first use is harmless */
+	volatile int adler32_impl = EAdler32Impl_Unknown;
+
+	EAdler32Impl detect_adler32_impl()
+	{
+#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 0);
+		int max_leaf = info[0];
+		__cpuid(info, 1);
+		bool has_sse2 = (info[3] & (1 << 26)) != 0;
+		bool has_avx = (info[2] & (1 << 27)) != 0 /* OSXSAVE */
+			&& (info[2] & (1 << 28)) != 0
+			&& (_xgetbv(0) & 6) == 6; /* XMM and YMM state enabled by OS */
+		bool has_avx2 = false;
+		if (has_avx && max_leaf >= 7)
+		{
+			__cpuidex(info, 7, 0);
+			has_avx2 = (info[1] & (1 << 5)) != 0;
+		}
+#else
+		__builtin_cpu_init();
+		bool has_sse2 = __builtin_cpu_supports("sse2") != 0;
+		bool has_avx2 = __builtin_cpu_supports("avx2") != 0;
+#endif
+		if (has_avx2)
+			return EAdler32Impl_AVX2;
+		if (has_sse2)
+			return EAdler32Impl_SSE2;
+		return EAdler32Impl_Scalar;
+	}
+}
+
+#endif //ADLER32_SIMD_AVAILABLE
+
+unsigned int urb_adler32(unsigned int adler, const char* pbuf, unsigned int len)
+{
+#ifdef ADLER32_SIMD_AVAILABLE
+	/* Not worth the setup for short buffers (and keeps the NULL buffer init case in one place) */
+	if (pbuf != 0 && len >= 64)
+	{
+		int impl = adler32_impl;
+		if (impl == EAdler32Impl_Unknown)
+		{
+			impl = detect_adler32_impl();
+			adler32_impl = impl;
+		}
+
+		const unsigned char* buf = reinterpret_cast<const unsigned char*>(pbuf);
+
+		switch (impl)
+		{
+		case EAdler32Impl_AVX2:
+			return adler32_avx2(adler, buf, len);
+		case EAdler32Impl_SSE2:
+			return adler32_sse2(adler, buf, len);
+		}
+	}
+#endif
+	return adler32_scalar(adler, pbuf, len);
+}
+
 unsigned int urb_adler32_combine(unsigned int adler1, unsigned int adler2, unsigned int len2)
 {
 	unsigned long sum1;
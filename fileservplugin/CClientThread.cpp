@@ -131,6 +131,8 @@ CClientThread::CClientThread(SOCKET pSocket, CTCPFileServ* pParent)
 	close_the_socket=true;
 	errcount=0;
 	clientpipe=Server->PipeFromSocket(pSocket);
+	zero_copy_send = clientpipe->canWriteFromFile()
+		&& Server->getServerParameter("disable_zero_copy_send").empty();
 	mutex=NULL;
 	cond=NULL;
 	state=CS_NONE;
@@ -153,6 +155,7 @@ CClientThread::CClientThread(IPipe *pClientpipe, CTCPFileServ* pParent, std::vec
 	close_the_socket=false;
 	errcount=0;
 	clientpipe=pClientpipe;
+	zero_copy_send=false;
 	state=CS_NONE;
 	mutex=NULL;
 	cond=NULL;
@@ -335,6 +338,16 @@ bool CClientThread::FlushInt()
 	return clientpipe->Flush(CLIENT_TIMEOUT * 1000);
 }
 
+bool CClientThread::canSendFromFile()
+{
+	return zero_copy_send;
+}
+
+int CClientThread::SendFromFileInt(const char *header, size_t header_size, IFile* file, _i64 offset, size_t bsize)
+{
+	return (int)(clientpipe->WriteFromFile(header, header_size, static_cast<IFsFile*>(file), offset, bsize, SEND_TIMEOUT)?(header_size+bsize):SOCKET_ERROR);
+}
+
 bool CClientThread::ProcessPacket(CRData *data)
 {
 	uchar id;
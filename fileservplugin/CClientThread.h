@@ -114,6 +114,8 @@ public:
 
     int SendInt(const char *buf, size_t bsize, bool flush=false);
 	bool FlushInt();
+	bool canSendFromFile();
+	int SendFromFileInt(const char *header, size_t header_size, IFile* file, _i64 offset, size_t bsize);
 	bool getNextChunk(SChunk *chunk, bool has_error);
 
 	static std::string getDummyMetadata(std::string output_fn, int64 folder_items, int64 metadata_id, bool is_dir);
@@ -205,6 +207,7 @@ private:
 
 	SOCKET int_socket;
 	bool has_socket;
+	bool zero_copy_send;
 
 	std::vector<char>* extra_buffer;
 
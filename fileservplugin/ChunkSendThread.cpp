@@ -36,6 +36,9 @@
 
 namespace
 {
+	//Below this a sendfile() call costs more than sending the already read data
+	const _u32 c_zero_copy_min_size = 64 * 1024;
+
 	unsigned int getSystemErrorCode()
 	{
 #ifdef _WIN32
@@ -390,6 +393,13 @@ bool ChunkSendThread::sendChunk(SChunk *chunk)
 	bool script_eof=false;
 	bool cbt_unchanged = false;
 	int64 index_chunkhash_pos = -1;
+	//Whole blocks can be sent directly from the file (sendfile)
+	//if the data was not padded with zeros. Changed chunks are
+	//too small for that and are sent from the read buffer.
+	bool zero_copy = parent->canSendFromFile()
+		&& pipe_file_user.get() == NULL
+		&& curr_file_size != -1;
+	int64 block_spos = spos;
 	_u16 index_chunkhash_pos_offset;
 
 	if (cbt_hash_file_info.cbt_hash_file!=NULL
@@ -551,6 +561,7 @@ bool ChunkSendThread::sendChunk(SChunk *chunk)
 					{
 						memset(cptr + r, 0, to_read - r);
 						r = to_read;
+						zero_copy = false;
 					}
 				}
 
@@ -626,7 +637,15 @@ bool ChunkSendThread::sendChunk(SChunk *chunk)
 		memcpy(chunk_buf+1, &chunk_startpos, sizeof(_i64));
 		unsigned int read_total_tmp = little_endian(read_total);
 		memcpy(chunk_buf+1+sizeof(_i64), &read_total_tmp, sizeof(_u32));
-		if(parent->SendInt(chunk_buf, read_total+1+sizeof(_i64)+sizeof(_u32))==SOCKET_ERROR)
+		if(zero_copy && read_total>=c_zero_copy_min_size)
+		{
+			if(parent->SendFromFileInt(chunk_buf, 1+sizeof(_i64)+sizeof(_u32), file, block_spos, read_total)==SOCKET_ERROR)
+			{
+				Log("Error sending whole block (zero copy)", LL_DEBUG);
+				return false;
+			}
+		}
+		else if(parent->SendInt(chunk_buf, read_total+1+sizeof(_i64)+sizeof(_u32))==SOCKET_ERROR)
 		{
 			Log("Error sending whole block", LL_DEBUG);
 			return false;
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "../Interface/Types.h"
+#include <memory.h>
+
+/**
+* Scans block bitmaps (one bit per block, least significant bit first)
+* for runs of used blocks. Skips over empty or full regions 64 blocks at
+* a time instead of testing every bit.
+*/
+namespace bitmap_extents
+{
+	inline bool has_bit(const unsigned char* bitmap, int64 block)
+	{
+		return (bitmap[block / 8] & (1 << (block % 8))) != 0;
+	}
+
+	//Returns the first block in [start, end) with bit value bit_set or end if there is none
+	inline int64 find_bit(const unsigned char* bitmap, int64 start, int64 end, bool bit_set)
+	{
+		int64 block = start;
+		while (block < end
+			&& block % 64 != 0)
+		{
+			if (has_bit(bitmap, block) == bit_set)
+				return block;
+			++block;
+		}
+
+		const uint64 skip_word = bit_set ? 0 : static_cast<uint64>(-1);
+		while (block + 64 <= end)
+		{
+			uint64 word;
+			memcpy(&word, bitmap + block / 8, sizeof(word));
+			if (word != skip_word)
+				break;
+			block += 64;
+		}
+
+		while (block < end)
+		{
+			if (has_bit(bitmap, block) == bit_set)
+				return block;
+			++block;
+		}
+
+		return end;
+	}
+
+	//Returns the first used block in [start, end) or -1. extent_len is set to the number of
+	//consecutive used blocks starting there (limited by end)
+	inline int64 next_extent(const unsigned char* bitmap, int64 start, int64 end, int64& extent_len)
+	{
+		int64 first = find_bit(bitmap, start, end, true);
+		if (first >= end)
+		{
+			extent_len = 0;
+			return -1;
+		}
+
+		extent_len = find_bit(bitmap, first, end, false) - first;
+		return first;
+	}
+
+	//Number of used blocks in [0, end)
+	inline int64 count_bits(const unsigned char* bitmap, int64 end)
+	{
+		int64 ret = 0;
+		int64 block = 0;
+		for (; block + 64 <= end; block += 64)
+		{
+			uint64 word;
+			memcpy(&word, bitmap + block / 8, sizeof(word));
+			word = word - ((word >> 1) & 0x5555555555555555ULL);
+			word = (word & 0x3333333333333333ULL) + ((word >> 2) & 0x3333333333333333ULL);
+			word = (word + (word >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+			ret += static_cast<int64>((word * 0x0101010101010101ULL) >> 56);
+		}
+
+		for (; block < end; ++block)
+		{
+			if (has_bit(bitmap, block))
+				++ret;
+		}
+
+		return ret;
+	}
+}
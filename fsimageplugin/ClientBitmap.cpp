@@ -2,7 +2,9 @@
 #include "../Interface/Server.h"
 #include "../urbackupcommon/sha2/sha2.h"
 #include "../stringtools.h"
+#include "BitmapExtents.h"
 #include <memory.h>
+#include <algorithm>
 
 namespace
 {
@@ -113,3 +115,29 @@ bool ClientBitmap::hasBlock(int64 pBlock)
 	return has_bit;
 }
 
+int64 ClientBitmap::getUsedExtent(int64 start_block, int64 end_block, int64& extent_len)
+{
+	//Blocks not covered by the bitmap are treated as used (see hasBlock)
+	int64 bitmap_end = static_cast<int64>(bitmap_data.size()) * 8;
+	const unsigned char* bitmap = reinterpret_cast<const unsigned char*>(bitmap_data.data());
+
+	int64 ret = bitmap_extents::next_extent(bitmap, start_block, (std::min)(end_block, bitmap_end), extent_len);
+
+	if (ret == -1)
+	{
+		ret = (std::max)(start_block, bitmap_end);
+		if (ret >= end_block)
+		{
+			return -1;
+		}
+		extent_len = 0;
+	}
+
+	if (ret + extent_len >= bitmap_end)
+	{
+		extent_len = end_block - ret;
+	}
+
+	return ret;
+}
+
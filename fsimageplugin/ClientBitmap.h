@@ -16,6 +16,7 @@ public:
 
 	int64 getBlocksize();
 	bool hasBlock(int64 block);
+	int64 getUsedExtent(int64 start_block, int64 end_block, int64& extent_len);
 
 private:
 	void init(IFile* bitmap_file);
@@ -26,12 +26,21 @@
 #include <zstd.h>
 #endif
 #include "LRUMemCache.h"
+#include "../Interface/Condition.h"
+#include "../Interface/Thread.h"
+#include <deque>
+#include <set>
+#include <cmath>
 
 #define MINIZ_NO_ZLIB_COMPATIBLE_NAMES
 #include "../common/miniz.h"
 
 const size_t c_cacheBuffersize = 2*1024*1024;
 const size_t c_ncacheItems = 5;
+const size_t c_maxReadaheadBlocks = 64;
+//Limits for all open compressed files together (e.g. an image and its parents)
+const size_t c_maxReadaheadThreadsTotal = 16;
+const size_t c_maxReadaheadBlocksTotal = 128;
 const size_t c_blockbufHeadersize = 2 * sizeof(_u32);
 const char headerMagic[] = "URBACKUP COMPRESSED FILE#";
 const char headerVersionV1_0[] = "1.0";
@@ -39,13 +48,163 @@ const char headerVersionV1_1[] = "1.1";
 const _u32 mode_none = 0;
 const _u32 mode_zlib = 1;
 const _u32 mode_zstd = 2;
+#ifdef NO_ZSTD_COMPRESSION
+const int c_defaultCompressionLevel = MZ_DEFAULT_LEVEL;
+const int c_maxCompressionLevel = MZ_BEST_COMPRESSION;
+#else
+const int c_defaultCompressionLevel = 7;
+const int c_maxCompressionLevel = 19;
+#endif
+//Blocks whose sampled byte entropy (bits per byte) is above this are stored uncompressed
+const double c_incompressibleEntropy = 7.9;
+const size_t c_entropySamples = 16;
+const size_t c_entropySampleSize = 256;
+//Store block uncompressed if compression saves less than 1/c_minCompressionSavings of it
+const size_t c_minCompressionSavings = 32;
 const size_t c_header_size = sizeof(headerMagic) + sizeof(headerVersionV1_0) + sizeof(__int64) + sizeof(__int64) + sizeof(_u32);
 
+IMutex* CompressedFile::readahead_budget_mutex = NULL;
+size_t CompressedFile::readahead_threads_total = 0;
+size_t CompressedFile::readahead_blocks_total = 0;
+
+//Decompresses blocks ahead of a sequential reader on n_threads worker threads
+class CompressedFileReadahead : public IThread
+{
+public:
+	CompressedFileReadahead(CompressedFile* parent, size_t n_threads)
+		: parent(parent), n_threads(n_threads), n_started(0), n_alive(0), do_quit(false),
+		mutex(Server->createMutex()), cond(Server->createCondition())
+	{
+	}
+
+	~CompressedFileReadahead()
+	{
+		IScopedLock lock(mutex.get());
+		do_quit = true;
+		cond->notify_all();
+		while (n_alive > 0)
+		{
+			cond->wait(&lock);
+		}
+	}
+
+	void schedule(size_t block)
+	{
+		IScopedLock lock(mutex.get());
+		if (queued.find(block) != queued.end()
+			|| running.find(block) != running.end())
+		{
+			return;
+		}
+
+		if (n_started < n_threads
+			&& CompressedFile::acquireReadaheadThread())
+		{
+			if (Server->createThread(this, "comp img ra"))
+			{
+				++n_started;
+				++n_alive;
+			}
+			else
+			{
+				CompressedFile::releaseReadaheadThread();
+				n_threads = n_started;
+			}
+		}
+
+		if (n_alive == 0)
+		{
+			return;
+		}
+
+		queue.push_back(block);
+		queued.insert(block);
+
+		cond->notify_all();
+	}
+
+	//Returns true if the block was being decompressed and the reader should look at the cache again
+	bool waitFor(size_t block)
+	{
+		IScopedLock lock(mutex.get());
+		if (queued.erase(block) > 0)
+		{
+			queue.erase(std::find(queue.begin(), queue.end(), block));
+		}
+
+		bool waited = false;
+		while (running.find(block) != running.end())
+		{
+			waited = true;
+			cond->wait(&lock);
+		}
+		return waited;
+	}
+
+	void operator()()
+	{
+		std::vector<char> block_buf;
+		std::vector<char> compressed_buf;
+
+		IScopedLock lock(mutex.get());
+		while (true)
+		{
+			while (!do_quit && queue.empty())
+			{
+				cond->wait(&lock);
+			}
+
+			if (do_quit)
+			{
+				break;
+			}
+
+			size_t block = queue.front();
+			queue.pop_front();
+			queued.erase(block);
+			running.insert(block);
+			lock.relock(NULL);
+
+			if (!parent->isBlockCached(block))
+			{
+				block_buf.resize(parent->blocksize);
+				if (parent->decompressBlock(block, &block_buf[0], compressed_buf, false, NULL))
+				{
+					parent->cacheBlock(block, block_buf.data());
+				}
+			}
+
+			lock.relock(mutex.get());
+			running.erase(block);
+			cond->notify_all();
+		}
+
+		CompressedFile::releaseReadaheadThread();
+		--n_alive;
+		cond->notify_all();
+	}
+
+private:
+	CompressedFile* parent;
+	size_t n_threads;
+	size_t n_started;
+	size_t n_alive;
+	bool do_quit;
+	std::deque<size_t> queue;
+	std::set<size_t> queued;
+	std::set<size_t> running;
+	std::auto_ptr<IMutex> mutex;
+	std::auto_ptr<ICondition> cond;
+};
+
 
 CompressedFile::CompressedFile( std::string pFilename, int pMode, size_t n_threads)
 	: hotCache(NULL), error(false), currentPosition(0),
 	  finished(false), filesize(0), noMagic(false),
-	mutex(Server->createMutex()), n_threads(n_threads), numBlockOffsets(0)
+	mutex(Server->createMutex()), n_threads(n_threads), numBlockOffsets(0),
+	readahead_blocks(0), last_read_block(std::string::npos), sequential_reads(0),
+	compression_level(c_defaultCompressionLevel),
+	adaptive_compression(Server->getServerParameter("image_adaptive_compression")!="false")
 {
 	uncompressedFile = Server->openFile(pFilename, pMode);
 
@@ -82,7 +241,10 @@ CompressedFile::CompressedFile( std::string pFilename, int pMode, size_t n_threa
 CompressedFile::CompressedFile(IFile* file, bool openExisting, bool readOnly, size_t n_threads)
 	: hotCache(NULL), error(false), currentPosition(0),
 	finished(false), uncompressedFile(file), filesize(0), readOnly(readOnly),
-	noMagic(false), n_threads(n_threads), numBlockOffsets(0)
+	noMagic(false), mutex(Server->createMutex()), n_threads(n_threads), numBlockOffsets(0),
+	readahead_blocks(0), last_read_block(std::string::npos), sequential_reads(0),
+	compression_level(c_defaultCompressionLevel),
+	adaptive_compression(Server->getServerParameter("image_adaptive_compression")!="false")
 {
 	if(openExisting)
 	{
@@ -105,6 +267,11 @@ CompressedFile::CompressedFile(IFile* file, bool openExisting, bool readOnly, si
 
 CompressedFile::~CompressedFile()
 {
+	if(readahead.get()!=NULL)
+	{
+		readahead.reset();
+		releaseReadaheadBlocks(readahead_blocks);
+	}
 	hotCache.reset();
 
 	if(!finished)
@@ -164,11 +331,135 @@ void CompressedFile::readHeader(bool *has_error)
 	filesize = little_endian(filesize);
 	blocksize = little_endian(blocksize);
 
-	hotCache.reset(new LRUMemCache(blocksize, c_ncacheItems, n_threads));
+	if(readOnly)
+	{
+		initReadCache();
+	}
+	else
+	{
+		hotCache.reset(new LRUMemCache(blocksize, c_ncacheItems, n_threads));
+	}
 
 	readIndex(has_error);
 }
 
+void CompressedFile::initReadCache()
+{
+	size_t cache_items = c_ncacheItems;
+
+	if(n_threads>0)
+	{
+		std::string readahead_param = Server->getServerParameter("image_readahead_blocks");
+		readahead_blocks = readahead_param.empty() ? n_threads : static_cast<size_t>((std::max)(0, watoi(readahead_param)));
+		readahead_blocks = acquireReadaheadBlocks((std::min)(readahead_blocks, c_maxReadaheadBlocks));
+
+		if(readahead_blocks>0)
+		{
+			readahead.reset(new CompressedFileReadahead(this, n_threads));
+			//Room for the prefetched blocks without evicting the ones currently read
+			cache_items += 2*readahead_blocks;
+		}
+	}
+
+	std::string cache_param = Server->getServerParameter("image_read_cache_blocks");
+	if(!cache_param.empty())
+	{
+		cache_items = (std::max)(static_cast<size_t>((std::max)(1, watoi(cache_param))), readahead_blocks+1);
+	}
+
+	//Nothing to write back on eviction, so no eviction threads
+	hotCache.reset(new LRUMemCache(blocksize, cache_items, 0));
+}
+
+void CompressedFile::init_mutex()
+{
+	readahead_budget_mutex = Server->createMutex();
+}
+
+bool CompressedFile::acquireReadaheadThread()
+{
+	IScopedLock lock(readahead_budget_mutex);
+	if(readahead_threads_total>=c_maxReadaheadThreadsTotal)
+	{
+		return false;
+	}
+	++readahead_threads_total;
+	return true;
+}
+
+void CompressedFile::releaseReadaheadThread()
+{
+	IScopedLock lock(readahead_budget_mutex);
+	--readahead_threads_total;
+}
+
+size_t CompressedFile::acquireReadaheadBlocks(size_t n)
+{
+	IScopedLock lock(readahead_budget_mutex);
+	n = (std::min)(n, c_maxReadaheadBlocksTotal - readahead_blocks_total);
+	readahead_blocks_total += n;
+	return n;
+}
+
+void CompressedFile::releaseReadaheadBlocks(size_t n)
+{
+	IScopedLock lock(readahead_budget_mutex);
+	readahead_blocks_total -= n;
+}
+
+bool CompressedFile::isBlockCached(size_t block)
+{
+	IScopedLock lock(mutex.get());
+	size_t cacheSize;
+	return hotCache->get(static_cast<__int64>(block)*blocksize, cacheSize)!=NULL;
+}
+
+void CompressedFile::cacheBlock(size_t block, const char* buf)
+{
+	IScopedLock lock(mutex.get());
+	size_t cacheSize;
+	__int64 offset = static_cast<__int64>(block)*blocksize;
+	if(hotCache->get(offset, cacheSize)==NULL)
+	{
+		memcpy(hotCache->create(offset), buf, blocksize);
+	}
+}
+
+void CompressedFile::trackReadahead(size_t block)
+{
+	if(readahead.get()==NULL
+		|| block==last_read_block)
+	{
+		return;
+	}
+
+	if(last_read_block!=std::string::npos
+		&& block==last_read_block+1)
+	{
+		++sequential_reads;
+	}
+	else
+	{
+		sequential_reads=0;
+	}
+
+	last_read_block=block;
+
+	if(sequential_reads==0)
+	{
+		return;
+	}
+
+	for(size_t i=1;i<=readahead_blocks && block+i<blockOffsets.size();++i)
+	{
+		size_t cacheSize;
+		if(hotCache->get(static_cast<__int64>(block+i)*blocksize, cacheSize)==NULL)
+		{
+			readahead->schedule(block+i);
+		}
+	}
+}
+
 void CompressedFile::readIndex(bool *has_error)
 {
 	size_t nOffsetItems = static_cast<size_t>(filesize/blocksize + ((filesize%blocksize!=0)?1:0));
@@ -222,6 +513,13 @@ _u32 CompressedFile::Read( char* buffer, _u32 bsize, bool *has_error)
 {
 	assert(!finished);
 
+	if(readOnly)
+	{
+		_u32 read = ReadAt(currentPosition, buffer, bsize, has_error);
+		currentPosition+=read;
+		return read;
+	}
+
 	size_t cacheSize;
 	char* cachePtr = hotCache->get(currentPosition, cacheSize);
 
@@ -263,6 +561,77 @@ _u32 CompressedFile::Read( char* buffer, _u32 bsize, bool *has_error)
 	return static_cast<_u32>(canRead);
 }
 
+_u32 CompressedFile::ReadAt(int64 spos, char* buffer, _u32 bsize, bool *has_error)
+{
+	assert(readOnly);
+
+	std::vector<char> block_buf;
+	std::vector<char> compressed_buf;
+
+	_u32 read = 0;
+	bool waited = false;
+	while(read<bsize && spos<filesize)
+	{
+		size_t canRead = bsize - read;
+		if(spos+static_cast<int64>(canRead)>filesize)
+			canRead = static_cast<size_t>(filesize-spos);
+
+		size_t block = static_cast<size_t>(spos/blocksize);
+
+		{
+			IScopedLock lock(mutex.get());
+
+			trackReadahead(block);
+
+			size_t cacheSize;
+			char* cachePtr = hotCache->get(spos, cacheSize);
+
+			if(cachePtr!=NULL)
+			{
+				canRead = (std::min)(canRead, cacheSize);
+				memcpy(buffer + read, cachePtr, canRead);
+				read += static_cast<_u32>(canRead);
+				spos += canRead;
+				waited = false;
+				continue;
+			}
+		}
+
+		if(block>=blockOffsets.size())
+		{
+			return read;
+		}
+
+		if(readahead.get()!=NULL && !waited)
+		{
+			waited = true;
+			if(readahead->waitFor(block))
+			{
+				continue;
+			}
+		}
+
+		waited = false;
+
+		//Decompress without holding the lock, so that other readers can proceed
+		block_buf.resize(blocksize);
+		if(!decompressBlock(block, &block_buf[0], compressed_buf, true, has_error))
+		{
+			return read;
+		}
+
+		cacheBlock(block, block_buf.data());
+
+		size_t innerOffset = static_cast<size_t>(spos - static_cast<int64>(block)*blocksize);
+		canRead = (std::min)(canRead, blocksize - innerOffset);
+		memcpy(buffer + read, &block_buf[innerOffset], canRead);
+		read += static_cast<_u32>(canRead);
+		spos += canRead;
+	}
+
+	return read;
+}
+
 std::string CompressedFile::Read( _u32 tr, bool *has_error)
 {
 	assert(!finished);
@@ -312,6 +681,13 @@ bool CompressedFile::fillCache( __int64 offset, bool errorMsg, bool *has_error)
 		return false;
 	}
 
+	return decompressBlock(block, buf, compressedBuffer, errorMsg, has_error);
+}
+
+bool CompressedFile::decompressBlock(size_t block, char* buf, std::vector<char>& compressed_buf, bool errorMsg, bool *has_error)
+{
+	const __int64 offset = static_cast<__int64>(block)*blocksize;
+
 	if(blockOffsets[block]==-1)
 	{
 		memset(buf, 0, blocksize);
@@ -351,12 +727,12 @@ bool CompressedFile::fillCache( __int64 offset, bool errorMsg, bool *has_error)
 	}
 	else
 	{
-		if(compressedBuffer.size()<compressedSize)
+		if(compressed_buf.size()<compressedSize)
 		{
-			compressedBuffer.resize(compressedSize);
+			compressed_buf.resize(compressedSize);
 		}	
 
-		if(readFromFile(blockDataOffset + c_blockbufHeadersize, &compressedBuffer[0], compressedSize, has_error)!=compressedSize)
+		if(readFromFile(blockDataOffset + c_blockbufHeadersize, &compressed_buf[0], compressedSize, has_error)!=compressedSize)
 		{
 			Server->Log("Error while reading compressed data from "+convert(blockDataOffset)+" ("+convert(compressedSize)+" bytes)", LL_ERROR);
 			return false;
@@ -368,7 +744,7 @@ bool CompressedFile::fillCache( __int64 offset, bool errorMsg, bool *has_error)
 	{
 		rdecomp = blocksize;
 		int rc = mz_uncompress(reinterpret_cast<unsigned char*>(buf), &rdecomp,
-			reinterpret_cast<const unsigned char*>(compressedBuffer.data()), static_cast<mz_ulong>(compressedSize));
+			reinterpret_cast<const unsigned char*>(compressed_buf.data()), static_cast<mz_ulong>(compressedSize));
 
 		if(rc != MZ_OK)
 		{
@@ -381,7 +757,7 @@ bool CompressedFile::fillCache( __int64 offset, bool errorMsg, bool *has_error)
 	{
 		rdecomp = blocksize;
 		const size_t rc = ZSTD_decompress(buf, blocksize,
-			compressedBuffer.data(), compressedSize);
+			compressed_buf.data(), compressedSize);
 
 		if (ZSTD_isError(rc))
 		{
@@ -481,35 +857,62 @@ void CompressedFile::evictFromLruCache( const SCacheItem& item )
 
 	char* compBuffer;
 	size_t compBufferIdx;
+	int level;
 
 	{
 		IScopedLock lock(mutex.get());
 		compBuffer = getCompressedBuffer(compBufferIdx);
+		level = compression_level;
 	}
 
-#ifdef NO_ZSTD_COMPRESSION
-	const _u32 mode = mode_zlib;
-	mz_ulong compBytes = static_cast<mz_ulong>(compressedBufferSize - c_blockbufHeadersize);
-	const int rc = mz_compress(reinterpret_cast<unsigned char*>(compBuffer)+ c_blockbufHeadersize, &compBytes,
-		reinterpret_cast<const unsigned char*>(item.buffer), blocksize);
+	_u32 mode;
+	size_t compBytes;
 
-	if(rc!=MZ_OK)
+	if(adaptive_compression && isIncompressible(item.buffer))
 	{
-		error=true;
-		Server->Log("Error while compressing data. Error code: "+convert(rc), LL_ERROR);
-		return;
+		mode = mode_none;
+		compBytes = blocksize;
 	}
+	else
+	{
+#ifdef NO_ZSTD_COMPRESSION
+		mode = mode_zlib;
+		mz_ulong mzCompBytes = static_cast<mz_ulong>(compressedBufferSize - c_blockbufHeadersize);
+		const int rc = mz_compress2(reinterpret_cast<unsigned char*>(compBuffer)+ c_blockbufHeadersize, &mzCompBytes,
+			reinterpret_cast<const unsigned char*>(item.buffer), blocksize, level);
+
+		if(rc!=MZ_OK)
+		{
+			error=true;
+			Server->Log("Error while compressing data. Error code: "+convert(rc), LL_ERROR);
+			return;
+		}
+		compBytes = mzCompBytes;
 #else
-	const _u32 mode = mode_zstd;
-	const size_t compBytes = ZSTD_compress(compBuffer+ c_blockbufHeadersize, compressedBufferSize - c_blockbufHeadersize, item.buffer, blocksize,
-		7);
-	if (ZSTD_isError(compBytes))
+		mode = mode_zstd;
+		compBytes = ZSTD_compress(compBuffer+ c_blockbufHeadersize, compressedBufferSize - c_blockbufHeadersize, item.buffer, blocksize,
+			level);
+		if (ZSTD_isError(compBytes))
+		{
+			error = true;
+			Server->Log(std::string("Error while compressing data (ZSTD). Error code: ") + ZSTD_getErrorName(compBytes), LL_ERROR);
+			return;
+		}
+#endif
+
+		if(adaptive_compression
+			&& compBytes + blocksize/c_minCompressionSavings > blocksize)
+		{
+			//Not worth the decompression time when reading
+			mode = mode_none;
+			compBytes = blocksize;
+		}
+	}
+
+	if(mode==mode_none)
 	{
-		error = true;
-		Server->Log(std::string("Error while compressing data (ZSTD). Error code: ") + ZSTD_getErrorName(compBytes), LL_ERROR);
-		return;
+		memcpy(compBuffer + c_blockbufHeadersize, item.buffer, blocksize);
 	}
-#endif
 
 	int64 blockOffset;
 	{
@@ -550,6 +953,50 @@ void CompressedFile::evictFromLruCache( const SCacheItem& item )
 	blockOffsets[blockIdx] = blockOffset;
 }
 
+bool CompressedFile::isIncompressible(const char* buf)
+{
+	size_t counts[256] = {};
+	const size_t sample_step = blocksize / c_entropySamples;
+
+	if(sample_step<c_entropySampleSize)
+	{
+		return false;
+	}
+
+	for(size_t i=0;i<c_entropySamples;++i)
+	{
+		const unsigned char* sample = reinterpret_cast<const unsigned char*>(buf + i*sample_step);
+		for(size_t j=0;j<c_entropySampleSize;++j)
+		{
+			++counts[sample[j]];
+		}
+	}
+
+	const double total = static_cast<double>(c_entropySamples*c_entropySampleSize);
+	double entropy = 0;
+	for(size_t i=0;i<256;++i)
+	{
+		if(counts[i]>0)
+		{
+			double p = counts[i]/total;
+			entropy -= p*std::log(p);
+		}
+	}
+
+	return entropy/std::log(2.0) > c_incompressibleEntropy;
+}
+
+void CompressedFile::setCompressionLevel(int level)
+{
+	if(level<=0)
+	{
+		level = c_defaultCompressionLevel;
+	}
+
+	IScopedLock lock(mutex.get());
+	compression_level = (std::min)(level, c_maxCompressionLevel);
+}
+
 void CompressedFile::writeHeader()
 {
 	char header[c_header_size];
@@ -7,6 +7,7 @@
 #include "../Interface/Mutex.h"
 
 class LRUMemCache;
+class CompressedFileReadahead;
 
 struct SCacheItem
 {
@@ -57,10 +58,32 @@ public:
 
 	bool hasNoMagic();
 
+	//Position independent read. Can be called from multiple threads at once (read only)
+	_u32 ReadAt(int64 spos, char* buffer, _u32 bsize, bool *has_error = NULL);
+
+	//Compression level used for blocks written from now on. <=0 resets to the default level
+	void setCompressionLevel(int level);
+
+	static void init_mutex();
+
 private:
+	friend class CompressedFileReadahead;
+
+	//Readahead threads and blocks are shared by all open compressed files
+	static bool acquireReadaheadThread();
+	static void releaseReadaheadThread();
+	static size_t acquireReadaheadBlocks(size_t n);
+	static void releaseReadaheadBlocks(size_t n);
+
 	void readHeader(bool *has_error);
 	void readIndex(bool *has_error);
 	bool fillCache(__int64 offset, bool errorMsg, bool *has_error);
+	bool decompressBlock(size_t block, char* buf, std::vector<char>& compressed_buf, bool errorMsg, bool *has_error);
+	bool isBlockCached(size_t block);
+	void cacheBlock(size_t block, const char* buf);
+	void initReadCache();
+	void trackReadahead(size_t block);
+	bool isIncompressible(const char* buf);
 	virtual void evictFromLruCache(const SCacheItem& item);
 	void writeHeader();
 	void writeIndex();
@@ -104,4 +127,18 @@ private:
 	std::auto_ptr<IMutex> mutex;
 
 	size_t n_threads;
+
+	//for sequential readahead (read only)
+	std::auto_ptr<CompressedFileReadahead> readahead;
+	size_t readahead_blocks;
+	size_t last_read_block;
+	size_t sequential_reads;
+
+	static IMutex* readahead_budget_mutex;
+	static size_t readahead_threads_total;
+	static size_t readahead_blocks_total;
+
+	//for writing
+	int compression_level;
+	bool adaptive_compression;
 };
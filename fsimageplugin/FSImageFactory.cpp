@@ -319,7 +319,8 @@ IFilesystem *FSImageFactory::createFilesystem(const std::string &pDevOrig, ERead
 #ifndef _WIN32
 	if(read_ahead==EReadaheadMode_Overlapped)
 	{
-		read_ahead = EReadaheadMode_None;
+		//Multiple readahead threads keep several reads in flight instead
+		read_ahead = EReadaheadMode_Thread;
 	}
 
 	pDev = trim(getFile(pDevOrig+"-dev"));
@@ -7,6 +7,9 @@ public:
 	virtual int64 getBlocksize() = 0;
 	virtual bool hasBlock(int64 block) = 0;
 	virtual bool hasError(void) = 0;
+	//Returns first used block in [start_block, end_block) or -1 and sets extent_len to the
+	//number of consecutive used blocks starting there
+	virtual int64 getUsedExtent(int64 start_block, int64 end_block, int64& extent_len) = 0;
 };
 
 class IFsNextBlockCallback
@@ -15,6 +15,8 @@ class IVHDWriteCallback
 public:
 	virtual bool writeVHD(uint64 pos, char *buf, unsigned int bsize) = 0;
 	virtual bool emptyVHDBlock(int64 empty_start, int64 empty_end) = 0;
+	//Progress of makeFull. Bytes are either cloned from the parents (reflink) or copied
+	virtual void makeFullProgress(int64 done_bytes, int64 total_bytes, int64 cloned_bytes, int64 copied_bytes) = 0;
 };
 
 class IVHDFile
@@ -23,6 +25,8 @@ public:
 	virtual ~IVHDFile() {}
 	virtual bool Seek(_i64 offset)=0;
 	virtual bool Read(char* buffer, size_t bsize, size_t &read)=0;
+	//Reads at offset without changing the current position. Can be called from multiple threads at once (read only files)
+	virtual bool ReadAt(_i64 offset, char* buffer, size_t bsize, size_t &read)=0;
 	virtual _u32 Write(const char *buffer, _u32 bsize, bool *has_error=NULL)=0;
 	virtual bool isOpen(void)=0;
 	virtual uint64 getSize(void)=0;
@@ -37,4 +41,6 @@ public:
 	virtual bool makeFull(_i64 fs_offset, IVHDWriteCallback* write_callback)=0;
 	virtual bool setUnused(_i64 unused_start, _i64 unused_end) = 0;
 	virtual bool setBackingFileSize(_i64 fsize) = 0;
+	//Compression level of newly written data if the file is compressed. <=0 is the default level
+	virtual void setCompressionLevel(int level) = 0;
 };
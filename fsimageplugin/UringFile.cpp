@@ -0,0 +1,571 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "UringFile.h"
+#include "../Interface/Server.h"
+#include "../stringtools.h"
+#include <string.h>
+#include <algorithm>
+
+#ifndef _WIN32
+#include "../config.h"
+#endif
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+
+#if !defined(__NR_io_uring_setup) || !defined(__NR_io_uring_enter)
+#undef HAVE_LINUX_IO_URING_H
+#endif
+#endif
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+namespace
+{
+	//Needs IORING_OP_WRITE, i.e. Linux 5.6. Writes fall back to pwrite if the kernel does not support it
+	const size_t c_uringQueueDepth = 32;
+	const size_t c_uringBufsize = 1024 * 1024;
+
+	int io_uring_setup(unsigned int entries, struct io_uring_params* p)
+	{
+		return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+	}
+
+	int io_uring_enter(int ring_fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+	{
+		return static_cast<int>(syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0));
+	}
+}
+
+UringFile* UringFile::open(IFsFile* file)
+{
+	if (Server->getServerParameter("image_io_uring") == "false")
+	{
+		return NULL;
+	}
+
+	if (file->getOsHandle() == -1)
+	{
+		return NULL;
+	}
+
+	UringFile* ret = new UringFile(file, c_uringQueueDepth);
+	if (!ret->setupRing())
+	{
+		Server->Log("io_uring not available (errno " + convert(errno) + "). Using synchronous image writes.", LL_DEBUG);
+		ret->file = NULL;
+		delete ret;
+		return NULL;
+	}
+
+	return ret;
+}
+
+UringFile::UringFile(IFsFile* file, size_t queue_depth)
+	: file(file), fd(file->getOsHandle()), ring_fd(-1),
+	sq_ring(MAP_FAILED), sq_ring_size(0), cq_ring(MAP_FAILED), cq_ring_size(0),
+	sqes(MAP_FAILED), sqes_size(0), n_inflight(0), curr_slot(std::string::npos),
+	pos(0), max_written(0), error(false), mutex(Server->createMutex())
+{
+	bufs.resize(queue_depth);
+	inflight.resize(queue_depth);
+	for (size_t i = 0; i < queue_depth; ++i)
+	{
+		bufs[i] = new char[c_uringBufsize];
+		inflight[i].busy = false;
+		free_slots.push_back(queue_depth - i - 1);
+	}
+}
+
+UringFile::~UringFile()
+{
+	if (file != NULL)
+	{
+		IScopedLock lock(mutex.get());
+		if (!waitAll())
+		{
+			Server->Log("Error writing to \"" + file->getFilename() + "\" via io_uring", LL_ERROR);
+		}
+	}
+
+	if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+	if (cq_ring != MAP_FAILED) munmap(cq_ring, cq_ring_size);
+	if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+	if (ring_fd >= 0) close(ring_fd);
+
+	for (size_t i = 0; i < bufs.size(); ++i)
+	{
+		delete[] bufs[i];
+	}
+
+	delete file;
+}
+
+bool UringFile::setupRing()
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	ring_fd = io_uring_setup(static_cast<unsigned int>(bufs.size()), &params);
+	if (ring_fd < 0)
+	{
+		return false;
+	}
+
+	sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (sq_ring == MAP_FAILED)
+	{
+		return false;
+	}
+
+	cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+	if (cq_ring == MAP_FAILED)
+	{
+		return false;
+	}
+
+	sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+	{
+		return false;
+	}
+
+	char* sq_ptr = reinterpret_cast<char*>(sq_ring);
+	sq_head = reinterpret_cast<unsigned int*>(sq_ptr + params.sq_off.head);
+	sq_tail = reinterpret_cast<unsigned int*>(sq_ptr + params.sq_off.tail);
+	sq_mask = reinterpret_cast<unsigned int*>(sq_ptr + params.sq_off.ring_mask);
+	sq_array = reinterpret_cast<unsigned int*>(sq_ptr + params.sq_off.array);
+
+	char* cq_ptr = reinterpret_cast<char*>(cq_ring);
+	cq_head = reinterpret_cast<unsigned int*>(cq_ptr + params.cq_off.head);
+	cq_tail = reinterpret_cast<unsigned int*>(cq_ptr + params.cq_off.tail);
+	cq_mask = reinterpret_cast<unsigned int*>(cq_ptr + params.cq_off.ring_mask);
+	cqes = cq_ptr + params.cq_off.cqes;
+
+	return true;
+}
+
+bool UringFile::submit(size_t slot)
+{
+	SInflight& item = inflight[slot];
+
+	unsigned int tail = *sq_tail;
+	unsigned int idx = tail & *sq_mask;
+	struct io_uring_sqe* sqe = reinterpret_cast<struct io_uring_sqe*>(sqes) + idx;
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->off = static_cast<__u64>(item.offset + item.done);
+	sqe->addr = reinterpret_cast<__u64>(bufs[slot] + item.done);
+	sqe->len = static_cast<__u32>(item.size - item.done);
+	sqe->user_data = slot;
+	sq_array[idx] = idx;
+
+	__sync_synchronize();
+	*sq_tail = tail + 1;
+	__sync_synchronize();
+
+	int rc;
+	do
+	{
+		rc = io_uring_enter(ring_fd, 1, 0, 0);
+	} while (rc < 0 && errno == EINTR);
+
+	if (rc < 1)
+	{
+		//Not consumed by the kernel. Take it back and write synchronously
+		*sq_tail = tail;
+		__sync_synchronize();
+		--n_inflight;
+		return writeSync(slot);
+	}
+
+	return true;
+}
+
+bool UringFile::writeSync(size_t slot)
+{
+	SInflight& item = inflight[slot];
+	while (item.done < item.size)
+	{
+		_u32 w = file->Write(item.offset + item.done, bufs[slot] + item.done,
+			static_cast<_u32>(item.size - item.done));
+		if (w == 0)
+		{
+			Server->Log("Error writing to \"" + file->getFilename() + "\" at offset " + convert(item.offset + item.done) + ". errno=" + convert(errno), LL_ERROR);
+			error = true;
+			break;
+		}
+		item.done += w;
+	}
+
+	item.busy = false;
+	free_slots.push_back(slot);
+	return !error;
+}
+
+bool UringFile::submitCurrent()
+{
+	if (curr_slot == std::string::npos)
+	{
+		return true;
+	}
+
+	size_t slot = curr_slot;
+	curr_slot = std::string::npos;
+
+	SInflight& item = inflight[slot];
+	waitOverlapping(item.offset, item.size);
+
+	item.done = 0;
+	item.busy = true;
+	++n_inflight;
+	return submit(slot);
+}
+
+bool UringFile::reap(bool wait)
+{
+	if (n_inflight == 0)
+	{
+		return true;
+	}
+
+	if (wait)
+	{
+		int rc;
+		do
+		{
+			rc = io_uring_enter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+		} while (rc < 0 && errno == EINTR);
+
+		if (rc < 0)
+		{
+			Server->Log("Error waiting for io_uring completion. errno=" + convert(errno), LL_ERROR);
+			error = true;
+			return false;
+		}
+	}
+
+	unsigned int head = *cq_head;
+	__sync_synchronize();
+	unsigned int tail = *cq_tail;
+
+	while (head != tail)
+	{
+		struct io_uring_cqe* cqe = reinterpret_cast<struct io_uring_cqe*>(cqes) + (head & *cq_mask);
+		size_t slot = static_cast<size_t>(cqe->user_data);
+		int res = cqe->res;
+		++head;
+		__sync_synchronize();
+		*cq_head = head;
+
+		SInflight& item = inflight[slot];
+		--n_inflight;
+
+		if (res < 0)
+		{
+			if (res != -EAGAIN && res != -EINTR)
+			{
+				Server->Log("io_uring write to \"" + file->getFilename() + "\" failed with errno " + convert(-res) + ". Retrying synchronously...", LL_DEBUG);
+			}
+			writeSync(slot);
+		}
+		else if (res == 0)
+		{
+			writeSync(slot);
+		}
+		else
+		{
+			item.done += static_cast<size_t>(res);
+			if (item.done < item.size)
+			{
+				++n_inflight;
+				submit(slot);
+			}
+			else
+			{
+				item.busy = false;
+				free_slots.push_back(slot);
+			}
+		}
+
+		tail = *cq_tail;
+	}
+
+	return !error;
+}
+
+size_t UringFile::getFreeSlot()
+{
+	while (free_slots.empty())
+	{
+		if (!reap(true))
+		{
+			break;
+		}
+	}
+
+	if (free_slots.empty())
+	{
+		return std::string::npos;
+	}
+
+	size_t slot = free_slots.back();
+	free_slots.pop_back();
+	return slot;
+}
+
+void UringFile::waitOverlapping(int64 offset, size_t size)
+{
+	while (!error)
+	{
+		bool overlaps = false;
+		for (size_t i = 0; i < inflight.size(); ++i)
+		{
+			const SInflight& item = inflight[i];
+			if (item.busy
+				&& item.offset < offset + static_cast<int64>(size)
+				&& offset < item.offset + static_cast<int64>(item.size))
+			{
+				overlaps = true;
+				break;
+			}
+		}
+
+		if (!overlaps || !reap(true))
+		{
+			return;
+		}
+	}
+}
+
+bool UringFile::waitAll()
+{
+	submitCurrent();
+
+	while (n_inflight > 0)
+	{
+		if (!reap(true))
+		{
+			break;
+		}
+	}
+
+	return !error;
+}
+
+bool UringFile::flush()
+{
+	IScopedLock lock(mutex.get());
+	return waitAll();
+}
+
+_u32 UringFile::Write(int64 spos, const char* buffer, _u32 bsize, bool *has_error)
+{
+	IScopedLock lock(mutex.get());
+
+	reap(false);
+
+	if (error)
+	{
+		if (has_error) *has_error = true;
+		return 0;
+	}
+
+	_u32 written = 0;
+	while (written < bsize)
+	{
+		int64 offset = spos + written;
+
+		if (curr_slot != std::string::npos)
+		{
+			SInflight& curr = inflight[curr_slot];
+			if (offset < curr.offset
+				|| offset > curr.offset + static_cast<int64>(curr.size)
+				|| offset >= curr.offset + static_cast<int64>(c_uringBufsize))
+			{
+				submitCurrent();
+			}
+		}
+
+		if (curr_slot == std::string::npos)
+		{
+			curr_slot = getFreeSlot();
+			if (curr_slot == std::string::npos)
+			{
+				if (has_error) *has_error = true;
+				return written;
+			}
+			inflight[curr_slot].offset = offset;
+			inflight[curr_slot].size = 0;
+		}
+
+		SInflight& curr = inflight[curr_slot];
+		size_t buf_off = static_cast<size_t>(offset - curr.offset);
+		size_t tocopy = (std::min)(static_cast<size_t>(bsize - written), c_uringBufsize - buf_off);
+		memcpy(bufs[curr_slot] + buf_off, buffer + written, tocopy);
+		curr.size = (std::max)(curr.size, buf_off + tocopy);
+		written += static_cast<_u32>(tocopy);
+
+		if (curr.size == c_uringBufsize)
+		{
+			submitCurrent();
+		}
+	}
+
+	max_written = (std::max)(max_written, spos + bsize);
+
+	return written;
+}
+
+_u32 UringFile::Read(int64 spos, char* buffer, _u32 bsize, bool *has_error)
+{
+	IScopedLock lock(mutex.get());
+
+	if (curr_slot != std::string::npos)
+	{
+		const SInflight& curr = inflight[curr_slot];
+		if (curr.offset < spos + static_cast<int64>(bsize)
+			&& spos < curr.offset + static_cast<int64>(curr.size))
+		{
+			submitCurrent();
+		}
+	}
+
+	waitOverlapping(spos, bsize);
+
+	return file->Read(spos, buffer, bsize, has_error);
+}
+
+#else //HAVE_LINUX_IO_URING_H
+
+UringFile* UringFile::open(IFsFile* file)
+{
+	return NULL;
+}
+
+UringFile::~UringFile()
+{
+}
+
+bool UringFile::flush()
+{
+	return false;
+}
+
+_u32 UringFile::Write(int64 spos, const char* buffer, _u32 bsize, bool *has_error)
+{
+	return 0;
+}
+
+_u32 UringFile::Read(int64 spos, char* buffer, _u32 bsize, bool *has_error)
+{
+	return 0;
+}
+
+#endif //HAVE_LINUX_IO_URING_H
+
+std::string UringFile::Read(_u32 tr, bool *has_error)
+{
+	std::string ret;
+	ret.resize(tr);
+	_u32 read = Read(&ret[0], tr, has_error);
+	ret.resize(read);
+	return ret;
+}
+
+std::string UringFile::Read(int64 spos, _u32 tr, bool *has_error)
+{
+	std::string ret;
+	ret.resize(tr);
+	_u32 read = Read(spos, &ret[0], tr, has_error);
+	ret.resize(read);
+	return ret;
+}
+
+_u32 UringFile::Read(char* buffer, _u32 bsize, bool *has_error)
+{
+	_u32 read = Read(pos, buffer, bsize, has_error);
+	pos += read;
+	return read;
+}
+
+_u32 UringFile::Write(const std::string &tw, bool *has_error)
+{
+	return Write(tw.data(), static_cast<_u32>(tw.size()), has_error);
+}
+
+_u32 UringFile::Write(int64 spos, const std::string &tw, bool *has_error)
+{
+	return Write(spos, tw.data(), static_cast<_u32>(tw.size()), has_error);
+}
+
+_u32 UringFile::Write(const char* buffer, _u32 bsize, bool *has_error)
+{
+	_u32 written = Write(pos, buffer, bsize, has_error);
+	pos += written;
+	return written;
+}
+
+bool UringFile::Seek(_i64 spos)
+{
+	pos = spos;
+	return true;
+}
+
+_i64 UringFile::Size(void)
+{
+	IScopedLock lock(mutex.get());
+	return (std::max)(file->Size(), max_written);
+}
+
+_i64 UringFile::RealSize()
+{
+	flush();
+	return file->RealSize();
+}
+
+std::string UringFile::getFilename(void)
+{
+	return file->getFilename();
+}
+
+bool UringFile::PunchHole( _i64 spos, _i64 size )
+{
+	flush();
+	return file->PunchHole(spos, size);
+}
+
+bool UringFile::Sync()
+{
+	if (!flush())
+	{
+		return false;
+	}
+
+	return file->Sync();
+}
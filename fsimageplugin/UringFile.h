@@ -0,0 +1,96 @@
+#pragma once
+
+#include "../Interface/File.h"
+#include "../Interface/Types.h"
+#include "../Interface/Mutex.h"
+#include <string>
+#include <vector>
+#include <memory>
+
+/**
+* Write-behind wrapper around a file using Linux io_uring.
+* Sequential writes are coalesced into larger buffers and kept in flight
+* asynchronously. Reads and writes overlapping data still in flight wait
+* for it first. Write errors are sticky and returned by the next
+* Write()/Sync(). Takes ownership of the wrapped file.
+*/
+class UringFile : public IFile
+{
+public:
+	//Returns NULL if io_uring is not available (or disabled). The caller keeps ownership of file then
+	static UringFile* open(IFsFile* file);
+
+	~UringFile();
+
+	virtual std::string Read(_u32 tr, bool *has_error=NULL);
+	virtual std::string Read(int64 spos, _u32 tr, bool *has_error = NULL);
+	virtual _u32 Read(char* buffer, _u32 bsize, bool *has_error = NULL);
+	virtual _u32 Read(int64 spos, char* buffer, _u32 bsize, bool *has_error = NULL);
+	virtual _u32 Write(const std::string &tw, bool *has_error = NULL);
+	virtual _u32 Write(int64 spos, const std::string &tw, bool *has_error = NULL);
+	virtual _u32 Write(const char* buffer, _u32 bsize, bool *has_error = NULL);
+	virtual _u32 Write(int64 spos, const char* buffer, _u32 bsize, bool *has_error = NULL);
+	virtual bool Seek(_i64 spos);
+	virtual _i64 Size(void);
+	virtual _i64 RealSize();
+	virtual std::string getFilename(void);
+	virtual bool PunchHole( _i64 spos, _i64 size );
+	virtual bool Sync();
+
+	//Waits for all writes to complete (without syncing to disk). Needed before using the wrapped file directly
+	bool flush();
+
+private:
+	struct SInflight
+	{
+		int64 offset;
+		size_t size;
+		size_t done;
+		bool busy;
+	};
+
+	UringFile(IFsFile* file, size_t queue_depth);
+	bool setupRing();
+
+	bool submitCurrent();
+	bool submit(size_t slot);
+	bool reap(bool wait);
+	size_t getFreeSlot();
+	void waitOverlapping(int64 offset, size_t size);
+	bool waitAll();
+	bool writeSync(size_t slot);
+
+	IFsFile* file;
+	int fd;
+	int ring_fd;
+
+	void* sq_ring;
+	size_t sq_ring_size;
+	void* cq_ring;
+	size_t cq_ring_size;
+	void* sqes;
+	size_t sqes_size;
+
+	unsigned int* sq_head;
+	unsigned int* sq_tail;
+	unsigned int* sq_mask;
+	unsigned int* sq_array;
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	unsigned int* cq_mask;
+	void* cqes;
+
+	std::vector<char*> bufs;
+	std::vector<SInflight> inflight;
+	std::vector<size_t> free_slots;
+	size_t n_inflight;
+
+	//Slot currently being filled by sequential writes or std::string::npos
+	size_t curr_slot;
+
+	int64 pos;
+	int64 max_written;
+	bool error;
+
+	std::auto_ptr<IMutex> mutex;
+};
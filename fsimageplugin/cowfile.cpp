@@ -41,6 +41,7 @@
 #define O_LARGEFILE 0
 #define ftruncate64 ftruncate
 #define lseek64 lseek
+#define pread64 pread
 #define stat64 stat
 #define fstat64 fstat
 #define off64_t off_t
@@ -420,6 +421,37 @@ bool CowFile::Read(char* buffer, size_t bsize, size_t& read_bytes)
 	}
 }
 
+bool CowFile::ReadAt(_i64 offset, char* buffer, size_t bsize, size_t& read_bytes)
+{
+	if(!is_open) return false;
+
+#ifndef _WIN32
+	ssize_t r=pread64(fd, buffer, bsize, offset);
+	if( r<0 )
+	{
+		read_bytes=0;
+		return false;
+	}
+	read_bytes=r;
+	return true;
+#else
+	OVERLAPPED overlapped = {};
+	LARGE_INTEGER li;
+	li.QuadPart = offset;
+	overlapped.Offset = li.LowPart;
+	overlapped.OffsetHigh = li.HighPart;
+
+	DWORD r;
+	if (!ReadFile(fd, buffer, static_cast<DWORD>(bsize), &r, &overlapped))
+	{
+		read_bytes=0;
+		return false;
+	}
+	read_bytes=r;
+	return true;
+#endif
+}
+
 _u32 CowFile::Write(const char* buffer, _u32 bsize, bool *has_error)
 {
 	if(!is_open) return 0;
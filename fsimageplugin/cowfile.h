@@ -17,6 +17,7 @@ public:
 
 	virtual bool Seek(_i64 offset);
 	virtual bool Read(char* buffer, size_t bsize, size_t &read_bytes);
+	virtual bool ReadAt(_i64 offset, char* buffer, size_t bsize, size_t &read_bytes);
 	virtual _u32 Write(const char *buffer, _u32 bsize, bool *has_error);
 	virtual bool isOpen(void);
 	virtual uint64 getSize(void);
@@ -31,6 +32,7 @@ public:
 	virtual bool makeFull(_i64 fs_offset, IVHDWriteCallback* write_callback) { return true; }
 	virtual bool setUnused(_i64 unused_start, _i64 unused_end);
 	virtual bool setBackingFileSize(_i64 fsize);
+	virtual void setCompressionLevel(int level) { }
 
 private:
 	void setupBitmap();
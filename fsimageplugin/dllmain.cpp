@@ -564,6 +564,8 @@ DLLEXPORT void LoadActions(IServer* pServer)
 {
 	Server=pServer;
 
+	CompressedFile::init_mutex();
+
 	std::string compress_file = Server->getServerParameter("compress");
 	if(!compress_file.empty())
 	{
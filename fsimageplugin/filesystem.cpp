@@ -30,7 +30,9 @@
 #include "../Interface/Thread.h"
 #include "../Interface/Condition.h"
 #include "../Interface/ThreadPool.h"
+#include "BitmapExtents.h"
 #include <assert.h>
+#include <set>
 
 
 namespace
@@ -43,6 +45,8 @@ namespace
 #endif
 	const size_t max_idle_buffers = readahead_num_blocks;
 	const size_t readahead_low_level_blocks = readahead_num_blocks/2;
+	//Number of concurrent device reads in readahead thread mode
+	const size_t readahead_num_threads = 8;
 	const size_t slow_read_warning_seconds = 5 * 60;
 	const size_t max_read_wait_seconds = 60 * 60;
 
@@ -84,7 +88,8 @@ public:
 		current_block(-1),
 		do_stop(false),
 		readahead_miss(false),
-		background_priority(background_priority)
+		background_priority(background_priority),
+		curr_fs_readahead_n_max_buffers(fs.curr_fs_readahead_n_max_buffers)
 	{
 
 	}
@@ -93,11 +98,15 @@ public:
 		for (std::map<int64, IFilesystem::IFsBuffer*>::iterator it = read_blocks.begin();
 			it != read_blocks.end(); ++it)
 		{
-			fs.releaseBuffer(it->second);
+			if (it->second != NULL)
+			{
+				fs.releaseBuffer(it->second);
+			}
 		}
 	}
 
-
+	//Run by multiple threads. Each one reads the next run of consecutive
+	//used blocks, so several reads are in flight at the same time
 	void operator()()
 	{
 		ScopedBackgroundPrio background_prio(false);
@@ -108,12 +117,16 @@ public:
 #endif
 		}
 
+		std::vector<char> run_buf;
+		std::vector<int64> run_blocks;
+		std::vector<IFilesystem::IFsBuffer*> run_bufs;
+
 		IScopedLock lock(mutex.get());
 		while (!do_stop)
 		{
-			if (read_blocks.size() >= readahead_num_blocks)
+			if (read_blocks.size() + inflight_blocks.size() >= readahead_num_blocks)
 			{
-				while (read_blocks.size()>readahead_low_level_blocks
+				while (read_blocks.size() + inflight_blocks.size()>readahead_low_level_blocks
 					&& !readahead_miss)
 				{
 					start_readahead_cond->wait(&lock);
@@ -133,38 +146,48 @@ public:
 
 			if (do_stop) break;
 
-			std::map<int64, IFilesystem::IFsBuffer*>::iterator it;
-			do
+			while (current_block != -1
+				&& isQueued(current_block))
 			{
-				it = read_blocks.find(current_block);
-				if (it != read_blocks.end())
-				{
-					current_block = fs.nextBlockInt(current_block);
-				}
-			} while (it != read_blocks.end());
+				current_block = fs.nextBlockInt(current_block);
+			}
 
-			if (current_block != -1)
+			if (current_block == -1)
 			{
-				int64 l_current_block = current_block;
-				lock.relock(NULL);
-				IFilesystem::IFsBuffer* buf = fs.readBlockInt(l_current_block, false, NULL);
-				lock.relock(mutex.get());
-
-				read_blocks[l_current_block] = buf;
+				continue;
+			}
 
-				current_block = fs.nextBlockInt(l_current_block);
+			run_blocks.clear();
+			do
+			{
+				run_blocks.push_back(current_block);
+				inflight_blocks.insert(current_block);
+				current_block = fs.nextBlockInt(current_block);
+			} while (current_block == run_blocks.back() + 1
+				&& static_cast<int64>(run_blocks.size()) < curr_fs_readahead_n_max_buffers
+				&& !isQueued(current_block));
+
+			lock.relock(NULL);
+			fs.readBlockRun(run_blocks[0], run_blocks.size(), run_buf, run_bufs);
+			lock.relock(mutex.get());
+
+			for (size_t i = 0; i < run_blocks.size(); ++i)
+			{
+				inflight_blocks.erase(run_blocks[i]);
+				read_blocks[run_blocks[i]] = run_bufs[i];
+			}
 
-				if (readahead_miss)
-				{
-					read_block_cond->notify_all();
-					readahead_miss = false;
-				}
+			if (readahead_miss)
+			{
+				read_block_cond->notify_all();
+				readahead_miss = false;
 			}
 		}
 	}
 
 	void setMaxReadaheadNBuffers(int64 n_max_buffers)
 	{
+		IScopedLock lock(mutex.get());
 		curr_fs_readahead_n_max_buffers = n_max_buffers;
 	}
 
@@ -174,25 +197,34 @@ public:
 
 		clearUnusedReadahead(block);
 
-		IFilesystem::IFsBuffer* ret = NULL;
-		while (ret == NULL)
+		while (true)
 		{
 			std::map<int64, IFilesystem::IFsBuffer*>::iterator it = read_blocks.find(block);
 
 			if (it != read_blocks.end())
 			{
-				ret = it->second;
+				//NULL if reading the block failed
+				IFilesystem::IFsBuffer* ret = it->second;
 				read_blocks.erase(it);
+
+				if (read_blocks.size() + inflight_blocks.size() <= readahead_low_level_blocks)
+				{
+					start_readahead_cond->notify_all();
+				}
+
+				return ret;
 			}
 			else
 			{
-				readaheadFromInt(block);
+				if (inflight_blocks.find(block) == inflight_blocks.end())
+				{
+					readaheadFromInt(block);
+				}
 				readahead_miss = true;
+				start_readahead_cond->notify_all();
 				read_block_cond->wait(&lock);
 			}
 		}
-
-		return ret;
 	}
 
 	void stop()
@@ -204,6 +236,12 @@ public:
 
 private:
 
+	bool isQueued(int64 block)
+	{
+		return read_blocks.find(block) != read_blocks.end()
+			|| inflight_blocks.find(block) != inflight_blocks.end();
+	}
+
 	void readaheadFromInt(int64 pBlock)
 	{
 		current_block = pBlock;
@@ -219,7 +257,10 @@ private:
 			{
 				std::map<int64, IFilesystem::IFsBuffer*>::iterator todel = it;
 				++it;
-				fs.releaseBuffer(todel->second);
+				if (todel->second != NULL)
+				{
+					fs.releaseBuffer(todel->second);
+				}
 				read_blocks.erase(todel);
 			}
 			else
@@ -235,6 +276,7 @@ private:
 	Filesystem& fs;
 
 	std::map<int64, IFilesystem::IFsBuffer*> read_blocks;
+	std::set<int64> inflight_blocks;
 
 	bool readahead_miss;
 
@@ -271,8 +313,8 @@ Filesystem::Filesystem(const std::string &pDev, IFSImageFactory::EReadaheadMode
 }
 
 Filesystem::Filesystem(IFile *pDev, IFsNextBlockCallback* next_block_callback)
-	: dev(pDev), next_block_callback(next_block_callback), overlapped_next_block(-1),
-	num_uncompleted_blocks(0), errcode(0)
+	: buffer_mutex(Server->createMutex()), dev(pDev), next_block_callback(next_block_callback), overlapped_next_block(-1),
+	num_uncompleted_blocks(0), errcode(0), curr_fs_readahead_n_max_buffers(fs_readahead_n_max_buffers)
 {
 	has_error=false;
 	own_dev=false;
@@ -350,7 +392,13 @@ IFilesystem::IFsBuffer* Filesystem::readBlockInt(int64 pBlock, bool use_readahea
 	}
 	else if (read_ahead_mode == IFSImageFactory::EReadaheadMode_Thread)
 	{
-		return readahead_thread->getBlock(pBlock);
+		IFsBuffer* buf = readahead_thread->getBlock(pBlock);
+		if (buf == NULL
+			&& p_has_error != NULL)
+		{
+			*p_has_error = true;
+		}
+		return buf;
 	}
 	else
 	{
@@ -407,21 +455,25 @@ void Filesystem::overlappedIoCompletion(SNextBlock * block, DWORD dwErrorCode, D
 }
 #endif
 
+int64 Filesystem::getUsedExtent(int64 start_block, int64 end_block, int64& extent_len)
+{
+	int64 size_blocks = getSize() / getBlocksize();
+
+	return bitmap_extents::next_extent(getBitmap(), start_block, (std::min)(end_block, size_blocks), extent_len);
+}
+
 int64 Filesystem::nextBlock(int64 curr_block)
 {
 	int64 size_blocks = getSize() / getBlocksize();
 
-	while (curr_block + 1<size_blocks)
+	if (curr_block + 1 >= size_blocks)
 	{
-		++curr_block;
-
-		if (hasBlock(curr_block))
-		{
-			return curr_block;
-		}
+		return -1;
 	}
 
-	return -1;
+	int64 ret = bitmap_extents::find_bit(getBitmap(), curr_block + 1, size_blocks, true);
+
+	return ret < size_blocks ? ret : -1;
 }
 
 void Filesystem::slowReadWarning(int64 passed_time_ms, int64 curr_block)
@@ -441,6 +493,11 @@ int64 Filesystem::getOsErrorCode()
 void Filesystem::readaheadSetMaxNBuffers(int64 n_max_buffers)
 {
 	curr_fs_readahead_n_max_buffers = n_max_buffers;
+
+	if (readahead_thread.get() != NULL)
+	{
+		readahead_thread->setMaxReadaheadNBuffers(n_max_buffers);
+	}
 }
 
 std::vector<int64> Filesystem::readBlocks(int64 pStartBlock, unsigned int n,
@@ -517,6 +574,53 @@ bool Filesystem::readFromDev(char *buf, _u32 bsize)
 	return true;
 }
 
+bool Filesystem::readFromDevAt(int64 pos, char *buf, _u32 bsize)
+{
+	int tries=20;
+	_u32 rc=dev->Read(pos, buf, bsize);
+	while(rc<bsize)
+	{
+		Server->wait(200);
+		int64 last_error = getLastSystemError();
+		Server->Log("Reading from device at position "+convert(pos+rc)+" failed. Retrying. Errorcode: "+convert(last_error), LL_WARNING);
+		rc+=dev->Read(pos+rc, buf+rc, bsize-rc);
+		--tries;
+		if(tries<0
+			&& rc<bsize)
+		{
+			errcode = getLastSystemError();
+			Server->Log("Reading from device at position "+convert(pos+rc)+" failed. Errorcode: "+convert(errcode), LL_ERROR);
+			return false;
+		}
+	}
+	return true;
+}
+
+bool Filesystem::readBlockRun(int64 start_block, size_t n_blocks, std::vector<char>& run_buf, std::vector<IFsBuffer*>& ret)
+{
+	size_t blocksize = static_cast<size_t>(getBlocksize());
+	run_buf.resize(n_blocks*blocksize);
+	ret.resize(n_blocks);
+
+	if (!readFromDevAt(start_block*blocksize, run_buf.data(), static_cast<_u32>(run_buf.size())))
+	{
+		has_error = true;
+		for (size_t i = 0; i < n_blocks; ++i)
+		{
+			ret[i] = NULL;
+		}
+		return false;
+	}
+
+	for (size_t i = 0; i < n_blocks; ++i)
+	{
+		ret[i] = getBuffer();
+		memcpy(ret[i]->getBuf(), run_buf.data() + i*blocksize, blocksize);
+	}
+
+	return true;
+}
+
 void Filesystem::initReadahead(IFSImageFactory::EReadaheadMode read_ahead, bool background_priority)
 {
 	read_ahead_mode = read_ahead;
@@ -593,7 +697,10 @@ void Filesystem::initReadahead(IFSImageFactory::EReadaheadMode read_ahead, bool
 	else if (read_ahead == IFSImageFactory::EReadaheadMode_Thread)
 	{
 		readahead_thread.reset(new Filesystem_ReadaheadThread(*this, background_priority));
-		readahead_thread_ticket = Server->getThreadPool()->execute(readahead_thread.get(), "device readahead");
+		for (size_t i = 0; i < readahead_num_threads; ++i)
+		{
+			readahead_thread_tickets.push_back(Server->getThreadPool()->execute(readahead_thread.get(), "device readahead"));
+		}
 	}
 
 	if (read_ahead != IFSImageFactory::EReadaheadMode_None
@@ -753,30 +860,7 @@ void Filesystem::completionFreeBuffer(SBlockBuffer* block_buf)
 
 int64 Filesystem::calculateUsedSpace(void)
 {
-	const unsigned char *bm=getBitmap();
-	uint64 blocks1=getSize()/getBlocksize();
-	unsigned int tadd=(unsigned int)(blocks1/8);;
-	if( blocks1%8>0)
-		++tadd;
-
-	const unsigned char *target=bm+tadd;
-	int64 used_blocks=0;
-	uint64 blocknum=0;
-	while(bm!=target)
-	{
-		const unsigned char b=*bm;
-		for(int i=0;i<8;++i)
-		{
-			if(blocknum>=blocks1)
-				break;
-			if( (b & (1<<i))>0 )
-			{
-				++used_blocks;
-			}
-			++blocknum;
-		}
-		++bm;
-	}
+	int64 used_blocks = bitmap_extents::count_bits(getBitmap(), getSize()/getBlocksize());
 	return used_blocks*getBlocksize();
 }
 
@@ -834,7 +918,8 @@ void Filesystem::shutdownReadahead()
 	if(readahead_thread.get()!=NULL)
 	{
 		readahead_thread->stop();
-		Server->getThreadPool()->waitFor(readahead_thread_ticket);
+		Server->getThreadPool()->waitFor(readahead_thread_tickets);
+		readahead_thread_tickets.clear();
 		readahead_thread.reset();
 	}
 
@@ -16,6 +16,7 @@
 #include <memory>
 #include <map>
 #include <stack>
+#include <vector>
 
 class VHDFile;
 
@@ -58,6 +59,7 @@ struct SNextBlock
 
 class Filesystem : public IFilesystem, public IFsNextBlockCallback
 {
+	friend class Filesystem_ReadaheadThread;
 public:
 	Filesystem(const std::string &pDev, IFSImageFactory::EReadaheadMode read_ahead, IFsNextBlockCallback* next_block_callback);
 	Filesystem(IFile *pDev, IFsNextBlockCallback* next_block_callback);
@@ -67,6 +69,7 @@ public:
 	virtual const unsigned char *getBitmap(void)=0;
 
 	virtual bool hasBlock(int64 pBlock);
+	virtual int64 getUsedExtent(int64 start_block, int64 end_block, int64& extent_len);
 	
 	virtual IFsBuffer* readBlock(int64 pBlock, bool* p_has_error=NULL);
 	std::vector<int64> readBlocks(int64 pStartBlock, unsigned int n,
@@ -102,6 +105,8 @@ public:
 
 protected:
 	bool readFromDev(char *buf, _u32 bsize);
+	bool readFromDevAt(int64 pos, char *buf, _u32 bsize);
+	bool readBlockRun(int64 start_block, size_t n_blocks, std::vector<char>& run_buf, std::vector<IFsBuffer*>& ret);
 	void initReadahead(IFSImageFactory::EReadaheadMode read_ahead, bool background_priority);
 	bool queueOverlappedReads(bool force_queue);
 	bool waitForCompletion(unsigned int wtimems);
@@ -132,7 +137,7 @@ protected:
 	std::vector<SSimpleBuffer*> buffers;
 	std::auto_ptr<IMutex> buffer_mutex;
 	std::auto_ptr<Filesystem_ReadaheadThread> readahead_thread;
-	THREADPOOL_TICKET readahead_thread_ticket;
+	std::vector<THREADPOOL_TICKET> readahead_thread_tickets;
 
 	size_t num_uncompleted_blocks;
 	int64 overlapped_next_block;
@@ -21,11 +21,13 @@
 #include "../Interface/Types.h"
 #include "../stringtools.h"
 #include "CompressedFile.h"
+#include "UringFile.h"
 #include <memory.h>
 #include <stdlib.h>
 #include <limits.h>
 #include "FileWrapper.h"
 #include "ClientBitmap.h"
+#include "../urbackupcommon/os_functions.h"
 
 #ifdef _WIN32
 #include <windows.h>
@@ -42,14 +44,14 @@ const uint64 def_bat_offset_parent=2*1024;
 const int64 unixtime_offset=946684800;
 
 const unsigned int sector_size=512;
+//Block data of uncompressed files is aligned to this, so that it can be cloned via reflinks
+const unsigned int block_data_alignment=4096;
 
 namespace
 {
-	size_t getNumCompThreads(bool read_only)
+	//Used for compression when writing and for decompression readahead when reading
+	size_t getNumCompThreads()
 	{
-		if (read_only)
-			return 0;
-
 		const size_t maxCpus = 5;
 #ifdef _WIN32
 		SYSTEM_INFO system_info;
@@ -69,9 +71,10 @@ namespace
 
 VHDFile::VHDFile(const std::string &fn, bool pRead_only, uint64 pDstsize, unsigned int pBlocksize, bool fast_mode, bool compress)
 	: dstsize(pDstsize), blocksize(pBlocksize), fast_mode(fast_mode), bitmap_offset(0), bitmap_dirty(false), volume_offset(0), finished(false),
-	file(NULL)
+	file(NULL), resolved_mutex(Server->createMutex())
 {
 	compressed_file=NULL;
+	async_file=NULL;
 	parent=NULL;
 	read_only=pRead_only;
 	is_open=false;
@@ -98,7 +101,7 @@ VHDFile::VHDFile(const std::string &fn, bool pRead_only, uint64 pDstsize, unsign
 
 	if(check_if_compressed() || compress)
 	{
-		compressed_file = new CompressedFile(backing_file, openedExisting, read_only, getNumCompThreads(pRead_only));
+		compressed_file = new CompressedFile(openDataFile(), openedExisting, read_only, getNumCompThreads());
 		file = compressed_file;
 
 		if(compressed_file->hasError())
@@ -108,7 +111,7 @@ VHDFile::VHDFile(const std::string &fn, bool pRead_only, uint64 pDstsize, unsign
 	}
 	else
 	{
-		file = backing_file;
+		file = openDataFile();
 	}
 
 	if(file->Size()==0 && !read_only) // created file
@@ -163,9 +166,11 @@ VHDFile::VHDFile(const std::string &fn, bool pRead_only, uint64 pDstsize, unsign
 }
 
 VHDFile::VHDFile(const std::string &fn, const std::string &parent_fn, bool pRead_only, bool fast_mode, bool compress, uint64 pDstsize)
-	: fast_mode(fast_mode), bitmap_offset(0), bitmap_dirty(false), volume_offset(0), finished(false), file(NULL)
+	: fast_mode(fast_mode), bitmap_offset(0), bitmap_dirty(false), volume_offset(0), finished(false), file(NULL),
+	resolved_mutex(Server->createMutex())
 {
 	compressed_file=NULL;
+	async_file=NULL;
 	curr_offset=0;
 	is_open=false;
 	read_only=pRead_only;
@@ -191,11 +196,11 @@ VHDFile::VHDFile(const std::string &fn, const std::string &parent_fn, bool pRead
 
 	if(check_if_compressed() || compress)
 	{
-		file = new CompressedFile(backing_file, openedExisting, read_only, getNumCompThreads(pRead_only));
+		file = new CompressedFile(openDataFile(), openedExisting, read_only, getNumCompThreads());
 	}
 	else
 	{
-		file = backing_file;
+		file = openDataFile();
 	}
 
 	parent=new VHDFile(parent_fn, true, 0);
@@ -273,6 +278,7 @@ VHDFile::~VHDFile()
 	}
 	delete file;
 	delete parent;
+	Server->destroy(resolved_mutex);
 }
 
 bool VHDFile::write_header(bool diff)
@@ -500,7 +506,12 @@ bool VHDFile::write_footer(void)
 	}
 	else
 	{
-		if (file==backing_file 
+		if (async_file!=NULL && file==async_file)
+		{
+			async_file->flush();
+		}
+
+		if ((file==backing_file || file==async_file)
 			&& backing_file->Size() != nextblock_offset + sizeof(VHDFooter))
 		{
 			backing_file->Resize(nextblock_offset + sizeof(VHDFooter));
@@ -726,6 +737,12 @@ inline bool VHDFile::isBitmapSet(unsigned int offset)
 	return has_bit;
 }
 
+inline bool VHDFile::isBitmapSet(const std::vector<unsigned char>& block_bitmap, unsigned int offset)
+{
+	size_t sector=offset/sector_size;
+	return (block_bitmap[sector/8] & (1<<(7-sector%8)))>0;
+}
+
 inline bool VHDFile::setBitmapBit(unsigned int offset, bool v)
 {
 	size_t sector=offset/sector_size;
@@ -774,13 +791,14 @@ bool VHDFile::Read(char* buffer, size_t bsize, size_t &read)
 		{
 			unsigned int wantread=(unsigned int)(std::min)(remaining, toread);
 
-			if(parent==NULL)
+			VHDFile* owner=getBlockOwner(block);
+			if(owner==NULL)
 				memset(&buffer[read], 0, wantread );
 			else
 			{
-				parent->Seek(curr_offset);
+				owner->Seek(curr_offset);
 				size_t p_read;
-				bool b=parent->Read(&buffer[read], wantread, p_read);
+				bool b=owner->Read(&buffer[read], wantread, p_read);
 				if(!b)
 				{
 					Server->Log("Reading from parent failed -1", LL_ERROR);
@@ -862,10 +880,11 @@ bool VHDFile::Read(char* buffer, size_t bsize, size_t &read)
 			}
 			else
 			{
-				if(parent!=NULL)
+				VHDFile* owner=getBlockOwner(block);
+				if(owner!=NULL)
 				{
-					parent->Seek(curr_offset);
-					bool b=parent->Read(&buffer[read], wantread, wantread);
+					owner->Seek(curr_offset);
+					bool b=owner->Read(&buffer[read], wantread, wantread);
 					if(!b)
 					{
 						Server->Log("Reading from parent failed -2", LL_ERROR);
@@ -939,9 +958,7 @@ _u32 VHDFile::Write(const char *buffer, _u32 bsize, bool *has_error)
 		bool new_block=false;
 		if(bat_ref==0xFFFFFFFF)
 		{
-			dataoffset=nextblock_offset;
-			nextblock_offset+=blocksize+bitmap_size;
-			nextblock_offset=nextblock_offset+(sector_size-nextblock_offset%sector_size);
+			dataoffset=allocateBlock();
 			dwrite_footer=true;
 			new_block=true;
 			int64 bat_offset = dataoffset / (uint64)(sector_size);
@@ -1083,6 +1100,412 @@ _u32 VHDFile::Write(int64 spos, const char *buffer, _u32 bsize, bool* has_error)
 	return Write(buffer, bsize, has_error);
 }
 
+VHDFile* VHDFile::getBlockOwner(unsigned int block)
+{
+	if(parent==NULL)
+	{
+		return NULL;
+	}
+
+	{
+		IScopedLock lock(resolved_mutex);
+		if(resolved_bat.empty())
+		{
+			buildResolvedBat();
+		}
+	}
+
+	if(block>=resolved_bat.size())
+	{
+		return NULL;
+	}
+
+	unsigned short chain_idx=resolved_bat[block];
+	if(chain_idx==0)
+	{
+		return NULL;
+	}
+
+	return resolved_chain[chain_idx-1];
+}
+
+uint64 VHDFile::allocateBlock()
+{
+	uint64 dataoffset=nextblock_offset;
+	if(compressed_file==NULL)
+	{
+		uint64 data_start=dataoffset+bitmap_size;
+		if(data_start%block_data_alignment!=0)
+		{
+			dataoffset+=block_data_alignment-data_start%block_data_alignment;
+		}
+	}
+
+	nextblock_offset=dataoffset+blocksize+bitmap_size;
+	nextblock_offset=nextblock_offset+(sector_size-nextblock_offset%sector_size);
+	return dataoffset;
+}
+
+int64 VHDFile::cloneFromParents(uint64 start, uint64 end)
+{
+	if(parent==NULL || compressed_file!=NULL || read_only)
+	{
+		return 0;
+	}
+
+	const unsigned int sectors_per_cluster=block_data_alignment/sector_size;
+	std::vector<VHDFile*> chain;
+	std::vector<uint64> chain_dataoffset;
+	std::vector<std::vector<unsigned char> > chain_bitmap;
+	int64 cloned=0;
+
+	for(uint64 block=start/blocksize;block*blocksize<end && block<batsize;++block)
+	{
+		unsigned int bat_ref=big_endian(bat[block]);
+		bool new_block=bat_ref==0xFFFFFFFF;
+		uint64 dataoffset=new_block ? 0 : (uint64)bat_ref*(uint64)sector_size;
+
+		if(!new_block
+			&& (dataoffset+bitmap_size)%block_data_alignment!=0)
+		{
+			continue;
+		}
+
+		if(!new_block && currblock!=block)
+		{
+			switchBitmap(dataoffset);
+			if(readFileAt(dataoffset, reinterpret_cast<char*>(bitmap.data()), bitmap_size, NULL)!=bitmap_size)
+			{
+				Server->Log("Error reading bitmap", LL_ERROR);
+				return -1;
+			}
+			currblock=block;
+		}
+
+		//Parents which have the block allocated, nearest first
+		chain.clear();
+		chain_dataoffset.clear();
+		for(VHDFile* curr=parent;curr!=NULL;curr=curr->parent)
+		{
+			if(block>=curr->batsize
+				|| curr->bat[block]==0xFFFFFFFF)
+			{
+				continue;
+			}
+
+			uint64 curr_dataoffset=(uint64)big_endian(curr->bat[block])*(uint64)sector_size;
+			if(chain_bitmap.size()<=chain.size())
+			{
+				chain_bitmap.resize(chain.size()+1);
+			}
+			chain_bitmap[chain.size()].resize(bitmap_size);
+
+			if(curr->bitmap_size!=bitmap_size
+				|| curr->readFileAt(curr_dataoffset, reinterpret_cast<char*>(chain_bitmap[chain.size()].data()), bitmap_size, NULL)!=bitmap_size)
+			{
+				break;
+			}
+
+			chain.push_back(curr);
+			chain_dataoffset.push_back(curr_dataoffset);
+		}
+
+		//Owner of each cluster in the parent chain (NULL if it cannot be cloned)
+		std::vector<VHDFile*> cluster_owner(blocksize/block_data_alignment);
+		std::vector<uint64> owner_dataoffset(cluster_owner.size());
+		for(size_t i=0;i<cluster_owner.size();++i)
+		{
+			uint64 cluster_start=block*blocksize+i*block_data_alignment;
+			if(cluster_start+block_data_alignment<=start
+				|| cluster_start>=end
+				|| cluster_start+block_data_alignment>dstsize)
+			{
+				continue;
+			}
+
+			bool has_sector=false;
+			for(unsigned int j=0;j<sectors_per_cluster && !new_block;++j)
+			{
+				if(isBitmapSet(static_cast<unsigned int>(i*block_data_alignment+j*sector_size)))
+				{
+					has_sector=true;
+				}
+			}
+
+			if(has_sector)
+			{
+				continue;
+			}
+
+			for(size_t c=0;c<chain.size();++c)
+			{
+				unsigned int n_set=0;
+				for(unsigned int j=0;j<sectors_per_cluster;++j)
+				{
+					if(isBitmapSet(chain_bitmap[c], static_cast<unsigned int>(i*block_data_alignment+j*sector_size)))
+					{
+						++n_set;
+					}
+				}
+
+				if(n_set==sectors_per_cluster
+					&& chain[c]->compressed_file==NULL
+					&& (chain_dataoffset[c]+bitmap_size)%block_data_alignment==0)
+				{
+					cluster_owner[i]=chain[c];
+					owner_dataoffset[i]=chain_dataoffset[c];
+				}
+
+				if(n_set>0)
+				{
+					//Partially owned clusters are copied
+					break;
+				}
+			}
+		}
+
+		bool has_owner=false;
+		for(size_t i=0;i<cluster_owner.size();++i)
+		{
+			if(cluster_owner[i]!=NULL)
+			{
+				has_owner=true;
+				break;
+			}
+		}
+
+		if(!has_owner)
+		{
+			continue;
+		}
+
+		if(new_block)
+		{
+			dataoffset=allocateBlock();
+			int64 new_bat_offset = dataoffset / (uint64)(sector_size);
+			if (new_bat_offset >= UINT_MAX)
+			{
+				Server->Log("Too much data in VHD file. BAT table overflow. Next BAT entry would be to offset " + convert(new_bat_offset), LL_ERROR);
+				return -1;
+			}
+			bat[block]=big_endian((unsigned int)(new_bat_offset));
+
+			switchBitmap(dataoffset);
+			memset(bitmap.data(), 0, bitmap_size);
+			currblock=block;
+		}
+
+		if(async_file!=NULL && file==async_file)
+		{
+			async_file->flush();
+		}
+
+		bool clone_error=false;
+		for(size_t i=0;i<cluster_owner.size() && !clone_error;)
+		{
+			VHDFile* owner=cluster_owner[i];
+			if(owner==NULL)
+			{
+				++i;
+				continue;
+			}
+
+			size_t run_end=i+1;
+			while(run_end<cluster_owner.size()
+				&& cluster_owner[run_end]==owner)
+			{
+				++run_end;
+			}
+
+			int64 run_offset=i*block_data_alignment;
+			int64 run_len=(run_end-i)*block_data_alignment;
+
+			if(os_clone_range(owner->backing_file, owner_dataoffset[i]+bitmap_size+run_offset,
+				backing_file, dataoffset+bitmap_size+run_offset, run_len)!=run_len)
+			{
+				Server->Log("Cloning data from parent VHD file \""+owner->getFilename()+"\" failed. "+os_last_error_str(), LL_INFO);
+				clone_error=true;
+				break;
+			}
+
+			for(int64 off=run_offset;off<run_offset+run_len;off+=sector_size)
+			{
+				setBitmapBit(static_cast<unsigned int>(off), true);
+			}
+
+			cloned+=run_len;
+			i=run_end;
+		}
+
+		if(file->Write(dataoffset, reinterpret_cast<char*>(bitmap.data()), bitmap_size)!=bitmap_size)
+		{
+			Server->Log("Writing bitmap failed", LL_ERROR);
+			print_last_error();
+			return -1;
+		}
+		bitmap_dirty=false;
+
+		if(clone_error)
+		{
+			return -1;
+		}
+	}
+
+	return cloned;
+}
+
+void VHDFile::buildResolvedBat()
+{
+	resolved_chain.clear();
+	for(VHDFile* curr=parent;curr!=NULL;curr=curr->parent)
+	{
+		resolved_chain.push_back(curr);
+	}
+
+	if(resolved_chain.size()>=USHRT_MAX)
+	{
+		Server->Log("VHD parent chain of \""+getFilename()+"\" is too long ("+convert(resolved_chain.size())+")", LL_ERROR);
+		resolved_chain.resize(USHRT_MAX-1);
+	}
+
+	resolved_bat.resize(batsize);
+	for(unsigned int block=0;block<batsize;++block)
+	{
+		for(size_t i=0;i<resolved_chain.size();++i)
+		{
+			VHDFile* curr=resolved_chain[i];
+			if(block<curr->batsize
+				&& curr->bat[block]!=0xFFFFFFFF)
+			{
+				resolved_bat[block]=static_cast<unsigned short>(i+1);
+				break;
+			}
+		}
+	}
+}
+
+_u32 VHDFile::readFileAt(int64 pos, char* buffer, _u32 bsize, bool* has_error)
+{
+	CompressedFile* compfile = dynamic_cast<CompressedFile*>(file);
+	if(compfile!=NULL)
+	{
+		return compfile->ReadAt(pos, buffer, bsize, has_error);
+	}
+
+	_u32 read = 0;
+	while(read<bsize)
+	{
+		_u32 rc = file->Read(pos+read, buffer+read, bsize-read, has_error);
+		if(rc==0)
+		{
+			break;
+		}
+		read+=rc;
+	}
+	return read;
+}
+
+bool VHDFile::ReadAt(_i64 offset, char* buffer, size_t bsize, size_t &read)
+{
+	uint64 pos=(uint64)offset+volume_offset;
+	read=0;
+
+	if(pos>=dstsize)
+	{
+		return false;
+	}
+
+	if(pos+bsize>dstsize)
+	{
+		bsize=(size_t)(dstsize-pos);
+	}
+
+	std::vector<unsigned char> block_bitmap;
+
+	while(read<bsize)
+	{
+		unsigned int block=(unsigned int)(pos/blocksize);
+		size_t blockoffset=pos%blocksize;
+		size_t toread=(std::min)(bsize-read, blocksize-blockoffset);
+
+		unsigned int bat_off=big_endian(bat[block]);
+		if(bat_off==0xFFFFFFFF)
+		{
+			VHDFile* owner=getBlockOwner(block);
+			if(owner==NULL)
+			{
+				memset(&buffer[read], 0, toread);
+			}
+			else
+			{
+				size_t p_read;
+				if(!owner->ReadAt(pos, &buffer[read], toread, p_read))
+				{
+					Server->Log("Reading from parent failed -1", LL_ERROR);
+				}
+			}
+		}
+		else
+		{
+			uint64 dataoffset=(uint64)bat_off*(uint64)sector_size;
+
+			block_bitmap.resize(bitmap_size);
+			if(readFileAt(dataoffset, reinterpret_cast<char*>(block_bitmap.data()), bitmap_size, NULL)!=bitmap_size)
+			{
+				Server->Log("Error reading bitmap", LL_ERROR);
+				return false;
+			}
+
+			VHDFile* owner=getBlockOwner(block);
+
+			//Handle runs of sectors which are all either in this file or not
+			size_t done=0;
+			while(done<toread)
+			{
+				size_t curr_off=blockoffset+done;
+				bool has_bit=isBitmapSet(block_bitmap, (unsigned int)curr_off);
+				size_t run=sector_size-curr_off%sector_size;
+				while(done+run<toread
+					&& isBitmapSet(block_bitmap, (unsigned int)(curr_off+run))==has_bit)
+				{
+					run+=sector_size;
+				}
+				run=(std::min)(run, toread-done);
+
+				if(has_bit)
+				{
+					bool has_read_error=false;
+					if(readFileAt(dataoffset+bitmap_size+curr_off, &buffer[read+done], (_u32)run, &has_read_error)!=run)
+					{
+						Server->Log("Error reading from VHD file at position " + convert(dataoffset + bitmap_size + curr_off) + ".");
+						print_last_error();
+						return false;
+					}
+				}
+				else if(owner!=NULL)
+				{
+					size_t p_read;
+					if(!owner->ReadAt(pos+done, &buffer[read+done], run, p_read))
+					{
+						Server->Log("Reading from parent failed -2", LL_ERROR);
+					}
+				}
+				else
+				{
+					memset(&buffer[read+done], 0, run);
+				}
+
+				done+=run;
+			}
+		}
+
+		read+=toread;
+		pos+=toread;
+	}
+
+	return true;
+}
+
 bool VHDFile::has_block(bool use_parent)
 {
 	unsigned int block=(unsigned int)(curr_offset/blocksize);
@@ -1096,14 +1519,15 @@ bool VHDFile::has_block(bool use_parent)
 	unsigned int bat_off=big_endian(bat[block]);
 	if(bat_off==0xFFFFFFFF)
 	{
-		if(parent==NULL || !use_parent)
+		VHDFile* owner=use_parent ? getBlockOwner(block) : NULL;
+		if(owner==NULL)
 		{
 			return false;
 		}
 		else
 		{
-			parent->Seek(curr_offset);
-			return parent->has_block();
+			owner->Seek(curr_offset);
+			return owner->has_block();
 		}
 	}
 
@@ -1134,10 +1558,11 @@ bool VHDFile::has_block(bool use_parent)
 	}
 	else
 	{
-		if(parent!=NULL && use_parent)
+		VHDFile* owner=use_parent ? getBlockOwner(block) : NULL;
+		if(owner!=NULL)
 		{
-			parent->Seek(curr_offset);
-			return parent->has_block();
+			owner->Seek(curr_offset);
+			return owner->has_block();
 		}
 		else
 		{
@@ -1199,13 +1624,7 @@ bool VHDFile::has_sector(_i64 sector_size)
 	unsigned int bat_ref=big_endian(bat[block]);
 	if(bat_ref==0xFFFFFFFF)
 	{
-		if(parent!=NULL)
-		{
-			parent->Seek(curr_offset);
-			return parent->has_sector();
-		}
-		else
-			return false;
+		return getBlockOwner(block)!=NULL;
 	}
 	else
 	{
@@ -1409,6 +1828,21 @@ bool VHDFile::finish()
 	return false;
 }
 
+IFile* VHDFile::openDataFile()
+{
+	//Keep many block writes in flight while writing new images
+	if(fast_mode && !read_only)
+	{
+		async_file = UringFile::open(backing_file);
+		if(async_file!=NULL)
+		{
+			return async_file;
+		}
+	}
+
+	return backing_file;
+}
+
 VHDFile* VHDFile::getParent()
 {
 	return parent;
@@ -1446,9 +1880,23 @@ bool VHDFile::makeFull( _i64 fs_offset, IVHDWriteCallback* write_callback)
 
 	int64 ntfs_blocks_per_vhd_sector = blocksize / bitmap_blocksize;
 
+	//Shares inherited data with the parents instead of copying it, if the file system supports it
+	bool use_clone = Server->getServerParameter("image_reflink_make_full") != "false";
+	int64 cloned_bytes = 0;
+	int64 copied_bytes = 0;
+	int64 last_progress_pc = 0;
+
 	for(int64 ntfs_block=0, n_ntfs_blocks = devfile.Size()/ bitmap_blocksize;
 		ntfs_block<n_ntfs_blocks; ntfs_block+= ntfs_blocks_per_vhd_sector)
 	{
+		int64 progress_pc = ntfs_block * 100 / n_ntfs_blocks;
+		if (progress_pc / 10 != last_progress_pc / 10)
+		{
+			write_callback->makeFullProgress(ntfs_block*bitmap_blocksize, n_ntfs_blocks*bitmap_blocksize,
+				cloned_bytes, copied_bytes);
+			last_progress_pc = progress_pc;
+		}
+
 		bool has_vhd_sector = false;
 		for (int64 i = ntfs_block;
 			i < ntfs_block + ntfs_blocks_per_vhd_sector
@@ -1466,6 +1914,21 @@ bool VHDFile::makeFull( _i64 fs_offset, IVHDWriteCallback* write_callback)
 			int64 block_pos = fs_offset + ntfs_block*bitmap_blocksize;
 			int64 max_block_pos = (std::min)(fs_offset + ntfs_block*bitmap_blocksize + blocksize,
 				fs_offset + n_ntfs_blocks*bitmap_blocksize);
+
+			if (use_clone)
+			{
+				int64 cloned = cloneFromParents(block_pos + volume_offset, max_block_pos + volume_offset);
+				if (cloned < 0)
+				{
+					Server->Log("Cloning data from parent VHD files not possible. Copying data instead.", LL_INFO);
+					use_clone = false;
+				}
+				else
+				{
+					cloned_bytes += cloned;
+				}
+			}
+
 			for(int64 i = block_pos;i<max_block_pos;i+=sector_size)
 			{
 				Seek(i);
@@ -1485,6 +1948,8 @@ bool VHDFile::makeFull( _i64 fs_offset, IVHDWriteCallback* write_callback)
 						Server->Log("Error converting incremental to full image. Cannot write to VHD file at position "+convert(i), LL_WARNING);
 						return false;
 					}
+
+					copied_bytes += sector_size;
 				}
 			}
 		}
@@ -1498,6 +1963,8 @@ bool VHDFile::makeFull( _i64 fs_offset, IVHDWriteCallback* write_callback)
 		}
 	}
 
+	write_callback->makeFullProgress(devfile.Size(), devfile.Size(), cloned_bytes, copied_bytes);
+
 	delete parent;
 	parent = NULL;
 
@@ -1558,9 +2025,7 @@ bool VHDFile::setUnused(_i64 unused_start, _i64 unused_end)
 		bool new_block = false;
 		if (bat_ref == 0xFFFFFFFF)
 		{
-			dataoffset = nextblock_offset;
-			nextblock_offset += blocksize + bitmap_size;
-			nextblock_offset = nextblock_offset + (sector_size - nextblock_offset%sector_size);
+			dataoffset = allocateBlock();
 			dwrite_footer = true;
 			new_block = true;
 			bat[block] = big_endian((unsigned int)(dataoffset / (uint64)(sector_size)));
@@ -1693,7 +2158,11 @@ bool VHDFile::Sync()
 
 bool VHDFile::setBackingFileSize(_i64 fsize)
 {
-	if (file != backing_file)
+	if (async_file!=NULL && file==async_file)
+	{
+		async_file->flush();
+	}
+	else if (file != backing_file)
 	{
 		return false;
 	}
@@ -1703,6 +2172,8 @@ bool VHDFile::setBackingFileSize(_i64 fsize)
 
 	_i64 one_blocksize = blocksize + bitmap_size;
 	one_blocksize = one_blocksize + (sector_size - one_blocksize%sector_size);
+	//See allocateBlock()
+	one_blocksize += block_data_alignment;
 
 	_i64 nblocks = fsize / blocksize + (fsize%blocksize != 0 ? 1 : 0);
 
@@ -1717,3 +2188,12 @@ bool VHDFile::setBackingFileSize(_i64 fsize)
 		return false;
 	}
 }
+
+void VHDFile::setCompressionLevel(int level)
+{
+	CompressedFile* compfile = dynamic_cast<CompressedFile*>(file);
+	if(compfile!=NULL)
+	{
+		compfile->setCompressionLevel(level);
+	}
+}
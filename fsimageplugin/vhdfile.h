@@ -60,6 +60,7 @@ struct VHDDynamicHeader
 #endif
 
 class CompressedFile;
+class UringFile;
 
 class VHDFile : public IVHDFile, public IFile
 {
@@ -81,9 +82,11 @@ public:
 	virtual bool PunchHole( _i64 spos, _i64 size );
 	virtual bool Sync();
 	virtual bool setBackingFileSize(_i64 fsize);
+	virtual void setCompressionLevel(int level);
 	
 	bool Seek(_i64 offset);
 	bool Read(char* buffer, size_t bsize, size_t &read);
+	bool ReadAt(_i64 offset, char* buffer, size_t bsize, size_t &read);
 	uint64 getSize(void);
 	uint64 getRealSize(void);
 	uint64 usedSize(void);
@@ -139,9 +142,18 @@ private:
 	void init_bitmap(void);
 
 	inline bool isBitmapSet(unsigned int offset);
+	inline bool isBitmapSet(const std::vector<unsigned char>& block_bitmap, unsigned int offset);
+	_u32 readFileAt(int64 pos, char* buffer, _u32 bsize, bool* has_error);
+
+	VHDFile* getBlockOwner(unsigned int block);
+	uint64 allocateBlock();
+	int64 cloneFromParents(uint64 start, uint64 end);
+	void buildResolvedBat();
 	inline bool setBitmapBit(unsigned int offset, bool v);
 	void switchBitmap(uint64 new_offset);
 
+	IFile* openDataFile();
+
 	unsigned int calculate_chs(void);
 	unsigned int calculate_checksum(const unsigned char * data, size_t dsize);
 
@@ -152,6 +164,7 @@ private:
 	IFsFile* backing_file;
 	IFile* file;
 	CompressedFile* compressed_file;
+	UringFile* async_file;
 
 	uint64 dstsize;
 
@@ -187,4 +200,9 @@ private:
 	_i64 volume_offset;
 
 	bool finished;
+
+	//Index into resolved_chain+1 of the nearest parent which has the block allocated (0 if none)
+	std::vector<unsigned short> resolved_bat;
+	std::vector<VHDFile*> resolved_chain;
+	IMutex* resolved_mutex;
 };
@@ -113,22 +113,32 @@ namespace
 	static int vhdfile_read(const char* path, char* buf, size_t size, off_t offset,
 							struct fuse_file_info* fi)
 	{
-		size_t len;
 		if(strcmp(path, volume_path) != 0)
 			return -ENOENT;
 
-		if(!vhdfile->Seek(offset+global_offset))
+		//Called concurrently by the fuse worker threads
+		size_t total_read = 0;
+		while(total_read<size)
 		{
-			return -EINVAL;
-		}
-		
-		size_t read;
-		if(!vhdfile->Read(buf, size, read))
-		{
-			return -EINVAL;
+			size_t read;
+			if(!vhdfile->ReadAt(offset+global_offset+total_read, buf+total_read, size-total_read, read))
+			{
+				if(total_read>0)
+				{
+					break;
+				}
+				return -EINVAL;
+			}
+
+			if(read==0)
+			{
+				break;
+			}
+
+			total_read+=read;
 		}
 		
-		return static_cast<int>(read);
+		return static_cast<int>(total_read);
 	}
 
 	static struct fuse_operations vhdfile_oper = {};  
@@ -183,6 +193,22 @@ DLLEXPORT void LoadActions(IServer* pServer)
 	Server->Log("Volume offset is "+convert(global_offset)+" bytes. Configure via --offset", LL_DEBUG);
 	
 	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+
+	std::string max_readahead = Server->getServerParameter("max_readahead");
+	if(max_readahead.empty())
+	{
+		max_readahead = "1048576";
+	}
+
+	//The image is read-only, so the kernel may keep cached pages across opens
+	std::string fuse_opts = "-oro,kernel_cache,max_read=131072,max_readahead="+max_readahead;
+
+	if(fuse_opt_add_arg(&args, "urbackupsrv")!=0
+		|| fuse_opt_add_arg(&args, fuse_opts.c_str())!=0)
+	{
+		Server->Log("Error setting fuse options", LL_ERROR);
+		exit(4);
+	}
 	
 	fuse_chan * ch = fuse_mount(mountpoint.c_str(), &args);
 	
@@ -210,7 +236,7 @@ DLLEXPORT void LoadActions(IServer* pServer)
 	
 	fuse_set_signal_handlers(fuse_get_session(ffuse));
 	
-	int rc = fuse_loop(ffuse);
+	int rc = fuse_loop_mt(ffuse);
 	
 	fuse_unmount(mountpoint.c_str(), ch);
 	
@@ -11,6 +11,7 @@
 #include "PersistentOpenFiles.h"
 
 #include "watchdir/JournalDAO.h"
+#include "ChangeJournalListener.h"
 
 class DirectoryWatcherThread;
 
@@ -99,8 +100,6 @@ struct UsnInt
 
 const uint128 c_frn_root((uint64)-1, (uint64)-1);
 
-class IChangeJournalListener;
-
 class ChangeJournalWatcher
 {
 public:
@@ -191,28 +190,4 @@ private:
 	PersistentOpenFiles open_write_files;
 };
 
-class IChangeJournalListener
-{
-public:
-	virtual int64 getStartUsn(int64 sequence_id)=0;
-	virtual void On_FileNameChanged(const std::string & strOldFileName, const std::string & strNewFileName, bool closed)=0;
-	virtual void On_DirNameChanged(const std::string & strOldFileName, const std::string & strNewFileName, bool closed)=0;
-    virtual void On_FileRemoved(const std::string & strFileName, bool closed)=0;
-    virtual void On_FileAdded(const std::string & strFileName, bool closed)=0;
-	virtual void On_DirAdded(const std::string & strFileName, bool closed)=0;
-    virtual void On_FileModified(const std::string & strFileName, bool closed)=0;
-	virtual void On_FileOpen(const std::string & strFileName)=0;
-	virtual void On_ResetAll(const std::string & vol)=0;
-	virtual void On_DirRemoved(const std::string & strDirName, bool closed)=0;
-	
-	struct SSequence
-	{
-		int64 id;
-		int64 start;
-		int64 stop;
-	};
-
-	virtual void Commit(const std::vector<SSequence>& sequences)=0;
-};
-
 #endif //CHANGEJOURNALWATCHER_H
\ No newline at end of file
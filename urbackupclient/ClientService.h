@@ -121,6 +121,7 @@ struct ImageInformation
 	ImageThread *image_thread;
 	bool with_checksum;
 	bool with_bitmap;
+	bool with_block_refs;
 	std::string clientsubname;
 	int64 running_process_id;
 	int64 server_status_id;
@@ -1423,6 +1423,7 @@ void ClientConnector::CMD_FULL_IMAGE(const std::string &cmd, bool ident_ok)
 			if(params["bitmap"]=="1")
 				image_inf.with_bitmap=true;
 		}
+		image_inf.with_block_refs=false;
 
 		image_inf.no_shadowcopy=false;
 
@@ -1561,6 +1562,12 @@ void ClientConnector::CMD_INCR_IMAGE(const std::string &cmd, bool ident_ok)
 				if(params["bitmap"]=="1")
 					image_inf.with_bitmap=true;
 			}
+			image_inf.with_block_refs=false;
+			if(params.find("block_refs")!=params.end())
+			{
+				if(params["block_refs"]=="1")
+					image_inf.with_block_refs=true;
+			}
 			
 			image_inf.no_shadowcopy=false;
 			image_inf.clientsubname = params["clientsubname"];
@@ -23,6 +23,7 @@
 #include "database.h"
 #include "client.h"
 #include "clientdao.h"
+#include <time.h>
 
 #define CHANGE_JOURNAL
 
@@ -35,20 +36,41 @@ std::vector<std::string> DirectoryWatcherThread::open_files;
 namespace
 {
 	const unsigned int max_change_ram_cache=10*60*1000;
-}
 
+#ifdef _WIN32
+	//Time until the change journal is read again
+	const int update_interval_ms=10000;
+#else
+	//fanotify events are kept in memory by the kernel until they are read
+	const int update_interval_ms=1000;
+#endif
+
+	std::string normalize_path_case(const std::string& path)
+	{
+#ifdef _WIN32
+		return strlower(path);
+#else
+		return path;
+#endif
+	}
+}
 
+#ifdef _WIN32
 DirectoryWatcherThread::DirectoryWatcherThread(const std::vector<std::string> &watchdirs,
 	const std::vector<ContinuousWatchEnqueue::SWatchItem> &watchdirs_continuous)
+#else
+DirectoryWatcherThread::DirectoryWatcherThread(const std::vector<std::string> &watchdirs)
+#endif
 {
 	do_stop=false;
 	watching=watchdirs;
 
 	for(size_t i=0;i<watching.size();++i)
 	{
-		watching[i]=strlower(add_trailing_slash(watching[i]));
+		watching[i]=normalize_path_case(add_trailing_slash(watching[i]));
 	}
 
+#ifdef _WIN32
 	if(!watchdirs_continuous.empty())
 	{
 		continuous_watch.reset(new ContinuousWatchEnqueue);
@@ -58,6 +80,7 @@ DirectoryWatcherThread::DirectoryWatcherThread(const std::vector<std::string> &w
 			continuous_watch->addWatchdir(watchdirs_continuous[i]);
 		}
 	}
+#endif
 }
 
 void DirectoryWatcherThread::operator()(void)
@@ -69,7 +92,11 @@ void DirectoryWatcherThread::operator()(void)
 	q_update_last_backup_time=db->Prepare("INSERT OR REPLACE INTO misc (tkey, tvalue) VALUES ('last_backup_filetime', ?)");
 	q_remove_changed_dirs = db->Prepare("DELETE FROM mdirs WHERE name GLOB ?");
 
+#ifdef _WIN32
 	ChangeJournalWatcher dcw(this, db);
+#else
+	FanotifyWatcher dcw;
+#endif
 
 	dcw.add_listener(this);
 
@@ -87,15 +114,17 @@ void DirectoryWatcherThread::operator()(void)
 		dcw.watchDir(watching[i]);
 	}
 
+#ifdef _WIN32
 	if(continuous_watch.get())
 	{
 		dcw.add_listener(continuous_watch.get());
 	}
+#endif
 
 	while(do_stop==false)
 	{
 		std::string msg;
-		pipe->Read(&msg, 10000);
+		pipe->Read(&msg, update_interval_ms);
 
 #ifdef CHANGE_JOURNAL
 		if(msg.empty())
@@ -108,7 +137,7 @@ void DirectoryWatcherThread::operator()(void)
 		{
 			if( msg[0]=='A' )
 			{
-				std::string dir=strlower(add_trailing_slash(msg.substr(1)));
+				std::string dir=normalize_path_case(add_trailing_slash(msg.substr(1)));
 				bool w=false;
 				for(size_t i=0;i<watching.size();++i)
 				{
@@ -127,7 +156,7 @@ void DirectoryWatcherThread::operator()(void)
 			}
 			else if( msg[0]=='D' )
 			{
-				std::string dir=strlower(add_trailing_slash(msg.substr(1)));
+				std::string dir=normalize_path_case(add_trailing_slash(msg.substr(1)));
 				for(size_t i=0;i<watching.size();++i)
 				{
 					if(watching[i]==dir)
@@ -137,9 +166,10 @@ void DirectoryWatcherThread::operator()(void)
 					}
 				}
 			}
+#ifdef _WIN32
 			else if( msg[0]=='C')
 			{
-				std::string dir=strlower(add_trailing_slash(getuntil("|", msg.substr(1))));
+				std::string dir=normalize_path_case(add_trailing_slash(getuntil("|", msg.substr(1))));
 				std::string name=getafter("|", msg.substr(1));
 
 				if(continuous_watch.get()==NULL)
@@ -152,11 +182,12 @@ void DirectoryWatcherThread::operator()(void)
 			}
 			else if( msg[0]=='X')
 			{
-				std::string dir=strlower(add_trailing_slash(getuntil("|", msg.substr(1))));
+				std::string dir=normalize_path_case(add_trailing_slash(getuntil("|", msg.substr(1))));
 				std::string name=getafter("|", msg.substr(1));
 
 				continuous_watch->removeWatchdir(ContinuousWatchEnqueue::SWatchItem(dir, name));
 			}
+#endif
 			else if( msg[0]=='U' )
 			{
 				dcw.update();
@@ -365,7 +396,7 @@ void DirectoryWatcherThread::On_DirAdded( const std::string & strFileName, bool
 void DirectoryWatcherThread::On_FileModified(const std::string & strFileName, bool closed)
 {
 	bool ok=false;
-	std::string dir=strlower(ExtractFilePath(strFileName, os_file_sep()))+os_file_sep();
+	std::string dir=normalize_path_case(ExtractFilePath(strFileName, os_file_sep()))+os_file_sep();
 	for(size_t i=0;i<watching.size();++i)
 	{
 		if(dir.find(watching[i])==0)
@@ -378,7 +409,7 @@ void DirectoryWatcherThread::On_FileModified(const std::string & strFileName, bo
 
 void DirectoryWatcherThread::On_DirRemoved(const std::string & strDirName, bool closed)
 {
-	std::string rmDir=strlower(add_trailing_slash(strDirName));
+	std::string rmDir=normalize_path_case(add_trailing_slash(strDirName));
 	for(size_t i=0;i<watching.size();++i)
 	{
 		if(rmDir.find(watching[i])==0)
@@ -398,16 +429,21 @@ bool DirectoryWatcherThread::is_stopped(void)
 
 void DirectoryWatcherThread::On_ResetAll(const std::string & vol)
 {
-	OnDirMod("##-GAP-##"+strlower(vol));
+	OnDirMod("##-GAP-##"+normalize_path_case(vol));
 }
 
 _i64 DirectoryWatcherThread::get_current_filetime()
 {
+#ifdef _WIN32
 	FILETIME ft;
 	SYSTEMTIME st;
 	GetSystemTime(&st);
 	SystemTimeToFileTime(&st, &ft);
 	return static_cast<__int64>(ft.dwHighDateTime) << 32 | ft.dwLowDateTime;
+#else
+	//100ns intervals since 1601 like FILETIME
+	return (static_cast<_i64>(time(NULL)) + 11644473600LL) * 10000000LL;
+#endif
 }
 
 void DirectoryWatcherThread::Commit(const std::vector<IChangeJournalListener::SSequence>& sequences)
@@ -422,5 +458,5 @@ int64 DirectoryWatcherThread::getStartUsn( int64 sequence_id )
 
 void DirectoryWatcherThread::On_FileOpen( const std::string & strFileName )
 {
-	open_files.push_back(strlower(strFileName));
+	open_files.push_back(normalize_path_case(strFileName));
 }
@@ -5,10 +5,15 @@
 #include "../Interface/Mutex.h"
 #include "../Interface/Condition.h"
 #include "database.h"
+#include <list>
+#ifdef _WIN32
 #include "ChangeJournalWatcher.h"
 #include "watchdir/JournalDAO.h"
-#include <list>
 #include "watchdir/ContinuousWatchEnqueue.h"
+#else
+#include "FanotifyWatcher.h"
+#include <memory>
+#endif
 
 struct SLastEntries
 {
@@ -19,8 +24,12 @@ struct SLastEntries
 class DirectoryWatcherThread : public IThread, public IChangeJournalListener
 {
 public:
+#ifdef _WIN32
 	DirectoryWatcherThread(const std::vector<std::string> &watchdirs,
 		const std::vector<ContinuousWatchEnqueue::SWatchItem> &watchdirs_continuous);
+#else
+	DirectoryWatcherThread(const std::vector<std::string> &watchdirs);
+#endif
 
 	static void init_mutex(void);
 
@@ -83,7 +92,9 @@ private:
 
 	int64 last_backup_filetime;
 
+#ifdef _WIN32
 	std::auto_ptr<ContinuousWatchEnqueue> continuous_watch;
+#endif
 
 	static std::vector<std::string> open_files;
 };
\ No newline at end of file
@@ -0,0 +1,433 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "FanotifyWatcher.h"
+#include "../Interface/Server.h"
+#include "../stringtools.h"
+#include "../urbackupcommon/os_functions.h"
+#include <set>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#ifdef __linux__
+#include <sys/fanotify.h>
+#include <sys/vfs.h>
+#endif
+
+#if defined(__linux__) && defined(FAN_REPORT_DFID_NAME)
+#define HAS_FANOTIFY_DFID_NAME
+#endif
+
+namespace
+{
+	//Maximum number of resolved directory handles kept between updates
+	const size_t max_handle_cache_size = 10000;
+}
+
+FanotifyWatcher::FanotifyWatcher()
+	: fan_fd(-1)
+{
+	init();
+}
+
+FanotifyWatcher::~FanotifyWatcher()
+{
+	if (fan_fd != -1)
+	{
+		close(fan_fd);
+	}
+}
+
+bool FanotifyWatcher::init()
+{
+#ifdef HAS_FANOTIFY_DFID_NAME
+	fan_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_UNLIMITED_QUEUE | FAN_NONBLOCK | FAN_CLOEXEC,
+		O_RDONLY | O_LARGEFILE);
+
+	if (fan_fd == -1)
+	{
+		Server->Log("Initializing fanotify failed. Every incremental file backup indexes all files. " + os_last_error_str(), LL_INFO);
+		return false;
+	}
+
+	return true;
+#else
+	Server->Log("Client was built without fanotify support. Every incremental file backup indexes all files.", LL_INFO);
+	return false;
+#endif
+}
+
+void FanotifyWatcher::watchDir(const std::string &dir)
+{
+	watching.push_back(dir);
+
+#ifdef HAS_FANOTIFY_DFID_NAME
+	if (fan_fd != -1)
+	{
+		updateMount(dir);
+		return;
+	}
+#endif
+
+	//Changes while not watching are not known
+	resetDir(dir);
+}
+
+void FanotifyWatcher::updateMount(const std::string& dir)
+{
+#ifdef HAS_FANOTIFY_DFID_NAME
+	SMount curr;
+	bool has_mount = getMount(dir, curr);
+
+	std::map<std::string, SMount>::iterator it = mounts.find(dir);
+	if (it != mounts.end()
+		&& has_mount
+		&& it->second.mount_id == curr.mount_id
+		&& it->second.fsid == curr.fsid)
+	{
+		if (!it->second.marked)
+		{
+			resetDir(dir);
+		}
+		return;
+	}
+
+	if (!has_mount)
+	{
+		if (it == mounts.end()
+			|| it->second.marked)
+		{
+			Server->Log("Cannot get mount of \"" + dir + "\". Indexing all files in it for every file backup. " + os_last_error_str(), LL_INFO);
+		}
+		mounts[dir] = SMount();
+		resetDir(dir);
+		return;
+	}
+
+	if (it != mounts.end())
+	{
+		Server->Log("File system of \"" + dir + "\" was mounted again. Watching it again.", LL_INFO);
+	}
+
+	//Changes while not watching are not known
+	resetDir(dir);
+
+	//Paths of cached handles might have changed
+	handle_cache.clear();
+
+	for (std::map<std::string, std::string>::iterator it_fsid = fsid_dirs.begin(); it_fsid != fsid_dirs.end();)
+	{
+		if (it_fsid->second == dir)
+		{
+			fsid_dirs.erase(it_fsid++);
+		}
+		else
+		{
+			++it_fsid;
+		}
+	}
+
+	if (fanotify_mark(fan_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+		FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_MODIFY | FAN_ATTRIB | FAN_ONDIR,
+		AT_FDCWD, dir.c_str()) == 0)
+	{
+		curr.marked = true;
+		fsid_dirs[curr.fsid] = dir;
+		Server->Log("Watching file system of \"" + dir + "\" for changes via fanotify", LL_DEBUG);
+	}
+	else
+	{
+		Server->Log("Cannot watch \"" + dir + "\" for changes via fanotify. Indexing all files in it for every file backup. " + os_last_error_str(), LL_INFO);
+	}
+
+	mounts[dir] = curr;
+#endif
+}
+
+bool FanotifyWatcher::getMount(const std::string& dir, SMount& mount)
+{
+#ifdef HAS_FANOTIFY_DFID_NAME
+	//The mount id changes if the file system is mounted again, even from the same device
+	std::vector<char> handle_buf(sizeof(struct file_handle) + MAX_HANDLE_SZ);
+	struct file_handle* handle = reinterpret_cast<struct file_handle*>(handle_buf.data());
+	handle->handle_bytes = MAX_HANDLE_SZ;
+	int mount_id;
+	if (name_to_handle_at(AT_FDCWD, dir.c_str(), handle, &mount_id, 0) != 0)
+	{
+		return false;
+	}
+
+	struct statfs fs_info;
+	if (statfs(dir.c_str(), &fs_info) != 0)
+	{
+		return false;
+	}
+
+	mount.mount_id = mount_id;
+	mount.fsid.assign(reinterpret_cast<char*>(&fs_info.f_fsid), sizeof(fs_info.f_fsid));
+	return true;
+#else
+	return false;
+#endif
+}
+
+void FanotifyWatcher::update(std::string vol_str)
+{
+#ifdef HAS_FANOTIFY_DFID_NAME
+	if (fan_fd == -1)
+	{
+		resetAll(watching);
+		return;
+	}
+
+	for (size_t i = 0; i < watching.size(); ++i)
+	{
+		updateMount(watching[i]);
+	}
+
+	std::vector<SChange> changes;
+	std::set<SChange> changes_set;
+	bool lost_events = false;
+
+	std::vector<int64> buf(64 * 1024 / sizeof(int64));
+	while (true)
+	{
+		ssize_t rc = read(fan_fd, buf.data(), buf.size()*sizeof(int64));
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			if (errno != EAGAIN
+				&& errno != EWOULDBLOCK)
+			{
+				Server->Log("Error reading fanotify events. " + os_last_error_str(), LL_ERROR);
+				lost_events = true;
+			}
+			break;
+		}
+
+		struct fanotify_event_metadata* metadata = reinterpret_cast<struct fanotify_event_metadata*>(buf.data());
+		for (; FAN_EVENT_OK(metadata, rc); metadata = FAN_EVENT_NEXT(metadata, rc))
+		{
+			if (metadata->vers != FANOTIFY_METADATA_VERSION)
+			{
+				Server->Log("Unsupported fanotify metadata version " + convert((int)metadata->vers), LL_ERROR);
+				lost_events = true;
+				break;
+			}
+
+			if (metadata->fd >= 0)
+			{
+				close(metadata->fd);
+			}
+
+			if (metadata->mask & FAN_Q_OVERFLOW)
+			{
+				lost_events = true;
+				continue;
+			}
+
+			struct fanotify_event_info_fid* fid = reinterpret_cast<struct fanotify_event_info_fid*>(metadata + 1);
+			if (metadata->event_len < sizeof(*metadata) + sizeof(*fid) + sizeof(struct file_handle)
+				|| (fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME
+					&& fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID))
+			{
+				continue;
+			}
+
+			struct file_handle* handle = reinterpret_cast<struct file_handle*>(fid->handle);
+			std::string name;
+			if (fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME)
+			{
+				name = reinterpret_cast<const char*>(handle->f_handle + handle->handle_bytes);
+			}
+
+			std::string fsid(reinterpret_cast<const char*>(&fid->fsid), sizeof(fid->fsid));
+			std::string handle_key = fsid + std::string(reinterpret_cast<const char*>(handle), sizeof(*handle) + handle->handle_bytes);
+
+			std::string dir;
+			EPathResult path_res = getDirPath(fsid, reinterpret_cast<const char*>(handle), handle_key, dir);
+			if (path_res == EPathResult_Removed)
+			{
+				//Directory was removed in the meantime. Its parent is changed as well.
+				continue;
+			}
+			else if (path_res == EPathResult_Error)
+			{
+				if (!lost_events)
+				{
+					Server->Log("Cannot resolve directory of fanotify event. " + os_last_error_str(), LL_WARNING);
+				}
+				lost_events = true;
+				continue;
+			}
+
+			SChange change(SChange::EType_Modified, std::string());
+
+			if (name.empty() || name == ".")
+			{
+				//Event on the directory itself. It is listed in its parent.
+				change.fn = dir;
+			}
+			else
+			{
+				change.fn = (dir == os_file_sep() ? std::string() : dir) + os_file_sep() + name;
+
+				if (metadata->mask & FAN_ONDIR)
+				{
+					if (metadata->mask & (FAN_DELETE | FAN_MOVED_FROM))
+					{
+						change.type = SChange::EType_DirRemoved;
+						//Paths of directories below it have changed
+						handle_cache.clear();
+					}
+					else if (metadata->mask & (FAN_CREATE | FAN_MOVED_TO))
+					{
+						change.type = SChange::EType_DirAdded;
+					}
+				}
+			}
+
+			if (changes_set.insert(change).second)
+			{
+				changes.push_back(change);
+			}
+		}
+	}
+
+	if (handle_cache.size() > max_handle_cache_size)
+	{
+		handle_cache.clear();
+	}
+
+	for (size_t i = 0; i < changes.size(); ++i)
+	{
+		for (size_t j = 0; j < listeners.size(); ++j)
+		{
+			switch (changes[i].type)
+			{
+			case SChange::EType_Modified:
+				listeners[j]->On_FileModified(changes[i].fn, true);
+				break;
+			case SChange::EType_DirAdded:
+				listeners[j]->On_DirAdded(changes[i].fn, true);
+				break;
+			case SChange::EType_DirRemoved:
+				listeners[j]->On_DirRemoved(changes[i].fn, true);
+				break;
+			}
+		}
+	}
+
+	if (lost_events)
+	{
+		Server->Log("Lost fanotify events. Indexing all files during next file backup.", LL_WARNING);
+		resetAll(watching);
+	}
+#else
+	resetAll(watching);
+#endif
+}
+
+FanotifyWatcher::EPathResult FanotifyWatcher::getDirPath(const std::string& fsid, const char* handle, const std::string& handle_key, std::string& path)
+{
+#ifdef HAS_FANOTIFY_DFID_NAME
+	std::map<std::string, std::string>::iterator it_cache = handle_cache.find(handle_key);
+	if (it_cache != handle_cache.end())
+	{
+		path = it_cache->second;
+		return EPathResult_Ok;
+	}
+
+	std::map<std::string, std::string>::iterator it_dir = fsid_dirs.find(fsid);
+	if (it_dir == fsid_dirs.end())
+	{
+		errno = ENODEV;
+		return EPathResult_Error;
+	}
+
+	int mount_fd = open(it_dir->second.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (mount_fd == -1)
+	{
+		return EPathResult_Error;
+	}
+
+	std::vector<char> handle_buf(handle, handle + sizeof(struct file_handle) + reinterpret_cast<const struct file_handle*>(handle)->handle_bytes);
+	int dir_fd = open_by_handle_at(mount_fd, reinterpret_cast<struct file_handle*>(handle_buf.data()), O_PATH | O_CLOEXEC);
+	int err = errno;
+	close(mount_fd);
+
+	if (dir_fd == -1)
+	{
+		errno = err;
+		return (err == ESTALE || err == ENOENT) ? EPathResult_Removed : EPathResult_Error;
+	}
+
+	char target[PATH_MAX + 1];
+	std::string proc_path = "/proc/self/fd/" + convert(dir_fd);
+	ssize_t rc = readlink(proc_path.c_str(), target, PATH_MAX);
+	err = errno;
+	close(dir_fd);
+
+	if (rc <= 0)
+	{
+		errno = err;
+		return EPathResult_Error;
+	}
+
+	path.assign(target, rc);
+
+	const std::string deleted_suffix = " (deleted)";
+	if (path.size() > deleted_suffix.size()
+		&& path.compare(path.size() - deleted_suffix.size(), deleted_suffix.size(), deleted_suffix) == 0)
+	{
+		return EPathResult_Removed;
+	}
+
+	handle_cache[handle_key] = path;
+	return EPathResult_Ok;
+#else
+	return EPathResult_Error;
+#endif
+}
+
+void FanotifyWatcher::resetDir(const std::string& dir)
+{
+	std::vector<std::string> dirs;
+	dirs.push_back(dir);
+	resetAll(dirs);
+}
+
+void FanotifyWatcher::resetAll(const std::vector<std::string>& dirs)
+{
+	for (size_t i = 0; i < dirs.size(); ++i)
+	{
+		for (size_t j = 0; j < listeners.size(); ++j)
+		{
+			listeners[j]->On_ResetAll(dirs[i]);
+		}
+	}
+}
+
+void FanotifyWatcher::add_listener(IChangeJournalListener *pListener)
+{
+	listeners.push_back(pListener);
+}
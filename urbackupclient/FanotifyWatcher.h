@@ -0,0 +1,99 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include "ChangeJournalListener.h"
+
+/**
+* Change source of DirectoryWatcherThread on Linux (ChangeJournalWatcher on Windows).
+* Watches the file systems of the backup directories with fanotify (FAN_REPORT_DFID_NAME)
+* and reports changed directories to the listeners. Changes are not persisted while the
+* client is not running, so newly watched directories, directories which cannot be
+* watched and dropped events are reported via On_ResetAll, which causes a full rescan.
+* The mark belongs to the superblock and is dropped on unmount without an event, so
+* every update() checks that the mounts of the watched directories did not change and
+* marks them again if they did. Writes through shared writable mmaps cause no event.
+*/
+class FanotifyWatcher
+{
+public:
+	FanotifyWatcher();
+	~FanotifyWatcher();
+
+	void watchDir(const std::string &dir);
+
+	void update(std::string vol_str="");
+	void update_longliving(void) {}
+
+	void set_freeze_open_write_files(bool b) {}
+
+	void set_last_backup_time(int64 t) {}
+
+	void add_listener(IChangeJournalListener *pListener);
+
+private:
+	struct SChange
+	{
+		enum EType
+		{
+			EType_Modified,
+			EType_DirAdded,
+			EType_DirRemoved
+		};
+
+		SChange(EType type, const std::string& fn)
+			: type(type), fn(fn)
+		{}
+
+		bool operator<(const SChange& other) const
+		{
+			if (type != other.type)
+				return type < other.type;
+			return fn < other.fn;
+		}
+
+		EType type;
+		std::string fn;
+	};
+
+	struct SMount
+	{
+		SMount()
+			: mount_id(-1), marked(false)
+		{}
+
+		int mount_id;
+		std::string fsid;
+		bool marked;
+	};
+
+	enum EPathResult
+	{
+		EPathResult_Ok,
+		EPathResult_Removed,
+		EPathResult_Error
+	};
+
+	bool init();
+	void updateMount(const std::string& dir);
+	bool getMount(const std::string& dir, SMount& mount);
+	EPathResult getDirPath(const std::string& fsid, const char* handle, const std::string& handle_key, std::string& path);
+	void resetAll(const std::vector<std::string>& dirs);
+	void resetDir(const std::string& dir);
+
+	int fan_fd;
+
+	std::vector<IChangeJournalListener*> listeners;
+
+	std::vector<std::string> watching;
+
+	//Mount each watched directory was marked on
+	std::map<std::string, SMount> mounts;
+
+	//Watched directory per file system id to open for resolving directory handles.
+	//Not kept open, as that would keep the file system from being unmounted.
+	std::map<std::string, std::string> fsid_dirs;
+
+	std::map<std::string, std::string> handle_cache;
+};
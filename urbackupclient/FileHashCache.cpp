@@ -0,0 +1,124 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "FileHashCache.h"
+#include "clientdao.h"
+#include "../Interface/Server.h"
+#include "../stringtools.h"
+
+namespace
+{
+	//Smaller files are cheap to hash again
+	const int64 min_cached_file_size = 1 * 1024 * 1024;
+
+	//Hashes which were not used for this long are removed
+	const int64 max_cache_entry_age = 90 * 24 * 60 * 60;
+}
+
+FileHashCache::FileHashCache(ClientDAO& clientdao)
+	: clientdao(clientdao), last_vol_id(0), last_vol_ok(false)
+{
+}
+
+bool FileHashCache::get(const std::string& orig_dir, const std::string& fn, int hash_version, SFileId& file_id, std::string& hash)
+{
+	file_id = SFileId();
+
+	int64 vol_id;
+	if (!getVolId(orig_dir, vol_id))
+	{
+		return false;
+	}
+
+	if (!os_get_file_id(os_file_prefix(fn), file_id))
+	{
+		file_id = SFileId();
+		return false;
+	}
+
+	if (file_id.size < min_cached_file_size)
+	{
+		file_id = SFileId();
+		return false;
+	}
+
+	file_id.vol_id = vol_id;
+
+	ClientDAO::SFileHashCacheEntry entry = clientdao.getFileHashCacheEntry(file_id.vol_id,
+		file_id.frn_high, file_id.frn_low, hash_version);
+
+	if (!entry.exists
+		|| entry.filesize != file_id.size
+		|| entry.modifytime != file_id.last_modified
+		|| entry.changetime != file_id.change_time
+		|| entry.hashdata.empty())
+	{
+		return false;
+	}
+
+	clientdao.updateFileHashCacheEntryLastUsed(Server->getTimeSeconds(), file_id.vol_id,
+		file_id.frn_high, file_id.frn_low, hash_version);
+
+	Server->Log("Using cached hash of file \"" + fn + "\"", LL_DEBUG);
+
+	hash = entry.hashdata;
+	return true;
+}
+
+void FileHashCache::put(const SFileId& file_id, const std::string& fn, int hash_version, const std::string& hash)
+{
+	if (file_id.size < min_cached_file_size
+		|| hash.empty())
+	{
+		return;
+	}
+
+	SFileId curr_id;
+	if (!os_get_file_id(os_file_prefix(fn), curr_id)
+		|| curr_id.frn_high != file_id.frn_high
+		|| curr_id.frn_low != file_id.frn_low
+		|| curr_id.size != file_id.size
+		|| curr_id.last_modified != file_id.last_modified
+		|| curr_id.change_time != file_id.change_time)
+	{
+		//Changed while hashing
+		return;
+	}
+
+	clientdao.addFileHashCacheEntry(file_id.vol_id, file_id.frn_high, file_id.frn_low, hash_version,
+		file_id.size, file_id.last_modified, file_id.change_time, hash, Server->getTimeSeconds());
+}
+
+void FileHashCache::cleanup()
+{
+	clientdao.deleteOldFileHashCacheEntries(Server->getTimeSeconds() - max_cache_entry_age);
+}
+
+bool FileHashCache::getVolId(const std::string& orig_dir, int64& vol_id)
+{
+	if (orig_dir != last_orig_dir)
+	{
+		SFileId dir_id;
+		last_vol_ok = os_get_file_id(os_file_prefix(orig_dir), dir_id);
+		last_vol_id = dir_id.vol_id;
+		last_orig_dir = orig_dir;
+	}
+
+	vol_id = last_vol_id;
+	return last_vol_ok;
+}
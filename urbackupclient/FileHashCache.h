@@ -0,0 +1,41 @@
+#pragma once
+
+#include <string>
+#include "../Interface/Types.h"
+#include "../urbackupcommon/os_functions.h"
+
+class ClientDAO;
+
+/**
+* Hashes of large files keyed by volume and file id (inode/NTFS file
+* reference number), so files in renamed or moved directories are not read
+* again. An entry is only used if size, modification and change time still
+* match. The change time catches files rewritten with a restored mtime and
+* reused file ids. The volume is taken from the original (not snapshotted)
+* directory, because snapshots keep the file ids but get a different
+* device/volume.
+*/
+class FileHashCache
+{
+public:
+	FileHashCache(ClientDAO& clientdao);
+
+	//Returns the cached hash of the file fn (in the snapshot) indexed in orig_dir.
+	//file_id is set for a following put() if there is no cached hash
+	bool get(const std::string& orig_dir, const std::string& fn, int hash_version, SFileId& file_id, std::string& hash);
+
+	//Adds the hash of the file fn if it did not change since get()
+	void put(const SFileId& file_id, const std::string& fn, int hash_version, const std::string& hash);
+
+	//Removes hashes of files which were not hashed or moved for a long time
+	void cleanup();
+
+private:
+	bool getVolId(const std::string& orig_dir, int64& vol_id);
+
+	ClientDAO& clientdao;
+
+	std::string last_orig_dir;
+	int64 last_vol_id;
+	bool last_vol_ok;
+};
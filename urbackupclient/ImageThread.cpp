@@ -36,6 +36,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <memory>
+#include <algorithm>
 
 extern IFSImageFactory *image_fak;
 
@@ -662,17 +663,18 @@ bool ImageThread::sendIncrImageThread(void)
 
 						bool fs_has_block = false;
 						bool bitmap_diff = false;
-						for (int64 j = imgpos; j < imgpos + c_vhdblocksize
-							&& j<drivesize; j += blocksize)
+						int64 end_block = (std::min)(imgpos + c_vhdblocksize, drivesize) / blocksize;
+						int64 extent_len;
+						for (int64 j = fs->getUsedExtent(imgpos / blocksize, end_block, extent_len);
+							j != -1; j = fs->getUsedExtent(j + extent_len, end_block, extent_len))
 						{
-							if (fs->hasBlock(j / blocksize))
+							fs_has_block = true;
+							int64 prev_extent_len;
+							if (previous_bitmap->getUsedExtent(j, j + extent_len, prev_extent_len) != j
+								|| prev_extent_len != extent_len)
 							{
-								fs_has_block = true;
-								if (!previous_bitmap->hasBlock(j / blocksize))
-								{
-									bitmap_diff = true;
-									break;
-								}
+								bitmap_diff = true;
+								break;
 							}
 						}
 
@@ -814,6 +816,11 @@ bool ImageThread::sendIncrImageThread(void)
 				}
 			}
 			
+			if (image_inf->with_block_refs)
+			{
+				buildBlockRefIndex(numblocks / blocks_per_vhdblock);
+			}
+
 			blockbufs.clear();
 			blockbufs.resize(blocks_per_vhdblock);
 			delete []zeroblockbuf;
@@ -846,13 +853,8 @@ bool ImageThread::sendIncrImageThread(void)
 
 				if (cbt_bitmap.empty())
 				{
-					for (int64 j = i; j < blocks && j < i + blocks_per_vhdblock; ++j)
-					{
-						if (fs->hasBlock(j))
-						{
-							has_data = true;
-						}
-					}
+					int64 extent_len;
+					has_data = fs->getUsedExtent(i, (std::min)(blocks, i + blocks_per_vhdblock), extent_len) != -1;
 				}
 				else
 				{
@@ -936,7 +938,38 @@ bool ImageThread::sendIncrImageThread(void)
 						}
 					}
 
-					if(!has_hashdata || memcmp(hashdata_buf, digest, c_hashsize) != 0)
+					int64 ref_vhdblock = -1;
+					if ((has_hashdata || with_checksum)
+						&& !block_ref_index.empty()
+						&& i + blocks_per_vhdblock <= blocks
+						&& (!has_hashdata || memcmp(hashdata_buf, digest, c_hashsize) != 0))
+					{
+						ref_vhdblock = findBlockRef(digest, currvhdblock);
+					}
+
+					if(ref_vhdblock!=-1)
+					{
+						Server->Log("Block did move: "+convert(i)+" previous position="+convert(ref_vhdblock*blocks_per_vhdblock), LL_DEBUG);
+						char* cb=clientSend->getBuffer();
+						int64 bs=-129;
+						int64 src_block=ref_vhdblock*blocks_per_vhdblock;
+						memcpy(cb, &bs, sizeof(int64) );
+						memcpy(cb+sizeof(int64), &i, sizeof(int64));
+						memcpy(cb+2*sizeof(int64), &src_block, sizeof(int64));
+						memcpy(cb+3*sizeof(int64), digest, c_hashsize);
+						clientSend->sendBuffer(cb, 3*sizeof(int64)+c_hashsize, true);
+						lastsendtime=Server->getTimeMS();
+
+						for(size_t k=0;k<blockbufs.size();++k)
+						{
+							if(blockbufs[k]!=NULL)
+							{
+								fs->releaseBuffer(blockbufs[k]);
+								blockbufs[k]=NULL;
+							}
+						}
+					}
+					else if(!has_hashdata || memcmp(hashdata_buf, digest, c_hashsize) != 0)
 					{
 						Server->Log("Block did change: "+convert(i)+" mixed="+convert(mixed), LL_DEBUG);
 						bool notify_cs=false;
@@ -1150,6 +1183,66 @@ void ImageThread::updateShadowCopyStarttime( int save_id )
 	}
 }
 
+void ImageThread::buildBlockRefIndex(int64 n_full_vhdblocks)
+{
+	block_ref_index.clear();
+
+	std::vector<char> buf;
+	buf.resize(c_hashsize*512);
+
+	hashdatafile->Seek(0);
+	int64 vhdblock = 0;
+	_u32 read;
+	do
+	{
+		read = hashdatafile->Read(buf.data(), static_cast<_u32>(buf.size()));
+
+		for (_u32 i = 0; i + c_hashsize <= read
+			&& vhdblock < n_full_vhdblocks; i += c_hashsize, ++vhdblock)
+		{
+			if (buf_is_zero(reinterpret_cast<unsigned char*>(&buf[i]), c_hashsize))
+			{
+				continue;
+			}
+
+			uint64 prefix;
+			memcpy(&prefix, &buf[i], sizeof(prefix));
+			block_ref_index.push_back(std::make_pair(prefix, vhdblock));
+		}
+	} while (read == buf.size()
+		&& vhdblock < n_full_vhdblocks);
+
+	std::sort(block_ref_index.begin(), block_ref_index.end());
+
+	Server->Log("Matching changed image blocks against " + convert(block_ref_index.size()) + " blocks of the previous image", LL_DEBUG);
+}
+
+int64 ImageThread::findBlockRef(const unsigned char* digest, int64 currvhdblock)
+{
+	uint64 prefix;
+	memcpy(&prefix, digest, sizeof(prefix));
+
+	std::vector<std::pair<uint64, int64> >::iterator it = std::lower_bound(block_ref_index.begin(),
+		block_ref_index.end(), std::make_pair(prefix, static_cast<int64>(-1)));
+
+	for (; it != block_ref_index.end() && it->first == prefix; ++it)
+	{
+		if (it->second == currvhdblock)
+		{
+			continue;
+		}
+
+		char hashdata_buf[c_hashsize];
+		if (hashdatafile->Read(it->second*c_hashsize, hashdata_buf, c_hashsize) == c_hashsize
+			&& memcmp(hashdata_buf, digest, c_hashsize) == 0)
+		{
+			return it->second;
+		}
+	}
+
+	return -1;
+}
+
 bool ImageThread::sendBitmap(IFilesystem* fs, int64 drivesize, unsigned int blocksize)
 {
 	int64 totalblocks = drivesize / blocksize;
@@ -1334,25 +1427,28 @@ int64 ImageThread::nextBlock(int64 curr_block)
 {
 	int64 size_blocks = curr_fs->getSize() / curr_fs->getBlocksize();
 
-	while (curr_block + 1<size_blocks)
+	++curr_block;
+	while (curr_block<size_blocks)
 	{
+		int64 vhdblock_end = (curr_block / blocks_per_vhdblock + 1)*blocks_per_vhdblock;
+
 		if (!cbt_bitmap.empty()
-			&& (curr_block + 1) % blocks_per_vhdblock == 0)
+			&& !cbt_bitmap.get(curr_block / blocks_per_vhdblock))
 		{
-			int64 vhdblock = (curr_block + 1) / blocks_per_vhdblock;
-			if (!cbt_bitmap.get(vhdblock))
-			{
-				curr_block += blocks_per_vhdblock;
-				continue;
-			}
+			curr_block = vhdblock_end;
+			continue;
 		}
 
-		++curr_block;
+		int64 scan_end = cbt_bitmap.empty() ? size_blocks : (std::min)(vhdblock_end, size_blocks);
 
-		if (curr_fs->hasBlock(curr_block))
+		int64 extent_len;
+		int64 ret = curr_fs->getUsedExtent(curr_block, scan_end, extent_len);
+		if (ret != -1)
 		{
-			return curr_block;
+			return ret;
 		}
+
+		curr_block = scan_end;
 	}
 
 	return -1;
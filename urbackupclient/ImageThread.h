@@ -1,6 +1,7 @@
 #pragma once
 #include <string>
 #include <map>
+#include <vector>
 #include "../Interface/Pipe.h"
 #include "../Interface/File.h"
 #include "../Interface/Thread.h"
@@ -43,6 +44,9 @@ private:
 	void updateShadowCopyStarttime(int save_id);
 
 	bool sendBitmap(IFilesystem* fs, int64 drivesize, unsigned int blocksize);
+
+	void buildBlockRefIndex(int64 n_full_vhdblocks);
+	int64 findBlockRef(const unsigned char* digest, int64 currvhdblock);
 	std::string getFsErrMsg();
 
 	void logImageChanges(const std::string& path);
@@ -57,6 +61,9 @@ private:
 	unsigned int blocks_per_vhdblock;
 	Bitmap cbt_bitmap;
 
+	//Hash prefix -> VHD block of the previous image. Sorted by hash prefix
+	std::vector<std::pair<uint64, int64> > block_ref_index;
+
 	IFilesystem* curr_fs;
 	
 	ImageInformation *image_inf;
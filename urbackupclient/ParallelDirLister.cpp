@@ -0,0 +1,207 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "ParallelDirLister.h"
+#include "../Interface/Server.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#endif
+
+ParallelDirLister::ParallelDirLister(size_t n_threads, size_t max_results)
+	: mutex(Server->createMutex()), work_cond(Server->createCondition()),
+	done_cond(Server->createCondition()), n_done(0), max_results(max_results),
+	do_stop(false)
+{
+	for (size_t i = 0; i < n_threads; ++i)
+	{
+		threads.push_back(new WorkerThread(*this));
+		tickets.push_back(Server->getThreadPool()->execute(threads[i], "dir lister"));
+	}
+}
+
+ParallelDirLister::~ParallelDirLister()
+{
+	{
+		IScopedLock lock(mutex.get());
+		do_stop = true;
+		work_cond->notify_all();
+	}
+
+	Server->getThreadPool()->waitFor(tickets);
+
+	for (size_t i = 0; i < threads.size(); ++i)
+	{
+		delete threads[i];
+	}
+}
+
+void ParallelDirLister::queue(const std::string& path, bool ignore_other_fs)
+{
+	IScopedLock lock(mutex.get());
+
+	if (listings.find(path) != listings.end())
+	{
+		return;
+	}
+
+	SListing& listing = listings[path];
+	listing.ignore_other_fs = ignore_other_fs;
+	jobs.push_back(path);
+
+	work_cond->notify_one();
+}
+
+std::vector<SFile> ParallelDirLister::getFiles(const std::string& path, bool* has_error, bool ignore_other_fs)
+{
+	{
+		IScopedLock lock(mutex.get());
+
+		std::map<std::string, SListing>::iterator it = listings.find(path);
+		if (it != listings.end()
+			&& it->second.ignore_other_fs == ignore_other_fs)
+		{
+			while (it->second.state == EState_Running)
+			{
+				done_cond->wait(&lock);
+				it = listings.find(path);
+			}
+
+			if (it->second.state == EState_Done)
+			{
+				std::vector<SFile> ret;
+				ret.swap(it->second.files);
+				if (has_error != NULL)
+				{
+					*has_error = it->second.has_error;
+				}
+				int64 err = it->second.err;
+
+				listings.erase(it);
+				--n_done;
+				work_cond->notify_one();
+
+				setLastError(err);
+				return ret;
+			}
+		}
+
+		if (it != listings.end())
+		{
+			//Not started yet (listing it here is faster than waiting for a worker)
+			//or listed with different flags
+			if (it->second.state == EState_Running)
+			{
+				it->second.discard = true;
+			}
+			else
+			{
+				if (it->second.state == EState_Done)
+				{
+					--n_done;
+				}
+				listings.erase(it);
+			}
+		}
+	}
+
+	return getFilesWin(path, has_error, true, true, ignore_other_fs);
+}
+
+void ParallelDirLister::clear()
+{
+	IScopedLock lock(mutex.get());
+
+	for (std::map<std::string, SListing>::iterator it = listings.begin(); it != listings.end();)
+	{
+		if (it->second.state == EState_Running)
+		{
+			it->second.discard = true;
+			++it;
+		}
+		else
+		{
+			listings.erase(it++);
+		}
+	}
+
+	jobs.clear();
+	n_done = 0;
+}
+
+void ParallelDirLister::run()
+{
+	IScopedLock lock(mutex.get());
+
+	while (!do_stop)
+	{
+		if (jobs.empty()
+			|| n_done >= max_results)
+		{
+			work_cond->wait(&lock);
+			continue;
+		}
+
+		std::string path = jobs.back();
+		jobs.pop_back();
+
+		std::map<std::string, SListing>::iterator it = listings.find(path);
+		if (it == listings.end()
+			|| it->second.state != EState_Queued)
+		{
+			continue;
+		}
+
+		it->second.state = EState_Running;
+		bool ignore_other_fs = it->second.ignore_other_fs;
+
+		lock.relock(NULL);
+
+		bool has_error = false;
+		std::vector<SFile> files = getFilesWin(path, &has_error, true, true, ignore_other_fs);
+		int64 err = has_error ? os_last_error() : 0;
+
+		lock.relock(mutex.get());
+
+		it = listings.find(path);
+		if (it->second.discard)
+		{
+			listings.erase(it);
+		}
+		else
+		{
+			it->second.files.swap(files);
+			it->second.has_error = has_error;
+			it->second.err = err;
+			it->second.state = EState_Done;
+			++n_done;
+		}
+
+		done_cond->notify_all();
+	}
+}
+
+void ParallelDirLister::setLastError(int64 err)
+{
+#ifdef _WIN32
+	SetLastError(static_cast<DWORD>(err));
+#else
+	errno = static_cast<int>(err);
+#endif
+}
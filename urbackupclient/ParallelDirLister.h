@@ -0,0 +1,89 @@
+#pragma once
+
+#include "../Interface/Thread.h"
+#include "../Interface/Mutex.h"
+#include "../Interface/Condition.h"
+#include "../Interface/ThreadPool.h"
+#include "../urbackupcommon/os_functions.h"
+#include <map>
+#include <memory>
+
+/**
+* Lists directories ahead of the (depth first, single threaded) index walk.
+* IndexThread queues the sub-directories it is going to descend into. Worker
+* threads take the most recently queued directory first, which is the next
+* one the walk visits. getFiles() returns the prefetched listing, waits for
+* a listing in progress or lists the directory itself if no worker started on
+* it yet. Listings are identical to getFilesWin(), so the file list order
+* does not change.
+*/
+class ParallelDirLister
+{
+public:
+	ParallelDirLister(size_t n_threads, size_t max_results);
+	~ParallelDirLister();
+
+	void queue(const std::string& path, bool ignore_other_fs);
+
+	std::vector<SFile> getFiles(const std::string& path, bool* has_error, bool ignore_other_fs);
+
+	//Drops all listings which were not retrieved
+	void clear();
+
+private:
+	class WorkerThread : public IThread
+	{
+	public:
+		WorkerThread(ParallelDirLister& lister)
+			: lister(lister)
+		{}
+
+		virtual ~WorkerThread() {}
+
+		void operator()()
+		{
+			lister.run();
+		}
+
+	private:
+		ParallelDirLister& lister;
+	};
+
+	enum EState
+	{
+		EState_Queued,
+		EState_Running,
+		EState_Done
+	};
+
+	struct SListing
+	{
+		SListing()
+			: state(EState_Queued), ignore_other_fs(false),
+			has_error(false), err(0), discard(false)
+		{}
+
+		EState state;
+		bool ignore_other_fs;
+		std::vector<SFile> files;
+		bool has_error;
+		int64 err;
+		bool discard;
+	};
+
+	void run();
+	void setLastError(int64 err);
+
+	std::auto_ptr<IMutex> mutex;
+	std::auto_ptr<ICondition> work_cond;
+	std::auto_ptr<ICondition> done_cond;
+
+	std::map<std::string, SListing> listings;
+	std::vector<std::string> jobs;
+	size_t n_done;
+	size_t max_results;
+	bool do_stop;
+
+	std::vector<WorkerThread*> threads;
+	std::vector<THREADPOOL_TICKET> tickets;
+};
@@ -2,6 +2,7 @@
 #include "../Interface/Server.h"
 #include "../Interface/ThreadPool.h"
 #include "ClientHash.h"
+#include "FileHashCache.h"
 #include <algorithm>
 #include "database.h"
 #include "../stringtools.h"
@@ -95,6 +96,7 @@ bool ParallelHash::readStderrIntoBuffer(char * buf, size_t buf_avail, size_t & r
 void ParallelHash::operator()()
 {
 	ClientDAO clientdao(Server->getDatabase(Server->getThreadID(), URBACKUPDB_CLIENT));
+	hash_cache.reset(new FileHashCache(clientdao));
 
 	int mode = MODE_READ_SEQUENTIAL;
 #ifdef _WIN32
@@ -141,6 +143,7 @@ void ParallelHash::operator()()
 	}
 
 	commitModifyFileBuffer(clientdao);
+	hash_cache.reset();
 
 	if (phash_queue->deref())
 	{
@@ -274,10 +277,21 @@ bool ParallelHash::hashFile(CRData & data, ClientDAO& clientdao)
 	std::auto_ptr<IFsFile>  f(Server->openFile(os_file_prefix(full_path), MODE_READ_SEQUENTIAL_BACKUP));
 
 	SFileAndHash fandhash;
+	SFileId fs_file_id;
+	//With change block tracking unchanged blocks are not read anyway and
+	//hashing has to write the chunk hashes
+	bool use_hash_cache = !(sha_version == 528 && client_hash->hasCbtFile());
+	bool cached_hash = false;
 	if (f.get() != NULL && f->Size() < link_file_min_size)
 	{
 		f.reset();
 	}
+	else if (use_hash_cache
+		&& hash_cache->get(curr_dir, full_path, sha_version, fs_file_id, fandhash.hash))
+	{
+		f.reset();
+		cached_hash = true;
+	}
 	else if (sha_version == 256)
 	{
 		f.reset();
@@ -296,7 +310,7 @@ bool ParallelHash::hashFile(CRData & data, ClientDAO& clientdao)
 	{
 		f.reset();
 
-		TreeHash treehash(client_hash->hasCbtFile() ? client_hash.get() : NULL);
+		TreeHash treehash(client_hash->hasCbtFile() ? client_hash.get() : NULL, TreeHash::parallelThreads());
 		if (!client_hash->getShaBinary(full_path, treehash, client_hash->hasCbtFile()))
 		{
 			Server->Log("Error hashing file (1) " + full_path+". "+os_last_error_str(), LL_DEBUG);
@@ -331,6 +345,12 @@ bool ParallelHash::hashFile(CRData & data, ClientDAO& clientdao)
 		{
 			fandhash.hash = hash_512.finalize();
 		}
+	}
+
+	if (use_hash_cache
+		&& !cached_hash)
+	{
+		hash_cache->put(fs_file_id, full_path, sha_version, fandhash.hash);
 	}
 
 	CWData wdata;
@@ -20,6 +20,7 @@ namespace
 }
 
 class ClientHash;
+class FileHashCache;
 
 class ParallelHash : public IPipeFileExt, public IThread
 {
@@ -54,6 +55,7 @@ private:
 	std::string curr_snapshot_dir;
 	std::vector<SFileAndHash> curr_files;
 	std::auto_ptr<ClientHash> client_hash;
+	std::auto_ptr<FileHashCache> hash_cache;
 	int sha_version;
 	THREADPOOL_TICKET ticket;
 
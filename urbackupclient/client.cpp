@@ -18,13 +18,14 @@
 
 #include "client.h"
 #include "ParallelHash.h"
+#include "ParallelDirLister.h"
+#include "FileHashCache.h"
 #include "../Interface/Server.h"
 #include "../Interface/File.h"
 #include "../Interface/SettingsReader.h"
 #include "../Interface/Condition.h"
-#ifdef _WIN32
 #include "DirectoryWatcherThread.h"
-#else
+#ifndef _WIN32
 #include <errno.h>
 #endif
 #include "../stringtools.h"
@@ -61,6 +62,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include "lin_btrfs_changes.h"
 #endif
 #include <set>
 #include "../urbackupcommon/glob.h"
@@ -111,6 +113,9 @@ namespace
 	const size_t max_file_buffer_size = 4 * 1024 * 1024;
 	const int64 file_buffer_commit_interval = 120 * 1000;
 	const int64 link_file_min_size = 2048;
+	//Directory listings are prefetched by this many threads while indexing (parameter index_dir_threads)
+	const size_t default_index_dir_threads = 8;
+	const size_t max_prefetched_dirs = 1024;
 }
 
 
@@ -572,14 +577,12 @@ IndexThread::~IndexThread()
 {
 	filesrv->stopServer();
 
-#ifdef _WIN32
 	if(dwt!=NULL)
 	{
 		dwt->stop();
 		Server->getThreadPool()->waitFor(dwt_ticket);
 		delete dwt;
 	}
-#endif
 
 	((IFileServFactory*)(Server->getPlugin(Server->getThreadID(), filesrv_pluginid)))->destroyFileServ(filesrv);
 	Server->destroy(filelist_mutex);
@@ -588,6 +591,7 @@ IndexThread::~IndexThread()
 	Server->destroy(cbt_shadow_id_mutex);
 	Server->destroy(read_error_mutex);
 	Server->destroy(result_mutex);
+	hash_cache.reset();
 	cd->destroyQueries();
 	delete cd;
 }
@@ -602,23 +606,30 @@ void IndexThread::updateDirs(void)
 	readBackupDirs();
 	readSnapshotGroups();
 
-#ifdef _WIN32
 	std::vector<std::string> watching;
+#ifdef _WIN32
 	std::vector<ContinuousWatchEnqueue::SWatchItem> continuous_watch;
+#endif
 	for(size_t i=0;i<backup_dirs.size();++i)
 	{
 		watching.push_back(backup_dirs[i].path);
 
+#ifdef _WIN32
 		if(backup_dirs[i].group==c_group_continuous)
 		{
 			continuous_watch.push_back(
 				ContinuousWatchEnqueue::SWatchItem(backup_dirs[i].path, backup_dirs[i].tname));
 		}
+#endif
 	}
 
 	if(dwt==NULL)
 	{
+#ifdef _WIN32
 		dwt=new DirectoryWatcherThread(watching, continuous_watch);
+#else
+		dwt=new DirectoryWatcherThread(watching);
+#endif
 		dwt_ticket=Server->getThreadPool()->execute(dwt, "directory watcher");
 	}
 	else
@@ -629,7 +640,6 @@ void IndexThread::updateDirs(void)
 			dwt->getPipe()->Write(msg);
 		}
 	}
-#endif
 }
 
 void IndexThread::log_read_errors(const std::string& share_name, const std::string& orig_path)
@@ -677,6 +687,7 @@ void IndexThread::operator()(void)
 
 	db=Server->getDatabase(Server->getThreadID(), URBACKUPDB_CLIENT);
 	cd=new ClientDAO(Server->getDatabase(Server->getThreadID(), URBACKUPDB_CLIENT));
+	hash_cache.reset(new FileHashCache(*cd));
 
 #ifdef _WIN32
 #ifdef ENABLE_VSS
@@ -1507,7 +1518,6 @@ IndexThread::IndexErrorInfo IndexThread::indexDirs(bool full_backup, bool simult
 		}
 	}
 
-#ifdef _WIN32
 	//Invalidate cache
 	DirectoryWatcherThread::freeze();
 	DirectoryWatcherThread::update_and_wait(open_files);
@@ -1521,7 +1531,17 @@ IndexThread::IndexErrorInfo IndexThread::indexDirs(bool full_backup, bool simult
 	}
 
 	//move GAP dirs to backup table
+#ifdef _WIN32
 	cd->getChangedDirs("##-GAP-##", true);
+#else
+	//The file index is not deleted on GAPs (see hasChangedGap()). Instead all directories
+	//below a GAP dir are listed again until the next index finished successfully
+	gap_dirs = cd->getChangedDirs("##-GAP-##", true);
+	for (size_t i = 0; i < gap_dirs.size(); ++i)
+	{
+		gap_dirs[i] = gap_dirs[i].substr(9);
+	}
+#endif
 	DirectoryWatcherThread::reset_mdirs("##-GAP-##");
 	
 	for(size_t i=0;i<selected_dirs.size();++i)
@@ -1545,8 +1565,26 @@ IndexThread::IndexErrorInfo IndexThread::indexDirs(bool full_backup, bool simult
 	}
 
 	_i64 last_filebackup_filetime_new = DirectoryWatcherThread::get_current_filetime();
+
+#ifndef _WIN32
+	btrfs_generations.clear();
 #endif
 
+	if (dir_lister.get() == NULL)
+	{
+		size_t index_dir_threads = default_index_dir_threads;
+		std::string s_index_dir_threads = Server->getServerParameter("index_dir_threads");
+		if (!s_index_dir_threads.empty())
+		{
+			index_dir_threads = static_cast<size_t>(watoi(s_index_dir_threads));
+		}
+
+		if (index_dir_threads > 0)
+		{
+			dir_lister.reset(new ParallelDirLister(index_dir_threads, max_prefetched_dirs));
+		}
+	}
+
 	bool has_stale_shadowcopy=false;
 	bool has_active_transaction = false;
 
@@ -1795,6 +1833,12 @@ IndexThread::IndexErrorInfo IndexThread::indexDirs(bool full_backup, bool simult
 				{
 					past_refs.push_back(scd->ref);
 				}
+
+				if (shadowcopy_ok
+					&& scd->ref != NULL)
+				{
+					addBtrfsChangedDirs(scd->ref, backup_dirs[i].path, full_backup);
+				}
 #endif
 
 				for (size_t k = 0; k < changed_dirs.size(); ++k)
@@ -1843,6 +1887,11 @@ IndexThread::IndexErrorInfo IndexThread::indexDirs(bool full_backup, bool simult
 						backup_dirs[i].flags, !full_backup, backup_dirs[i].symlinked, 0, true, true,
 						index_exclude_dirs, index_include_dirs, std::string());
 
+					if (dir_lister.get() != NULL)
+					{
+						dir_lister->clear();
+					}
+
 					index_exclude_dirs.insert(index_exclude_dirs.end(), rm_exclude_dirs.begin(), rm_exclude_dirs.end());
 				}
 
@@ -1929,7 +1978,6 @@ IndexThread::IndexErrorInfo IndexThread::indexDirs(bool full_backup, bool simult
 
 	index_hdat_file.reset();
 
-#ifdef _WIN32
 	if(!has_stale_shadowcopy
 		&& !has_active_transaction)
 	{
@@ -1938,6 +1986,15 @@ IndexThread::IndexErrorInfo IndexThread::indexDirs(bool full_backup, bool simult
 			VSSLog("Deleting backup of changed dirs...", LL_DEBUG);
 			cd->deleteSavedChangedDirs();
 			cd->deleteSavedDelDirs();
+			hash_cache->cleanup();
+
+#ifndef _WIN32
+			for (std::map<std::string, int64>::iterator it = btrfs_generations.begin();
+				it != btrfs_generations.end(); ++it)
+			{
+				cd->updateMiscValue(it->first, convert(it->second));
+			}
+#endif
 
 			if(index_group==c_group_default)
 			{
@@ -1967,8 +2024,8 @@ IndexThread::IndexErrorInfo IndexThread::indexDirs(bool full_backup, bool simult
 	DirectoryWatcherThread::unfreeze();
 	open_files.clear();
 	changed_dirs.clear();
+	gap_dirs.clear();
 	
-#endif
 
 	IndexErrorInfo ret = IndexErrorInfo_Ok;
 
@@ -2180,13 +2237,11 @@ void IndexThread::updateBackupDirsWithAll()
 				}
 			}
 
-#ifdef _WIN32
 			if (!found_watch)
 			{
 				std::string msg = "A" + os_get_final_path(cvol);
 				dwt->getPipe()->Write(msg);
 			}
-#endif
 
 			if (!found)
 			{
@@ -2266,7 +2321,6 @@ void IndexThread::updateBackupDirsWithAll()
 				q_del->Reset();
 				backup_dirs.erase(backup_dirs.begin() + i);
 
-#ifdef _WIN32
 				bool found = false;
 				for (size_t j = 0; j < backup_dirs.size(); ++j)
 				{
@@ -2282,7 +2336,6 @@ void IndexThread::updateBackupDirsWithAll()
 					std::string msg = "D" + os_get_final_path(cpath);
 					dwt->getPipe()->Write(msg);
 				}
-#endif
 
 				continue;
 			}				
@@ -2306,9 +2359,7 @@ void IndexThread::resetFileEntries(void)
 	db->Write("DELETE FROM files WHERE tgroup=0 OR tgroup="+convert(index_group+1));
 	cd->deleteSavedChangedDirs();
 	cd->resetAllHardlinks();
-#ifdef _WIN32
 	DirectoryWatcherThread::reset_mdirs(std::string());
-#endif
 }
 
 bool IndexThread::skipFile(const std::string& filepath, const std::string& namedpath,
@@ -2647,6 +2698,19 @@ bool IndexThread::initialCheck(std::vector<SRecurParams>& params_stack, size_t s
 
 			if( curr_included ||  !adding_worthless1 || !adding_worthless2 )
 			{
+				if (dir_lister.get() != NULL
+					&& (!files[i].issym || !with_proper_symlinks) )
+				{
+					//Directory is going to be listed from the file system. Start listing it in the background
+					bool child_use_db = use_db;
+					bool child_changed = isDirChanged(getIndexPathLower(orig_dir + os_file_sep() + files[i].name), child_use_db);
+					if (!child_use_db || child_changed)
+					{
+						dir_lister->queue(os_file_prefix(dir + os_file_sep() + files[i].name),
+							(flags & EBackupDirFlag_OneFilesystem) > 0);
+					}
+				}
+
 				first_info.idx = i;
 				SRecurParams curr_params(files[i], first ? &first_info : NULL, curr_included,
 					orig_dir, dir, named_path, depth, stack_idx);
@@ -3074,7 +3138,7 @@ bool IndexThread::addMissingHashes(std::vector<SFileAndHash>* dbfiles, std::vect
 				&& calc_hashes
 				&& fsfile.size>= link_file_min_size)
 			{
-				fsfile.hash=getShaBinary(filepath+os_file_sep()+fsfile.name);
+				fsfile.hash=getShaBinaryCached(orig_path, filepath+os_file_sep()+fsfile.name);
 				calculated_hash=true;
 			}
 		}
@@ -3099,7 +3163,7 @@ bool IndexThread::addMissingHashes(std::vector<SFileAndHash>* dbfiles, std::vect
 			if (dbfile.size < link_file_min_size)
 				continue;
 
-			dbfile.hash=getShaBinary(filepath+os_file_sep()+dbfile.name);
+			dbfile.hash=getShaBinaryCached(orig_path, filepath+os_file_sep()+dbfile.name);
 			calculated_hash=true;
 		}
 	}
@@ -3137,24 +3201,11 @@ std::vector<SFileAndHash> IndexThread::getFilesProxy(const std::string &orig_pat
 	{
 		path = os_file_sep();
 	}
-	std::string path_lower=orig_path + os_file_sep();
-#else
-	std::string path_lower=strlower(orig_path+os_file_sep());
 #endif
+	std::string path_lower=getIndexPathLower(orig_path);
 
-	std::vector<std::string>::iterator it_dir=changed_dirs.end();
-#ifdef _WIN32
+	bool dir_changed=isDirChanged(path_lower, use_db);
 
-	bool dir_changed=std::binary_search(changed_dirs.begin(), changed_dirs.end(), path_lower);
-	
-	if(path_lower==strlower(Server->getServerWorkingDir())+os_file_sep()+"urbackup"+os_file_sep())
-	{
-		use_db=false;
-	}
-#else
-	use_db=false;
-	bool dir_changed=true;
-#endif
 	std::vector<SFileAndHash> fs_files;
 	if (!use_db || dir_changed)
 	{
@@ -3163,7 +3214,7 @@ std::vector<SFileAndHash> IndexThread::getFilesProxy(const std::string &orig_pat
 		std::string tpath = os_file_prefix(path);
 
 		bool has_error;
-		std::vector<SFile> os_files = getFilesWin(tpath, &has_error, true, true, (index_flags & EBackupDirFlag_OneFilesystem) > 0);
+		std::vector<SFile> os_files = listDirectory(tpath, &has_error);
 		filterEncryptedFiles(path, orig_path, os_files);
 		fs_files = convertToFileAndHash(orig_path, named_path, exclude_dirs, include_dirs, os_files, fn_filter);
 
@@ -3207,7 +3258,8 @@ std::vector<SFileAndHash> IndexThread::getFilesProxy(const std::string &orig_pat
 		if (use_db_hashes)
 		{
 #ifndef _WIN32
-			if (calculate_filehashes_on_client)
+			if (calculate_filehashes_on_client
+				|| dwt!=NULL)
 			{
 #endif
 				has_files = cd->getFiles(path_lower, get_db_tgroup(), db_files, target_generation);
@@ -3283,8 +3335,9 @@ std::vector<SFileAndHash> IndexThread::getFilesProxy(const std::string &orig_pat
 		else
 		{
 #ifndef _WIN32
-			if(calculate_filehashes_on_client
-				&& (hasHash(fs_files) || hasDirectory(fs_files) ) )
+			if(dwt!=NULL
+				|| (calculate_filehashes_on_client
+					&& (hasHash(fs_files) || hasDirectory(fs_files) ) ) )
 			{
 #endif
 				addFilesInt(path_lower, get_db_tgroup(), fs_files);
@@ -3295,7 +3348,6 @@ std::vector<SFileAndHash> IndexThread::getFilesProxy(const std::string &orig_pat
 
 		return fs_files;
 	}
-#ifdef _WIN32
 	else
 	{	
 		if( cd->getFiles(path_lower, get_db_tgroup(), fs_files, target_generation) )
@@ -3323,11 +3375,12 @@ std::vector<SFileAndHash> IndexThread::getFilesProxy(const std::string &orig_pat
 			std::string tpath=os_file_prefix(path);
 
 			bool has_error;
-			std::vector<SFile> os_files = getFilesWin(tpath, &has_error, true, true, (index_flags & EBackupDirFlag_OneFilesystem) > 0);
+			std::vector<SFile> os_files = listDirectory(tpath, &has_error);
 			filterEncryptedFiles(path, orig_path, os_files);
 			fs_files=convertToFileAndHash(orig_path, named_path, exclude_dirs, include_dirs, os_files, fn_filter);
 			if(has_error)
 			{
+#ifdef _WIN32
 				if(os_directory_exists(index_root_path))
 				{
 					VSSLog("Error while getting files in folder \""+path+"\". SYSTEM may not have permissions to access this folder. Windows errorcode: "+convert((int)GetLastError()), LL_ERROR);
@@ -3337,6 +3390,19 @@ std::vector<SFileAndHash> IndexThread::getFilesProxy(const std::string &orig_pat
 					VSSLog("Error while getting files in folder \""+path+"\". Windows errorcode: "+convert((int)GetLastError())+". Access to root directory is gone too. Shadow copy was probably deleted while indexing.", LL_ERROR);
 					index_error=true;
 				}
+#else
+				int err = errno;
+				if(os_directory_exists(index_root_path))
+				{
+					VSSLog("Error while getting files in folder \""+path+"\". User may not have permissions to access this folder. Errno is "+convert(err), LL_ERROR);
+					index_error=true;
+				}
+				else
+				{
+					VSSLog("Error while getting files in folder \""+path+"\". Errorno is "+convert(err)+". Access to root directory is gone too. Snapshot was probably deleted while indexing.", LL_ERROR);
+					index_error=true;
+				}
+#endif
 			}
 
 			if(calculate_filehashes_on_client
@@ -3350,9 +3416,64 @@ std::vector<SFileAndHash> IndexThread::getFilesProxy(const std::string &orig_pat
 			return fs_files;
 		}
 	}
-#else //_WIN32
-	return fs_files;
+}
+
+std::string IndexThread::getIndexPathLower(const std::string& orig_path)
+{
+#ifndef _WIN32
+	return orig_path + os_file_sep();
+#else
+	return strlower(orig_path+os_file_sep());
+#endif
+}
+
+bool IndexThread::isDirChanged(const std::string& path_lower, bool& use_db)
+{
+#ifdef _WIN32
+
+	bool dir_changed=std::binary_search(changed_dirs.begin(), changed_dirs.end(), path_lower);
+	
+	if(path_lower==strlower(Server->getServerWorkingDir())+os_file_sep()+"urbackup"+os_file_sep())
+	{
+		use_db=false;
+	}
+#else
+	bool dir_changed=true;
+	if(dwt==NULL)
+	{
+		use_db=false;
+	}
+	else
+	{
+		dir_changed=std::binary_search(changed_dirs.begin(), changed_dirs.end(), path_lower);
+
+		for(size_t i=0;i<gap_dirs.size() && !dir_changed;++i)
+		{
+			if(next(path_lower, 0, gap_dirs[i]))
+			{
+				dir_changed=true;
+			}
+		}
+	}
+
+	if(path_lower==Server->getServerWorkingDir()+os_file_sep()+"urbackup"+os_file_sep())
+	{
+		use_db=false;
+	}
 #endif
+	return dir_changed;
+}
+
+std::vector<SFile> IndexThread::listDirectory(const std::string& path, bool* has_error)
+{
+	bool ignore_other_fs = (index_flags & EBackupDirFlag_OneFilesystem) > 0;
+
+	if(dir_lister.get()!=NULL)
+	{
+		return dir_lister->getFiles(path, has_error, ignore_other_fs);
+	}
+
+	return getFilesWin(path, has_error, true, true, ignore_other_fs);
 }
 
 IPipe * IndexThread::getMsgPipe(void)
@@ -5380,7 +5501,7 @@ std::string IndexThread::getShaBinary(const std::string& fn)
 	}
 	else if (sha_version == 528)
 	{
-		TreeHash treehash(index_hdat_file.get() == NULL ? NULL : client_hash.get());
+		TreeHash treehash(index_hdat_file.get() == NULL ? NULL : client_hash.get(), TreeHash::parallelThreads());
 		if (!getShaBinary(fn, treehash, index_hdat_file.get() != NULL))
 		{
 			return std::string();
@@ -5400,6 +5521,30 @@ std::string IndexThread::getShaBinary(const std::string& fn)
 	}
 }
 
+std::string IndexThread::getShaBinaryCached(const std::string& orig_dir, const std::string& fn)
+{
+	//With change block tracking unchanged blocks are not read anyway and
+	//hashing has to write the chunk hashes
+	if (sha_version == 528
+		&& index_hdat_file.get() != NULL)
+	{
+		return getShaBinary(fn);
+	}
+
+	SFileId file_id;
+	std::string hash;
+	if (hash_cache->get(orig_dir, fn, sha_version, file_id, hash))
+	{
+		return hash;
+	}
+
+	hash = getShaBinary(fn);
+
+	hash_cache->put(file_id, fn, sha_version, hash);
+
+	return hash;
+}
+
 bool IndexThread::getShaBinary( const std::string& fn, IHashFunc& hf, bool with_cbt)
 {
 	return client_hash->getShaBinary(fn, hf, with_cbt);
@@ -7671,13 +7816,11 @@ void IndexThread::addSymlinkBackupDir( const std::string& target, std::string& o
 
 	backup_dir.id=static_cast<int>(db->getLastInsertID());
 
-#ifdef _WIN32
 	if(dwt!=NULL)
 	{
 		std::string msg="A"+target;
 		dwt->getPipe()->Write(msg);
     }
-#endif
 
 	
 	backup_dir.group=index_group;
@@ -7934,6 +8077,62 @@ int64 IndexThread::getChangeIndicator(const SFile & file)
 }
 
 #ifndef _WIN32
+void IndexThread::addBtrfsChangedDirs(SCRef* ref, const std::string& backup_path, bool full_backup)
+{
+	std::string source_uuid;
+	int64 generation;
+	if (!btrfs_snapshot_info(ref->volpath, source_uuid, generation))
+	{
+		return;
+	}
+
+	//The file index of a backup directory is in the state of the snapshot it was last indexed from
+	std::string generation_key = "btrfs_generation_" + convert(index_group) + "_" + source_uuid + "|" + backup_path;
+	btrfs_generations[generation_key] = generation;
+
+	std::string gap_dir = add_trailing_slash(backup_path);
+	std::vector<std::string>::iterator it_gap = std::find(gap_dirs.begin(), gap_dirs.end(), gap_dir);
+
+	if (full_backup
+		|| it_gap == gap_dirs.end())
+	{
+		return;
+	}
+
+	std::string last_generation = cd->getMiscValue(generation_key);
+	if (last_generation.empty())
+	{
+		return;
+	}
+
+	std::vector<std::string> snapshot_changed_dirs;
+	if (!btrfs_changed_dirs(ref->volpath, watoi64(last_generation), snapshot_changed_dirs))
+	{
+		VSSLog("Getting changes in btrfs snapshot \"" + ref->volpath + "\" failed. Indexing all files in \"" + backup_path + "\".", LL_WARNING);
+		return;
+	}
+
+	std::string vol = removeDirectorySeparatorAtEnd(ref->target);
+	size_t n_changed = 0;
+	for (size_t i = 0; i < snapshot_changed_dirs.size(); ++i)
+	{
+		std::string changed_dir = vol + snapshot_changed_dirs[i];
+		if (next(changed_dir, 0, gap_dir))
+		{
+			changed_dirs.push_back(changed_dir);
+			++n_changed;
+		}
+	}
+
+	std::sort(changed_dirs.begin(), changed_dirs.end());
+	changed_dirs.erase(std::unique(changed_dirs.begin(), changed_dirs.end()), changed_dirs.end());
+
+	gap_dirs.erase(it_gap);
+
+	VSSLog("Changes in \"" + backup_path + "\" are not tracked completely. Using " + convert(n_changed) +
+		" changed directories since btrfs generation " + last_generation + " instead of indexing all files.", LL_INFO);
+}
+
 bool IndexThread::start_shadowcopy_lin( SCDirs * dir, std::string &wpath, bool for_imagebackup, bool * &onlyref, bool* not_configured)
 {
 	std::string scriptname;
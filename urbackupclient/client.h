@@ -65,6 +65,8 @@ const uint64 change_indicator_special_bit = 0x2000000000000000ULL;
 const uint64 change_indicator_all_bits = change_indicator_symlink_bit | change_indicator_special_bit;
 
 class DirectoryWatcherThread;
+class ParallelDirLister;
+class FileHashCache;
 
 class IdleCheckerThread : public IThread
 {
@@ -440,6 +442,12 @@ private:
 		const std::vector<std::string>& exclude_dirs,
 		const std::vector<SIndexInclude>& include_dirs, int64& target_generation);
 
+	bool isDirChanged(const std::string& path_lower, bool& use_db);
+
+	std::string getIndexPathLower(const std::string& orig_path);
+
+	std::vector<SFile> listDirectory(const std::string& path, bool* has_error);
+
 	bool start_shadowcopy(SCDirs *dir, bool *onlyref=NULL, bool allow_restart=false, bool simultaneous_other=true, std::vector<SCRef*> no_restart_refs=std::vector<SCRef*>(),
 		bool for_imagebackup=false, bool *stale_shadowcopy=NULL, bool* not_configured=NULL, bool* has_active_transaction=NULL);
 
@@ -477,6 +485,7 @@ private:
 	bool start_shadowcopy_lin( SCDirs * dir, std::string &wpath, bool for_imagebackup, bool * &onlyref, bool* not_configured);
 	bool get_volumes_mounted_locally();
 	bool getVssSettings() { return true; }
+	void addBtrfsChangedDirs(SCRef* ref, const std::string& backup_path, bool full_backup);
 #endif
 
 	bool deleteShadowcopy(SCDirs *dir);
@@ -518,6 +527,7 @@ private:
 	void addFilesInt(std::string path, int tgroup, const std::vector<SFileAndHash> &data);
 	void commitAddFilesBuffer();
 	std::string getShaBinary(const std::string& fn);
+	std::string getShaBinaryCached(const std::string& orig_dir, const std::string& fn);
 
 	std::string removeDirectorySeparatorAtEnd(const std::string& path);
 
@@ -627,6 +637,11 @@ private:
 
 	std::vector<std::string> changed_dirs;
 	std::vector<std::string> open_files;
+#ifndef _WIN32
+	std::vector<std::string> gap_dirs;
+	//btrfs snapshot generation per backup directory. Saved once indexing finished
+	std::map<std::string, int64> btrfs_generations;
+#endif
 
 	static IMutex *filelist_mutex;
 	static IMutex *filesrv_mutex;
@@ -647,6 +662,10 @@ private:
 	DirectoryWatcherThread *dwt;
 	THREADPOOL_TICKET dwt_ticket;
 
+	std::auto_ptr<ParallelDirLister> dir_lister;
+
+	std::auto_ptr<FileHashCache> hash_cache;
+
 	std::map<SCDirServerKey, std::map<std::string, SCDirs*> > scdirs;
 	std::vector<SCRef*> sc_refs;
 
@@ -20,11 +20,204 @@
 #include "../stringtools.h"
 #include "../Interface/Server.h"
 #include <memory.h>
+#include <algorithm>
 
 const int ClientDAO::c_is_group = 0;
 const int ClientDAO::c_is_user = 1;
 const int ClientDAO::c_is_system_user = 2;
 
+namespace
+{
+	/**
+	* Files data with format c_files_format_compact (format column of the files
+	* table). The number of files is followed by the files. Names are stored
+	* with the length of the prefix shared with the previous name, numbers as
+	* LEB128 varints.
+	*/
+	const int c_files_format_compact = 1;
+
+	const char c_file_flag_dir = 1;
+	const char c_file_flag_sym = 2;
+	const char c_file_flag_special = 4;
+
+	void addVarInt(std::string& out, uint64 val)
+	{
+		while(val>=0x80)
+		{
+			out+=static_cast<char>((val & 0x7f) | 0x80);
+			val>>=7;
+		}
+		out+=static_cast<char>(val);
+	}
+
+	void addString(std::string& out, const std::string& str, size_t off=0)
+	{
+		addVarInt(out, str.size()-off);
+		out.append(str, off, std::string::npos);
+	}
+
+	void constructData(const std::vector<SFileAndHash> &data, std::string& out)
+	{
+		addVarInt(out, data.size());
+
+		const std::string* prev_name = NULL;
+		for(size_t i=0;i<data.size();++i)
+		{
+			const SFileAndHash& file = data[i];
+
+			size_t prefix_len = 0;
+			if(prev_name!=NULL)
+			{
+				size_t max_prefix = (std::min)(prev_name->size(), file.name.size());
+				while(prefix_len<max_prefix
+					&& (*prev_name)[prefix_len]==file.name[prefix_len])
+				{
+					++prefix_len;
+				}
+			}
+			prev_name = &file.name;
+
+			addVarInt(out, prefix_len);
+			addString(out, file.name, prefix_len);
+
+			char flags = 0;
+			if(file.isdir) flags|=c_file_flag_dir;
+			if(file.issym) flags|=c_file_flag_sym;
+			if(file.isspecialf) flags|=c_file_flag_special;
+			out+=flags;
+
+			addVarInt(out, static_cast<uint64>(file.size));
+			addVarInt(out, file.change_indicator);
+			addString(out, file.hash);
+
+			if(file.issym)
+			{
+				addString(out, file.symlink_target);
+			}
+		}
+	}
+
+	//Reads the compact files data without size limits (CRData caps at 100MiB)
+	class FilesDataReader
+	{
+	public:
+		FilesDataReader(const std::string& data)
+			: ptr(data.data()), left(data.size())
+		{}
+
+		bool getVarInt(uint64& val)
+		{
+			val = 0;
+			for(unsigned int shift=0;shift<64;shift+=7)
+			{
+				if(left==0)
+					return false;
+
+				unsigned char b = static_cast<unsigned char>(*ptr);
+				++ptr;
+				--left;
+				val|=static_cast<uint64>(b & 0x7f)<<shift;
+				if((b & 0x80)==0)
+					return true;
+			}
+			return false;
+		}
+
+		bool getChar(char& ch)
+		{
+			if(left==0)
+				return false;
+
+			ch=*ptr;
+			++ptr;
+			--left;
+			return true;
+		}
+
+		bool appendString(std::string& str)
+		{
+			uint64 len;
+			if(!getVarInt(len)
+				|| len>left)
+				return false;
+
+			str.append(ptr, static_cast<size_t>(len));
+			ptr+=len;
+			left-=static_cast<size_t>(len);
+			return true;
+		}
+
+		size_t getLeft()
+		{
+			return left;
+		}
+
+	private:
+		const char* ptr;
+		size_t left;
+	};
+
+	bool decodeData(const std::string& qdata, std::vector<SFileAndHash> &data)
+	{
+		FilesDataReader reader(qdata);
+
+		uint64 count;
+		if(!reader.getVarInt(count)
+			|| count>reader.getLeft())
+		{
+			return false;
+		}
+
+		size_t start = data.size();
+		data.resize(start+static_cast<size_t>(count));
+
+		for(size_t i=start;i<data.size();++i)
+		{
+			SFileAndHash& f = data[i];
+
+			uint64 prefix_len;
+			if(!reader.getVarInt(prefix_len))
+			{
+				return false;
+			}
+
+			if(prefix_len>0)
+			{
+				if(i==start
+					|| prefix_len>data[i-1].name.size())
+				{
+					return false;
+				}
+				f.name.assign(data[i-1].name, 0, static_cast<size_t>(prefix_len));
+			}
+
+			char flags;
+			uint64 size;
+			if(!reader.appendString(f.name)
+				|| !reader.getChar(flags)
+				|| !reader.getVarInt(size)
+				|| !reader.getVarInt(f.change_indicator)
+				|| !reader.appendString(f.hash))
+			{
+				return false;
+			}
+
+			f.size = static_cast<int64>(size);
+			f.isdir = (flags & c_file_flag_dir)!=0;
+			f.issym = (flags & c_file_flag_sym)!=0;
+			f.isspecialf = (flags & c_file_flag_special)!=0;
+
+			if(f.issym
+				&& !reader.appendString(f.symlink_target))
+			{
+				return false;
+			}
+		}
+
+		return true;
+	}
+}
+
 ClientDAO::ClientDAO(IDatabase *pDB)
 {
 	db=pDB;
@@ -38,12 +231,12 @@ ClientDAO::~ClientDAO()
 
 void ClientDAO::prepareQueries()
 {
-	q_get_files=db->Prepare("SELECT data, num, generation FROM files WHERE name=? AND tgroup=?", false);
-	q_add_files=db->Prepare("INSERT OR REPLACE INTO files (name, tgroup, num, data) VALUES (?,?,?,?)", false);
+	q_get_files=db->Prepare("SELECT data, num, generation, format FROM files WHERE name=? AND tgroup=?", false);
+	q_add_files=db->Prepare("INSERT OR REPLACE INTO files (name, tgroup, num, data, format) VALUES (?,?,?,?,?)", false);
 	q_get_dirs=db->Prepare("SELECT name, path, id, optional, tgroup, symlinked, server_default, reset_keep FROM backupdirs ORDER BY id ASC", false);
 	q_remove_all=db->Prepare("DELETE FROM files", false);
 	q_get_changed_dirs=db->Prepare("SELECT id, name FROM mdirs WHERE name GLOB ? UNION SELECT id, name FROM mdirs_backup WHERE name GLOB ?", false);
-	q_modify_files=db->Prepare("UPDATE files SET data=?, num=?, generation=? WHERE name=? AND tgroup=? AND generation=?", false);
+	q_modify_files=db->Prepare("UPDATE files SET data=?, num=?, generation=?, format=? WHERE name=? AND tgroup=? AND generation=?", false);
 	q_has_files=db->Prepare("SELECT count(*) AS num FROM files WHERE name=? AND tgroup=?", false);
 	q_insert_shadowcopy=db->Prepare("INSERT INTO shadowcopies (vssid, ssetid, target, path, tname, orig_target, filesrv, vol, starttime, refs, starttoken, clientsubname) VALUES (?, ?, ?, ?, ?, ?, ?, ?, CURRENT_TIMESTAMP, ?, ?, ?)", false);
 	q_get_shadowcopies=db->Prepare("SELECT id, vssid, ssetid, target, path, tname, orig_target, filesrv, vol, (strftime('%s','now') - strftime('%s', starttime)) AS passedtime, refs, starttoken, clientsubname FROM shadowcopies", false);
@@ -110,6 +303,10 @@ void ClientDAO::prepareQueriesGen(void)
 	q_hasHardLink=NULL;
 	q_addHardlink=NULL;
 	q_resetAllHardlinks=NULL;
+	q_getFileHashCacheEntry=NULL;
+	q_addFileHashCacheEntry=NULL;
+	q_updateFileHashCacheEntryLastUsed=NULL;
+	q_deleteOldFileHashCacheEntries=NULL;
 }
 
 //@-SQLGenDestruction
@@ -130,6 +327,10 @@ void ClientDAO::destroyQueriesGen(void)
 	db->destroyQuery(q_hasHardLink);
 	db->destroyQuery(q_addHardlink);
 	db->destroyQuery(q_resetAllHardlinks);
+	db->destroyQuery(q_getFileHashCacheEntry);
+	db->destroyQuery(q_addFileHashCacheEntry);
+	db->destroyQuery(q_updateFileHashCacheEntryLastUsed);
+	db->destroyQuery(q_deleteOldFileHashCacheEntries);
 }
 
 void ClientDAO::restartQueries(void)
@@ -180,6 +381,17 @@ bool ClientDAO::getFiles(std::string path, int tgroup, std::vector<SFileAndHash>
 	if(qdata.empty())
 		return true;
 
+	if(watoi(res[0]["format"])==c_files_format_compact)
+	{
+		if(!decodeData(qdata, data))
+		{
+			Server->Log("Error decoding files data of \""+path+"\". Listing directory again.", LL_ERROR);
+			data.clear();
+			return false;
+		}
+		return true;
+	}
+
 	int num=watoi(res[0]["num"]);
 	char *ptr=(char*)&qdata[0];
 	while(ptr-(char*)&qdata[0]<num)
@@ -243,73 +455,6 @@ bool ClientDAO::getFiles(std::string path, int tgroup, std::vector<SFileAndHash>
 	return true;
 }
 
-char * constructData(const std::vector<SFileAndHash> &data, size_t &datasize)
-{
-	datasize=0;
-	std::vector<std::string> utf;
-	utf.resize(data.size());
-	for(size_t i=0;i<data.size();++i)
-	{
-		utf[i]=(data[i].name);
-		datasize+=utf[i].size();
-		datasize+=sizeof(unsigned short);
-		datasize+=sizeof(int64)*2;
-		++datasize; //isdir
-		datasize+=sizeof(unsigned short);
-		datasize+=data[i].hash.size();
-		++datasize; //issym
-		++datasize; //isspecial
-		if(data[i].issym)
-		{
-			datasize+=sizeof(unsigned short);
-			datasize+=(data[i].symlink_target).size();
-		}
-	}
-	char *buffer=new char[datasize];
-	char *ptr=buffer;
-	for(size_t i=0;i<data.size();++i)
-	{
-		unsigned short ss=(unsigned short)utf[i].size();
-		memcpy(ptr, (char*)&ss, sizeof(unsigned short));
-		ptr+=sizeof(unsigned short);
-		memcpy(ptr, &utf[i][0], ss);
-		ptr+=ss;
-		memcpy(ptr, (char*)&data[i].size, sizeof(int64));
-		ptr+=sizeof(int64);
-		memcpy(ptr, (char*)&data[i].change_indicator, sizeof(uint64));
-		ptr+=sizeof(uint64);
-		char isdir=1;
-		if(!data[i].isdir)
-			isdir=0;
-		*ptr=isdir;
-		ptr+=sizeof(char);
-		unsigned short hashsize=static_cast<unsigned short>(data[i].hash.size());
-		memcpy(ptr, &hashsize, sizeof(hashsize));
-		ptr+=sizeof(hashsize);
-		memcpy(ptr, data[i].hash.data(), hashsize);
-		ptr+=hashsize;
-		char issym = data[i].issym?1:0;
-		*ptr=issym;
-		++ptr;
-		char isspecialf = data[i].isspecialf?1:0;
-		*ptr= isspecialf ?1:0;
-		++ptr;
-		if(data[i].issym)
-		{
-			std::string symlink_target = (data[i].symlink_target);
-			ss=(unsigned short)symlink_target.size();
-			memcpy(ptr, (char*)&ss, sizeof(unsigned short));
-			ptr+=sizeof(unsigned short);
-			if(ss>0)
-			{
-				memcpy(ptr, &symlink_target[0], ss);
-			}
-			ptr+=ss;
-		}
-	}
-	return buffer;
-}
-
 std::string guidToString( GUID guid )
 {
 	return bytesToHex(reinterpret_cast<unsigned char*>(&guid), sizeof(guid));
@@ -324,30 +469,30 @@ GUID randomGuid()
 
 void ClientDAO::addFiles(std::string path, int tgroup, const std::vector<SFileAndHash> &data)
 {
-	size_t ds;
-	char *buffer=constructData(data, ds);
+	std::string buffer;
+	constructData(data, buffer);
 	q_add_files->Bind(path);
 	q_add_files->Bind(tgroup);
-	q_add_files->Bind(ds);
-	q_add_files->Bind(buffer, (_u32)ds);
+	q_add_files->Bind(buffer.size());
+	q_add_files->Bind(buffer.data(), (_u32)buffer.size());
+	q_add_files->Bind(c_files_format_compact);
 	q_add_files->Write();
 	q_add_files->Reset();
-	delete []buffer;
 }
 
 void ClientDAO::modifyFiles(std::string path, int tgroup, const std::vector<SFileAndHash> &data, int64 target_generation)
 {
-	size_t ds;
-	char *buffer=constructData(data, ds);
-	q_modify_files->Bind(buffer, (_u32)ds);
-	q_modify_files->Bind(ds);
+	std::string buffer;
+	constructData(data, buffer);
+	q_modify_files->Bind(buffer.data(), (_u32)buffer.size());
+	q_modify_files->Bind(buffer.size());
 	q_modify_files->Bind(target_generation+1);
+	q_modify_files->Bind(c_files_format_compact);
 	q_modify_files->Bind(path);
 	q_modify_files->Bind(tgroup);
 	q_modify_files->Bind(target_generation);
 	q_modify_files->Write();
 	q_modify_files->Reset();
-	delete []buffer;
 }
 
 bool ClientDAO::hasFiles(std::string path, int tgroup)
@@ -971,6 +1116,103 @@ void ClientDAO::resetAllHardlinks(void)
 	q_resetAllHardlinks->Write();
 }
 
+/**
+* @-SQLGenAccess
+* @func SFileHashCacheEntry ClientDAO::getFileHashCacheEntry
+* @return int64 filesize, int64 modifytime, int64 changetime, blob hashdata
+* @sql
+*    SELECT filesize, modifytime, changetime, hashdata FROM filehash_cache WHERE vol=:vol(int64) AND frn_high=:frn_high(int64) AND frn_low=:frn_low(int64)
+*		AND hash_version=:hash_version(int)
+**/
+ClientDAO::SFileHashCacheEntry ClientDAO::getFileHashCacheEntry(int64 vol, int64 frn_high, int64 frn_low, int hash_version)
+{
+	if(q_getFileHashCacheEntry==NULL)
+	{
+		q_getFileHashCacheEntry=db->Prepare("SELECT filesize, modifytime, changetime, hashdata FROM filehash_cache WHERE vol=? AND frn_high=? AND frn_low=? AND hash_version=?", false);
+	}
+	q_getFileHashCacheEntry->Bind(vol);
+	q_getFileHashCacheEntry->Bind(frn_high);
+	q_getFileHashCacheEntry->Bind(frn_low);
+	q_getFileHashCacheEntry->Bind(hash_version);
+	db_results res=q_getFileHashCacheEntry->Read();
+	q_getFileHashCacheEntry->Reset();
+	SFileHashCacheEntry ret = { false, 0, 0, 0, "" };
+	if(!res.empty())
+	{
+		ret.exists=true;
+		ret.filesize=watoi64(res[0]["filesize"]);
+		ret.modifytime=watoi64(res[0]["modifytime"]);
+		ret.changetime=watoi64(res[0]["changetime"]);
+		ret.hashdata=res[0]["hashdata"];
+	}
+	return ret;
+}
+
+/**
+* @-SQLGenAccess
+* @func void ClientDAO::addFileHashCacheEntry
+* @sql
+*    INSERT OR REPLACE INTO filehash_cache (vol, frn_high, frn_low, hash_version, filesize, modifytime, changetime, hashdata, lastused)
+*	 VALUES (:vol(int64), :frn_high(int64), :frn_low(int64), :hash_version(int), :filesize(int64), :modifytime(int64), :changetime(int64), :hashdata(blob), :lastused(int64))
+**/
+void ClientDAO::addFileHashCacheEntry(int64 vol, int64 frn_high, int64 frn_low, int hash_version, int64 filesize, int64 modifytime, int64 changetime, const std::string& hashdata, int64 lastused)
+{
+	if(q_addFileHashCacheEntry==NULL)
+	{
+		q_addFileHashCacheEntry=db->Prepare("INSERT OR REPLACE INTO filehash_cache (vol, frn_high, frn_low, hash_version, filesize, modifytime, changetime, hashdata, lastused) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)", false);
+	}
+	q_addFileHashCacheEntry->Bind(vol);
+	q_addFileHashCacheEntry->Bind(frn_high);
+	q_addFileHashCacheEntry->Bind(frn_low);
+	q_addFileHashCacheEntry->Bind(hash_version);
+	q_addFileHashCacheEntry->Bind(filesize);
+	q_addFileHashCacheEntry->Bind(modifytime);
+	q_addFileHashCacheEntry->Bind(changetime);
+	q_addFileHashCacheEntry->Bind(hashdata.c_str(), (_u32)hashdata.size());
+	q_addFileHashCacheEntry->Bind(lastused);
+	q_addFileHashCacheEntry->Write();
+	q_addFileHashCacheEntry->Reset();
+}
+
+/**
+* @-SQLGenAccess
+* @func void ClientDAO::updateFileHashCacheEntryLastUsed
+* @sql
+*    UPDATE filehash_cache SET lastused=:lastused(int64) WHERE vol=:vol(int64) AND frn_high=:frn_high(int64) AND frn_low=:frn_low(int64)
+*		AND hash_version=:hash_version(int)
+**/
+void ClientDAO::updateFileHashCacheEntryLastUsed(int64 lastused, int64 vol, int64 frn_high, int64 frn_low, int hash_version)
+{
+	if(q_updateFileHashCacheEntryLastUsed==NULL)
+	{
+		q_updateFileHashCacheEntryLastUsed=db->Prepare("UPDATE filehash_cache SET lastused=? WHERE vol=? AND frn_high=? AND frn_low=? AND hash_version=?", false);
+	}
+	q_updateFileHashCacheEntryLastUsed->Bind(lastused);
+	q_updateFileHashCacheEntryLastUsed->Bind(vol);
+	q_updateFileHashCacheEntryLastUsed->Bind(frn_high);
+	q_updateFileHashCacheEntryLastUsed->Bind(frn_low);
+	q_updateFileHashCacheEntryLastUsed->Bind(hash_version);
+	q_updateFileHashCacheEntryLastUsed->Write();
+	q_updateFileHashCacheEntryLastUsed->Reset();
+}
+
+/**
+* @-SQLGenAccess
+* @func void ClientDAO::deleteOldFileHashCacheEntries
+* @sql
+*    DELETE FROM filehash_cache WHERE lastused<:lastused(int64)
+**/
+void ClientDAO::deleteOldFileHashCacheEntries(int64 lastused)
+{
+	if(q_deleteOldFileHashCacheEntries==NULL)
+	{
+		q_deleteOldFileHashCacheEntries=db->Prepare("DELETE FROM filehash_cache WHERE lastused<?", false);
+	}
+	q_deleteOldFileHashCacheEntries->Bind(lastused);
+	q_deleteOldFileHashCacheEntries->Write();
+	q_deleteOldFileHashCacheEntries->Reset();
+}
+
 std::vector<std::pair<int, std::string> > getFlagStrMapping()
 {
 	std::vector<std::pair<int, std::string> > flag_mapping;
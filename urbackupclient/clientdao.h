@@ -182,6 +182,14 @@ public:
 		bool exists;
 		int64 value;
 	};
+	struct SFileHashCacheEntry
+	{
+		bool exists;
+		int64 filesize;
+		int64 modifytime;
+		int64 changetime;
+		std::string hashdata;
+	};
 	struct SToken
 	{
 		int64 id;
@@ -206,6 +214,10 @@ public:
 	CondInt64 hasHardLink(const std::string& vol, int64 frn_high, int64 frn_low);
 	void addHardlink(const std::string& vol, int64 frn_high, int64 frn_low, int64 parent_frn_high, int64 parent_frn_low);
 	void resetAllHardlinks(void);
+	SFileHashCacheEntry getFileHashCacheEntry(int64 vol, int64 frn_high, int64 frn_low, int hash_version);
+	void addFileHashCacheEntry(int64 vol, int64 frn_high, int64 frn_low, int hash_version, int64 filesize, int64 modifytime, int64 changetime, const std::string& hashdata, int64 lastused);
+	void updateFileHashCacheEntryLastUsed(int64 lastused, int64 vol, int64 frn_high, int64 frn_low, int hash_version);
+	void deleteOldFileHashCacheEntries(int64 lastused);
 	//@-SQLGenFunctionsEnd
 
 	static std::string escapeGlob(const std::string& input);
@@ -255,6 +267,10 @@ private:
 	IQuery* q_hasHardLink;
 	IQuery* q_addHardlink;
 	IQuery* q_resetAllHardlinks;
+	IQuery* q_getFileHashCacheEntry;
+	IQuery* q_addFileHashCacheEntry;
+	IQuery* q_updateFileHashCacheEntryLastUsed;
+	IQuery* q_deleteOldFileHashCacheEntries;
 	//@-SQLGenVariablesEnd
 
 	bool with_files_tmp;
@@ -62,8 +62,8 @@ extern IServer* Server;
 #include "../stringtools.h"
 #include "ServerIdentityMgr.h"
 #include "../urbackupcommon/os_functions.h"
-#ifdef _WIN32
 #include "DirectoryWatcherThread.h"
+#ifdef _WIN32
 #include "win_sysvol.h"
 #endif
 #include "InternetClient.h"
@@ -248,9 +248,7 @@ DLLEXPORT void LoadActions(IServer* pServer)
 	init_chunk_hasher();
 
 	ServerIdentityMgr::init_mutex();
-#ifdef _WIN32
 	DirectoryWatcherThread::init_mutex();
-#endif
 
 	if(getFile(pw_file).size()<5)
 	{
@@ -646,6 +644,21 @@ void update_client27_28(IDatabase* db)
 	ClientConnector::updateDefaultDirsSetting(db, true, 0);
 }
 
+void update_client29_30(IDatabase* db)
+{
+	db->Write("ALTER TABLE files ADD format INTEGER DEFAULT 0");
+	//Compact data written before the format column existed (marked with num=0)
+	db->Write("DELETE FROM files WHERE num=0 AND LENGTH(data)>0");
+}
+
+void update_client28_29(IDatabase* db)
+{
+	db->Write("CREATE TABLE filehash_cache (vol INTEGER, frn_high INTEGER, frn_low INTEGER, hash_version INTEGER,"
+		"filesize INTEGER, modifytime INTEGER, changetime INTEGER, hashdata BLOB, lastused INTEGER,"
+		"PRIMARY KEY(vol, frn_high, frn_low, hash_version) ) WITHOUT ROWID");
+	db->Write("CREATE INDEX filehash_cache_lastused_idx ON filehash_cache (lastused ASC)");
+}
+
 bool upgrade_client(void)
 {
 	IDatabase *db=Server->getDatabase(Server->getThreadID(), URBACKUPDB_CLIENT);
@@ -657,7 +670,7 @@ bool upgrade_client(void)
 		return false;
 	int ver=watoi(res_v[0]["tvalue"]);
 	int old_v;
-	int max_v = 28;
+	int max_v = 30;
 
 	if (ver > max_v)
 	{
@@ -789,6 +802,14 @@ bool upgrade_client(void)
 				update_client27_28(db);
 				++ver;
 				break;
+			case 28:
+				update_client28_29(db);
+				++ver;
+				break;
+			case 29:
+				update_client29_30(db);
+				++ver;
+				break;
 			default:
 				break;
 		}
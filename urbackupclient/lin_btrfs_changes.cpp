@@ -0,0 +1,263 @@
+#include "lin_btrfs_changes.h"
+#include "../Interface/Server.h"
+#include "../stringtools.h"
+#include "../urbackupcommon/os_functions.h"
+#include <set>
+#include <memory.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <endian.h>
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
+#endif
+
+#if defined(__linux__) && defined(BTRFS_IOC_GET_SUBVOL_INFO)
+#define HAS_BTRFS_CHANGES
+#endif
+
+namespace
+{
+#ifdef HAS_BTRFS_CHANGES
+	class ScopedFd
+	{
+	public:
+		ScopedFd(int fd)
+			: fd(fd)
+		{}
+		~ScopedFd()
+		{
+			if (fd != -1)
+				close(fd);
+		}
+		int get()
+		{
+			return fd;
+		}
+	private:
+		int fd;
+	};
+
+	bool get_inode_paths(int fd, uint64 inum, std::vector<std::string>& paths)
+	{
+		std::vector<uint64> buf(64 * 1024 / sizeof(uint64));
+
+		while (true)
+		{
+			struct btrfs_ioctl_ino_path_args args = {};
+			args.inum = inum;
+			args.size = buf.size()*sizeof(uint64);
+			args.fspath = reinterpret_cast<uintptr_t>(buf.data());
+
+			if (ioctl(fd, BTRFS_IOC_INO_PATHS, &args) != 0)
+			{
+				return false;
+			}
+
+			struct btrfs_data_container* container = reinterpret_cast<struct btrfs_data_container*>(buf.data());
+			if (container->elem_missed > 0)
+			{
+				if (buf.size() * sizeof(uint64) >= 16 * 1024 * 1024)
+				{
+					return false;
+				}
+				buf.resize(buf.size() * 4);
+				continue;
+			}
+
+			//val[i] is the offset of the path relative to val
+			const char* val_start = reinterpret_cast<const char*>(container->val);
+			for (__u32 i = 0; i < container->elem_cnt; ++i)
+			{
+				paths.push_back(val_start + container->val[i]);
+			}
+
+			return true;
+		}
+	}
+
+	void add_parent_dir(const std::string& path, std::set<std::string>& changed_dirs)
+	{
+		std::string parent = ExtractFilePath(path, "/");
+		if (parent.empty())
+		{
+			changed_dirs.insert("/");
+		}
+		else
+		{
+			changed_dirs.insert("/" + parent + "/");
+		}
+	}
+#endif
+}
+
+bool btrfs_snapshot_info(const std::string& snapshot_path, std::string& source_uuid, int64& generation)
+{
+#ifdef HAS_BTRFS_CHANGES
+	ScopedFd fd(open(snapshot_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+	if (fd.get() == -1)
+	{
+		return false;
+	}
+
+	struct btrfs_ioctl_get_subvol_info_args info = {};
+	if (ioctl(fd.get(), BTRFS_IOC_GET_SUBVOL_INFO, &info) != 0)
+	{
+		//Not btrfs or kernel older than 4.18
+		return false;
+	}
+
+	bool has_parent = false;
+	for (size_t i = 0; i < sizeof(info.parent_uuid); ++i)
+	{
+		if (info.parent_uuid[i] != 0)
+		{
+			has_parent = true;
+		}
+	}
+
+	if (!has_parent
+		|| !(info.flags & BTRFS_ROOT_SUBVOL_RDONLY))
+	{
+		return false;
+	}
+
+	source_uuid = bytesToHex(info.parent_uuid, sizeof(info.parent_uuid));
+	generation = static_cast<int64>(info.otransid);
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool btrfs_changed_dirs(const std::string& snapshot_path, int64 min_transid, std::vector<std::string>& changed_dirs)
+{
+#ifdef HAS_BTRFS_CHANGES
+	ScopedFd fd(open(snapshot_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+	if (fd.get() == -1)
+	{
+		Server->Log("Error opening btrfs snapshot \"" + snapshot_path + "\". " + os_last_error_str(), LL_ERROR);
+		return false;
+	}
+
+	//Inode items of all inodes changed since min_transid. Tree blocks not
+	//written since then are skipped by the kernel
+	struct btrfs_ioctl_search_args args = {};
+	struct btrfs_ioctl_search_key& sk = args.key;
+	sk.tree_id = 0;
+	sk.min_objectid = BTRFS_FIRST_FREE_OBJECTID;
+	sk.max_objectid = BTRFS_LAST_FREE_OBJECTID;
+	sk.min_type = BTRFS_INODE_ITEM_KEY;
+	sk.max_type = BTRFS_INODE_ITEM_KEY;
+	sk.min_offset = 0;
+	sk.max_offset = static_cast<__u64>(-1);
+	sk.min_transid = static_cast<__u64>(min_transid);
+	sk.max_transid = static_cast<__u64>(-1);
+
+	std::set<std::string> dirs;
+	int64 n_inodes = 0;
+
+	while (true)
+	{
+		sk.nr_items = 4096;
+
+		if (ioctl(fd.get(), BTRFS_IOC_TREE_SEARCH, &args) != 0)
+		{
+			Server->Log("Error searching btrfs snapshot \"" + snapshot_path + "\" for changes. " + os_last_error_str(), LL_ERROR);
+			return false;
+		}
+
+		if (sk.nr_items == 0)
+		{
+			break;
+		}
+
+		size_t off = 0;
+		for (__u32 i = 0; i < sk.nr_items; ++i)
+		{
+			struct btrfs_ioctl_search_header sh;
+			memcpy(&sh, args.buf + off, sizeof(sh));
+			off += sizeof(sh);
+			const char* item = args.buf + off;
+			off += sh.len;
+
+			sk.min_objectid = sh.objectid;
+			sk.min_type = sh.type;
+			sk.min_offset = sh.offset;
+
+			if (sh.type != BTRFS_INODE_ITEM_KEY
+				|| sh.len < sizeof(struct btrfs_inode_item))
+			{
+				continue;
+			}
+
+			struct btrfs_inode_item inode_item;
+			memcpy(&inode_item, item, sizeof(inode_item));
+
+			if (static_cast<int64>(le64toh(inode_item.transid)) < min_transid)
+			{
+				continue;
+			}
+
+			++n_inodes;
+			bool is_dir = S_ISDIR(le32toh(inode_item.mode));
+
+			if (sh.objectid == BTRFS_FIRST_FREE_OBJECTID)
+			{
+				//Root directory of the snapshot
+				dirs.insert("/");
+				continue;
+			}
+
+			std::vector<std::string> paths;
+			if (!get_inode_paths(fd.get(), sh.objectid, paths))
+			{
+				Server->Log("Error resolving paths of inode " + convert(static_cast<int64>(sh.objectid)) + " in btrfs snapshot \"" + snapshot_path + "\". " + os_last_error_str(), LL_ERROR);
+				return false;
+			}
+
+			for (size_t j = 0; j < paths.size(); ++j)
+			{
+				//Changed entry in the parent directory
+				add_parent_dir(paths[j], dirs);
+
+				if (is_dir)
+				{
+					dirs.insert("/" + paths[j] + "/");
+				}
+			}
+		}
+
+		if (sk.min_offset < static_cast<__u64>(-1))
+		{
+			++sk.min_offset;
+		}
+		else if (sk.min_type < static_cast<__u32>(static_cast<__u8>(-1)))
+		{
+			++sk.min_type;
+			sk.min_offset = 0;
+		}
+		else
+		{
+			++sk.min_objectid;
+			sk.min_type = 0;
+			sk.min_offset = 0;
+		}
+
+		if (sk.min_objectid > sk.max_objectid)
+		{
+			break;
+		}
+	}
+
+	changed_dirs.assign(dirs.begin(), dirs.end());
+
+	Server->Log("Found " + convert(n_inodes) + " changed inodes in " + convert(changed_dirs.size()) + " directories in btrfs snapshot \"" + snapshot_path + "\" since transaction " + convert(min_transid), LL_DEBUG);
+
+	return true;
+#else
+	return false;
+#endif
+}
@@ -0,0 +1,12 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "../Interface/Types.h"
+
+//UUID (hex) of the subvolume the read-only btrfs snapshot at snapshot_path was taken of and
+//the transaction id the snapshot was created in
+bool btrfs_snapshot_info(const std::string& snapshot_path, std::string& source_uuid, int64& generation);
+
+//Directories with entries changed in transaction min_transid or later. Paths are relative to
+//the snapshot root and start and end with a separator (e.g. "/" or "/home/user/")
+bool btrfs_changed_dirs(const std::string& snapshot_path, int64 min_transid, std::vector<std::string>& changed_dirs);
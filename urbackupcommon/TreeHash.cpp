@@ -5,9 +5,216 @@
 #include "../stringtools.h"
 #include <limits.h>
 #include <memory.h>
+#include <deque>
+#include "../Interface/Server.h"
+#include "../Interface/Mutex.h"
+#include "../Interface/Condition.h"
+#include "../Interface/Thread.h"
+#include "../Interface/ThreadPool.h"
+#include "os_functions.h"
+
+namespace
+{
+	const size_t treehash_max_threads = 4;
+	const size_t treehash_leaves_per_thread = 4;
+}
 
-TreeHash::TreeHash(IHashOutput* hash_output)
-	: offset(0), has_sparse(false), hash_output(hash_output), hash_pos(0)
+class TreeHashParallel
+{
+public:
+	struct SLeaf
+	{
+		std::vector<char> data;
+		_u32 size;
+		int64 end_pos;
+		bool done;
+		char hash[64];
+		std::vector<char> all_adlers;
+	};
+
+	TreeHashParallel(size_t n_threads, bool with_all_adlers)
+		: n_threads(n_threads), with_all_adlers(with_all_adlers),
+		mutex(Server->createMutex()), cond(Server->createCondition()),
+		do_quit(false), curr_leaf(NULL)
+	{
+	}
+
+	~TreeHashParallel()
+	{
+		{
+			IScopedLock lock(mutex);
+			do_quit = true;
+			cond->notify_all();
+		}
+
+		Server->getThreadPool()->waitFor(worker_tickets);
+
+		for (size_t i = 0; i < workers.size(); ++i)
+		{
+			delete workers[i];
+		}
+
+		for (std::deque<SLeaf*>::iterator it = leaves.begin(); it != leaves.end(); ++it)
+		{
+			delete *it;
+		}
+
+		for (size_t i = 0; i < free_leaves.size(); ++i)
+		{
+			delete free_leaves[i];
+		}
+
+		delete curr_leaf;
+
+		Server->destroy(cond);
+		Server->destroy(mutex);
+	}
+
+	SLeaf* currLeaf()
+	{
+		if (curr_leaf == NULL)
+		{
+			IScopedLock lock(mutex);
+			if (!free_leaves.empty())
+			{
+				curr_leaf = free_leaves.back();
+				free_leaves.pop_back();
+			}
+			else
+			{
+				curr_leaf = new SLeaf;
+				curr_leaf->data.resize(treehash_blocksize);
+				if (with_all_adlers)
+				{
+					curr_leaf->all_adlers.resize(528);
+				}
+			}
+			curr_leaf->size = 0;
+			curr_leaf->done = false;
+		}
+		return curr_leaf;
+	}
+
+	void submit(int64 end_pos)
+	{
+		if (workers.empty())
+		{
+			for (size_t i = 0; i < n_threads; ++i)
+			{
+				Worker* worker = new Worker(this);
+				workers.push_back(worker);
+				worker_tickets.push_back(Server->getThreadPool()->execute(worker, "treehash leaves"));
+			}
+		}
+
+		IScopedLock lock(mutex);
+		curr_leaf->end_pos = end_pos;
+		leaves.push_back(curr_leaf);
+		todo.push_back(curr_leaf);
+		curr_leaf = NULL;
+		cond->notify_one();
+	}
+
+	//Returns finished leaves in submission order. Waits for the oldest leaf if wait is set
+	//or if too many leaves are in flight
+	SLeaf* nextDone(bool wait)
+	{
+		IScopedLock lock(mutex);
+
+		if (leaves.empty())
+		{
+			return NULL;
+		}
+
+		if (wait
+			|| leaves.size() >= n_threads*treehash_leaves_per_thread)
+		{
+			while (!leaves.front()->done)
+			{
+				cond->wait(&lock);
+			}
+		}
+
+		if (!leaves.front()->done)
+		{
+			return NULL;
+		}
+
+		SLeaf* ret = leaves.front();
+		leaves.pop_front();
+		return ret;
+	}
+
+	void release(SLeaf* leaf)
+	{
+		IScopedLock lock(mutex);
+		free_leaves.push_back(leaf);
+	}
+
+private:
+	class Worker : public IThread
+	{
+	public:
+		Worker(TreeHashParallel* parent)
+			: parent(parent)
+		{}
+
+		void operator()()
+		{
+			parent->work();
+		}
+
+	private:
+		TreeHashParallel* parent;
+	};
+
+	void work()
+	{
+		IScopedLock lock(mutex);
+		while (true)
+		{
+			while (todo.empty() && !do_quit)
+			{
+				cond->wait(&lock);
+			}
+
+			if (todo.empty())
+			{
+				return;
+			}
+
+			SLeaf* leaf = todo.front();
+			todo.pop_front();
+
+			lock.relock(NULL);
+
+			TreeHash::hashLeaf(leaf->data.data(), leaf->size, leaf->hash,
+				leaf->all_adlers.empty() ? NULL : leaf->all_adlers.data());
+
+			lock.relock(mutex);
+			leaf->done = true;
+			cond->notify_all();
+		}
+	}
+
+	size_t n_threads;
+	bool with_all_adlers;
+	IMutex* mutex;
+	ICondition* cond;
+	bool do_quit;
+
+	SLeaf* curr_leaf;
+	std::deque<SLeaf*> leaves;
+	std::deque<SLeaf*> todo;
+	std::vector<SLeaf*> free_leaves;
+
+	std::vector<Worker*> workers;
+	std::vector<THREADPOOL_TICKET> worker_tickets;
+};
+
+TreeHash::TreeHash(IHashOutput* hash_output, size_t n_threads)
+	: offset(0), has_sparse(false), hash_output(hash_output), hash_pos(0),
+	n_threads(n_threads), parallel(NULL)
 {
 	offset = 0;
 	for (size_t i = 0; i < 12; ++i)
@@ -24,10 +231,41 @@ TreeHash::TreeHash(IHashOutput* hash_output)
 	}
 }
 
+TreeHash::~TreeHash()
+{
+	delete parallel;
+}
+
 void TreeHash::hash(const char * buf, _u32 bsize)
 {
 	assert(offset != UINT_MAX);
 
+	if (n_threads > 1)
+	{
+		if (parallel == NULL
+			&& level_hash.size() == 1
+			&& level_hash[0].empty())
+		{
+			//Hash the first leaf inline, so files smaller than a leaf
+			//do not start the workers
+			_u32 serial_size = (std::min)(bsize, treehash_blocksize - offset);
+			hash_serial(buf, serial_size);
+			buf += serial_size;
+			bsize -= serial_size;
+		}
+
+		if (bsize > 0)
+		{
+			hash_parallel(buf, bsize);
+		}
+		return;
+	}
+
+	hash_serial(buf, bsize);
+}
+
+void TreeHash::hash_serial(const char * buf, _u32 bsize)
+{
 	_u32 offset_end = offset + bsize;
 	_u32 buf_off = 0;
 	for (_u32 i = offset; i < offset_end; i += treehash_smallblock)
@@ -80,7 +318,20 @@ void TreeHash::sparse_hash(const char * buf, _u32 bsize)
 
 std::string TreeHash::finalize()
 {
-	if (offset != 0)
+	if (parallel != NULL)
+	{
+		if (offset != 0)
+		{
+			offset = 0;
+			parallel->submit(hash_pos);
+		}
+
+		consume_leaves(true);
+
+		delete parallel;
+		parallel = NULL;
+	}
+	else if (offset != 0)
 	{
 		offset = 0;
 		finalize_curr();
@@ -132,6 +383,18 @@ void TreeHash::addHash(const char* h, size_t hashed_size)
 {
 	assert(offset == 0);
 
+	if (parallel != NULL)
+	{
+		consume_leaves(true);
+	}
+
+	addLevelHash(h);
+
+	hash_pos += hashed_size;
+}
+
+void TreeHash::addLevelHash(const char* h)
+{
 	level_hash[0].push_back(std::string(h, 64));
 
 	for (size_t i = 0; i < level_hash.size(); ++i)
@@ -142,8 +405,6 @@ void TreeHash::addHash(const char* h, size_t hashed_size)
 			finalize_level(i);
 		}
 	}
-
-	hash_pos += hashed_size;
 }
 
 void TreeHash::addHashAllAdler(const char * h, size_t size, size_t hashed_size)
@@ -218,7 +479,7 @@ void TreeHash::finalize_curr()
 		hash_output->hash_output_all_adlers(hash_pos, hash_all_adlers.data(), hash_all_adlers.size());
 	}
 
-	addHash(h, 0);
+	addLevelHash(h);
 
 	md5sum.init();
 
@@ -252,4 +513,100 @@ void TreeHash::finalize_level(size_t idx)
 	level_hash[idx].clear();
 }
 
+void TreeHash::hashLeaf(const char* buf, _u32 bsize, char* hash_out, char* all_adlers)
+{
+	MD5 md5sum;
+	md5sum.update(const_cast<unsigned char*>(reinterpret_cast<const unsigned char*>(buf)), bsize);
+	md5sum.finalize();
 
+	unsigned int adlers[12];
+	for (size_t i = 0; i < 12; ++i)
+	{
+		adlers[i] = urb_adler32(0, NULL, 0);
+	}
+
+	for (_u32 i = 0; i < bsize; i += treehash_smallblock)
+	{
+		_u32 adler_idx = (i / treehash_smallblock) % 12;
+		_u32 tohash = (std::min)(treehash_smallblock, bsize - i);
+
+		if (all_adlers != NULL)
+		{
+			unsigned int adler_curr = urb_adler32(urb_adler32(0, NULL, 0), buf + i, tohash);
+			adlers[adler_idx] = urb_adler32_combine(adlers[adler_idx], adler_curr, tohash);
+			unsigned int adler_le = little_endian(adler_curr);
+			memcpy(all_adlers + 16 + (i / treehash_smallblock) * sizeof(_u32), &adler_le, sizeof(adler_le));
+		}
+		else
+		{
+			adlers[adler_idx] = urb_adler32(adlers[adler_idx], buf + i, tohash);
+		}
+	}
+
+	memcpy(hash_out, md5sum.raw_digest_int(), 16);
+
+	for (size_t j = 0; j < 12; ++j)
+	{
+		adlers[j] = little_endian(adlers[j]);
+	}
+
+	memcpy(hash_out + 16, adlers, 12 * sizeof(_u32));
+
+	if (all_adlers != NULL)
+	{
+		memcpy(all_adlers, md5sum.raw_digest_int(), 16);
+	}
+}
+
+size_t TreeHash::parallelThreads()
+{
+	return (std::min)(os_get_num_cpus(), treehash_max_threads);
+}
+
+void TreeHash::hash_parallel(const char * buf, _u32 bsize)
+{
+	if (parallel == NULL)
+	{
+		parallel = new TreeHashParallel(n_threads, hash_output != NULL);
+	}
+
+	while (bsize > 0)
+	{
+		TreeHashParallel::SLeaf* leaf = parallel->currLeaf();
+
+		_u32 tocopy = (std::min)(bsize, treehash_blocksize - offset);
+		memcpy(leaf->data.data() + offset, buf, tocopy);
+		leaf->size += tocopy;
+
+		offset += tocopy;
+		buf += tocopy;
+		bsize -= tocopy;
+		hash_pos += tocopy;
+
+		if (offset == treehash_blocksize)
+		{
+			offset = 0;
+			parallel->submit(hash_pos);
+			consume_leaves(false);
+		}
+	}
+}
+
+void TreeHash::consume_leaves(bool wait_all)
+{
+	TreeHashParallel::SLeaf* leaf;
+	while ((leaf = parallel->nextDone(wait_all)) != NULL)
+	{
+		if (hash_output != NULL)
+		{
+			//Only overwrite the adlers of this leaf (same as serial hashing)
+			size_t n_small = (leaf->size + treehash_smallblock - 1) / treehash_smallblock;
+			memcpy(hash_all_adlers.data(), leaf->all_adlers.data(), 16 + n_small * sizeof(_u32));
+			hash_output->hash_output_all_adlers(leaf->end_pos, hash_all_adlers.data(), hash_all_adlers.size());
+		}
+
+		addLevelHash(leaf->hash);
+
+		parallel->release(leaf);
+	}
+}
@@ -120,10 +120,15 @@ const unsigned int treehash_blocksize = 512 * 1024;
 const unsigned int treehash_smallblock = 4096;
 const size_t max_level_size = 16;
 
+class TreeHashParallel;
+
 class TreeHash : public IHashFunc
 {
 public:
-	TreeHash(IHashOutput* hash_output);
+	//n_threads>1 hashes 512KiB leaves on a worker pool. The first leaf is hashed inline,
+	//the pool is only created once a file has more than one leaf
+	TreeHash(IHashOutput* hash_output, size_t n_threads=1);
+	~TreeHash();
 
 	virtual void hash(const char * buf, _u32 bsize);
 
@@ -138,9 +143,20 @@ public:
 
 	static void allAdlerTo64byteHash(const char * h, size_t size, size_t hashed_size, char * byteout);
 
+	//Hashes a complete leaf (md5+adlers) independently of other leaves. all_adlers is optional (528 bytes)
+	static void hashLeaf(const char* buf, _u32 bsize, char* hash_out, char* all_adlers);
+
+	//Number of threads to use for hashing large files
+	static size_t parallelThreads();
+
 private:
 	void finalize_curr();
 	void finalize_level(size_t idx);
+	void addLevelHash(const char* h);
+
+	void hash_serial(const char* buf, _u32 bsize);
+	void hash_parallel(const char* buf, _u32 bsize);
+	void consume_leaves(bool wait_all);
 
 	bool has_sparse;
 	sha512_ctx sparse_ctx;
@@ -155,4 +171,7 @@ private:
 	int64 hash_pos;
 
 	std::vector<std::vector<std::string> > level_hash;
+
+	size_t n_threads;
+	TreeHashParallel* parallel;
 };
\ No newline at end of file
@@ -55,8 +55,15 @@ namespace
 	const unsigned int DISCOVERY_TIMEOUT=1000; //1sec
 #endif
 
-	const size_t maxQueuedFiles = 3000;
-	const size_t queuedFilesLow = 100;
+	const size_t initialQueuedFiles = 3000;
+	const size_t maxQueuedFiles = 100000;
+	const size_t minQueuedFiles = 100;
+	//Limits the file data requested but not yet received
+	const int64 maxQueuedBytes = 1024LL * 1024 * 1024;
+	//Limits the memory used by the names of requested files
+	const size_t maxQueuedMemory = 32 * 1024 * 1024;
+	const int64 queueWindowInterval = 1000;
+	const size_t queueWindowSamples = 10;
 	const char* multicast_group = "ff12::f894:d:dd00:ef91";
 }
 
@@ -100,7 +107,8 @@ FileClient::FileClient(bool enable_find_servers, std::string identity, int proto
 	identity(identity), received_data_bytes(0), queue_callback(NULL), dl_off(0),
 	last_transferred_bytes(0), last_progress_log(0), progress_log_callback(NULL), needs_flush(false),
 	real_transferred_bytes(0), is_downloading(false), sparse_extends_f(NULL), sparse_bytes(0),
-	reconnect_tries(50)
+	reconnect_tries(50), queue_window(initialQueuedFiles), queued_memory(0), queue_interval_starttime(0),
+	queue_interval_bytes(0), queue_interval_files(0), queue_interval_min_latency(-1)
 {
 	memset(buffer, 0, BUFFERSIZE_UDP);
 
@@ -927,6 +935,7 @@ bool FileClient::Reconnect(void)
 {
 	dl_off=0;
 	queued.clear();
+	queued_memory=0;
 	if(queue_callback!=NULL)
 	{
 		queue_callback->resetQueueFull();
@@ -1002,6 +1011,9 @@ bool FileClient::Reconnect(void)
 		protocol_version=1;
 	}
 
+	int64 request_time;
+	int64 request_transferred;
+
 	if(queued.empty())
 	{
 		CWData data;
@@ -1043,12 +1055,17 @@ bool FileClient::Reconnect(void)
 				return ERR_TIMEOUT;
 			}
 		}
+
+		request_time = Server->getTimeMS();
+		request_transferred = getTransferredBytes();
 	}
 	else
 	{
 		assert(queued.front().fn == remotefn);
 		assert(!queued.front().finish_script);
-		queued.pop_front();
+		request_time = queued.front().request_time;
+		request_transferred = queued.front().request_transferred;
+		popQueued();
 	}
 
 	_u64 filesize=0;
@@ -1222,6 +1239,8 @@ bool FileClient::Reconnect(void)
 				}
 
 				starttime=Server->getTimeMS();
+				request_time=starttime;
+				request_transferred=getTransferredBytes();
 
 				if(protocol_version>0)
 					firstpacket=true;
@@ -1241,6 +1260,12 @@ bool FileClient::Reconnect(void)
             if( firstpacket==true)
             {
 				firstpacket=false;
+
+				if(!is_script)
+				{
+					addQueueLatencySample(request_time, request_transferred);
+				}
+
 				if(PID==ID_COULDNT_OPEN)
 				{
 					if(rc>1)
@@ -1668,6 +1693,8 @@ bool FileClient::Reconnect(void)
 					}
 				}
 				starttime=Server->getTimeMS();
+				request_time=starttime;
+				request_transferred=getTransferredBytes();
 
 				if(protocol_version>0)
 					firstpacket=true;
@@ -1765,7 +1792,10 @@ _u32 FileClient::fillQueue()
 		return ERR_SUCCESS;
 	}
 
-	if(queued.size()>queuedFilesLow)
+	updateQueueWindow();
+
+	if(queued.size()>queue_window-queue_window/4
+		|| queued_memory>=maxQueuedMemory)
 	{
 		if (needs_flush)
 		{
@@ -1781,7 +1811,8 @@ _u32 FileClient::fillQueue()
 	std::vector<SQueueItem> queued_files;
 	int64 queue_starttime = Server->getTimeMS();
 
-	while(queued.size()<maxQueuedFiles
+	while(queued.size()<queue_window
+		&& queued_memory<maxQueuedMemory
 		&& Server->getTimeMS()-queue_starttime<10000)
 	{
 		if(!tcpsock->isWritable())
@@ -1865,8 +1896,10 @@ _u32 FileClient::fillQueue()
 			return ERR_TIMEOUT;
 		}
 
-		queued.push_back(SQueueItem(queue_fn, finish_script));
-		queued_files.push_back(SQueueItem(queue_fn, finish_script));
+		SQueueItem item(queue_fn, finish_script, Server->getTimeMS(), getTransferredBytes());
+		queued.push_back(item);
+		queued_memory += queuedItemMemory(item);
+		queued_files.push_back(item);
 		needs_flush=true;
 	}
 
@@ -1891,6 +1924,137 @@ _u32 FileClient::fillQueue()
 	return ERR_SUCCESS;
 }
 
+size_t FileClient::queuedItemMemory(const SQueueItem& item)
+{
+	return sizeof(SQueueItem) + item.fn.capacity();
+}
+
+void FileClient::popQueued()
+{
+	queued_memory -= (std::min)(queued_memory, queuedItemMemory(queued.front()));
+	queued.pop_front();
+}
+
+void FileClient::updateQueueWindow()
+{
+	int64 ctime = Server->getTimeMS();
+
+	if(queue_interval_starttime==0)
+	{
+		queue_interval_starttime = ctime;
+		queue_interval_bytes = getTransferredBytes();
+		return;
+	}
+
+	int64 passed = ctime - queue_interval_starttime;
+	if(passed<queueWindowInterval)
+	{
+		return;
+	}
+
+	int64 transferred = getTransferredBytes();
+	int64 new_bytes = transferred - queue_interval_bytes;
+
+	//Bottleneck bandwidth is the maximum delivery rate of the last intervals,
+	//round trip time the minimum request latency
+	queue_rate_samples.push_back(static_cast<double>(new_bytes) / passed);
+	if(queue_rate_samples.size()>queueWindowSamples)
+	{
+		queue_rate_samples.pop_front();
+	}
+
+	if(queue_interval_min_latency!=-1)
+	{
+		queue_latency_samples.push_back(queue_interval_min_latency);
+		if(queue_latency_samples.size()>queueWindowSamples)
+		{
+			queue_latency_samples.pop_front();
+		}
+	}
+
+	double bandwidth_bpms = *std::max_element(queue_rate_samples.begin(), queue_rate_samples.end());
+	int64 rtt_ms = -1;
+	if(!queue_latency_samples.empty())
+	{
+		rtt_ms = *std::min_element(queue_latency_samples.begin(), queue_latency_samples.end());
+	}
+
+	int64 avg_file_bytes = queue_stats.avg_file_bytes;
+	if(queue_interval_files>0)
+	{
+		int64 interval_file_bytes = (std::max)(static_cast<int64>(1), new_bytes / queue_interval_files);
+		if(avg_file_bytes==0)
+		{
+			avg_file_bytes = interval_file_bytes;
+		}
+		else
+		{
+			avg_file_bytes = (3*avg_file_bytes + interval_file_bytes) / 4;
+		}
+	}
+
+	if(rtt_ms>0 && bandwidth_bpms>0 && avg_file_bytes>0)
+	{
+		//Keep twice the bandwidth-delay product in flight, but not more
+		//than maxQueuedBytes of expected file data
+		double bdp_bytes = (std::min)(2 * bandwidth_bpms * rtt_ms, static_cast<double>(maxQueuedBytes));
+		double bdp_files = bdp_bytes / avg_file_bytes;
+		if(bdp_files>=maxQueuedFiles)
+		{
+			queue_window = maxQueuedFiles;
+		}
+		else
+		{
+			queue_window = (std::max)(minQueuedFiles, static_cast<size_t>(bdp_files) + 1);
+		}
+	}
+
+	{
+		IScopedLock lock(mutex);
+		queue_stats.rtt_ms = rtt_ms;
+		queue_stats.bandwidth_bpms = bandwidth_bpms;
+		queue_stats.avg_file_bytes = avg_file_bytes;
+		queue_stats.window = queue_window;
+		queue_stats.in_flight = queued.size();
+	}
+
+	queue_interval_starttime = ctime;
+	queue_interval_bytes = transferred;
+	queue_interval_files = 0;
+	queue_interval_min_latency = -1;
+}
+
+void FileClient::addQueueLatencySample(int64 request_time, int64 request_transferred)
+{
+	int64 latency = Server->getTimeMS() - request_time;
+
+	if(!queue_rate_samples.empty())
+	{
+		//Subtract the time it took to receive the files queued in front of this one
+		double bandwidth_bpms = *std::max_element(queue_rate_samples.begin(), queue_rate_samples.end());
+		if(bandwidth_bpms>0)
+		{
+			latency -= static_cast<int64>((getTransferredBytes() - request_transferred) / bandwidth_bpms);
+		}
+	}
+
+	latency = (std::max)(static_cast<int64>(1), latency);
+
+	if(queue_interval_min_latency==-1
+		|| latency<queue_interval_min_latency)
+	{
+		queue_interval_min_latency = latency;
+	}
+
+	++queue_interval_files;
+}
+
+FileClient::SQueueStats FileClient::getQueueStats()
+{
+	IScopedLock lock(mutex);
+	return queue_stats;
+}
+
 void FileClient::logProgress(const std::string& remotefn, _u64 filesize, _u64 received)
 {
 	int64 ct = Server->getTimeMS();
@@ -2037,7 +2201,7 @@ void FileClient::setNoFreeSpaceCallback(FileClient::NoFreeSpaceCallback * cb)
 	{
 		assert(queued.front().fn == remotefn);
 		assert(!queued.front().finish_script);
-		queued.pop_front();
+		popQueued();
 	}
 
 
@@ -2404,7 +2568,7 @@ _u32 FileClient::FinishScript(std::string remotefn)
 	{
 		assert(queued.front().fn == remotefn);
 		assert(queued.front().finish_script);
-		queued.pop_front();
+		popQueued();
 	}
 
 	int tries=20;
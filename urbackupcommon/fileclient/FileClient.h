@@ -78,6 +78,20 @@ public:
 			FileClient::NoFreeSpaceCallback *nofreespace_callback=NULL);
         ~FileClient(void);
 
+		struct SQueueStats
+		{
+			SQueueStats()
+				: rtt_ms(-1), bandwidth_bpms(0), avg_file_bytes(0),
+				window(0), in_flight(0)
+			{}
+
+			int64 rtt_ms;
+			double bandwidth_bpms;
+			int64 avg_file_bytes;
+			size_t window;
+			size_t in_flight;
+		};
+
 		struct SAddrHint
 		{
 			SAddrHint()
@@ -162,6 +176,8 @@ public:
 
 		void setQueueCallback(FileClient::QueueCallback* cb);
 
+		SQueueStats getQueueStats();
+
 		void setProgressLogCallback(FileClient::ProgressLogCallback* cb);
 
 		FileClient::ProgressLogCallback* getProgressLogCallback();
@@ -191,6 +207,10 @@ private:
 
 		_u32 fillQueue();
 
+		void updateQueueWindow();
+
+		void addQueueLatencySample(int64 request_time, int64 request_transferred);
+
 		void logProgress(const std::string& remotefn, _u64 filesize, _u64 received);
 
 		bool alreadyHasAddrv4(sockaddr_in addr);
@@ -263,18 +283,34 @@ private:
 
 		struct SQueueItem
 		{
-			SQueueItem(std::string fn, bool finish_script)
-				: fn(fn), finish_script(finish_script)
+			SQueueItem(std::string fn, bool finish_script, int64 request_time, int64 request_transferred)
+				: fn(fn), finish_script(finish_script),
+				request_time(request_time), request_transferred(request_transferred)
 			{
 
 			}
 
 			std::string fn;
 			bool finish_script;
+			int64 request_time;
+			int64 request_transferred;
 		};
 
+		size_t queuedItemMemory(const SQueueItem& item);
+		void popQueued();
+
 		std::deque<SQueueItem> queued;
 
+		size_t queue_window;
+		size_t queued_memory;
+		int64 queue_interval_starttime;
+		int64 queue_interval_bytes;
+		int64 queue_interval_files;
+		int64 queue_interval_min_latency;
+		std::deque<double> queue_rate_samples;
+		std::deque<int64> queue_latency_samples;
+		SQueueStats queue_stats;
+
 		char dl_buf[BUFFERSIZE];
 		size_t dl_off;
 
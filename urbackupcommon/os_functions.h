@@ -46,6 +46,28 @@ SFile getFileMetadataWin(const std::string &path, bool with_usn);
 
 SFile getFileMetadata(const std::string &path);
 
+struct SFileId
+{
+	SFileId() :
+		vol_id(0), frn_high(0), frn_low(0),
+		size(0), last_modified(0), change_time(0)
+	{
+
+	}
+
+	int64 vol_id;
+	int64 frn_high;
+	int64 frn_low;
+	int64 size;
+	//Times in full resolution of the file system (ns on Linux, 100ns on Windows)
+	int64 last_modified;
+	//Changed on every write and metadata change (ctime, NTFS ChangeTime)
+	int64 change_time;
+};
+
+//Fails on file systems without unique, stable file ids (e.g. FAT or ReFS on Windows)
+bool os_get_file_id(const std::string &path, SFileId& file_id);
+
 bool removeFile(const std::string &path);
 
 bool moveFile(const std::string &src, const std::string &dst);
@@ -125,6 +147,15 @@ bool copy_file(const std::string &src, const std::string &dst, bool flush = fals
 class IFile;
 bool copy_file(IFile *fsrc, IFile *fdst, std::string* error_str = NULL);
 
+class IFsFile;
+//Shares the range of src with dst if the data is identical (checked by the file system).
+//Returns the number of bytes shared or -1 if not supported
+int64 os_dedupe_range(IFsFile* src, int64 src_offset, IFsFile* dst, int64 dst_offset, int64 length);
+
+//Shares the range of src with dst without comparing data (reflink). Offsets and length
+//have to be aligned to the file system block size. Returns the number of bytes shared or -1 on error
+int64 os_clone_range(IFsFile* src, int64 src_offset, IFsFile* dst, int64 dst_offset, int64 length);
+
 bool os_path_absolute(const std::string& path);
 
 bool os_sync(const std::string& path);
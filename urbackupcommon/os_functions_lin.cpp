@@ -44,6 +44,7 @@
 #include <sys/time.h>
 #include <limits.h>
 #include "../config.h"
+#include "../Interface/File.h"
 #ifdef __linux__
 #include <sys/resource.h>
 #include <sys/syscall.h>
@@ -54,6 +55,8 @@
 #if defined(__FreeBSD__) || defined(__APPLE__)
 #define lstat64 lstat
 #define stat64 stat
+#define fstat64 fstat
+#define fstatat64 fstatat
 #define statvfs64 statvfs
 #define open64 open
 #define readdir64 readdir
@@ -88,7 +91,10 @@ std::vector<SFile> getFiles(const std::string &path, bool *has_error, bool ignor
 	std::vector<SFile> tmp;
 	DIR *dp;
     struct dirent64 *dirp;
-    if((dp  = opendir(upath.c_str())) == NULL)
+	//Entries are stat'ed relative to the directory fd, so the path is only resolved once
+	int dir_fd = open(upath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(dir_fd==-1
+		|| (dp = fdopendir(dir_fd)) == NULL)
 	{
 		if(has_error!=NULL)
 		{
@@ -97,6 +103,10 @@ std::vector<SFile> getFiles(const std::string &path, bool *has_error, bool ignor
 		std::string errmsg;
 		int err = os_last_error(errmsg);
 		Log("Cannot open \""+path+"\": "+errmsg+" ("+convert(err)+")", LL_ERROR);
+		if(dir_fd!=-1)
+		{
+			close(dir_fd);
+		}
         return tmp;
     }
 	
@@ -105,7 +115,7 @@ std::vector<SFile> getFiles(const std::string &path, bool *has_error, bool ignor
 	if(ignore_other_fs)
 	{
 		struct stat64 f_info;
-		int rc=lstat64(upath.c_str(), &f_info);
+		int rc=fstat64(dir_fd, &f_info);
 		if(rc==0)
 		{
 			has_parent_dev_id = true;
@@ -127,7 +137,7 @@ std::vector<SFile> getFiles(const std::string &path, bool *has_error, bool ignor
 		f.isdir=(dirp->d_type==DT_DIR);
 		
 		struct stat64 f_info;
-		int rc=lstat64((upath+dirp->d_name).c_str(), &f_info);
+		int rc=fstatat64(dir_fd, dirp->d_name, &f_info, AT_SYMLINK_NOFOLLOW);
 		if(rc==0)
 		{	
 			f.isdir = S_ISDIR(f_info.st_mode);
@@ -143,7 +153,7 @@ std::vector<SFile> getFiles(const std::string &path, bool *has_error, bool ignor
 				f.issym=true;
 				f.isspecialf=true;
 				struct stat64 l_info;
-				int rc2 = stat64((upath+dirp->d_name).c_str(), &l_info);
+				int rc2 = fstatat64(dir_fd, dirp->d_name, &l_info, 0);
 				
 				if(rc2==0)
 				{
@@ -1024,6 +1034,31 @@ SFile getFileMetadata( const std::string &path )
 	}
 }
 
+bool os_get_file_id(const std::string &path, SFileId& file_id)
+{
+	struct stat64 f_info;
+	int rc=stat64((path).c_str(), &f_info);
+
+	if(rc!=0)
+	{
+		return false;
+	}
+
+	file_id.vol_id = static_cast<int64>(f_info.st_dev);
+	file_id.frn_high = 0;
+	file_id.frn_low = static_cast<int64>(f_info.st_ino);
+	file_id.size = f_info.st_size;
+#ifdef __APPLE__
+	file_id.last_modified = static_cast<int64>(f_info.st_mtimespec.tv_sec)*1000000000LL + f_info.st_mtimespec.tv_nsec;
+	file_id.change_time = static_cast<int64>(f_info.st_ctimespec.tv_sec)*1000000000LL + f_info.st_ctimespec.tv_nsec;
+#else
+	file_id.last_modified = static_cast<int64>(f_info.st_mtim.tv_sec)*1000000000LL + f_info.st_mtim.tv_nsec;
+	file_id.change_time = static_cast<int64>(f_info.st_ctim.tv_sec)*1000000000LL + f_info.st_ctim.tv_nsec;
+#endif
+
+	return true;
+}
+
 std::string os_get_final_path(std::string path)
 {
     char* retptr = realpath((path).c_str(), NULL);
@@ -1397,3 +1432,60 @@ int os_system(const std::string& cmd)
 	return system(cmd.c_str());
 #endif
 }
+
+int64 os_dedupe_range(IFsFile* src, int64 src_offset, IFsFile* dst, int64 dst_offset, int64 length)
+{
+#ifdef FIDEDUPERANGE
+	std::vector<char> buf(sizeof(struct file_dedupe_range) + sizeof(struct file_dedupe_range_info));
+	struct file_dedupe_range* range = reinterpret_cast<struct file_dedupe_range*>(buf.data());
+	struct file_dedupe_range_info* info = range->info;
+
+	int64 deduped = 0;
+	while (deduped < length)
+	{
+		memset(buf.data(), 0, buf.size());
+		range->src_offset = src_offset + deduped;
+		range->src_length = length - deduped;
+		range->dest_count = 1;
+		info->dest_fd = dst->getOsHandle();
+		info->dest_offset = dst_offset + deduped;
+
+		if (ioctl(src->getOsHandle(), FIDEDUPERANGE, range) != 0)
+		{
+			return deduped > 0 ? deduped : -1;
+		}
+
+		if (info->status != FILE_DEDUPE_RANGE_SAME
+			|| info->bytes_deduped == 0)
+		{
+			return deduped;
+		}
+
+		deduped += info->bytes_deduped;
+	}
+
+	return deduped;
+#else
+	return -1;
+#endif
+}
+
+int64 os_clone_range(IFsFile* src, int64 src_offset, IFsFile* dst, int64 dst_offset, int64 length)
+{
+#ifdef FICLONERANGE
+	struct file_clone_range range;
+	range.src_fd = src->getOsHandle();
+	range.src_offset = src_offset;
+	range.src_length = length;
+	range.dest_offset = dst_offset;
+
+	if (ioctl(dst->getOsHandle(), FICLONERANGE, &range) != 0)
+	{
+		return -1;
+	}
+
+	return length;
+#else
+	return -1;
+#endif
+}
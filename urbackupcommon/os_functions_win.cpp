@@ -475,6 +475,50 @@ SFile getFileMetadata( const std::string &path )
 	return getFileMetadataWin(path, false);
 }
 
+bool os_get_file_id(const std::string &path, SFileId& file_id)
+{
+	HANDLE hFile = CreateFileW(ConvertToWchar(path).c_str(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+		OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	//File ids on FAT/exFAT are not stable and 64-bit ids on ReFS are truncated
+	wchar_t fs_name[MAX_PATH + 1];
+	BY_HANDLE_FILE_INFORMATION fileInformation;
+	FILE_BASIC_INFO basic_info;
+	BOOL b = GetVolumeInformationByHandleW(hFile, NULL, 0, NULL, NULL, NULL, fs_name, MAX_PATH + 1)
+		&& _wcsicmp(fs_name, L"NTFS") == 0
+		&& GetFileInformationByHandle(hFile, &fileInformation)
+		&& GetFileInformationByHandleEx(hFile, FileBasicInfo, &basic_info, sizeof(basic_info));
+
+	CloseHandle(hFile);
+
+	if (!b)
+	{
+		return false;
+	}
+
+	file_id.vol_id = fileInformation.dwVolumeSerialNumber;
+	file_id.frn_high = fileInformation.nFileIndexHigh;
+	file_id.frn_low = fileInformation.nFileIndexLow;
+
+	LARGE_INTEGER size;
+	size.HighPart = fileInformation.nFileSizeHigh;
+	size.LowPart = fileInformation.nFileSizeLow;
+	file_id.size = size.QuadPart;
+
+	LARGE_INTEGER lwt;
+	lwt.HighPart = fileInformation.ftLastWriteTime.dwHighDateTime;
+	lwt.LowPart = fileInformation.ftLastWriteTime.dwLowDateTime;
+	file_id.last_modified = lwt.QuadPart;
+	file_id.change_time = basic_info.ChangeTime.QuadPart;
+
+	return true;
+}
+
 bool removeFile(const std::string &path)
 {
 	return _unlink(path.c_str())==0;
@@ -1819,3 +1863,34 @@ int os_system(const std::string & cmd)
 {
 	return system(cmd.c_str());
 }
+
+int64 os_dedupe_range(IFsFile* src, int64 src_offset, IFsFile* dst, int64 dst_offset, int64 length)
+{
+	//FSCTL_DUPLICATE_EXTENTS_TO_FILE does not compare the data
+	return -1;
+}
+
+int64 os_clone_range(IFsFile* src, int64 src_offset, IFsFile* dst, int64 dst_offset, int64 length)
+{
+	//FSCTL_DUPLICATE_EXTENTS_TO_FILE does not extend the destination file
+	if (dst->Size() < dst_offset + length
+		&& !dst->Resize(dst_offset + length, false))
+	{
+		return -1;
+	}
+
+	reflink::DUPLICATE_EXTENTS_DATA reflink_data;
+	reflink_data.FileHandle = src->getOsHandle();
+	reflink_data.SourceFileOffset.QuadPart = src_offset;
+	reflink_data.TargetFileOffset.QuadPart = dst_offset;
+	reflink_data.ByteCount.QuadPart = length;
+
+	DWORD ret_bytes;
+	if (!DeviceIoControl(dst->getOsHandle(), reflink::LOCAL_FSCTL_DUPLICATE_EXTENTS_TO_FILE,
+		&reflink_data, sizeof(reflink_data), NULL, 0, &ret_bytes, NULL))
+	{
+		return -1;
+	}
+
+	return length;
+}
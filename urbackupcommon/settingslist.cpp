@@ -90,6 +90,8 @@ std::vector<std::string> getSettingsList(void)
 	ret.push_back("internet_full_image_style");
 	ret.push_back("create_linked_user_views");
 	ret.push_back("max_running_jobs_per_client");
+	ret.push_back("file_download_connections");
+	ret.push_back("file_download_max_held_back");
 	ret.push_back("cbt_volumes");
 	ret.push_back("cbt_crash_persistent_volumes");
 	ret.push_back("ignore_disk_errors");
@@ -179,6 +181,8 @@ std::vector<std::string> getOnlyServerClientSettingsList(void)
 	ret.push_back("internet_full_image_style");
 	ret.push_back("create_linked_user_views");
 	ret.push_back("max_running_jobs_per_client");
+	ret.push_back("file_download_connections");
+	ret.push_back("file_download_max_held_back");
 	ret.push_back("cbt_volumes");
 	ret.push_back("cbt_crash_persistent_volumes");
 	ret.push_back("ignore_disk_errors");
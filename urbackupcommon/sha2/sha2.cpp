@@ -37,6 +37,14 @@
 
 #ifdef DO_NOT_USE_CRYPTOPP_SHA
 
+#if !defined(SHA2_NO_X86_ACCEL) && (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#include <immintrin.h>
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -337,6 +345,126 @@ const static sha2_word64 sha512_initial_hash_value[8] = {
 */
 static const char *sha2_hex_digits = "0123456789abcdef";
 
+/*** x86 SHA-NI acceleration *****************************************/
+/*
+* SHA-256 blocks are processed with the SHA extensions (SHA-NI) if the
+* CPU supports them. Selection happens at runtime; everything falls
+* back to the portable transforms above. Define SHA2_NO_X86_ACCEL to
+* disable.
+*/
+#if !defined(SHA2_NO_X86_ACCEL) && (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86))
+#	if defined(_MSC_VER) && _MSC_VER >= 1900
+#		define SHA2_X86_ACCEL
+#		define SHA2_TARGET_SHANI
+#	elif defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5)
+#		define SHA2_X86_ACCEL
+#		define SHA2_TARGET_SHANI __attribute__((target("sha,sse4.1,ssse3")))
+#	endif
+#endif
+
+#ifdef SHA2_X86_ACCEL
+
+#define SHA2_ACCEL_UNKNOWN 0
+#define SHA2_ACCEL_SHANI 1
+
+/* Detection is idempotent, so a race on first use is harmless */
+static volatile int sha2_accel_features = -1;
+
+static int sha2_detect_accel(void) {
+	int features = 0;
+	unsigned int regs[4];
+	unsigned int max_leaf;
+
+#ifdef _MSC_VER
+	__cpuid((int*)regs, 0);
+	max_leaf = regs[0];
+	__cpuid((int*)regs, 1);
+	if (max_leaf >= 7) {
+		unsigned int ssse3_sse41 = (regs[2] & (1 << 9)) && (regs[2] & (1 << 19));
+		__cpuidex((int*)regs, 7, 0);
+#else
+	__cpuid(0, regs[0], regs[1], regs[2], regs[3]);
+	max_leaf = regs[0];
+	__cpuid(1, regs[0], regs[1], regs[2], regs[3]);
+	if (max_leaf >= 7) {
+		unsigned int ssse3_sse41 = (regs[2] & (1 << 9)) && (regs[2] & (1 << 19));
+		__cpuid_count(7, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+		if (ssse3_sse41 && (regs[1] & (1 << 29)) != 0) {
+			features |= SHA2_ACCEL_SHANI;
+		}
+	}
+
+	return features;
+}
+
+static int sha2_accel(int feature) {
+	int features = sha2_accel_features;
+	if (features == -1) {
+		features = sha2_detect_accel();
+		sha2_accel_features = features;
+	}
+	return (features & feature) != 0;
+}
+
+static SHA2_TARGET_SHANI void SHA256_Transform_shani(sha2_word32 state[8], const sha2_byte* data, size_t blocks) {
+	__m128i STATE0, STATE1, MSG, TMP, ABEF_SAVE, CDGH_SAVE;
+	__m128i MSGS[4];
+	const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	int g;
+
+	TMP = _mm_loadu_si128((const __m128i*)&state[0]);
+	STATE1 = _mm_loadu_si128((const __m128i*)&state[4]);
+
+	TMP = _mm_shuffle_epi32(TMP, 0xB1);          /* CDAB */
+	STATE1 = _mm_shuffle_epi32(STATE1, 0x1B);    /* EFGH */
+	STATE0 = _mm_alignr_epi8(TMP, STATE1, 8);    /* ABEF */
+	STATE1 = _mm_blend_epi16(STATE1, TMP, 0xF0); /* CDGH */
+
+	while (blocks--) {
+		ABEF_SAVE = STATE0;
+		CDGH_SAVE = STATE1;
+
+		/* 16 groups of four rounds, message schedule is computed in MSGS[] ring */
+		for (g = 0; g < 16; ++g) {
+			if (g < 4) {
+				MSGS[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + g * 16)), MASK);
+			}
+
+			MSG = _mm_add_epi32(MSGS[g & 3], _mm_loadu_si128((const __m128i*)&K256[g * 4]));
+			STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG);
+
+			if (g >= 3 && g <= 14) {
+				TMP = _mm_alignr_epi8(MSGS[g & 3], MSGS[(g + 3) & 3], 4);
+				MSGS[(g + 1) & 3] = _mm_add_epi32(MSGS[(g + 1) & 3], TMP);
+				MSGS[(g + 1) & 3] = _mm_sha256msg2_epu32(MSGS[(g + 1) & 3], MSGS[g & 3]);
+			}
+
+			MSG = _mm_shuffle_epi32(MSG, 0x0E);
+			STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MSG);
+
+			if (g >= 1 && g <= 12) {
+				MSGS[(g + 3) & 3] = _mm_sha256msg1_epu32(MSGS[(g + 3) & 3], MSGS[g & 3]);
+			}
+		}
+
+		STATE0 = _mm_add_epi32(STATE0, ABEF_SAVE);
+		STATE1 = _mm_add_epi32(STATE1, CDGH_SAVE);
+
+		data += SHA256_BLOCK_LENGTH;
+	}
+
+	TMP = _mm_shuffle_epi32(STATE0, 0x1B);       /* FEBA */
+	STATE1 = _mm_shuffle_epi32(STATE1, 0xB1);    /* DCHG */
+	STATE0 = _mm_blend_epi16(TMP, STATE1, 0xF0); /* DCBA */
+	STATE1 = _mm_alignr_epi8(STATE1, TMP, 8);    /* ABEF */
+
+	_mm_storeu_si128((__m128i*)&state[0], STATE0);
+	_mm_storeu_si128((__m128i*)&state[4], STATE1);
+}
+
+#endif /* SHA2_X86_ACCEL */
+
 
 /*** SHA-256: *********************************************************/
 void SHA256_Init(SHA256_CTX* context) {
@@ -390,6 +518,13 @@ void SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
 	sha2_word32	T1, *W256;
 	int		j;
 
+#ifdef SHA2_X86_ACCEL
+	if (sha2_accel(SHA2_ACCEL_SHANI)) {
+		SHA256_Transform_shani(context->state, (const sha2_byte*)data, 1);
+		return;
+	}
+#endif
+
 	W256 = (sha2_word32*)context->buffer;
 
 	/* Initialize registers with the prev. intermediate value */
@@ -448,6 +583,13 @@ void SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
 	sha2_word32	T1, T2, *W256;
 	int		j;
 
+#ifdef SHA2_X86_ACCEL
+	if (sha2_accel(SHA2_ACCEL_SHANI)) {
+		SHA256_Transform_shani(context->state, (const sha2_byte*)data, 1);
+		return;
+	}
+#endif
+
 	W256 = (sha2_word32*)context->buffer;
 
 	/* Initialize registers with the prev. intermediate value */
@@ -556,6 +698,15 @@ void SHA256_Update(SHA256_CTX* context, const sha2_byte *data, size_t len) {
 			return;
 		}
 	}
+#ifdef SHA2_X86_ACCEL
+	if (len >= SHA256_BLOCK_LENGTH && sha2_accel(SHA2_ACCEL_SHANI)) {
+		size_t blocks = len / SHA256_BLOCK_LENGTH;
+		SHA256_Transform_shani(context->state, data, blocks);
+		context->bitcount += (sha2_word64)(blocks * SHA256_BLOCK_LENGTH) << 3;
+		len -= blocks * SHA256_BLOCK_LENGTH;
+		data += blocks * SHA256_BLOCK_LENGTH;
+	}
+#endif
 	while (len >= SHA256_BLOCK_LENGTH) {
 		/* Process as many complete blocks as we can */
 		SHA256_Transform(context, (sha2_word32*)data);
@@ -1178,5 +1329,4 @@ void sha256(const unsigned char *message, unsigned int len, unsigned char *diges
 	sha256_update(&ctx, message, len);
 	sha256_final(&ctx, digest);
 }
-
 #endif //DO_NOT_USE_CRYPTOPP_SHA
\ No newline at end of file
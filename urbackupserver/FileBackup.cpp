@@ -707,7 +707,7 @@ _i64 FileBackup::getIncrementalSize(IFile *f, const std::vector<size_t> &diffs,
 	return rsize;
 }
 
-void FileBackup::calculateDownloadSpeed(int64 ctime, FileClient & fc, FileClientChunked * fc_chunked)
+void FileBackup::calculateDownloadSpeed(int64 ctime, FileClient & fc, const std::vector<FileClientChunked*>& fc_chunked)
 {
 	if (speed_set_time == 0)
 	{
@@ -716,7 +716,11 @@ void FileBackup::calculateDownloadSpeed(int64 ctime, FileClient & fc, FileClient
 
 	if (ctime - speed_set_time>10000)
 	{
-		int64 received_data_bytes = fc.getTransferredBytes() + (fc_chunked != NULL ? fc_chunked->getTransferredBytes() : 0);
+		int64 received_data_bytes = fc.getTransferredBytes();
+		for (size_t i = 0; i < fc_chunked.size(); ++i)
+		{
+			received_data_bytes += fc_chunked[i]->getTransferredBytes();
+		}
 
 		int64 new_bytes = received_data_bytes - last_speed_received_bytes;
 		int64 passed_time = ctime - speed_set_time;
@@ -733,17 +737,25 @@ void FileBackup::calculateDownloadSpeed(int64 ctime, FileClient & fc, FileClient
 					speed_bpms);
 			}
 
+			FileClient::SQueueStats queue_stats = fc.getQueueStats();
+			ServerStatus::setProcessTransferStats(clientname, status_id,
+				queue_stats.rtt_ms, queue_stats.window, queue_stats.in_flight);
+
 			last_speed_received_bytes = received_data_bytes;
 		}
 	}
 }
 
-void FileBackup::calculateEtaFileBackup( int64 &last_eta_update, int64& eta_set_time, int64 ctime, FileClient &fc, FileClientChunked* fc_chunked,
+void FileBackup::calculateEtaFileBackup( int64 &last_eta_update, int64& eta_set_time, int64 ctime, FileClient &fc, const std::vector<FileClientChunked*>& fc_chunked,
 	int64 linked_bytes, int64 &last_eta_received_bytes, double &eta_estimated_speed, _i64 files_size )
 {
 	last_eta_update=ctime;
 
-	int64 received_data_bytes = fc.getReceivedDataBytes(true) + (fc_chunked?fc_chunked->getReceivedDataBytes(true):0) + linked_bytes;
+	int64 received_data_bytes = fc.getReceivedDataBytes(true) + linked_bytes;
+	for (size_t i = 0; i < fc_chunked.size(); ++i)
+	{
+		received_data_bytes += fc_chunked[i]->getReceivedDataBytes(true);
+	}
 
 	int64 new_bytes =  received_data_bytes - last_eta_received_bytes;
 	int64 passed_time = Server->getTimeMS() - eta_set_time;
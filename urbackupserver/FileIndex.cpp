@@ -19,6 +19,9 @@
 #include "FileIndex.h"
 #include "../Interface/Server.h"
 #include "create_files_index.h"
+#ifdef _WIN32
+#include <windows.h>
+#endif
 
 const size_t max_buffer_size=100000;
 #ifdef _DEBUG
@@ -28,12 +31,8 @@ const unsigned int max_wait_time=30000;
 #endif
 const size_t min_size_no_wait=10000;
 
-std::map<FileIndex::SIndexKey, int64> FileIndex::cache_buffer_1;
-std::map<FileIndex::SIndexKey, int64> FileIndex::cache_buffer_2;
-std::map<FileIndex::SIndexKey, int64>* FileIndex::active_cache_buffer=&cache_buffer_1;
-std::map<FileIndex::SIndexKey, int64>* FileIndex::other_cache_buffer=&cache_buffer_2;
-
-
+FileIndex::SCacheShard FileIndex::cache_shards[c_n_cache_shards];
+size_t FileIndex::active_cache_size=0;
 
 IMutex *FileIndex::mutex=NULL;
 ICondition *FileIndex::cond=NULL;
@@ -41,72 +40,131 @@ bool FileIndex::do_shutdown=false;
 bool FileIndex::do_flush=false;
 bool FileIndex::do_accept = true;
 
+namespace
+{
+	//Stats are updated by concurrent readers, so they are changed atomically instead of with a lock
+	void stats_add(int64& val, int64 add)
+	{
+#ifdef _WIN32
+		InterlockedExchangeAdd64(&val, add);
+#else
+		__sync_fetch_and_add(&val, add);
+#endif
+	}
+
+	int64 stats_get(int64& val)
+	{
+#ifdef _WIN32
+		return InterlockedExchangeAdd64(&val, 0);
+#else
+		return __sync_fetch_and_add(&val, 0);
+#endif
+	}
+
+	class ScopedLookupStats
+	{
+	public:
+		ScopedLookupStats(FileIndex::SCacheShardStats& stats)
+			: stats(stats), starttime(Server->getTimeMS()), lock_wait_ms(0)
+		{
+		}
+
+		~ScopedLookupStats()
+		{
+			int64 lookup_time = Server->getTimeMS() - starttime;
+
+			stats_add(stats.lookups, 1);
+			stats_add(stats.lookup_time_ms, lookup_time);
+			if (lock_wait_ms > 0)
+			{
+				stats_add(stats.lock_wait_ms, lock_wait_ms);
+				stats_add(stats.contended_lookups, 1);
+			}
+		}
+
+		void locked()
+		{
+			lock_wait_ms = Server->getTimeMS() - starttime;
+		}
+
+	private:
+		FileIndex::SCacheShardStats& stats;
+		int64 starttime;
+		int64 lock_wait_ms;
+	};
+}
+
 
 void FileIndex::operator()(void)
 {
 	mutex=Server->createMutex();
 	cond=Server->createCondition();
 
-	while(true)
+	for(size_t i=0;i<c_n_cache_shards;++i)
 	{
-		std::map<FileIndex::SIndexKey, int64>* local_buf;
+		cache_shards[i].mutex=Server->createSharedMutex();
+	}
 
+	while(true)
+	{
 		{
 			IScopedLock lock(mutex);
 
 			if(do_shutdown &&
-				cache_buffer_1.empty() &&
-				cache_buffer_2.empty() )
+				active_cache_size==0 )
 			{
 				break;
 			}
 
-			while(active_cache_buffer->empty() && !do_shutdown)
+			while(active_cache_size==0 && !do_shutdown)
 			{
 				do_flush=false;
 				int64 starttime=Server->getTimeMS();
 
-				while(active_cache_buffer->size()<min_size_no_wait
+				while(active_cache_size<min_size_no_wait
 					&& Server->getTimeMS()-starttime<max_wait_time
 					&& !do_shutdown && !do_flush)
 				{
 					cond->wait(&lock, max_wait_time);
 				}
-			}			
-
-			local_buf=active_cache_buffer;
-			
-			if(active_cache_buffer==&cache_buffer_1)
-			{
-				active_cache_buffer=&cache_buffer_2;
-				other_cache_buffer=&cache_buffer_1;
 			}
-			else
+
+			for(size_t i=0;i<c_n_cache_shards;++i)
 			{
-				active_cache_buffer=&cache_buffer_1;
-				other_cache_buffer=&cache_buffer_2;
+				SCacheShard& shard = cache_shards[i];
+				IScopedWriteLock shard_lock(shard.mutex);
+				std::swap(shard.active_cache_buffer, shard.other_cache_buffer);
 			}
+
+			active_cache_size=0;
 		}
 
 		start_transaction();
 
-		for(std::map<FileIndex::SIndexKey, int64>::iterator it=local_buf->begin();
-			it!=local_buf->end();++it)
+		//Readers only consult other_cache_buffer concurrently, which is not modified
+		//until the transaction is committed
+		for(size_t i=0;i<c_n_cache_shards;++i)
 		{
-			if(it->second!=0)
-			{
-				FILEENTRY_DEBUG(Server->Log("LMDB: PUT clientid=" + convert(it->first.getClientid()) 
-					+ " filesize=" + convert(it->first.getFilesize())
-					+ " hash=" + base64_encode(reinterpret_cast<const unsigned char*>(it->first.getHash()), bytes_in_index)
-					+ " target=" + convert(it->second), LL_DEBUG));
-				put(it->first, it->second);
-			}
-			else
+			std::map<FileIndex::SIndexKey, int64>* local_buf = cache_shards[i].other_cache_buffer;
+
+			for(std::map<FileIndex::SIndexKey, int64>::iterator it=local_buf->begin();
+				it!=local_buf->end();++it)
 			{
-				FILEENTRY_DEBUG(Server->Log("LMDB: DEL clientid=" + convert(it->first.getClientid()) 
-					+ " filesize=" + convert(it->first.getFilesize())
-					+ " hash="+base64_encode(reinterpret_cast<const unsigned char*>(it->first.getHash()), bytes_in_index), LL_DEBUG));
-				del(it->first);
+				if(it->second!=0)
+				{
+					FILEENTRY_DEBUG(Server->Log("LMDB: PUT clientid=" + convert(it->first.getClientid()) 
+						+ " filesize=" + convert(it->first.getFilesize())
+						+ " hash=" + base64_encode(reinterpret_cast<const unsigned char*>(it->first.getHash()), bytes_in_index)
+						+ " target=" + convert(it->second), LL_DEBUG));
+					put(it->first, it->second);
+				}
+				else
+				{
+					FILEENTRY_DEBUG(Server->Log("LMDB: DEL clientid=" + convert(it->first.getClientid()) 
+						+ " filesize=" + convert(it->first.getFilesize())
+						+ " hash="+base64_encode(reinterpret_cast<const unsigned char*>(it->first.getHash()), bytes_in_index), LL_DEBUG));
+					del(it->first);
+				}
 			}
 		}
 
@@ -114,26 +172,46 @@ void FileIndex::operator()(void)
 
 		{
 			IScopedLock lock(mutex);
-			local_buf->clear();
+			for(size_t i=0;i<c_n_cache_shards;++i)
+			{
+				SCacheShard& shard = cache_shards[i];
+				IScopedWriteLock shard_lock(shard.mutex);
+				shard.other_cache_buffer->clear();
+				++shard.generation;
+			}
 			do_flush=false;
 		}
 	}
 
+	log_cache_stats();
+
 	delete this;
 }
 
+FileIndex::SCacheShard& FileIndex::get_shard(const SIndexKey& key)
+{
+	return cache_shards[static_cast<unsigned char>(key.getHash()[0]) * c_n_cache_shards / 256];
+}
+
 void FileIndex::put_delayed(const SIndexKey& key, int64 value)
 {
 	IScopedLock lock(mutex);
 
-	while(active_cache_buffer->size()>=max_buffer_size || !do_accept)
+	while(active_cache_size>=max_buffer_size || !do_accept)
 	{
 		lock.relock(NULL);
 		Server->wait(10);
 		lock.relock(mutex);
 	}
 
-	(*active_cache_buffer)[key]=value;
+	{
+		SCacheShard& shard = get_shard(key);
+		IScopedWriteLock shard_lock(shard.mutex);
+		size_t prev_size = shard.active_cache_buffer->size();
+		(*shard.active_cache_buffer)[key]=value;
+		active_cache_size += shard.active_cache_buffer->size() - prev_size;
+	}
+
 	cond->notify_all();
 }
 
@@ -144,16 +222,20 @@ void FileIndex::del_delayed(const SIndexKey& key)
 
 int64 FileIndex::get_with_cache(const FileIndex::SIndexKey& key)
 {
+	SCacheShard& shard = get_shard(key);
+	ScopedLookupStats lookup_stats(shard.stats);
+
 	{
-		IScopedLock lock(mutex);
+		IScopedReadLock lock(shard.mutex);
+		lookup_stats.locked();
 
 		int64 ret;
-		if(get_from_cache(key, *active_cache_buffer, ret))
+		if(get_from_cache(key, *shard.active_cache_buffer, ret))
 		{
 			return ret;
 		}
 
-		if(get_from_cache(key, *other_cache_buffer, ret))
+		if(get_from_cache(key, *shard.other_cache_buffer, ret))
 		{
 			return ret;
 		}
@@ -165,19 +247,92 @@ int64 FileIndex::get_with_cache(const FileIndex::SIndexKey& key)
 
 int64 FileIndex::get_with_cache_prefer_client(const SIndexKey& key)
 {
+	SCacheShard& shard = get_shard(key);
+	ScopedLookupStats lookup_stats(shard.stats);
+
+	{
+		IScopedReadLock lock(shard.mutex);
+		lookup_stats.locked();
+
+		int64 ret;
+		if(get_from_cache_prefer_client(key, *shard.active_cache_buffer, ret))
+		{
+			return ret;
+		}
+
+		if(get_from_cache_prefer_client(key, *shard.other_cache_buffer, ret))
+		{
+			return ret;
+		}
+	}
+
+	return get_prefer_client(key);
+}
+
+void FileIndex::get_batch_with_cache_prefer_client(const std::vector<SIndexKey>& keys, std::map<SIndexKey, SPrefetchedEntry>& prefetched)
+{
+	std::vector<SIndexKey> lookup_keys;
+	std::vector<int64> generations;
+	lookup_keys.reserve(keys.size());
+	generations.reserve(keys.size());
+
+	for(size_t i=0;i<keys.size();++i)
 	{
-		IScopedLock lock(mutex);
+		SCacheShard& shard = get_shard(keys[i]);
+		IScopedReadLock lock(shard.mutex);
 
 		int64 ret;
-		if(get_from_cache_prefer_client(key, *active_cache_buffer, ret))
+		if(get_from_cache_prefer_client(keys[i], *shard.active_cache_buffer, ret)
+			|| get_from_cache_prefer_client(keys[i], *shard.other_cache_buffer, ret))
+		{
+			continue;
+		}
+
+		lookup_keys.push_back(keys[i]);
+		generations.push_back(shard.generation);
+	}
+
+	if(lookup_keys.empty())
+	{
+		return;
+	}
+
+	std::vector<int64> entryids = get_prefer_client_batch(lookup_keys);
+
+	for(size_t i=0;i<lookup_keys.size() && i<entryids.size();++i)
+	{
+		SPrefetchedEntry entry = { entryids[i], generations[i] };
+		prefetched[lookup_keys[i]] = entry;
+	}
+}
+
+int64 FileIndex::get_with_cache_prefer_client(const SIndexKey& key, const std::map<SIndexKey, SPrefetchedEntry>& prefetched)
+{
+	SCacheShard& shard = get_shard(key);
+	ScopedLookupStats lookup_stats(shard.stats);
+
+	{
+		IScopedReadLock lock(shard.mutex);
+		lookup_stats.locked();
+
+		int64 ret;
+		if(get_from_cache_prefer_client(key, *shard.active_cache_buffer, ret))
 		{
 			return ret;
 		}
 
-		if(get_from_cache_prefer_client(key, *other_cache_buffer, ret))
+		if(get_from_cache_prefer_client(key, *shard.other_cache_buffer, ret))
 		{
 			return ret;
 		}
+
+		//Prefetched result is only valid if nothing was committed in the meantime
+		std::map<SIndexKey, SPrefetchedEntry>::const_iterator it = prefetched.find(key);
+		if(it!=prefetched.end()
+			&& it->second.generation==shard.generation)
+		{
+			return it->second.entryid;
+		}
 	}
 
 	return get_prefer_client(key);
@@ -187,12 +342,16 @@ std::map<int, int64> FileIndex::get_all_clients_with_cache( const SIndexKey& key
 {
 	std::map<int, int64> ret_cache;
 
+	SCacheShard& shard = get_shard(key);
+	ScopedLookupStats lookup_stats(shard.stats);
+
 	{
-		IScopedLock lock(mutex);
+		IScopedReadLock lock(shard.mutex);
+		lookup_stats.locked();
 
-		get_from_cache_all_clients(key, *other_cache_buffer, ret_cache);
+		get_from_cache_all_clients(key, *shard.other_cache_buffer, ret_cache);
 
-		get_from_cache_all_clients(key, *active_cache_buffer, ret_cache);
+		get_from_cache_all_clients(key, *shard.active_cache_buffer, ret_cache);
 	}
 
 	std::map<int, int64> ret = get_all_clients(key);
@@ -224,16 +383,20 @@ std::map<int, int64> FileIndex::get_all_clients_with_cache( const SIndexKey& key
 
 int64 FileIndex::get_with_cache_exact( const SIndexKey& key )
 {
+	SCacheShard& shard = get_shard(key);
+	ScopedLookupStats lookup_stats(shard.stats);
+
 	{
-		IScopedLock lock(mutex);
+		IScopedReadLock lock(shard.mutex);
+		lookup_stats.locked();
 
 		int64 ret;
-		if(get_from_cache_exact(key, *active_cache_buffer, ret))
+		if(get_from_cache_exact(key, *shard.active_cache_buffer, ret))
 		{
 			return ret;
 		}
 
-		if(get_from_cache_exact(key, *other_cache_buffer, ret))
+		if(get_from_cache_exact(key, *shard.other_cache_buffer, ret))
 		{
 			return ret;
 		}
@@ -242,6 +405,41 @@ int64 FileIndex::get_with_cache_exact( const SIndexKey& key )
 	return get(key);
 }
 
+std::vector<FileIndex::SCacheShardStats> FileIndex::get_cache_stats()
+{
+	std::vector<SCacheShardStats> ret;
+	ret.resize(c_n_cache_shards);
+
+	for(size_t i=0;i<c_n_cache_shards;++i)
+	{
+		SCacheShardStats& stats = cache_shards[i].stats;
+		ret[i].lookups = stats_get(stats.lookups);
+		ret[i].lookup_time_ms = stats_get(stats.lookup_time_ms);
+		ret[i].lock_wait_ms = stats_get(stats.lock_wait_ms);
+		ret[i].contended_lookups = stats_get(stats.contended_lookups);
+	}
+
+	return ret;
+}
+
+void FileIndex::log_cache_stats()
+{
+	std::vector<SCacheShardStats> stats = get_cache_stats();
+
+	for(size_t i=0;i<stats.size();++i)
+	{
+		if(stats[i].lookups==0)
+		{
+			continue;
+		}
+
+		Server->Log("File index cache shard "+convert(i)+": lookups="+convert(stats[i].lookups)
+			+" lookup_time="+convert(stats[i].lookup_time_ms)+"ms"
+			+" lock_wait="+convert(stats[i].lock_wait_ms)+"ms"
+			+" contended="+convert(stats[i].contended_lookups), LL_DEBUG);
+	}
+}
+
 void FileIndex::shutdown()
 {
 	IScopedLock lock(mutex);
@@ -3,13 +3,18 @@
 #include "../Interface/Database.h"
 #include "../Interface/Types.h"
 #include "../Interface/Mutex.h"
+#include "../Interface/SharedMutex.h"
 #include "../Interface/Condition.h"
 #include "../Interface/Thread.h"
 #include <memory.h>
 #include "../stringtools.h"
 #include <assert.h>
+#include <vector>
 
 const size_t bytes_in_index = 16;
+//Number of shards of the delayed put/del cache. Shards are selected by the upper
+//bits of the first hash byte, so iterating the shards in order yields sorted keys.
+const size_t c_n_cache_shards = 16;
 
 class FileIndex : public IThread
 {
@@ -106,6 +111,9 @@ public:
 
 	virtual std::map<int, int64> get_all_clients(const SIndexKey& key) = 0;
 
+	//Returns get_prefer_client() results in the order of keys, using a single transaction
+	virtual std::vector<int64> get_prefer_client_batch(const std::vector<SIndexKey>& keys) = 0;
+
 	virtual void start_transaction(void)=0;
 
 	virtual void put(const SIndexKey& key, int64 value)=0;
@@ -120,6 +128,16 @@ public:
 
 	virtual int64 get_with_cache_prefer_client(const SIndexKey& key);
 
+	struct SPrefetchedEntry
+	{
+		int64 entryid;
+		int64 generation;
+	};
+
+	virtual void get_batch_with_cache_prefer_client(const std::vector<SIndexKey>& keys, std::map<SIndexKey, SPrefetchedEntry>& prefetched);
+
+	virtual int64 get_with_cache_prefer_client(const SIndexKey& key, const std::map<SIndexKey, SPrefetchedEntry>& prefetched);
+
 	virtual void del(const SIndexKey& key)=0;
 
 	static void del_delayed(const SIndexKey& key);
@@ -140,8 +158,44 @@ public:
 
 	static void stop_accept();
 
+	struct SCacheShardStats
+	{
+		SCacheShardStats()
+			: lookups(0), lookup_time_ms(0), lock_wait_ms(0), contended_lookups(0)
+		{}
+
+		int64 lookups;
+		int64 lookup_time_ms;
+		int64 lock_wait_ms;
+		int64 contended_lookups;
+	};
+
+	static std::vector<SCacheShardStats> get_cache_stats();
+
 private:
 
+	struct SCacheShard
+	{
+		SCacheShard()
+			: mutex(NULL),
+			active_cache_buffer(&cache_buffer_1), other_cache_buffer(&cache_buffer_2),
+			generation(0)
+		{}
+
+		ISharedMutex* mutex;
+		std::map<SIndexKey, int64> cache_buffer_1;
+		std::map<SIndexKey, int64> cache_buffer_2;
+		std::map<SIndexKey, int64>* active_cache_buffer;
+		std::map<SIndexKey, int64>* other_cache_buffer;
+		//Incremented each time committed entries are removed from the cache
+		int64 generation;
+		SCacheShardStats stats;
+	};
+
+	static SCacheShard& get_shard(const SIndexKey& key);
+
+	static void log_cache_stats();
+
 	bool get_from_cache( const FileIndex::SIndexKey &key, const std::map<SIndexKey, int64>& cache, int64& res );
 
 	bool get_from_cache_prefer_client( const SIndexKey &key, const std::map<SIndexKey, int64>& cache, int64& res);
@@ -150,11 +204,8 @@ private:
 
 	void get_from_cache_all_clients( const SIndexKey &key, const std::map<SIndexKey, int64>& cache, std::map<int, int64> &ret );
 
-	static std::map<SIndexKey, int64> cache_buffer_1;
-	static std::map<SIndexKey, int64> cache_buffer_2;
-	static std::map<SIndexKey, int64>* active_cache_buffer;
-	static std::map<SIndexKey, int64>* other_cache_buffer;
-	static std::map<SIndexKey, bool> del_buffer;
+	static SCacheShard cache_shards[c_n_cache_shards];
+	static size_t active_cache_size;
 	static IMutex *mutex;
 	static ICondition *cond;
 	static bool do_shutdown;
@@ -0,0 +1,327 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "FileIndexFilter.h"
+#include "../Interface/Server.h"
+#include "../Interface/File.h"
+#include "../common/data.h"
+#include "../stringtools.h"
+#include "../urbackupcommon/os_functions.h"
+#include <memory>
+#include <algorithm>
+
+namespace
+{
+	const char filter_magic[] = "URBFIDXF";
+	const _u32 filter_version = 1;
+	const unsigned int filter_n_hashes = 7;
+	const int64 filter_bits_per_entry = 12;
+	//Filter is sized for this many times the current number of entries, so it
+	//does not need to be rebuilt after a few backups
+	const int64 filter_headroom = 2;
+	//Filter needs to be rebuilt if it has fewer bits per entry than this
+	const int64 filter_min_bits_per_entry = 6;
+	const uint64 filter_min_bits = 8 * 1024 * 1024;
+	const _u32 filter_io_blocksize = 4 * 1024 * 1024;
+}
+
+IMutex* FileIndexFilter::stats_mutex = NULL;
+FileIndexFilter::SFilterStats FileIndexFilter::stats;
+
+FileIndexFilter::FileIndexFilter()
+	: mutex(Server->createSharedMutex()), bits_mask(0),
+	n_added(0), n_removed(0), enabled(false)
+{
+	if (stats_mutex == NULL)
+	{
+		stats_mutex = Server->createMutex();
+	}
+}
+
+FileIndexFilter::~FileIndexFilter()
+{
+	Server->destroy(mutex);
+}
+
+void FileIndexFilter::reset(int64 expected_entries)
+{
+	uint64 n_bits = filter_min_bits;
+	while (n_bits < static_cast<uint64>(expected_entries*filter_headroom*filter_bits_per_entry))
+	{
+		n_bits *= 2;
+	}
+
+	IScopedWriteLock lock(mutex);
+
+	enabled = false;
+	bits.clear();
+	bits.resize(static_cast<size_t>(n_bits / 8));
+	bits_mask = n_bits - 1;
+	n_added = 0;
+	n_removed = 0;
+}
+
+void FileIndexFilter::get_bit_positions(const FileIndex::SIndexKey& key, uint64& h1, uint64& h2)
+{
+	const char* hash = key.getHash();
+	memcpy(&h1, hash, sizeof(h1));
+	memcpy(&h2, hash + sizeof(h1), sizeof(h2));
+
+	uint64 filesize = static_cast<uint64>(key.getFilesize());
+	h1 ^= filesize * 0x9E3779B97F4A7C15ULL;
+	h2 ^= filesize * 0xC2B2AE3D27D4EB4FULL;
+	h2 |= 1;
+}
+
+void FileIndexFilter::add(const FileIndex::SIndexKey& key)
+{
+	uint64 h1, h2;
+	get_bit_positions(key, h1, h2);
+
+	IScopedWriteLock lock(mutex);
+
+	if (bits.empty())
+	{
+		return;
+	}
+
+	for (unsigned int i = 0; i < filter_n_hashes; ++i)
+	{
+		uint64 pos = (h1 + i*h2) & bits_mask;
+		bits[static_cast<size_t>(pos / 8)] |= static_cast<char>(1 << (pos % 8));
+	}
+
+	++n_added;
+}
+
+void FileIndexFilter::removed()
+{
+	IScopedWriteLock lock(mutex);
+	++n_removed;
+}
+
+bool FileIndexFilter::too_full(int64 n_entries, int64 n_bits, int64 n_added, int64 n_removed)
+{
+	return n_entries*filter_min_bits_per_entry > n_bits
+		|| n_removed * 4 > n_added;
+}
+
+bool FileIndexFilter::needs_rebuild(int64 n_entries)
+{
+	IScopedReadLock lock(mutex);
+
+	return enabled
+		&& too_full(n_entries, static_cast<int64>(bits.size()) * 8, n_added, n_removed);
+}
+
+bool FileIndexFilter::may_contain(const FileIndex::SIndexKey& key)
+{
+	if (!enabled)
+	{
+		return true;
+	}
+
+	uint64 h1, h2;
+	get_bit_positions(key, h1, h2);
+
+	IScopedReadLock lock(mutex);
+
+	if (!enabled || bits.empty())
+	{
+		return true;
+	}
+
+	for (unsigned int i = 0; i < filter_n_hashes; ++i)
+	{
+		uint64 pos = (h1 + i*h2) & bits_mask;
+		if ((bits[static_cast<size_t>(pos / 8)] & (1 << (pos % 8))) == 0)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool FileIndexFilter::is_enabled()
+{
+	return enabled;
+}
+
+void FileIndexFilter::set_enabled(bool b)
+{
+	IScopedWriteLock lock(mutex);
+	enabled = b;
+}
+
+bool FileIndexFilter::load(const std::string& fn, int64 last_txnid, int64 n_entries)
+{
+	std::auto_ptr<IFile> f(Server->openFile(fn, MODE_READ));
+
+	if (f.get() == NULL)
+	{
+		return false;
+	}
+
+	const size_t header_size = sizeof(filter_magic) - 1 + sizeof(_u32) + 4 * sizeof(int64);
+
+	std::string header = f->Read(static_cast<_u32>(header_size));
+
+	if (header.size() != header_size)
+	{
+		return false;
+	}
+
+	CRData rdata(header.data(), header.size());
+
+	std::string magic = header.substr(0, sizeof(filter_magic) - 1);
+	rdata.incrementPtr(static_cast<unsigned int>(magic.size()));
+
+	_u32 version;
+	int64 file_txnid;
+	int64 n_bits;
+	int64 file_n_added;
+	int64 file_n_removed;
+	if (magic != filter_magic
+		|| !rdata.getUInt(&version)
+		|| version != filter_version
+		|| !rdata.getInt64(&file_txnid)
+		|| !rdata.getInt64(&n_bits)
+		|| !rdata.getInt64(&file_n_added)
+		|| !rdata.getInt64(&file_n_removed))
+	{
+		Server->Log("File entry index filter has unknown format", LL_INFO);
+		return false;
+	}
+
+	if (file_txnid != last_txnid)
+	{
+		Server->Log("File entry index filter is out of date (txnid " + convert(file_txnid) + " != " + convert(last_txnid) + ")", LL_INFO);
+		return false;
+	}
+
+	if (n_bits < static_cast<int64>(filter_min_bits)
+		|| (n_bits & (n_bits - 1)) != 0
+		|| f->Size() != static_cast<int64>(header_size) + n_bits / 8)
+	{
+		Server->Log("File entry index filter has wrong size", LL_WARNING);
+		return false;
+	}
+
+	if (too_full(n_entries, n_bits, file_n_added, file_n_removed))
+	{
+		Server->Log("File entry index filter is too full. Rebuilding...", LL_INFO);
+		return false;
+	}
+
+	IScopedWriteLock lock(mutex);
+
+	bits.resize(static_cast<size_t>(n_bits / 8));
+	bits_mask = static_cast<uint64>(n_bits) - 1;
+	n_added = file_n_added;
+	n_removed = file_n_removed;
+
+	for (size_t pos = 0; pos < bits.size();)
+	{
+		_u32 toread = static_cast<_u32>((std::min)(bits.size() - pos, static_cast<size_t>(filter_io_blocksize)));
+		if (f->Read(&bits[pos], toread) != toread)
+		{
+			Server->Log("Error reading file entry index filter. " + os_last_error_str(), LL_ERROR);
+			bits.clear();
+			return false;
+		}
+		pos += toread;
+	}
+
+	enabled = true;
+
+	return true;
+}
+
+bool FileIndexFilter::save(const std::string& fn, int64 last_txnid)
+{
+	IScopedReadLock lock(mutex);
+
+	if (bits.empty())
+	{
+		return false;
+	}
+
+	std::auto_ptr<IFile> f(Server->openFile(fn + ".new", MODE_WRITE));
+
+	if (f.get() == NULL)
+	{
+		Server->Log("Error opening file entry index filter for writing. " + os_last_error_str(), LL_ERROR);
+		return false;
+	}
+
+	CWData wdata;
+	wdata.addBuffer(filter_magic, sizeof(filter_magic) - 1);
+	wdata.addUInt(filter_version);
+	wdata.addInt64(last_txnid);
+	wdata.addInt64(static_cast<int64>(bits.size()) * 8);
+	wdata.addInt64(n_added);
+	wdata.addInt64(n_removed);
+
+	if (f->Write(wdata.getDataPtr(), wdata.getDataSize()) != wdata.getDataSize())
+	{
+		Server->Log("Error writing file entry index filter header. " + os_last_error_str(), LL_ERROR);
+		return false;
+	}
+
+	for (size_t pos = 0; pos < bits.size();)
+	{
+		_u32 towrite = static_cast<_u32>((std::min)(bits.size() - pos, static_cast<size_t>(filter_io_blocksize)));
+		if (f->Write(&bits[pos], towrite) != towrite)
+		{
+			Server->Log("Error writing file entry index filter. " + os_last_error_str(), LL_ERROR);
+			return false;
+		}
+		pos += towrite;
+	}
+
+	if (!f->Sync())
+	{
+		Server->Log("Error syncing file entry index filter. " + os_last_error_str(), LL_ERROR);
+		return false;
+	}
+
+	f.reset();
+
+	if (!os_rename_file(fn + ".new", fn))
+	{
+		Server->Log("Error renaming file entry index filter. " + os_last_error_str(), LL_ERROR);
+		return false;
+	}
+
+	return true;
+}
+
+void FileIndexFilter::add_stats(const SFilterStats& add)
+{
+	IScopedLock lock(stats_mutex);
+	stats.hits += add.hits;
+	stats.misses += add.misses;
+	stats.false_positives += add.false_positives;
+}
+
+FileIndexFilter::SFilterStats FileIndexFilter::get_stats()
+{
+	IScopedLock lock(stats_mutex);
+	return stats;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "FileIndex.h"
+#include "../Interface/SharedMutex.h"
+#include <vector>
+#include <string>
+
+class FileIndexFilter
+{
+public:
+	struct SFilterStats
+	{
+		SFilterStats()
+			: hits(0), misses(0), false_positives(0)
+		{}
+
+		int64 hits;
+		int64 misses;
+		int64 false_positives;
+	};
+
+	FileIndexFilter();
+	~FileIndexFilter();
+
+	void reset(int64 expected_entries);
+
+	void add(const FileIndex::SIndexKey& key);
+
+	void removed();
+
+	bool may_contain(const FileIndex::SIndexKey& key);
+
+	//Returns true if the filter has too few bits for n_entries or too many removed entries
+	bool needs_rebuild(int64 n_entries);
+
+	bool is_enabled();
+
+	void set_enabled(bool b);
+
+	bool load(const std::string& fn, int64 last_txnid, int64 n_entries);
+
+	bool save(const std::string& fn, int64 last_txnid);
+
+	static void add_stats(const SFilterStats& stats);
+
+	static SFilterStats get_stats();
+
+private:
+	static bool too_full(int64 n_entries, int64 n_bits, int64 n_added, int64 n_removed);
+
+	void get_bit_positions(const FileIndex::SIndexKey& key, uint64& h1, uint64& h2);
+
+	ISharedMutex* mutex;
+	std::vector<char> bits;
+	uint64 bits_mask;
+	int64 n_added;
+	int64 n_removed;
+	volatile bool enabled;
+
+	static IMutex* stats_mutex;
+	static SFilterStats stats;
+};
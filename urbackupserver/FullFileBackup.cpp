@@ -317,10 +317,10 @@ bool FullFileBackup::doFileBackup()
 
 					if (ctime - last_eta_update > eta_update_intervall)
 					{
-						calculateEtaFileBackup(last_eta_update, eta_set_time, ctime, fc, NULL, linked_bytes, last_eta_received_bytes, eta_estimated_speed, files_size);
+						calculateEtaFileBackup(last_eta_update, eta_set_time, ctime, fc, std::vector<FileClientChunked*>(), linked_bytes, last_eta_received_bytes, eta_estimated_speed, files_size);
 					}
 
-					calculateDownloadSpeed(ctime, fc, NULL);
+					calculateDownloadSpeed(ctime, fc, std::vector<FileClientChunked*>());
 
 				} while (server_download->sleepQueue());
 
@@ -638,10 +638,10 @@ bool FullFileBackup::doFileBackup()
 		int64 ctime = Server->getTimeMS();
 		if(ctime-last_eta_update>eta_update_intervall)
 		{
-			calculateEtaFileBackup(last_eta_update, eta_set_time, ctime, fc, NULL, linked_bytes, last_eta_received_bytes, eta_estimated_speed, files_size);
+			calculateEtaFileBackup(last_eta_update, eta_set_time, ctime, fc, std::vector<FileClientChunked*>(), linked_bytes, last_eta_received_bytes, eta_estimated_speed, files_size);
 		}
 
-		calculateDownloadSpeed(ctime, fc, NULL);
+		calculateDownloadSpeed(ctime, fc, std::vector<FileClientChunked*>());
 	}
 
 	ServerStatus::setProcessSpeed(clientname, status_id, 0);
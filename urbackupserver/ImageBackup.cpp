@@ -41,11 +41,15 @@
 #include "server_ping.h"
 #include "snapshot_helper.h"
 #include "server.h"
+#include "ImageBlockIndex.h"
 
 const unsigned int status_update_intervall=1000;
 const unsigned int eta_update_intervall=60000;
 const unsigned int sector_size=512;
 const unsigned int sha_size=32;
+const size_t image_dedup_batch_size=1024;
+const size_t image_dedup_max_open_sources=64;
+const size_t image_dedup_max_failures=64;
 const size_t minfreespace_image=1000*1024*1024; //1000 MB
 const unsigned int image_timeout=10*24*60*60*1000;
 const unsigned int image_recv_timeout=30*60*1000;
@@ -585,6 +589,13 @@ bool ImageBackup::doImage(const std::string &pLetter, const std::string &pParent
 
 	chksum_str += "&zero_skipped=1";
 
+	bool with_block_refs = !pParentvhd.empty()
+		&& Server->getServerParameter("image_block_references") == "true";
+	if (with_block_refs)
+	{
+		chksum_str += "&block_refs=1";
+	}
+
 	if(pParentvhd.empty())
 	{
 		tcpstack.Send(cc, identity+"FULL IMAGE letter="+pLetter+"&token="+server_token+chksum_str);
@@ -676,6 +687,7 @@ bool ImageBackup::doImage(const std::string &pLetter, const std::string &pParent
 	IFile *hashfile=NULL;
 	IFile *parenthashfile=NULL;
 	std::auto_ptr<IFile> bitmap_file;
+	std::auto_ptr<IVHDFile> parent_vhdfile;
 	int64 blockcnt=0;
 	int64 numblocks=0;
 	int64 blocks=0;
@@ -870,6 +882,10 @@ bool ImageBackup::doImage(const std::string &pLetter, const std::string &pParent
 						ts += "&clientsubname=" + EscapeParamString(clientsubname);
 					}
 					ts += "&zero_skipped=1";
+					if (with_block_refs)
+					{
+						ts += "&block_refs=1";
+					}
 					std::auto_ptr<IFile> prevbitmap;
 					if (transfer_prev_cbitmap)
 					{
@@ -1544,6 +1560,13 @@ bool ImageBackup::doImage(const std::string &pLetter, const std::string &pParent
 
 							if(hashfile!=NULL) Server->destroy(hashfile);
 
+							if(!vhdfile_err
+								&& image_file_format == image_file_format_cowraw
+								&& Server->getServerParameter("image_block_dedup")!="false")
+							{
+								dedupImageBlocks(imagefn, pParentvhd, mbr_offset, vhd_blocksize*blocksize, drivesize);
+							}
+
 							IFile *t_file=Server->openFile(os_file_prefix(imagefn), MODE_READ);
 							if(t_file!=NULL)
 							{
@@ -1758,6 +1781,98 @@ bool ImageBackup::doImage(const std::string &pLetter, const std::string &pParent
 							}
 							currblock=-1;
 						}
+						else if (currblock == -129) //VHD block with the content of another VHD block of the parent image
+						{
+							if (r - off >= 3 * sizeof(int64) + sha_size)
+							{
+								int64 dst_block;
+								int64 src_block;
+								unsigned char dig[sha_size];
+								memcpy(&dst_block, &buffer[off + sizeof(int64)], sizeof(int64));
+								dst_block = little_endian(dst_block);
+								memcpy(&src_block, &buffer[off + 2 * sizeof(int64)], sizeof(int64));
+								src_block = little_endian(src_block);
+								memcpy(dig, &buffer[off + 3 * sizeof(int64)], sha_size);
+
+								if (!has_parent
+									|| dst_block < nextblock
+									|| dst_block % vhd_blocksize != 0
+									|| dst_block + vhd_blocksize > blocks
+									|| src_block < 0
+									|| src_block % vhd_blocksize != 0
+									|| src_block + vhd_blocksize > blocks)
+								{
+									ServerLogger::Log(logid, "Received invalid block reference from " + convert(src_block) + " to " + convert(dst_block) + ". Stopping backup.", LL_ERROR);
+									goto do_image_cleanup;
+								}
+
+								if (parent_vhdfile.get() == NULL)
+								{
+									IFSImageFactory::ImageFormat parent_format = IFSImageFactory::ImageFormat_VHD;
+									if (findextension(pParentvhd) == "raw")
+									{
+										parent_format = IFSImageFactory::ImageFormat_RawCowFile;
+									}
+
+									parent_vhdfile.reset(image_fak->createVHDFile(os_file_prefix(pParentvhd), true, 0,
+										2 * 1024 * 1024, false, parent_format));
+
+									if (parent_vhdfile.get() == NULL
+										|| !parent_vhdfile->isOpen())
+									{
+										ServerLogger::Log(logid, "Error opening parent image \"" + pParentvhd + "\" to copy moved blocks", LL_ERROR);
+										goto do_image_cleanup;
+									}
+								}
+
+								nextblock = updateNextblock(nextblock, dst_block, &shactx, zeroblockdata.data(), has_parent,
+									hashfile, parenthashfile, blocksize, mbr_offset, vhd_blocksize, warned_about_parenthashfile_error,
+									-1, vhdfile, 0);
+
+								if (!copyParentBlocks(parent_vhdfile.get(), vhdfile, &shactx, src_block, dst_block,
+									vhd_blocksize, blocksize, mbr_offset))
+								{
+									ServerLogger::Log(logid, "Error reading moved block " + convert(src_block) + " from parent image \"" + pParentvhd + "\"", LL_ERROR);
+									goto do_image_cleanup;
+								}
+
+								nextblock = dst_block + vhd_blocksize;
+								numblocks += vhd_blocksize;
+
+								sha256_final(&shactx, verify_checksum);
+								hashfile->Write((char*)verify_checksum, sha_size);
+								sha256_init(&shactx);
+
+								if (memcmp(verify_checksum, dig, sha_size) != 0)
+								{
+									if (num_hash_errors < max_num_hash_errors)
+									{
+										ServerLogger::Log(logid, "Checksum for moved image block wrong. Retrying...", LL_WARNING);
+										transferred_bytes += cc->getTransferedBytes();
+										Server->destroy(cc);
+										cc = NULL;
+										nextblock = last_verified_block;
+										hashfile->Seek((nextblock / vhd_blocksize)*sha_size);
+										++num_hash_errors;
+										break;
+									}
+									else
+									{
+										ServerLogger::Log(logid, "Checksum for moved image block wrong. Stopping image backup.", LL_ERROR);
+										goto do_image_cleanup;
+									}
+								}
+
+								last_verified_block = dst_block;
+
+								off += 3 * sizeof(int64) + sha_size;
+							}
+							else
+							{
+								accum = true;
+							}
+							currblock = -1;
+						}
 						else if (currblock == -128) //Number of skipped blocks
 						{
 							if (r - off >= 2 * sizeof(int64))
@@ -1885,6 +2000,187 @@ do_image_cleanup:
 	return false;
 }
 
+bool ImageBackup::copyParentBlocks(IVHDFile* parent_vhdfile, ServerVHDWriter* vhdfile, sha256_ctx* shactx, int64 src_block, int64 dst_block,
+	int64 n_blocks, unsigned int blocksize, int64 mbr_offset)
+{
+	for (int64 i = 0; i < n_blocks; ++i)
+	{
+		char* buf = vhdfile->getBuffer();
+		if (buf == NULL)
+		{
+			return false;
+		}
+
+		size_t read;
+		if (!parent_vhdfile->ReadAt(mbr_offset + (src_block + i)*blocksize, buf, blocksize, read))
+		{
+			vhdfile->freeBuffer(buf);
+			return false;
+		}
+
+		if (read < blocksize)
+		{
+			memset(buf + read, 0, blocksize - read);
+		}
+
+		sha256_update(shactx, reinterpret_cast<unsigned char*>(buf), blocksize);
+
+		vhdfile->writeBuffer(mbr_offset + (dst_block + i)*blocksize, buf, blocksize);
+	}
+
+	return true;
+}
+
+void ImageBackup::dedupImageBlocks(const std::string& imagefn, const std::string& pParentvhd, int64 mbr_offset, int64 vhd_blocksize, int64 drivesize)
+{
+	std::auto_ptr<IFsFile> imagef(Server->openFile(os_file_prefix(imagefn), MODE_RW));
+	std::auto_ptr<IFile> hashf(Server->openFile(os_file_prefix(imagefn + ".hash"), MODE_READ));
+	std::auto_ptr<IFile> parenthashf;
+	if (!pParentvhd.empty())
+	{
+		parenthashf.reset(Server->openFile(os_file_prefix(pParentvhd + ".hash"), MODE_READ));
+	}
+
+	if (imagef.get() == NULL || hashf.get() == NULL)
+	{
+		ServerLogger::Log(logid, "Error opening image for block deduplication. " + os_last_error_str(), LL_WARNING);
+		return;
+	}
+
+	ServerLogger::Log(logid, "Deduplicating image blocks against other images...", LL_DEBUG);
+
+	std::map<int64, IFsFile*> src_images;
+	std::vector<ImageBlockIndex::SBlock> batch;
+	std::vector<ImageBlockIndex::SBlock> stale;
+	int64 deduped_bytes = 0;
+	size_t n_failures = 0;
+	const int64 n_blocks = drivesize / vhd_blocksize;
+
+	for (int64 i = 0; i < n_blocks && n_failures<image_dedup_max_failures; ++i)
+	{
+		ImageBlockIndex::SBlock block;
+		if (hashf->Read(block.hash, sha_size) != sha_size)
+		{
+			break;
+		}
+
+		char parent_hash[sha_size];
+		if (parenthashf.get() != NULL
+			&& parenthashf->Read(parent_hash, sha_size) != sha_size)
+		{
+			parenthashf.reset();
+		}
+
+		if (memcmp(block.hash, zero_hash, sha_size) == 0
+			|| (parenthashf.get() != NULL
+				&& memcmp(block.hash, parent_hash, sha_size) == 0))
+		{
+			//Empty or already shared with the parent via snapshot
+			continue;
+		}
+
+		block.offset = mbr_offset + i*vhd_blocksize;
+		batch.push_back(block);
+
+		if (batch.size() < image_dedup_batch_size
+			&& i + 1 < n_blocks)
+		{
+			continue;
+		}
+
+		if (!ImageBlockIndex::lookupOrAdd(backupid, batch))
+		{
+			ServerLogger::Log(logid, "Error accessing image block index. Skipping image block deduplication.", LL_WARNING);
+			break;
+		}
+
+		for (size_t j = 0; j < batch.size() && n_failures<image_dedup_max_failures; ++j)
+		{
+			ImageBlockIndex::SBlock& curr = batch[j];
+			if (curr.found_backupid == 0)
+			{
+				continue;
+			}
+
+			IFsFile* src_image = NULL;
+			std::map<int64, IFsFile*>::iterator it = src_images.find(curr.found_backupid);
+			if (curr.found_backupid == backupid)
+			{
+				//Block occurs more than once in this image
+				src_image = imagef.get();
+			}
+			else if (it == src_images.end())
+			{
+				if (src_images.size() >= image_dedup_max_open_sources)
+				{
+					for (it = src_images.begin(); it != src_images.end(); ++it)
+					{
+						Server->destroy(it->second);
+					}
+					src_images.clear();
+				}
+
+				IFsFile* src = NULL;
+				ServerBackupDao::SMountedImage src_info = backup_dao->getImageInfo(static_cast<int>(curr.found_backupid));
+				if (src_info.exists)
+				{
+					src = Server->openFile(os_file_prefix(src_info.path), MODE_READ);
+				}
+				src_images.insert(std::make_pair(curr.found_backupid, src));
+				src_image = src;
+			}
+			else
+			{
+				src_image = it->second;
+			}
+
+			int64 rc = -1;
+			if (src_image != NULL)
+			{
+				rc = os_dedupe_range(src_image, curr.found_offset, imagef.get(), curr.offset, vhd_blocksize);
+			}
+
+			if (rc == vhd_blocksize)
+			{
+				deduped_bytes += rc;
+				n_failures = 0;
+			}
+			else
+			{
+				//Previous owner was deleted, changed or is on a different file system
+				stale.push_back(curr);
+				if (rc < 0)
+				{
+					++n_failures;
+				}
+			}
+		}
+
+		if (!ImageBlockIndex::replace(backupid, stale))
+		{
+			ServerLogger::Log(logid, "Error updating image block index", LL_WARNING);
+		}
+
+		stale.clear();
+		batch.clear();
+	}
+
+	for (std::map<int64, IFsFile*>::iterator it = src_images.begin(); it != src_images.end(); ++it)
+	{
+		Server->destroy(it->second);
+	}
+
+	if (n_failures >= image_dedup_max_failures)
+	{
+		ServerLogger::Log(logid, "Image block deduplication is not supported by the backup storage file system. " + os_last_error_str(), LL_DEBUG);
+	}
+
+	if (deduped_bytes > 0)
+	{
+		ServerLogger::Log(logid, "Shared " + PrettyPrintBytes(deduped_bytes) + " of image data with other image backups", LL_INFO);
+	}
+}
+
 unsigned int ImageBackup::writeMBR(ServerVHDWriter* vhdfile, uint64 volsize)
 {
 	unsigned char *mbr=(unsigned char *)vhdfile->getBuffer();
@@ -7,6 +7,7 @@
 class IMutex;
 class ServerVHDWriter;
 class IFile;
+class IVHDFile;
 class ServerPingThread;
 class ScopedLockImageFromCleanup;
 class ServerRunningUpdater;
@@ -64,6 +65,9 @@ protected:
 		int incremental, int incremental_ref, const std::string& imagefn, ScopedLockImageFromCleanup& cleanup_lock,
 		ServerRunningUpdater *running_updater);
 	bool readShadowData(const std::string& shadowdata);
+	bool copyParentBlocks(IVHDFile* parent_vhdfile, ServerVHDWriter* vhdfile, sha256_ctx* shactx, int64 src_block, int64 dst_block,
+		int64 n_blocks, unsigned int blocksize, int64 mbr_offset);
+	void dedupImageBlocks(const std::string& imagefn, const std::string& pParentvhd, int64 mbr_offset, int64 vhd_blocksize, int64 drivesize);
 
 	std::string letter;
 
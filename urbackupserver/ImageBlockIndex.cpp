@@ -0,0 +1,485 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "ImageBlockIndex.h"
+#include "../Interface/Server.h"
+#include "../Interface/File.h"
+#include "../stringtools.h"
+#include "../common/data.h"
+#include "../urbackupcommon/os_functions.h"
+#include <memory>
+#include <string.h>
+
+MDB_env* ImageBlockIndex::env = NULL;
+MDB_dbi ImageBlockIndex::dbi;
+MDB_dbi ImageBlockIndex::dbi_backups;
+size_t ImageBlockIndex::map_size = 1 * 1024 * 1024;
+IMutex* ImageBlockIndex::mutex = NULL;
+
+namespace
+{
+	const char* c_image_block_index_fn = "urbackup/imageblockindex/backup_server_image_blocks.lmdb";
+	const size_t c_backup_block_key_size = sizeof(int64) + 32;
+	const size_t c_remove_txn_n = 10000;
+}
+
+void ImageBlockIndex::init_mutex()
+{
+	mutex = Server->createMutex();
+}
+
+bool ImageBlockIndex::create_env()
+{
+	if (env != NULL)
+	{
+		return true;
+	}
+
+	int rc = mdb_env_create(&env);
+	if (rc)
+	{
+		Server->Log("LMDB: Failed to create image block index env (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+		env = NULL;
+		return false;
+	}
+
+	{
+		std::auto_ptr<IFile> lmdb_f(Server->openFile(c_image_block_index_fn, MODE_READ));
+		if (lmdb_f.get() != NULL)
+		{
+			while (lmdb_f->Size() > static_cast<_i64>(map_size))
+			{
+				map_size *= 2;
+			}
+		}
+	}
+
+	rc = mdb_env_set_mapsize(env, map_size);
+	if (rc == 0)
+	{
+		rc = mdb_env_set_maxdbs(env, 2);
+	}
+	if (rc)
+	{
+		Server->Log("LMDB: Failed to set image block index map size (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+		mdb_env_close(env);
+		env = NULL;
+		return false;
+	}
+
+	os_create_dir("urbackup/imageblockindex");
+
+	rc = mdb_env_open(env, c_image_block_index_fn, MDB_NOSUBDIR, 0664);
+	if (rc)
+	{
+		Server->Log("LMDB: Failed to open image block index (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+		mdb_env_close(env);
+		env = NULL;
+		return false;
+	}
+
+	MDB_txn* txn;
+	rc = mdb_txn_begin(env, NULL, 0, &txn);
+	if (rc)
+	{
+		Server->Log("LMDB: Failed to open transaction for image block index dbi (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+		mdb_env_close(env);
+		env = NULL;
+		return false;
+	}
+
+	rc = mdb_dbi_open(txn, "blocks", MDB_CREATE, &dbi);
+	if (rc == 0)
+	{
+		rc = mdb_dbi_open(txn, "backup_blocks", MDB_CREATE, &dbi_backups);
+	}
+	if (rc == 0)
+	{
+		rc = mdb_txn_commit(txn);
+	}
+	else
+	{
+		mdb_txn_abort(txn);
+	}
+
+	if (rc)
+	{
+		Server->Log("LMDB: Failed to open image block index database (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+		mdb_env_close(env);
+		env = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+bool ImageBlockIndex::increase_map_size()
+{
+	map_size *= 2;
+
+	//No transaction can be active because all of them run under mutex
+	int rc = mdb_env_set_mapsize(env, map_size);
+	if (rc)
+	{
+		Server->Log("LMDB: Failed to increase image block index map size (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+		return false;
+	}
+
+	Server->Log("Increased image block index size to " + PrettyPrintBytes(map_size), LL_DEBUG);
+	return true;
+}
+
+void ImageBlockIndex::backup_block_key(int backupid, const char* hash, char* key)
+{
+	//Big endian, so that the blocks of a backup are next to each other
+	uint64 ubackupid = static_cast<uint64>(backupid);
+	for (size_t i = 0; i < sizeof(int64); ++i)
+	{
+		key[i] = static_cast<char>((ubackupid >> (8 * (sizeof(int64) - 1 - i))) & 0xFF);
+	}
+	memcpy(key + sizeof(int64), hash, 32);
+}
+
+bool ImageBlockIndex::put(MDB_txn* txn, const SBlock& block, int backupid, unsigned int flags, bool& map_full)
+{
+	CWData vdata;
+	vdata.addVarInt(backupid);
+	vdata.addVarInt(block.offset);
+
+	MDB_val mdb_key;
+	mdb_key.mv_data = const_cast<char*>(block.hash);
+	mdb_key.mv_size = sizeof(block.hash);
+
+	MDB_val mdb_value;
+	mdb_value.mv_data = vdata.getDataPtr();
+	mdb_value.mv_size = vdata.getDataSize();
+
+	int rc = mdb_put(txn, dbi, &mdb_key, &mdb_value, flags);
+
+	if (rc == MDB_MAP_FULL)
+	{
+		map_full = true;
+		return false;
+	}
+	else if (rc && rc != MDB_KEYEXIST)
+	{
+		Server->Log("LMDB: Failed to put image block (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+		return false;
+	}
+
+	char backup_key[c_backup_block_key_size];
+	backup_block_key(backupid, block.hash, backup_key);
+
+	mdb_key.mv_data = backup_key;
+	mdb_key.mv_size = sizeof(backup_key);
+
+	mdb_value.mv_data = NULL;
+	mdb_value.mv_size = 0;
+
+	rc = mdb_put(txn, dbi_backups, &mdb_key, &mdb_value, 0);
+
+	if (rc == MDB_MAP_FULL)
+	{
+		map_full = true;
+		return false;
+	}
+	else if (rc)
+	{
+		Server->Log("LMDB: Failed to put image backup block (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+		return false;
+	}
+
+	return true;
+}
+
+bool ImageBlockIndex::commit(MDB_txn* txn, bool& map_full)
+{
+	int rc = mdb_txn_commit(txn);
+
+	if (rc == MDB_MAP_FULL)
+	{
+		map_full = true;
+		return false;
+	}
+	else if (rc)
+	{
+		Server->Log("LMDB: Failed to commit image block index transaction (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+		return false;
+	}
+
+	return true;
+}
+
+bool ImageBlockIndex::lookupOrAdd(int backupid, std::vector<SBlock>& blocks)
+{
+	IScopedLock lock(mutex);
+
+	if (!create_env())
+	{
+		return false;
+	}
+
+	while (true)
+	{
+		MDB_txn* txn;
+		int rc = mdb_txn_begin(env, NULL, 0, &txn);
+		if (rc)
+		{
+			Server->Log("LMDB: Failed to begin image block index transaction (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+			return false;
+		}
+
+		bool map_full = false;
+		bool ok = true;
+
+		for (size_t i = 0; i < blocks.size() && ok; ++i)
+		{
+			SBlock& block = blocks[i];
+			block.found_backupid = 0;
+			block.found_offset = -1;
+
+			MDB_val mdb_key;
+			mdb_key.mv_data = block.hash;
+			mdb_key.mv_size = sizeof(block.hash);
+
+			MDB_val mdb_value;
+			rc = mdb_get(txn, dbi, &mdb_key, &mdb_value);
+
+			if (rc == MDB_NOTFOUND)
+			{
+				ok = put(txn, block, backupid, MDB_NOOVERWRITE, map_full);
+			}
+			else if (rc)
+			{
+				Server->Log("LMDB: Failed to get image block (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+				ok = false;
+			}
+			else
+			{
+				CRData vdata(reinterpret_cast<const char*>(mdb_value.mv_data), mdb_value.mv_size);
+				int64 found_backupid;
+				int64 found_offset;
+				if (vdata.getVarInt(&found_backupid)
+					&& vdata.getVarInt(&found_offset)
+					&& (found_backupid != backupid
+						|| found_offset != block.offset))
+				{
+					block.found_backupid = found_backupid;
+					block.found_offset = found_offset;
+				}
+			}
+		}
+
+		if (ok)
+		{
+			if (commit(txn, map_full))
+			{
+				return true;
+			}
+		}
+		else
+		{
+			mdb_txn_abort(txn);
+		}
+
+		if (!map_full
+			|| !increase_map_size())
+		{
+			return false;
+		}
+	}
+}
+
+bool ImageBlockIndex::replace(int backupid, const std::vector<SBlock>& blocks)
+{
+	if (blocks.empty())
+	{
+		return true;
+	}
+
+	IScopedLock lock(mutex);
+
+	if (!create_env())
+	{
+		return false;
+	}
+
+	while (true)
+	{
+		MDB_txn* txn;
+		int rc = mdb_txn_begin(env, NULL, 0, &txn);
+		if (rc)
+		{
+			Server->Log("LMDB: Failed to begin image block index transaction (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+			return false;
+		}
+
+		bool map_full = false;
+		bool ok = true;
+
+		for (size_t i = 0; i < blocks.size() && ok; ++i)
+		{
+			ok = put(txn, blocks[i], backupid, 0, map_full);
+		}
+
+		if (ok)
+		{
+			if (commit(txn, map_full))
+			{
+				return true;
+			}
+		}
+		else
+		{
+			mdb_txn_abort(txn);
+		}
+
+		if (!map_full
+			|| !increase_map_size())
+		{
+			return false;
+		}
+	}
+}
+
+bool ImageBlockIndex::removeBackup(int backupid)
+{
+	IScopedLock lock(mutex);
+
+	if (!create_env())
+	{
+		return false;
+	}
+
+	char start_key[c_backup_block_key_size];
+	char zero_hash[32] = {};
+	backup_block_key(backupid, zero_hash, start_key);
+
+	size_t n_removed = 0;
+
+	while (true)
+	{
+		MDB_txn* txn;
+		int rc = mdb_txn_begin(env, NULL, 0, &txn);
+		if (rc)
+		{
+			Server->Log("LMDB: Failed to begin image block index transaction (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+			return false;
+		}
+
+		MDB_cursor* cursor;
+		rc = mdb_cursor_open(txn, dbi_backups, &cursor);
+		if (rc)
+		{
+			Server->Log("LMDB: Failed to open image block index cursor (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+			mdb_txn_abort(txn);
+			return false;
+		}
+
+		MDB_val mdb_key;
+		mdb_key.mv_data = start_key;
+		mdb_key.mv_size = sizeof(start_key);
+		MDB_val mdb_value;
+
+		size_t n_txn = 0;
+		rc = mdb_cursor_get(cursor, &mdb_key, &mdb_value, MDB_SET_RANGE);
+		while (rc == 0
+			&& n_txn < c_remove_txn_n
+			&& mdb_key.mv_size == c_backup_block_key_size
+			&& memcmp(mdb_key.mv_data, start_key, sizeof(int64)) == 0)
+		{
+			MDB_val mdb_block_key;
+			mdb_block_key.mv_data = reinterpret_cast<char*>(mdb_key.mv_data) + sizeof(int64);
+			mdb_block_key.mv_size = 32;
+
+			MDB_val mdb_block_value;
+			rc = mdb_get(txn, dbi, &mdb_block_key, &mdb_block_value);
+			if (rc == 0)
+			{
+				CRData vdata(reinterpret_cast<const char*>(mdb_block_value.mv_data), mdb_block_value.mv_size);
+				int64 owner_backupid;
+				//The block may have been handed to another image by replace()
+				if (vdata.getVarInt(&owner_backupid)
+					&& owner_backupid == backupid)
+				{
+					rc = mdb_del(txn, dbi, &mdb_block_key, NULL);
+				}
+			}
+			else if (rc == MDB_NOTFOUND)
+			{
+				rc = 0;
+			}
+
+			if (rc == 0)
+			{
+				rc = mdb_cursor_del(cursor, 0);
+			}
+
+			if (rc == 0)
+			{
+				++n_txn;
+				//Cursor is on the entry after the deleted one
+				rc = mdb_cursor_get(cursor, &mdb_key, &mdb_value, MDB_NEXT);
+			}
+		}
+
+		mdb_cursor_close(cursor);
+
+		bool map_full = false;
+		if (rc == MDB_MAP_FULL)
+		{
+			mdb_txn_abort(txn);
+			map_full = true;
+		}
+		else if (rc && rc != MDB_NOTFOUND)
+		{
+			Server->Log("LMDB: Failed to remove image backup blocks (" + (std::string)mdb_strerror(rc) + ")", LL_ERROR);
+			mdb_txn_abort(txn);
+			return false;
+		}
+		else if (!commit(txn, map_full)
+			&& !map_full)
+		{
+			return false;
+		}
+
+		if (map_full)
+		{
+			//Deleting needs new pages as well (copy on write)
+			if (!increase_map_size())
+			{
+				return false;
+			}
+			continue;
+		}
+
+		n_removed += n_txn;
+
+		if (n_txn < c_remove_txn_n)
+		{
+			break;
+		}
+	}
+
+	if (n_removed > 0)
+	{
+		Server->Log("Removed " + convert(n_removed) + " blocks of image backup " + convert(backupid) + " from image block index", LL_DEBUG);
+	}
+
+	return true;
+}
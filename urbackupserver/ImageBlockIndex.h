@@ -0,0 +1,56 @@
+#pragma once
+
+#include "../Interface/Types.h"
+#include "../Interface/Mutex.h"
+#ifdef NO_EMBEDDED_LMDB
+#include <lmdb.h>
+#else
+#include "lmdb/lmdb.h"
+#endif
+#include <vector>
+
+/**
+* Content addressed index of image blocks (SHA-256 of a vhd_blocksize block)
+* to the image backup and file offset where the block was first stored.
+* Used to share identical blocks within an image and across volumes and
+* clients. A second database lists the blocks per image backup, so that
+* they can be removed when the image backup is deleted.
+*/
+class ImageBlockIndex
+{
+public:
+	struct SBlock
+	{
+		char hash[32];
+		int64 offset;
+
+		//Set by lookupOrAdd if the block is already stored at another position
+		//(in another image or in this one)
+		int64 found_backupid;
+		int64 found_offset;
+	};
+
+	static void init_mutex();
+
+	//Looks up all blocks. Blocks not found are added with backupid as owner
+	static bool lookupOrAdd(int backupid, std::vector<SBlock>& blocks);
+
+	//Replaces the owner of blocks (e.g. if the previous owner was deleted)
+	static bool replace(int backupid, const std::vector<SBlock>& blocks);
+
+	//Removes all blocks owned by a deleted image backup
+	static bool removeBackup(int backupid);
+
+private:
+	static bool create_env();
+	static void backup_block_key(int backupid, const char* hash, char* key);
+	static bool put(MDB_txn* txn, const SBlock& block, int backupid, unsigned int flags, bool& map_full);
+	static bool commit(MDB_txn* txn, bool& map_full);
+	static bool increase_map_size();
+
+	static MDB_env* env;
+	static MDB_dbi dbi;
+	static MDB_dbi dbi_backups;
+	static size_t map_size;
+	static IMutex* mutex;
+};
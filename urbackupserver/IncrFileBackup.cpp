@@ -44,7 +44,15 @@ const int64 c_readd_size_limit=4096;
 
 namespace
 {
-	
+	int64 getReceivedDataBytes(const std::vector<FileClientChunked*>& fc_chunked)
+	{
+		int64 ret = 0;
+		for (size_t i = 0; i < fc_chunked.size(); ++i)
+		{
+			ret += fc_chunked[i]->getReceivedDataBytes(true);
+		}
+		return ret;
+	}
 }
 
 IncrFileBackup::IncrFileBackup( ClientMain* client_main, int clientid, std::string clientname, std::string clientsubname, LogAction log_action,
@@ -523,6 +531,38 @@ bool IncrFileBackup::doFileBackup()
 	bool backup_with_components;
 	_i64 files_size = getIncrementalSize(tmp_filelist, diffs, backup_with_components);
 
+	std::vector<FileClientChunked*> fc_chunked_all;
+	if(fc_chunked.get()!=NULL)
+	{
+		fc_chunked_all.push_back(fc_chunked.get());
+
+		for(int i=1;i<server_settings->getSettings()->file_download_connections;++i)
+		{
+			std::auto_ptr<FileClientChunked> fc_chunked_add;
+			if(!client_main->getClientChunkedFilesrvConnection(fc_chunked_add, server_settings.get(), this, 60000))
+			{
+				ServerLogger::Log(logid, "Could not open additional file transfer connection to "+clientname+". Continuing with "+convert(fc_chunked_all.size())+" connection(s).", LL_WARNING);
+				break;
+			}
+
+			fc_chunked_add->setProgressLogCallback(this);
+			fc_chunked_add->setDestroyPipe(true);
+
+			if(fc_chunked_add->hasError())
+			{
+				ServerLogger::Log(logid, "Additional file transfer connection to "+clientname+" has an error. Continuing with "+convert(fc_chunked_all.size())+" connection(s).", LL_WARNING);
+				break;
+			}
+
+			fc_chunked_all.push_back(fc_chunked_add.release());
+		}
+
+		if(fc_chunked_all.size()>1)
+		{
+			ServerLogger::Log(logid, "Downloading changed files over "+convert(fc_chunked_all.size())+" parallel connections", LL_DEBUG);
+		}
+	}
+
 	std::auto_ptr<ServerDownloadThread> server_download(new ServerDownloadThread(fc, fc_chunked.get(), backuppath,
 		backuppath_hashes, last_backuppath, last_backuppath_complete,
 		hashed_transfer, intra_file_diffs, clientid, clientname, clientsubname,
@@ -531,6 +571,12 @@ bool IncrFileBackup::doFileBackup()
 		incremental_num, logid, with_hashes, shares_without_snapshot, with_sparse_hashing, metadata_download_thread.get(),
 		backup_with_components, filepath_corrections, max_file_id));
 
+	for(size_t i=1;i<fc_chunked_all.size();++i)
+	{
+		server_download->addChunkedConnection(fc_chunked_all[i]);
+	}
+	server_download->setMaxHeldBackHashData((std::max)(1, server_settings->getSettings()->file_download_max_held_back));
+
 	bool queue_downloads = client_main->getProtocolVersions().filesrv_protocol_version>2;
 
 	THREADPOOL_TICKET server_download_ticket = 
@@ -555,9 +601,9 @@ bool IncrFileBackup::doFileBackup()
 	IdRange download_nok_ids;
 
 	fc.resetReceivedDataBytes(true);
-	if(fc_chunked.get()!=NULL)
+	for(size_t i=0;i<fc_chunked_all.size();++i)
 	{
-		fc_chunked->resetReceivedDataBytes(true);
+		fc_chunked_all[i]->resetReceivedDataBytes(true);
 	}
 
 	ServerStatus::setProcessTotalBytes(clientname, status_id, files_size);
@@ -697,7 +743,7 @@ bool IncrFileBackup::doFileBackup()
 						else
 						{
 							int64 done_bytes = fc.getReceivedDataBytes(true)
-								+ (fc_chunked.get() ? fc_chunked->getReceivedDataBytes(true) : 0) + linked_bytes;
+								+ getReceivedDataBytes(fc_chunked_all) + linked_bytes;
 							ServerStatus::setProcessDoneBytes(clientname, status_id, done_bytes);
 							ServerStatus::setProcessPcDone(clientname, status_id,
 								(std::min)(100, (int)(((float)done_bytes) / ((float)files_size / 100.f) + 0.5f)));
@@ -709,10 +755,10 @@ bool IncrFileBackup::doFileBackup()
 
 					if (ctime - last_eta_update > eta_update_intervall)
 					{
-						calculateEtaFileBackup(last_eta_update, eta_set_time, ctime, fc, fc_chunked.get(), linked_bytes, last_eta_received_bytes, eta_estimated_speed, files_size);
+						calculateEtaFileBackup(last_eta_update, eta_set_time, ctime, fc, fc_chunked_all, linked_bytes, last_eta_received_bytes, eta_estimated_speed, files_size);
 					}
 
-					calculateDownloadSpeed(ctime, fc, fc_chunked.get());
+					calculateDownloadSpeed(ctime, fc, fc_chunked_all);
 				} while (server_download->sleepQueue());
 
 				if(server_download->isOffline() && !r_offline)
@@ -1379,7 +1425,7 @@ bool IncrFileBackup::doFileBackup()
 		else
 		{
 			int64 done_bytes = fc.getReceivedDataBytes(true)
-				+ (fc_chunked.get() ? fc_chunked->getReceivedDataBytes(true) : 0) + linked_bytes;
+				+ getReceivedDataBytes(fc_chunked_all) + linked_bytes;
 			ServerStatus::setProcessDoneBytes(clientname, status_id, done_bytes);
 			ServerStatus::setProcessPcDone(clientname, status_id,
 				(std::min)(100,(int)(((float)done_bytes)/((float)files_size/100.f)+0.5f)) );
@@ -1391,10 +1437,10 @@ bool IncrFileBackup::doFileBackup()
 		int64 ctime = Server->getTimeMS();
 		if(ctime-last_eta_update>eta_update_intervall)
 		{
-			calculateEtaFileBackup(last_eta_update, eta_set_time, ctime, fc, fc_chunked.get(), linked_bytes, last_eta_received_bytes, eta_estimated_speed, files_size);
+			calculateEtaFileBackup(last_eta_update, eta_set_time, ctime, fc, fc_chunked_all, linked_bytes, last_eta_received_bytes, eta_estimated_speed, files_size);
 		}
 
-		calculateDownloadSpeed(ctime, fc, fc_chunked.get());
+		calculateDownloadSpeed(ctime, fc, fc_chunked_all);
 	}
 
 	ServerStatus::setProcessSpeed(clientname, status_id, 0);
@@ -1823,8 +1869,13 @@ bool IncrFileBackup::doFileBackup()
 	running_updater->stop();
 	backup_dao->updateFileBackupRunning(backupid);
 
-	_i64 transferred_bytes=fc.getTransferredBytes()+(fc_chunked.get()?fc_chunked->getTransferredBytes():0);
-	_i64 transferred_compressed=fc.getRealTransferredBytes()+(fc_chunked.get()?fc_chunked->getRealTransferredBytes():0);
+	_i64 transferred_bytes=fc.getTransferredBytes();
+	_i64 transferred_compressed=fc.getRealTransferredBytes();
+	for(size_t i=0;i<fc_chunked_all.size();++i)
+	{
+		transferred_bytes+=fc_chunked_all[i]->getTransferredBytes();
+		transferred_compressed+=fc_chunked_all[i]->getRealTransferredBytes();
+	}
 	int64 passed_time=incr_backup_stoptime-incr_backup_starttime;
 	ServerLogger::Log(logid, "Transferred "+PrettyPrintBytes(transferred_bytes)+" - Average speed: "+PrettyPrintSpeed((size_t)((transferred_bytes*1000)/(passed_time)) ), LL_INFO );
 	if(transferred_compressed>0)
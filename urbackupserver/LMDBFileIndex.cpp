@@ -28,6 +28,7 @@
 #include "../Interface/Types.h"
 #include "../Interface/File.h"
 #include <memory>
+#include <algorithm>
 #include "../Interface/Server.h"
 #include "create_files_index.h"
 
@@ -36,10 +37,48 @@ MDB_dbi LMDBFileIndex::dbi;
 ISharedMutex* LMDBFileIndex::mutex=NULL;
 LMDBFileIndex* LMDBFileIndex::fileindex=NULL;
 THREADPOOL_TICKET LMDBFileIndex::fileindex_ticket = ILLEGAL_THREADPOOL_TICKET;
+FileIndexFilter* LMDBFileIndex::filter=NULL;
+THREADPOOL_TICKET LMDBFileIndex::filter_builder_ticket = ILLEGAL_THREADPOOL_TICKET;
+volatile bool LMDBFileIndex::stop_filter_builder=false;
 
 
 const size_t c_initial_map_size=1*1024*1024;
 const size_t c_create_commit_n = 10000;
+const size_t c_filter_build_txn_n = 100000;
+const size_t c_filter_stats_flush_n = 1000;
+const char* c_filter_fn = "urbackup/fileindex/backup_server_files_index.filter";
+
+namespace
+{
+	class FileIndexFilterBuilder : public IThread
+	{
+	public:
+		FileIndexFilterBuilder(FileIndexFilter* filter, volatile bool* do_stop)
+			: filter(filter), do_stop(do_stop)
+		{
+		}
+
+		void operator()()
+		{
+			{
+				LMDBFileIndex fileindex;
+
+				if (!fileindex.has_error()
+					&& fileindex.build_filter(*filter, do_stop))
+				{
+					filter->set_enabled(true);
+					Server->Log("File entry index filter enabled", LL_INFO);
+				}
+			}
+
+			delete this;
+		}
+
+	private:
+		FileIndexFilter* filter;
+		volatile bool* do_stop;
+	};
+}
 
 
 bool LMDBFileIndex::initFileIndex()
@@ -47,6 +86,29 @@ bool LMDBFileIndex::initFileIndex()
 	mutex = Server->createSharedMutex();
 
 	fileindex=new LMDBFileIndex;
+
+	if(!fileindex->has_error())
+	{
+		int64 last_txnid;
+		int64 n_entries;
+		fileindex->get_env_state(last_txnid, n_entries);
+
+		FileIndexFilter* new_filter = new FileIndexFilter;
+
+		if(!new_filter->load(c_filter_fn, last_txnid, n_entries))
+		{
+			//Filter gets allocated before the writer thread starts, so that all entries put
+			//after the builder's read transactions are recorded in the filter as well
+			filter = new_filter;
+			start_filter_build(n_entries);
+		}
+		else
+		{
+			Server->Log("Loaded file entry index filter", LL_INFO);
+			filter = new_filter;
+		}
+	}
+
 	fileindex_ticket = Server->getThreadPool()->execute(fileindex, "fileindex writer");
 
 	return !fileindex->has_error();
@@ -57,11 +119,32 @@ void LMDBFileIndex::shutdownFileIndex()
 {
 	fileindex->shutdown();
 	Server->getThreadPool()->waitFor(fileindex_ticket);
+
+	if(filter!=NULL)
+	{
+		stop_filter_builder=true;
+		Server->getThreadPool()->waitFor(filter_builder_ticket);
+
+		FileIndexFilter::SFilterStats stats = get_filter_stats();
+		Server->Log("File entry index filter: hits="+convert(stats.hits)+" misses="+convert(stats.misses)
+			+" false_positives="+convert(stats.false_positives), LL_INFO);
+
+		if(filter->is_enabled())
+		{
+			LMDBFileIndex fileindex;
+			int64 last_txnid;
+			int64 n_entries;
+			fileindex.get_env_state(last_txnid, n_entries);
+
+			filter->save(c_filter_fn, last_txnid);
+		}
+	}
 }
 
 
 LMDBFileIndex::LMDBFileIndex(bool no_sync)
-	: _has_error(false), txn(NULL), map_size(c_initial_map_size), it_cursor(NULL), no_sync(no_sync)
+	: _has_error(false), txn(NULL), map_size(c_initial_map_size), it_cursor(NULL), no_sync(no_sync),
+	filter_stats_lookups(0)
 {
 	IScopedWriteLock lock(mutex);
 
@@ -74,6 +157,7 @@ LMDBFileIndex::LMDBFileIndex(bool no_sync)
 
 LMDBFileIndex::~LMDBFileIndex(void)
 {
+	flush_filter_stats();
 }
 
 
@@ -110,103 +194,141 @@ void LMDBFileIndex::create(get_data_callback_t get_data_callback, void *userdata
 
 	ServerFilesDao filesdao(db);
 
-	size_t n_done=0;
+	SCreateState state;
 	size_t n_rows=0;
 
-	SIndexKey last;
-	int64 last_prev_entry;
-	int64 last_id;
 	db_results res;
 	do
 	{
-		res=get_data_callback(n_done, n_rows, userdata);
+		res=get_data_callback(state.n_done, n_rows, userdata);
 
 		++n_rows;
 
 		for(size_t i=0;i<res.size();++i)
 		{
 			const std::string& shahash=res[i]["shahash"];
-			int64 id = watoi64(res[i]["id"]);
-			SIndexKey key(reinterpret_cast<const char*>(shahash.c_str()), watoi64(res[i]["filesize"]), watoi(res[i]["clientid"]));
 
-			int64 next_entry = watoi64(res[i]["next_entry"]);
-			int64 prev_entry = watoi64(res[i]["prev_entry"]);
-			int pointed_to = watoi(res[i]["pointed_to"]);
+			SCreateEntry entry;
+			entry.key = SIndexKey(reinterpret_cast<const char*>(shahash.c_str()), watoi64(res[i]["filesize"]), watoi(res[i]["clientid"]));
+			entry.id = watoi64(res[i]["id"]);
+			entry.next_entry = watoi64(res[i]["next_entry"]);
+			entry.prev_entry = watoi64(res[i]["prev_entry"]);
+			entry.pointed_to = watoi(res[i]["pointed_to"]);
 
-			assert(memcmp(&last, &key, sizeof(SIndexKey))!=1);
-
-			if(key==last)
+			if(!create_add(entry, state, filesdao))
 			{
-				if(last_prev_entry==0)
-				{
-					filesdao.setPrevEntry(id, last_id);
-				}
+				return;
+			}
+		}		
+	}
+	while(!res.empty());
 
-				if(next_entry==0
-					&& (last_prev_entry==0 || last_prev_entry==id) )
-				{
-					filesdao.setNextEntry(last_id, id);
-				}
+	commit_transaction();
+}
 
-				if(pointed_to)
-				{
-					filesdao.setPointedTo(0, id);
-				}
+void LMDBFileIndex::create(ICreateEntrySource* source)
+{
+	begin_txn(0);
 
-				last=key;
-				last_id=id;
-				last_prev_entry=prev_entry;
+	IDatabase *db=Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER_FILES_NEW);
 
-				continue;
-			}
-			else
-			{
-				if(!pointed_to)
-				{
-					filesdao.setPointedTo(1, id);
-				}
-			}
-			
-			put(key, id, MDB_APPEND);
+	ServerFilesDao filesdao(db);
 
-			if(_has_error)
-			{
-				Server->Log("LMDB error after putting element. Error state interrupting..", LL_ERROR);
-				return;
-			}
+	SCreateState state;
+	SCreateEntry entry;
 
-			if(n_done % 1000 == 0 && n_done>0)
-			{
-				if ((Server->getFailBits() & IServer::FAIL_DATABASE_CORRUPTED) ||
-					(Server->getFailBits() & IServer::FAIL_DATABASE_IOERR) ||
-					(Server->getFailBits() & IServer::FAIL_DATABASE_FULL))
-				{
-					Server->Log("Database error. Stopping.", LL_ERROR);
-					return;
-				}
-				Server->Log("File entry index contains "+convert(n_done)+" entries now.", LL_INFO);
-			}
+	while(source->next(entry))
+	{
+		if(!create_add(entry, state, filesdao))
+		{
+			return;
+		}
+	}
 
-			if(n_done % c_create_commit_n == 0 && n_done>0)
-			{
-				commit_transaction();
-				begin_txn(0);
-			}
+	commit_transaction();
+}
 
-			++n_done;
+bool LMDBFileIndex::create_add(const SCreateEntry& entry, SCreateState& state, ServerFilesDao& filesdao)
+{
+	const SIndexKey& key = entry.key;
+	int64 id = entry.id;
 
-			last=key;
-			last_id=id;
-			last_prev_entry=prev_entry;
-		}		
+	assert(memcmp(&state.last, &key, sizeof(SIndexKey))!=1);
+
+	if(key==state.last)
+	{
+		if(state.last_prev_entry==0)
+		{
+			filesdao.setPrevEntry(id, state.last_id);
+		}
+
+		if(entry.next_entry==0
+			&& (state.last_prev_entry==0 || state.last_prev_entry==id) )
+		{
+			filesdao.setNextEntry(state.last_id, id);
+		}
+
+		if(entry.pointed_to)
+		{
+			filesdao.setPointedTo(0, id);
+		}
+
+		state.last=key;
+		state.last_id=id;
+		state.last_prev_entry=entry.prev_entry;
+
+		return true;
 	}
-	while(!res.empty());
+	else
+	{
+		if(!entry.pointed_to)
+		{
+			filesdao.setPointedTo(1, id);
+		}
+	}
+	
+	put(key, id, MDB_APPEND);
 
-	commit_transaction();
+	if(_has_error)
+	{
+		Server->Log("LMDB error after putting element. Error state interrupting..", LL_ERROR);
+		return false;
+	}
+
+	if(state.n_done % 1000 == 0 && state.n_done>0)
+	{
+		if ((Server->getFailBits() & IServer::FAIL_DATABASE_CORRUPTED) ||
+			(Server->getFailBits() & IServer::FAIL_DATABASE_IOERR) ||
+			(Server->getFailBits() & IServer::FAIL_DATABASE_FULL))
+		{
+			Server->Log("Database error. Stopping.", LL_ERROR);
+			return false;
+		}
+		Server->Log("File entry index contains "+convert(state.n_done)+" entries now.", LL_INFO);
+	}
+
+	if(state.n_done % c_create_commit_n == 0 && state.n_done>0)
+	{
+		commit_transaction();
+		begin_txn(0);
+	}
+
+	++state.n_done;
+
+	state.last=key;
+	state.last_id=id;
+	state.last_prev_entry=entry.prev_entry;
+
+	return true;
 }
 
 int64 LMDBFileIndex::get(const LMDBFileIndex::SIndexKey& key)
 {
+	if(!filter_may_contain(key))
+	{
+		return 0;
+	}
+
 	begin_txn(MDB_RDONLY);
 
 	MDB_val mdb_tkey;
@@ -324,6 +446,11 @@ void LMDBFileIndex::put_internal(const SIndexKey& key, int64 value, int flags, b
 	{
 		STransactionLogItem item = { key, value, flags};
 		transaction_log.push_back(item);
+
+		if(filter!=NULL)
+		{
+			filter->add(key);
+		}
 	}
 }
 
@@ -414,12 +541,50 @@ void LMDBFileIndex::del_internal(const SIndexKey& key, bool log, bool handle_eno
 	{
 		STransactionLogItem item = { key, 0, 0 };
 		transaction_log.push_back(item);
+
+		if(filter!=NULL)
+		{
+			filter->removed();
+		}
 	}	
 }
 
 void LMDBFileIndex::commit_transaction(void)
 {
 	commit_transaction_internal(true);
+
+	if(this==fileindex
+		&& filter!=NULL)
+	{
+		check_filter_rebuild();
+	}
+}
+
+void LMDBFileIndex::start_filter_build(int64 n_entries)
+{
+	Server->Log("Building file entry index filter in background...", LL_INFO);
+	filter->reset(n_entries);
+	filter_builder_ticket = Server->getThreadPool()->execute(new FileIndexFilterBuilder(filter, &stop_filter_builder), "fileindex filter");
+}
+
+void LMDBFileIndex::check_filter_rebuild()
+{
+	if(Server->getThreadPool()->isRunning(filter_builder_ticket))
+	{
+		return;
+	}
+
+	int64 last_txnid;
+	int64 n_entries;
+	get_env_state(last_txnid, n_entries);
+
+	//Only called from the writer thread directly after a commit, so there are no
+	//uncommitted entries the builder's read transactions would miss
+	if(filter->needs_rebuild(n_entries))
+	{
+		Server->Log("File entry index filter is too full ("+convert(n_entries)+" entries)", LL_INFO);
+		start_filter_build(n_entries);
+	}
 }
 
 void LMDBFileIndex::commit_transaction_internal(bool handle_enosp)
@@ -588,6 +753,11 @@ size_t LMDBFileIndex::get_map_size()
 
 int64 LMDBFileIndex::get_any_client( const SIndexKey& key )
 {
+	if(!filter_may_contain(key))
+	{
+		return 0;
+	}
+
 	begin_txn(MDB_RDONLY);
 
 	MDB_cursor* cursor;
@@ -628,6 +798,8 @@ int64 LMDBFileIndex::get_any_client( const SIndexKey& key )
 
 	abort_transaction();
 
+	filter_lookup_result(ret!=0);
+
 	return ret;
 }
 
@@ -641,6 +813,11 @@ void LMDBFileIndex::abort_transaction()
 
 std::map<int, int64> LMDBFileIndex::get_all_clients( const SIndexKey& key )
 {
+	if(!filter_may_contain(key))
+	{
+		return std::map<int, int64>();
+	}
+
 	begin_txn(MDB_RDONLY);
 
 	MDB_cursor* cursor;
@@ -685,17 +862,37 @@ std::map<int, int64> LMDBFileIndex::get_all_clients( const SIndexKey& key )
 
 	abort_transaction();
 
+	filter_lookup_result(!ret.empty());
+
 	return ret;
 }
 
 int64 LMDBFileIndex::get_prefer_client( const SIndexKey& key )
 {
+	if(!filter_may_contain(key))
+	{
+		return 0;
+	}
+
 	begin_txn(MDB_RDONLY);
 
 	MDB_cursor* cursor;
 
 	mdb_cursor_open(txn, dbi, &cursor);
 
+	int64 ret = get_prefer_client_cursor(cursor, key);
+
+	mdb_cursor_close(cursor);
+
+	abort_transaction();
+
+	filter_lookup_result(ret!=0);
+
+	return ret;
+}
+
+int64 LMDBFileIndex::get_prefer_client_cursor(MDB_cursor* cursor, const SIndexKey& key)
+{
 	SIndexKey orig_key = key;
 
 	MDB_val mdb_tkey;
@@ -734,6 +931,65 @@ int64 LMDBFileIndex::get_prefer_client( const SIndexKey& key )
 		}
 	}
 
+	return ret;
+}
+
+namespace
+{
+	struct SBatchKeyOrder
+	{
+		SBatchKeyOrder(const std::vector<FileIndex::SIndexKey>& keys)
+			: keys(keys) {}
+
+		bool operator()(size_t a, size_t b) const
+		{
+			return keys[a] < keys[b];
+		}
+
+		const std::vector<FileIndex::SIndexKey>& keys;
+	};
+}
+
+std::vector<int64> LMDBFileIndex::get_prefer_client_batch(const std::vector<SIndexKey>& keys)
+{
+	std::vector<int64> ret;
+	ret.resize(keys.size());
+
+	if(keys.empty())
+	{
+		return ret;
+	}
+
+	//Walk the keys in sorted order so that the cursor mostly stays on the same
+	//or neighbouring leaf pages instead of descending from the root for each key
+	std::vector<size_t> order;
+	order.resize(keys.size());
+	for(size_t i=0;i<keys.size();++i)
+	{
+		order[i]=i;
+	}
+	std::sort(order.begin(), order.end(), SBatchKeyOrder(keys));
+
+	begin_txn(MDB_RDONLY);
+
+	MDB_cursor* cursor;
+
+	mdb_cursor_open(txn, dbi, &cursor);
+
+	for(size_t i=0;i<order.size() && !_has_error;++i)
+	{
+		const SIndexKey& key = keys[order[i]];
+
+		if(!filter_may_contain(key))
+		{
+			continue;
+		}
+
+		ret[order[i]] = get_prefer_client_cursor(cursor, key);
+
+		filter_lookup_result(ret[order[i]]!=0);
+	}
+
 	mdb_cursor_close(cursor);
 
 	abort_transaction();
@@ -741,6 +997,166 @@ int64 LMDBFileIndex::get_prefer_client( const SIndexKey& key )
 	return ret;
 }
 
+bool LMDBFileIndex::filter_may_contain(const SIndexKey& key)
+{
+	if(filter==NULL
+		|| filter->may_contain(key))
+	{
+		return true;
+	}
+
+	++filter_stats.misses;
+	if(++filter_stats_lookups>=c_filter_stats_flush_n)
+	{
+		flush_filter_stats();
+	}
+
+	return false;
+}
+
+void LMDBFileIndex::filter_lookup_result(bool found)
+{
+	if(filter==NULL
+		|| !filter->is_enabled())
+	{
+		return;
+	}
+
+	if(found)
+	{
+		++filter_stats.hits;
+	}
+	else
+	{
+		++filter_stats.false_positives;
+	}
+
+	if(++filter_stats_lookups>=c_filter_stats_flush_n)
+	{
+		flush_filter_stats();
+	}
+}
+
+void LMDBFileIndex::flush_filter_stats()
+{
+	if(filter_stats_lookups==0)
+	{
+		return;
+	}
+
+	FileIndexFilter::add_stats(filter_stats);
+	filter_stats = FileIndexFilter::SFilterStats();
+	filter_stats_lookups=0;
+}
+
+FileIndexFilter::SFilterStats LMDBFileIndex::get_filter_stats()
+{
+	if(filter==NULL)
+	{
+		return FileIndexFilter::SFilterStats();
+	}
+
+	return FileIndexFilter::get_stats();
+}
+
+void LMDBFileIndex::get_env_state(int64& last_txnid, int64& n_entries)
+{
+	IScopedReadLock lock(mutex);
+
+	MDB_envinfo info;
+	mdb_env_info(env, &info);
+	last_txnid = static_cast<int64>(info.me_last_txnid);
+
+	MDB_stat stat;
+	mdb_env_stat(env, &stat);
+	n_entries = static_cast<int64>(stat.ms_entries);
+}
+
+bool LMDBFileIndex::build_filter(FileIndexFilter& filter, volatile bool* do_stop)
+{
+	SIndexKey last_key;
+	bool has_last_key=false;
+	size_t n_done=0;
+
+	while(do_stop==NULL || !*do_stop)
+	{
+		//Use several short read transactions so that a map size increase is not blocked for long
+		begin_txn(MDB_RDONLY);
+
+		if(_has_error)
+		{
+			return false;
+		}
+
+		MDB_cursor* cursor;
+		mdb_cursor_open(txn, dbi, &cursor);
+
+		MDB_val mdb_tkey;
+		mdb_tkey.mv_data=&last_key;
+		mdb_tkey.mv_size=sizeof(SIndexKey);
+
+		MDB_val mdb_tvalue;
+
+		int rc=mdb_cursor_get(cursor, &mdb_tkey, &mdb_tvalue, MDB_SET_RANGE);
+
+		if(rc==0 && has_last_key
+			&& *reinterpret_cast<SIndexKey*>(mdb_tkey.mv_data)==last_key)
+		{
+			rc=mdb_cursor_get(cursor, &mdb_tkey, &mdb_tvalue, MDB_NEXT);
+		}
+
+		size_t n_txn=0;
+		while(rc==0 && n_txn<c_filter_build_txn_n)
+		{
+			last_key = *reinterpret_cast<SIndexKey*>(mdb_tkey.mv_data);
+			has_last_key=true;
+
+			filter.add(last_key);
+
+			++n_txn;
+			rc=mdb_cursor_get(cursor, &mdb_tkey, &mdb_tvalue, MDB_NEXT);
+		}
+
+		mdb_cursor_close(cursor);
+
+		abort_transaction();
+
+		n_done+=n_txn;
+
+		if(rc==MDB_NOTFOUND)
+		{
+			Server->Log("Built file entry index filter with "+convert(n_done)+" entries", LL_INFO);
+			return true;
+		}
+		else if(rc)
+		{
+			Server->Log("LMDB: Failed to read while building filter ("+(std::string)mdb_strerror(rc)+")", LL_ERROR);
+			return false;
+		}
+	}
+
+	return false;
+}
+
+bool LMDBFileIndex::create_filter()
+{
+	int64 last_txnid;
+	int64 n_entries;
+	get_env_state(last_txnid, n_entries);
+
+	Server->Log("Creating file entry index filter...", LL_INFO);
+
+	FileIndexFilter new_filter;
+	new_filter.reset(n_entries);
+
+	if(!build_filter(new_filter, NULL))
+	{
+		return false;
+	}
+
+	return new_filter.save(c_filter_fn, last_txnid);
+}
+
 void LMDBFileIndex::replay_transaction_log()
 {
 	for(size_t i=0;i<transaction_log.size();++i)
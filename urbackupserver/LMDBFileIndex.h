@@ -6,12 +6,31 @@
 #include "lmdb/lmdb.h"
 #endif
 #include "FileIndex.h"
+#include "FileIndexFilter.h"
 #include "../Interface/SharedMutex.h"
 #include <memory>
 
+class ServerFilesDao;
+
 class LMDBFileIndex : public FileIndex
 {
 public:
+	struct SCreateEntry
+	{
+		SIndexKey key;
+		int64 id;
+		int64 next_entry;
+		int64 prev_entry;
+		int pointed_to;
+	};
+
+	//Has to return entries in the order of the files index creation query
+	class ICreateEntrySource
+	{
+	public:
+		virtual bool next(SCreateEntry& entry) = 0;
+	};
+
 	static bool initFileIndex();
 	static void shutdownFileIndex();
 
@@ -27,6 +46,8 @@ public:
 
 	virtual void create(get_data_callback_t get_data_callback, void *userdata);
 
+	void create(ICreateEntrySource* source);
+
 	virtual int64 get(const SIndexKey& key);
 
 	virtual int64 get_any_client(const SIndexKey& key);
@@ -35,6 +56,8 @@ public:
 
 	virtual std::map<int, int64> get_all_clients(const SIndexKey& key);
 
+	virtual std::vector<int64> get_prefer_client_batch(const std::vector<SIndexKey>& keys);
+
 	virtual void start_transaction(void);
 
 	virtual void put(const SIndexKey& key, int64 value);
@@ -54,10 +77,45 @@ public:
 	void abort_transaction();
 
 	size_t get_map_size();
+
+	bool build_filter(FileIndexFilter& filter, volatile bool* do_stop);
+
+	bool create_filter();
+
+	static FileIndexFilter::SFilterStats get_filter_stats();
+
 private:
 
 	void begin_txn(unsigned int flags);
 
+	struct SCreateState
+	{
+		SCreateState()
+			: last_prev_entry(0), last_id(0), n_done(0)
+		{}
+
+		SIndexKey last;
+		int64 last_prev_entry;
+		int64 last_id;
+		size_t n_done;
+	};
+
+	bool create_add(const SCreateEntry& entry, SCreateState& state, ServerFilesDao& filesdao);
+
+	void get_env_state(int64& last_txnid, int64& n_entries);
+
+	static void start_filter_build(int64 n_entries);
+
+	void check_filter_rebuild();
+
+	bool filter_may_contain(const SIndexKey& key);
+
+	void filter_lookup_result(bool found);
+
+	void flush_filter_stats();
+
+	int64 get_prefer_client_cursor(MDB_cursor* cursor, const SIndexKey& key);
+
 	static MDB_env *env;
 	static MDB_dbi dbi;
 	size_t map_size;
@@ -90,5 +148,11 @@ private:
 	static LMDBFileIndex* fileindex;
 	static THREADPOOL_TICKET fileindex_ticket;
 
+	static FileIndexFilter* filter;
+	static THREADPOOL_TICKET filter_builder_ticket;
+	static volatile bool stop_filter_builder;
+	FileIndexFilter::SFilterStats filter_stats;
+	size_t filter_stats_lookups;
+
 	bool no_sync;
 };
\ No newline at end of file
@@ -42,6 +42,68 @@ namespace
 	const char* tmpfile_dirname = ".b68xO+K9SCOF35cLk4Bf9Q";
 }
 
+class ChunkedDownloadWorker : public IThread
+{
+public:
+	ChunkedDownloadWorker(ServerDownloadThread* parent, FileClientChunked* fc_chunked)
+		: parent(parent), fc_chunked(fc_chunked), curr(NULL), do_quit(false)
+	{
+	}
+
+	void operator()()
+	{
+		while (true)
+		{
+			SChunkedDownload* dl;
+			{
+				IScopedLock lock(parent->mutex);
+				while (curr == NULL && !do_quit)
+				{
+					parent->worker_cond->wait(&lock);
+				}
+
+				if (curr == NULL)
+				{
+					break;
+				}
+
+				dl = curr;
+			}
+
+			parent->download_file_patch(dl->todl, fc_chunked, dl->res);
+
+			IScopedLock lock(parent->mutex);
+			dl->done = true;
+			curr = NULL;
+			parent->cond->notify_all();
+		}
+	}
+
+	//Following functions need to be called with parent->mutex locked
+	bool isIdle()
+	{
+		return curr == NULL;
+	}
+
+	void start(SChunkedDownload* dl)
+	{
+		curr = dl;
+		parent->worker_cond->notify_all();
+	}
+
+	void quit()
+	{
+		do_quit = true;
+		parent->worker_cond->notify_all();
+	}
+
+private:
+	ServerDownloadThread* parent;
+	FileClientChunked* fc_chunked;
+	SChunkedDownload* curr;
+	bool do_quit;
+};
+
 ServerDownloadThread::ServerDownloadThread( FileClient& fc, FileClientChunked* fc_chunked, const std::string& backuppath, const std::string& backuppath_hashes, const std::string& last_backuppath, const std::string& last_backuppath_complete, bool hashed_transfer, bool save_incomplete_file, int clientid,
 	const std::string& clientname, const std::string& clientsubname, bool use_tmpfiles, const std::string& tmpfile_path, const std::string& server_token, bool use_reflink, int backupid, bool r_incremental, IPipe* hashpipe_prepare, ClientMain* client_main,
 	int filesrv_protocol_version, int incremental_num, logid_t logid, bool with_hashes, const std::vector<std::string>& shares_without_snapshot, bool with_sparse_hashing, server::FileMetadataDownloadThread* file_metadata_download, bool sc_failure_fatal,
@@ -53,10 +115,12 @@ ServerDownloadThread::ServerDownloadThread( FileClient& fc, FileClientChunked* f
 	is_offline(false), client_main(client_main), filesrv_protocol_version(filesrv_protocol_version), skipping(false), queue_size(0),
 	all_downloads_ok(true), incremental_num(incremental_num), logid(logid), has_timeout(false), with_hashes(with_hashes), with_metadata(client_main->getProtocolVersions().file_meta>0), shares_without_snapshot(shares_without_snapshot),
 	with_sparse_hashing(with_sparse_hashing), exp_backoff(false), num_embedded_metadata_files(0), file_metadata_download(file_metadata_download), num_issues(0), last_snap_num_issues(0), has_disk_error(false), sc_failure_fatal(sc_failure_fatal),
-	tmpfile_num(0), filepath_corrections(filepath_corrections), max_file_id(max_file_id)
+	tmpfile_num(0), filepath_corrections(filepath_corrections), max_file_id(max_file_id), hash_data_direct(false),
+	held_back_hash_data(0), max_held_back_hash_data(1000)
 {
 	mutex = Server->createMutex();
 	cond = Server->createCondition();
+	worker_cond = Server->createCondition();
 
 	if (BackupServer::useTreeHashing())
 	{
@@ -70,8 +134,18 @@ ServerDownloadThread::ServerDownloadThread( FileClient& fc, FileClientChunked* f
 
 ServerDownloadThread::~ServerDownloadThread()
 {
+	for (size_t i = 0; i < chunked_workers.size(); ++i)
+	{
+		delete chunked_workers[i];
+	}
+	for (size_t i = 0; i < fc_chunked_parallel.size(); ++i)
+	{
+		delete fc_chunked_parallel[i];
+	}
+
 	Server->destroy(mutex);
 	Server->destroy(cond);
+	Server->destroy(worker_cond);
 }
 
 void ServerDownloadThread::operator()( void )
@@ -86,15 +160,38 @@ void ServerDownloadThread::operator()( void )
 		fc.setQueueCallback(this);
 	}
 
+	for (size_t i = 0; i < fc_chunked_parallel.size(); ++i)
+	{
+		ChunkedDownloadWorker* worker = new ChunkedDownloadWorker(this, fc_chunked_parallel[i]);
+		chunked_workers.push_back(worker);
+		chunked_worker_tickets.push_back(Server->getThreadPool()->execute(worker, "fbackup load chunked"));
+	}
+
 	while(true)
 	{
+		finishChunkedDownloads(false);
+
+		//Hash messages of files downloaded meanwhile are held back until the
+		//parallel downloads before them are done. Stop taking new items if
+		//too many are waiting.
+		while (held_back_hash_data >= max_held_back_hash_data
+			&& finishChunkedDownload(true))
+		{
+		}
+
 		SQueueItem curr;
 		{
 			IScopedLock lock(mutex);
-			while(dl_queue.empty())
+			while(dl_queue.empty() && !hasFinishedChunkedDownload())
 			{
 				cond->wait(&lock);
 			}
+
+			if (dl_queue.empty())
+			{
+				continue;
+			}
+
 			curr = dl_queue.front();
 			dl_queue.pop_front();
 
@@ -111,6 +208,13 @@ void ServerDownloadThread::operator()( void )
 			}			
 		}
 
+		if (curr.action == EQueueAction_Quit
+			|| curr.action == EQueueAction_StartShadowcopy
+			|| curr.action == EQueueAction_StopShadowcopy)
+		{
+			finishChunkedDownloads(true);
+		}
+
 		if(curr.action==EQueueAction_Quit)
 		{
 			IScopedLock lock(mutex);
@@ -225,7 +329,33 @@ void ServerDownloadThread::operator()( void )
 		}
 		else if(curr.fileclient== EFileClient_Chunked)
 		{
-			ret = load_file_patch(curr);
+			ChunkedDownloadWorker* worker = NULL;
+			if (!curr.is_script && !curr.queued)
+			{
+				worker = getIdleChunkedWorker();
+			}
+
+			if (worker != NULL)
+			{
+				bool queued_full;
+				ret = prepare_file_patch(curr, queued_full);
+
+				if (ret && !queued_full)
+				{
+					ServerLogger::Log(logid, "Loading file patch for \"" + curr.fn + "\" on parallel connection", LL_DEBUG);
+
+					SChunkedDownload* dl = new SChunkedDownload;
+					dl->todl = curr;
+					chunked_inflight.push_back(dl);
+
+					IScopedLock lock(mutex);
+					worker->start(dl);
+				}
+			}
+			else
+			{
+				ret = load_file_patch(curr);
+			}
 		}
 
 		if(!ret)
@@ -235,6 +365,21 @@ void ServerDownloadThread::operator()( void )
 		}
 	}
 
+	finishChunkedDownloads(true);
+
+	if (!chunked_workers.empty())
+	{
+		{
+			IScopedLock lock(mutex);
+			for (size_t i = 0; i < chunked_workers.size(); ++i)
+			{
+				chunked_workers[i]->quit();
+			}
+		}
+
+		Server->getThreadPool()->waitFor(chunked_worker_tickets);
+	}
+
 	if(!is_offline && !skipping && client_main->getProtocolVersions().file_meta>0)
 	{
 		_u32 rc = fc.InformMetadataStreamEnd(server_token, 3);
@@ -743,15 +888,29 @@ bool ServerDownloadThread::link_or_copy_file(const SQueueItem& todl)
 
 bool ServerDownloadThread::load_file_patch(SQueueItem todl)
 {
-	std::string cfn=todl.curr_path+"/"+todl.fn;
-	if(cfn[0]=='/')
-		cfn.erase(0,1);
+	bool queued_full;
+	if (!prepare_file_patch(todl, queued_full))
+	{
+		return false;
+	}
 
-	if(todl.is_script)
+	if (queued_full)
 	{
-		cfn = "SCRIPT|" + cfn + "|" + convert(incremental_num) + "|" + convert(todl.script_random)+"|"+server_token;
+		return true;
 	}
 
+	ServerLogger::Log(logid, "Loading file patch for \""+todl.fn+"\"", LL_DEBUG);
+
+	SPatchDownloadResult res;
+	download_file_patch(todl, fc_chunked, res);
+
+	return finish_file_patch(todl, res);
+}
+
+bool ServerDownloadThread::prepare_file_patch(SQueueItem& todl, bool& queued_full)
+{
+	queued_full = false;
+
 	bool full_dl=false;
 	SPatchDownloadFiles& dlfiles = todl.patch_dl_files;
 	if(!dlfiles.prepared && !dlfiles.prepare_error)
@@ -763,71 +922,106 @@ bool ServerDownloadThread::load_file_patch(SQueueItem todl)
             addToQueueFull(todl.id, todl.fn, todl.short_fn, todl.curr_path, todl.os_path,
 				todl.predicted_filesize, todl.metadata, todl.is_script, todl.metadata_only, todl.folder_items, todl.sha_dig,
 				true, todl.script_random, todl.display_fn);
+			queued_full = true;
 			return true;
 		}
 	}
 
-	if(dlfiles.prepare_error)
-	{
-		return false;
-	}
-
-
-	ServerLogger::Log(logid, "Loading file patch for \""+todl.fn+"\"", LL_DEBUG);
+	return !dlfiles.prepare_error;
+}
 
-	ScopedDeleteFile pfd_destroy(dlfiles.patchfile);
-	ScopedDeleteFile hash_tmp_destroy(dlfiles.hashoutput);
-	ScopedDeleteFile hashfile_old_destroy(NULL);
-	ObjectScope file_old_destroy(dlfiles.orig_file);
-	ObjectScope hashfile_old_delete(dlfiles.chunkhashes);
+void ServerDownloadThread::download_file_patch(SQueueItem& todl, FileClientChunked* curr_fc_chunked, SPatchDownloadResult& res)
+{
+	std::string cfn=todl.curr_path+"/"+todl.fn;
+	if(cfn[0]=='/')
+		cfn.erase(0,1);
 
-	if(dlfiles.delete_chunkhashes)
+	if(todl.is_script)
 	{
-		hashfile_old_destroy.reset(dlfiles.chunkhashes);
-		hashfile_old_delete.release();
+		cfn = "SCRIPT|" + cfn + "|" + convert(incremental_num) + "|" + convert(todl.script_random)+"|"+server_token;
 	}
-
-	if(!server_token.empty() && !todl.is_script)
+	else if(!server_token.empty())
 	{
 		cfn=server_token+"|"+cfn;
 	}
 
-	int64 script_start_time = Server->getTimeSeconds()-60;
+	res.cfn = cfn;
+
+	SPatchDownloadFiles& dlfiles = todl.patch_dl_files;
 
-	IFile* sparse_extents_f=NULL;
-	_u32 rc=fc_chunked->GetFilePatch((cfn), dlfiles.orig_file, dlfiles.patchfile, dlfiles.chunkhashes, dlfiles.hashoutput,
-		todl.predicted_filesize, with_metadata ? (todl.id+1) : 0, todl.is_script, &sparse_extents_f);
+	res.script_start_time = Server->getTimeSeconds()-60;
 
-	int64 download_filesize = todl.predicted_filesize;
+	res.rc=curr_fc_chunked->GetFilePatch((cfn), dlfiles.orig_file, dlfiles.patchfile, dlfiles.chunkhashes, dlfiles.hashoutput,
+		todl.predicted_filesize, with_metadata ? (todl.id+1) : 0, todl.is_script, &res.sparse_extents_f);
+
+	res.download_filesize = todl.predicted_filesize;
 
 	int hash_retries=5;
-	while(rc==ERR_HASH && hash_retries>0)
+	while(res.rc==ERR_HASH && hash_retries>0)
 	{
 		ServerLogger::Log(logid, "Corrupted data while loading patch for \"" + todl.fn + "\". Retrying...", LL_WARNING);
 
 		dlfiles.orig_file->Seek(0);
-		dlfiles.patchfile= getTempFile();
-		if(dlfiles.patchfile==NULL)
+		IFsFile* patchfile = getTempFile();
+		if(patchfile==NULL)
 		{
 			ServerLogger::Log(logid, "Error creating temporary file 'pfd' in load_file_patch", LL_ERROR);
-			return false;
+			res.tmpfile_error = true;
+			return;
 		}
-		pfd_destroy.reset(dlfiles.patchfile);
-		dlfiles.hashoutput= getTempFile();
-		if(dlfiles.hashoutput==NULL)
+		ScopedDeleteFile pfd_destroy(dlfiles.patchfile);
+		dlfiles.patchfile = patchfile;
+		IFsFile* hashoutput = getTempFile();
+		if(hashoutput==NULL)
 		{
 			ServerLogger::Log(logid, "Error creating temporary file 'hash_tmp' in load_file_patch -2", LL_ERROR);
-			return false;
+			res.tmpfile_error = true;
+			return;
 		}
-		hash_tmp_destroy.reset(dlfiles.hashoutput);
+		ScopedDeleteFile hash_tmp_destroy(dlfiles.hashoutput);
+		dlfiles.hashoutput = hashoutput;
 		dlfiles.chunkhashes->Seek(0);
-		download_filesize = todl.predicted_filesize;
-		rc=fc_chunked->GetFilePatch((cfn), dlfiles.orig_file, dlfiles.patchfile, dlfiles.chunkhashes, dlfiles.hashoutput,
-			download_filesize, with_metadata ? (todl.id+1) : 0, todl.is_script, &sparse_extents_f);
+		res.download_filesize = todl.predicted_filesize;
+		res.rc=curr_fc_chunked->GetFilePatch((cfn), dlfiles.orig_file, dlfiles.patchfile, dlfiles.chunkhashes, dlfiles.hashoutput,
+			res.download_filesize, with_metadata ? (todl.id+1) : 0, todl.is_script, &res.sparse_extents_f);
 		--hash_retries;
 	}
 
-	ScopedDeleteFile sparse_extents_f_delete(sparse_extents_f);
+	if(res.rc==ERR_ERRORCODES)
+	{
+		res.errorcode_str = curr_fc_chunked->getErrorcodeString();
+		res.errorcode1 = curr_fc_chunked->getErrorcode1();
+	}
+}
+
+bool ServerDownloadThread::finish_file_patch(SQueueItem& todl, SPatchDownloadResult& res)
+{
+	SPatchDownloadFiles& dlfiles = todl.patch_dl_files;
+
+	ScopedDeleteFile pfd_destroy(dlfiles.patchfile);
+	ScopedDeleteFile hash_tmp_destroy(dlfiles.hashoutput);
+	ScopedDeleteFile hashfile_old_destroy(NULL);
+	ObjectScope file_old_destroy(dlfiles.orig_file);
+	ObjectScope hashfile_old_delete(dlfiles.chunkhashes);
+
+	if(dlfiles.delete_chunkhashes)
+	{
+		hashfile_old_destroy.reset(dlfiles.chunkhashes);
+		hashfile_old_delete.release();
+	}
+
+	ScopedDeleteFile sparse_extents_f_delete(res.sparse_extents_f);
+
+	if(res.tmpfile_error)
+	{
+		return false;
+	}
+
+	const std::string& cfn = res.cfn;
+	_u32 rc = res.rc;
+	int64 download_filesize = res.download_filesize;
+	int64 script_start_time = res.script_start_time;
+	IFile* sparse_extents_f = res.sparse_extents_f;
 
 	if(download_filesize<0)
 	{
@@ -850,10 +1044,10 @@ bool ServerDownloadThread::load_file_patch(SQueueItem todl)
 
 		if(rc==ERR_ERRORCODES)
 		{
-			ServerLogger::Log(logid, "Remote Error: "+fc_chunked->getErrorcodeString(), LL_ERROR);
+			ServerLogger::Log(logid, "Remote Error: "+res.errorcode_str, LL_ERROR);
 			exp_backoff = true;
 
-			if (fc_chunked->getErrorcode1() == ERR_READING_FAILED)
+			if (res.errorcode1 == ERR_READING_FAILED)
 			{
 				rc = ERR_READ_ERROR;
 			}
@@ -1039,7 +1233,101 @@ void ServerDownloadThread::hashFile(int64 fileid, std::string dstpath, std::stri
 		}
 		
 	}
-	hashpipe_prepare->Write(data.getDataPtr(), data.getDataSize() );
+	writeHashData(data);
+}
+
+void ServerDownloadThread::writeHashData(CWData& data)
+{
+	//The hash pipeline has to see the files in queue order (see MaxFileId).
+	//Hold back everything queued after a download still running on a parallel connection
+	if (!hash_data_direct && !chunked_inflight.empty())
+	{
+		chunked_inflight.back()->hash_data_after.push_back(std::string(data.getDataPtr(), data.getDataSize()));
+		++held_back_hash_data;
+	}
+	else
+	{
+		hashpipe_prepare->Write(data.getDataPtr(), data.getDataSize());
+	}
+}
+
+void ServerDownloadThread::addChunkedConnection(FileClientChunked* fc_chunked)
+{
+	fc_chunked_parallel.push_back(fc_chunked);
+}
+
+void ServerDownloadThread::setMaxHeldBackHashData(size_t n)
+{
+	max_held_back_hash_data = n;
+}
+
+ChunkedDownloadWorker* ServerDownloadThread::getIdleChunkedWorker()
+{
+	IScopedLock lock(mutex);
+	for (size_t i = 0; i < chunked_workers.size(); ++i)
+	{
+		if (chunked_workers[i]->isIdle())
+		{
+			return chunked_workers[i];
+		}
+	}
+	return NULL;
+}
+
+bool ServerDownloadThread::hasFinishedChunkedDownload()
+{
+	return !chunked_inflight.empty()
+		&& chunked_inflight.front()->done;
+}
+
+bool ServerDownloadThread::finishChunkedDownload(bool wait)
+{
+	if (chunked_inflight.empty())
+	{
+		return false;
+	}
+
+	SChunkedDownload* dl = chunked_inflight.front();
+	{
+		IScopedLock lock(mutex);
+		while (!dl->done)
+		{
+			if (!wait)
+			{
+				return false;
+			}
+			cond->wait(&lock);
+		}
+	}
+
+	chunked_inflight.pop_front();
+
+	hash_data_direct = true;
+	bool ret = finish_file_patch(dl->todl, dl->res);
+	hash_data_direct = false;
+
+	for (size_t i = 0; i < dl->hash_data_after.size(); ++i)
+	{
+		hashpipe_prepare->Write(dl->hash_data_after[i]);
+	}
+	held_back_hash_data -= dl->hash_data_after.size();
+
+	delete dl;
+
+	if (!ret)
+	{
+		IScopedLock lock(mutex);
+		is_offline = true;
+	}
+
+	return true;
+}
+
+void ServerDownloadThread::finishChunkedDownloads(bool wait)
+{
+	while (finishChunkedDownload(wait))
+	{
+	}
 }
 
 bool ServerDownloadThread::isOffline()
@@ -1154,7 +1442,11 @@ IFsFile * ServerDownloadThread::getTempFile()
 	IFsFile *pfd = NULL;
 	while (pfd == NULL)
 	{
-		size_t num = tmpfile_num++;
+		size_t num;
+		{
+			IScopedLock lock(mutex);
+			num = tmpfile_num++;
+		}
 			
 		std::string fn = backuppath + os_file_sep() + tmpfile_dirname + os_file_sep() + convert(num);
 		pfd = Server->openFile(os_file_prefix(fn), MODE_RW_CREATE);
@@ -1462,6 +1754,11 @@ bool ServerDownloadThread::stop_shadowcopy(std::string path)
 		fc_chunked->freeFile();
 	}
 
+	for (size_t i = 0; i < fc_chunked_parallel.size(); ++i)
+	{
+		fc_chunked_parallel[i]->freeFile();
+	}
+
 	bool in_use_log = false;
 	bool in_use = false;
 	bool fret = true;
@@ -21,6 +21,8 @@ class FileClient;
 class FileClientChunked;
 class FilePathCorrections;
 class MaxFileId;
+class ChunkedDownloadWorker;
+class CWData;
 
 namespace server {
 	class FileMetadataDownloadThread;
@@ -92,6 +94,37 @@ namespace
 		unsigned int script_random;
 		bool switched;
 	};
+
+	struct SPatchDownloadResult
+	{
+		SPatchDownloadResult()
+			: rc(ERR_SUCCESS), download_filesize(-1), sparse_extents_f(NULL),
+			tmpfile_error(false), errorcode1(0), script_start_time(0)
+		{
+		}
+
+		_u32 rc;
+		std::string cfn;
+		int64 download_filesize;
+		IFile* sparse_extents_f;
+		bool tmpfile_error;
+		std::string errorcode_str;
+		_u32 errorcode1;
+		int64 script_start_time;
+	};
+
+	struct SChunkedDownload
+	{
+		SChunkedDownload()
+			: done(false)
+		{
+		}
+
+		SQueueItem todl;
+		SPatchDownloadResult res;
+		bool done;
+		std::vector<std::string> hash_data_after;
+	};
 	
 	
 	class IdRange
@@ -141,6 +174,7 @@ namespace
 
 class ServerDownloadThread : public IThread, public FileClient::QueueCallback, public FileClientChunked::QueueCallback
 {
+	friend class ChunkedDownloadWorker;
 public:
 	ServerDownloadThread(FileClient& fc, FileClientChunked* fc_chunked, const std::string& backuppath, const std::string& backuppath_hashes, const std::string& last_backuppath, const std::string& last_backuppath_complete, bool hashed_transfer, bool save_incomplete_file, int clientid,
 		const std::string& clientname, const std::string& clientsubname,
@@ -169,6 +203,10 @@ public:
 	void queueSkip();
 
 	void queueScriptEnd(const SQueueItem &todl);
+
+	void addChunkedConnection(FileClientChunked* fc_chunked);
+
+	void setMaxHeldBackHashData(size_t n);
 	
 	bool load_file(SQueueItem todl);
 		
@@ -223,6 +261,22 @@ private:
 
 	SPatchDownloadFiles preparePatchDownloadFiles(const SQueueItem& todl, bool& full_dl);
 
+	bool prepare_file_patch(SQueueItem& todl, bool& queued_full);
+
+	void download_file_patch(SQueueItem& todl, FileClientChunked* curr_fc_chunked, SPatchDownloadResult& res);
+
+	bool finish_file_patch(SQueueItem& todl, SPatchDownloadResult& res);
+
+	ChunkedDownloadWorker* getIdleChunkedWorker();
+
+	bool hasFinishedChunkedDownload();
+
+	bool finishChunkedDownload(bool wait);
+
+	void finishChunkedDownloads(bool wait);
+
+	void writeHashData(CWData& data);
+
 	bool start_shadowcopy(std::string path);
 
 	bool stop_shadowcopy(std::string path);
@@ -308,4 +362,13 @@ private:
 	size_t tmpfile_num;
 
 	MaxFileId& max_file_id;
+
+	std::vector<FileClientChunked*> fc_chunked_parallel;
+	std::vector<ChunkedDownloadWorker*> chunked_workers;
+	std::vector<THREADPOOL_TICKET> chunked_worker_tickets;
+	ICondition* worker_cond;
+	std::deque<SChunkedDownload*> chunked_inflight;
+	bool hash_data_direct;
+	size_t held_back_hash_data;
+	size_t max_held_back_hash_data;
 };
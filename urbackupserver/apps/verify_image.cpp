@@ -0,0 +1,368 @@
+/*************************************************************************
+*    UrBackup - Client/Server backup system
+*    Copyright (C) 2011-2016 Martin Raiber
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU Affero General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU Affero General Public License for more details.
+*
+*    You should have received a copy of the GNU Affero General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**************************************************************************/
+
+#include "app.h"
+#include "../../Interface/File.h"
+#include "../../Interface/Mutex.h"
+#include "../../Interface/Thread.h"
+#include "../../Interface/ThreadPool.h"
+#include "../../fsimageplugin/IFSImageFactory.h"
+#include "../../fsimageplugin/IVHDFile.h"
+#include "../../urbackupcommon/sha2/sha2.h"
+#include "../../urbackupcommon/os_functions.h"
+#include "../../stringtools.h"
+#include <iostream>
+#include <memory>
+#include <set>
+#include <memory.h>
+#include <algorithm>
+
+extern IFSImageFactory *image_fak;
+
+namespace
+{
+	//Image data covered by one hash in the .hash file
+	const int64 c_hash_blocksize = 512 * 1024;
+	//Offset of the volume in volume images (see ImageBackup::writeMBR)
+	const int64 c_mbr_size = 512 * 1024;
+	const int64 c_batch_blocks = 64;
+	const unsigned int sha_size = 32;
+
+	struct SVerifyImage
+	{
+		SVerifyImage(int id, const std::string& path, int parent_id)
+			: id(id), path(path), parent_id(parent_id)
+		{}
+
+		int id;
+		std::string path;
+		int parent_id;
+	};
+
+	struct SVerifyState
+	{
+		SVerifyState()
+			: mutex(Server->createMutex()), vhd(NULL), hashfile(NULL),
+			volume_offset(0), volume_size(0), n_blocks(0), skip_inherited(false),
+			next_block(0), n_checked(0), n_skipped(0), has_error(false)
+		{}
+
+		std::auto_ptr<IMutex> mutex;
+		IVHDFile* vhd;
+		IFile* hashfile;
+		int64 volume_offset;
+		int64 volume_size;
+		int64 n_blocks;
+		bool skip_inherited;
+
+		int64 next_block;
+		int64 n_checked;
+		int64 n_skipped;
+		std::vector<int64> failed_blocks;
+		bool has_error;
+	};
+
+	class VerifyImageThread : public IThread
+	{
+	public:
+		VerifyImageThread(SVerifyState& state)
+			: state(state)
+		{}
+
+		void operator()()
+		{
+			std::vector<char> buf(c_hash_blocksize);
+			std::vector<char> hashes(c_batch_blocks*sha_size);
+			std::vector<char> skip(c_batch_blocks);
+			std::vector<int64> failed;
+
+			while (true)
+			{
+				int64 start;
+				int64 n;
+				{
+					IScopedLock lock(state.mutex.get());
+					if (state.next_block >= state.n_blocks
+						|| state.has_error)
+					{
+						return;
+					}
+
+					start = state.next_block;
+					n = (std::min)(c_batch_blocks, state.n_blocks - start);
+					state.next_block += n;
+
+					//Seek is not thread-safe, ReadAt is
+					for (int64 i = 0; i < n; ++i)
+					{
+						skip[i] = state.skip_inherited
+							&& state.vhd->Seek(state.volume_offset + (start + i)*c_hash_blocksize)
+							&& !state.vhd->this_has_sector(c_hash_blocksize);
+					}
+				}
+
+				if (state.hashfile->Read(start*sha_size, hashes.data(), static_cast<_u32>(n*sha_size)) != n*sha_size)
+				{
+					Server->Log("Error reading hashes of blocks " + convert(start) + " to " + convert(start + n) + " from " + state.hashfile->getFilename() + ". " + os_last_error_str(), LL_ERROR);
+					setError();
+					return;
+				}
+
+				int64 n_checked = 0;
+				int64 n_skipped = 0;
+				failed.clear();
+
+				for (int64 i = 0; i < n; ++i)
+				{
+					if (skip[i])
+					{
+						++n_skipped;
+						continue;
+					}
+
+					int64 block = start + i;
+					size_t toread = static_cast<size_t>((std::min)(c_hash_blocksize, state.volume_size - block*c_hash_blocksize));
+					size_t read;
+					if (!state.vhd->ReadAt(state.volume_offset + block*c_hash_blocksize, buf.data(), toread, read)
+						|| read != toread)
+					{
+						Server->Log("Error reading block " + convert(block) + " from image " + state.vhd->getFilename(), LL_ERROR);
+						setError();
+						return;
+					}
+
+					unsigned char dig[sha_size];
+					sha256(reinterpret_cast<unsigned char*>(buf.data()), static_cast<unsigned int>(toread), dig);
+
+					if (memcmp(dig, &hashes[i*sha_size], sha_size) != 0)
+					{
+						failed.push_back(block);
+					}
+
+					++n_checked;
+				}
+
+				IScopedLock lock(state.mutex.get());
+				state.n_checked += n_checked;
+				state.n_skipped += n_skipped;
+				state.failed_blocks.insert(state.failed_blocks.end(), failed.begin(), failed.end());
+			}
+		}
+
+	private:
+		void setError()
+		{
+			IScopedLock lock(state.mutex.get());
+			state.has_error = true;
+		}
+
+		SVerifyState& state;
+	};
+
+	bool verify_image_file(const std::string& path, bool skip_inherited, size_t n_threads)
+	{
+		IFSImageFactory::ImageFormat format = IFSImageFactory::ImageFormat_VHD;
+		if (findextension(path) == "raw")
+		{
+			format = IFSImageFactory::ImageFormat_RawCowFile;
+		}
+
+		std::auto_ptr<IVHDFile> vhd(image_fak->createVHDFile(os_file_prefix(path), true, 0,
+			2 * 1024 * 1024, false, format));
+
+		if (vhd.get() == NULL
+			|| !vhd->isOpen())
+		{
+			Server->Log("Error opening image \"" + path + "\"", LL_ERROR);
+			return false;
+		}
+
+		std::auto_ptr<IFile> hashfile(Server->openFile(os_file_prefix(path + ".hash"), MODE_READ));
+		if (hashfile.get() == NULL)
+		{
+			Server->Log("Error opening hash file \"" + path + ".hash\". " + os_last_error_str(), LL_ERROR);
+			return false;
+		}
+
+		SVerifyState state;
+		state.vhd = vhd.get();
+		state.hashfile = hashfile.get();
+		state.skip_inherited = skip_inherited;
+
+		int64 image_size = static_cast<int64>(vhd->getSize());
+		int64 n_hashes = hashfile->Size() / sha_size;
+
+		//Volume images have one more hash block sized area (the MBR) than hashes
+		if (!Server->getServerParameter("verify_image_offset").empty())
+		{
+			state.volume_offset = watoi64(Server->getServerParameter("verify_image_offset"));
+		}
+		else if ((image_size + c_hash_blocksize - 1) / c_hash_blocksize > n_hashes)
+		{
+			state.volume_offset = c_mbr_size;
+		}
+
+		state.volume_size = image_size - state.volume_offset;
+		state.n_blocks = (state.volume_size + c_hash_blocksize - 1) / c_hash_blocksize;
+
+		if (n_hashes != state.n_blocks)
+		{
+			Server->Log("Hash file of \"" + path + "\" has " + convert(n_hashes) + " hashes. Expected " + convert(state.n_blocks), LL_WARNING);
+			state.n_blocks = (std::min)(state.n_blocks, n_hashes);
+		}
+
+		std::cout << "Checking image \"" << path << "\"";
+		if (skip_inherited)
+		{
+			std::cout << " (skipping blocks of verified parent)";
+		}
+		std::cout << ": " << std::flush;
+
+		std::vector<VerifyImageThread*> threads;
+		std::vector<THREADPOOL_TICKET> tickets;
+		for (size_t i = 0; i < n_threads; ++i)
+		{
+			threads.push_back(new VerifyImageThread(state));
+			tickets.push_back(Server->getThreadPool()->execute(threads[i], "verify image"));
+		}
+
+		Server->getThreadPool()->waitFor(tickets);
+
+		for (size_t i = 0; i < threads.size(); ++i)
+		{
+			delete threads[i];
+		}
+
+		if (state.has_error)
+		{
+			std::cout << "FAILED (read error)" << std::endl;
+			return false;
+		}
+
+		if (!state.failed_blocks.empty())
+		{
+			std::sort(state.failed_blocks.begin(), state.failed_blocks.end());
+			std::cout << "FAILED (" << state.failed_blocks.size() << " of " << state.n_checked << " blocks wrong)" << std::endl;
+			for (size_t i = 0; i < state.failed_blocks.size(); ++i)
+			{
+				Server->Log("Checksum of block " + convert(state.failed_blocks[i]) + " at image offset "
+					+ convert(state.volume_offset + state.failed_blocks[i] * c_hash_blocksize) + " of \"" + path + "\" wrong", LL_ERROR);
+			}
+			return false;
+		}
+
+		std::cout << "OK (" << state.n_checked << " blocks checked, " << state.n_skipped << " inherited blocks skipped)" << std::endl;
+		return true;
+	}
+}
+
+int verify_image()
+{
+	str_map params;
+	image_fak = (IFSImageFactory *)Server->getPlugin(Server->getThreadID(), Server->StartPlugin("fsimageplugin", params));
+	if (image_fak == NULL)
+	{
+		Server->Log("Error loading fsimageplugin", LL_ERROR);
+		return 1;
+	}
+
+	std::string verify_image = Server->getServerParameter("verify_image");
+	if (verify_image.empty())
+	{
+		Server->Log("Image to verify not specified. Use verify_image=<path> or verify_image=all", LL_ERROR);
+		return 1;
+	}
+
+	size_t n_threads = static_cast<size_t>(watoi(Server->getServerParameter("verify_threads")));
+	if (n_threads == 0)
+	{
+		n_threads = os_get_num_cpus();
+	}
+
+	std::vector<SVerifyImage> images;
+
+	if (verify_image == "all")
+	{
+		open_server_database(true);
+
+		IDatabase *db = Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER);
+		if (db == NULL)
+		{
+			Server->Log("Could not open server database", LL_ERROR);
+			return 1;
+		}
+
+		//Ordered by id so that parents are verified before their children
+		IQuery* q_images;
+		std::string clientid = Server->getServerParameter("verify_clientid");
+		if (clientid.empty())
+		{
+			q_images = db->Prepare("SELECT id, path, incremental_ref FROM backup_images WHERE complete=1 ORDER BY id ASC", false);
+		}
+		else
+		{
+			q_images = db->Prepare("SELECT id, path, incremental_ref FROM backup_images WHERE complete=1 AND clientid=? ORDER BY id ASC", false);
+			q_images->Bind(watoi(clientid));
+		}
+
+		db_results res = q_images->Read();
+		db->destroyQuery(q_images);
+
+		for (size_t i = 0; i < res.size(); ++i)
+		{
+			images.push_back(SVerifyImage(watoi(res[i]["id"]), res[i]["path"], watoi(res[i]["incremental_ref"])));
+		}
+	}
+	else
+	{
+		images.push_back(SVerifyImage(0, verify_image, 0));
+	}
+
+	std::set<int> verified_ids;
+	std::vector<std::string> failed_images;
+	for (size_t i = 0; i < images.size(); ++i)
+	{
+		const SVerifyImage& image = images[i];
+		bool skip_inherited = image.parent_id != 0
+			&& verified_ids.find(image.parent_id) != verified_ids.end();
+
+		if (verify_image_file(image.path, skip_inherited, n_threads))
+		{
+			verified_ids.insert(image.id);
+		}
+		else
+		{
+			failed_images.push_back(image.path);
+		}
+	}
+
+	if (!failed_images.empty())
+	{
+		std::cerr << "~~~~~~~~ SUMMARY ~~~~~~~~~~~" << std::endl;
+		for (size_t i = 0; i < failed_images.size(); ++i)
+		{
+			std::cerr << "FAILED: " << failed_images[i] << std::endl;
+		}
+
+		std::cerr << "Check failed for " << failed_images.size() << " images (successful: " << images.size() - failed_images.size() << " images)" << std::endl;
+		return 2;
+	}
+
+	std::cout << "Check successful for " << images.size() << " images. No failures." << std::endl;
+	return 0;
+}
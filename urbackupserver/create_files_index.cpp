@@ -27,6 +27,9 @@
 #include "../urbackupcommon/os_functions.h"
 #include "serverinterface/helper.h"
 #include "dao/ServerBackupDao.h"
+#include "../Interface/ThreadPool.h"
+#include <algorithm>
+#include <memory>
 
 namespace
 {
@@ -71,7 +74,565 @@ db_results create_callback(size_t n_done, size_t n_rows, void *userdata)
 	return ret;
 }
 
-bool create_files_index_common(FileIndex& fileindex, SStartupStatus& status)
+const int64 parallel_scan_chunk_ids = 1000000;
+const size_t parallel_merge_buffer_entries = 4096;
+//Maximum number of runs merged at once. More runs are merged in multiple passes
+const size_t parallel_merge_max_runs = 64;
+const size_t parallel_max_threads = 8;
+
+#pragma pack(1)
+struct SSortEntry
+{
+	FileIndex::SIndexKey key;
+	int64 created;
+	int64 id;
+	int64 next_entry;
+	int64 prev_entry;
+	int pointed_to;
+
+	//Same order as "ORDER BY shahash ASC, filesize ASC, clientid ASC, created DESC"
+	bool operator<(const SSortEntry& other) const
+	{
+		if (key != other.key)
+		{
+			return key < other.key;
+		}
+		if (created != other.created)
+		{
+			return created > other.created;
+		}
+		return id > other.id;
+	}
+};
+#pragma pack()
+
+void update_progress(SStartupStatus& status, double pc_done, int64 starttime)
+{
+	int last_pc = static_cast<int>(status.pc_done * 1000 + 0.5);
+
+	status.pc_done = pc_done;
+
+	int64 passed_time = Server->getTimeMS() - starttime;
+	if (pc_done > 0.001)
+	{
+		status.eta_ms = static_cast<int64>(passed_time / pc_done) - passed_time;
+	}
+
+	int curr_pc = static_cast<int>(status.pc_done * 1000 + 0.5);
+
+	if (curr_pc != last_pc)
+	{
+		std::string eta;
+		if (status.eta_ms >= 0)
+		{
+			eta = " ETA: " + PrettyPrintTime(status.eta_ms);
+		}
+		Server->Log("Creating files index: " + convert((double)curr_pc / 10) + "% finished." + eta, LL_INFO);
+	}
+}
+
+class ParallelScanState
+{
+public:
+	ParallelScanState(int64 max_id, SStartupStatus& status)
+		: mutex(Server->createMutex()), next_start_id(0), max_id(max_id),
+		has_error(false), n_read(0), n_runs(0), status(status), starttime(Server->getTimeMS())
+	{
+	}
+
+	~ParallelScanState()
+	{
+		Server->destroy(mutex);
+	}
+
+	bool nextRange(int64& start_id, int64& end_id)
+	{
+		IScopedLock lock(mutex);
+		if (next_start_id > max_id || has_error)
+		{
+			return false;
+		}
+		start_id = next_start_id;
+		end_id = start_id + parallel_scan_chunk_ids - 1;
+		next_start_id = end_id + 1;
+		return true;
+	}
+
+	void addRun(const std::string& fn, size_t n_entries)
+	{
+		IScopedLock lock(mutex);
+		if (!fn.empty())
+		{
+			run_fns.push_back(fn);
+		}
+		n_read += n_entries;
+		status.processed_file_entries = static_cast<size_t>(n_read);
+		//Scanning and sorting is the first half of the work
+		update_progress(status, max_id > 0 ? (std::min)(1.0, static_cast<double>(next_start_id) / max_id)*0.5 : 0.5, starttime);
+	}
+
+	void setError()
+	{
+		IScopedLock lock(mutex);
+		has_error = true;
+	}
+
+	bool hasError()
+	{
+		IScopedLock lock(mutex);
+		return has_error;
+	}
+
+	std::string nextRunFn()
+	{
+		IScopedLock lock(mutex);
+		return "urbackup/fileindex/create_run_" + convert(n_runs++) + ".tmp";
+	}
+
+	std::vector<std::string> getRunFns()
+	{
+		IScopedLock lock(mutex);
+		return run_fns;
+	}
+
+	int64 getNRead()
+	{
+		IScopedLock lock(mutex);
+		return n_read;
+	}
+
+	int64 getStarttime()
+	{
+		return starttime;
+	}
+
+private:
+	IMutex* mutex;
+	int64 next_start_id;
+	int64 max_id;
+	bool has_error;
+	int64 n_read;
+	std::vector<std::string> run_fns;
+	size_t n_runs;
+	SStartupStatus& status;
+	int64 starttime;
+};
+
+class ParallelScanThread : public IThread
+{
+public:
+	ParallelScanThread(ParallelScanState& state)
+		: state(state)
+	{
+	}
+
+	void operator()()
+	{
+		IDatabase* db = Server->getDatabase(Server->getThreadID(), URBACKUPDB_SERVER_FILES);
+
+		if (db == NULL)
+		{
+			Server->Log("Error opening files database for parallel files index creation", LL_ERROR);
+			state.setError();
+			return;
+		}
+
+		IQuery* q_read = db->Prepare("SELECT id, shahash, filesize, clientid, next_entry, prev_entry, pointed_to, created FROM files WHERE id BETWEEN ? AND ?", false);
+
+		std::vector<SSortEntry> entries;
+
+		int64 start_id;
+		int64 end_id;
+		while (state.nextRange(start_id, end_id))
+		{
+			entries.clear();
+
+			q_read->Bind(start_id);
+			q_read->Bind(end_id);
+			IDatabaseCursor* cur = q_read->Cursor();
+
+			db_single_result res;
+			while (cur->next(res))
+			{
+				SSortEntry entry;
+				const std::string& shahash = res["shahash"];
+				entry.key = FileIndex::SIndexKey(shahash.c_str(), watoi64(res["filesize"]), watoi(res["clientid"]));
+				entry.created = watoi64(res["created"]);
+				entry.id = watoi64(res["id"]);
+				entry.next_entry = watoi64(res["next_entry"]);
+				entry.prev_entry = watoi64(res["prev_entry"]);
+				entry.pointed_to = watoi(res["pointed_to"]);
+				entries.push_back(entry);
+			}
+
+			bool has_error = cur->has_error();
+
+			q_read->Reset();
+
+			if (has_error)
+			{
+				Server->Log("Error reading files from database for parallel files index creation", LL_ERROR);
+				state.setError();
+				break;
+			}
+
+			if (entries.empty())
+			{
+				state.addRun(std::string(), 0);
+				continue;
+			}
+
+			std::sort(entries.begin(), entries.end());
+
+			std::string run_fn = state.nextRunFn();
+			std::auto_ptr<IFile> run_file(Server->openFile(run_fn, MODE_WRITE));
+
+			if (run_file.get() == NULL)
+			{
+				Server->Log("Error opening files index run file \"" + run_fn + "\". " + os_last_error_str(), LL_ERROR);
+				state.setError();
+				break;
+			}
+
+			_u32 towrite = static_cast<_u32>(entries.size() * sizeof(SSortEntry));
+			if (run_file->Write(reinterpret_cast<char*>(&entries[0]), towrite) != towrite)
+			{
+				Server->Log("Error writing files index run file \"" + run_fn + "\". " + os_last_error_str(), LL_ERROR);
+				state.setError();
+				break;
+			}
+
+			state.addRun(run_fn, entries.size());
+		}
+
+		db->destroyQuery(q_read);
+		Server->destroyDatabases(Server->getThreadID());
+	}
+
+private:
+	ParallelScanState& state;
+};
+
+class RunMergeSource : public LMDBFileIndex::ICreateEntrySource
+{
+public:
+	//status may be NULL for intermediate merges
+	RunMergeSource(SStartupStatus* status, int64 n_total, int64 starttime)
+		: status(status), n_total(n_total), n_merged(0), starttime(starttime), has_error(false)
+	{
+	}
+
+	~RunMergeSource()
+	{
+		for (size_t i = 0; i < runs.size(); ++i)
+		{
+			std::string fn = runs[i].file->getFilename();
+			Server->destroy(runs[i].file);
+			Server->deleteFile(fn);
+		}
+	}
+
+	bool init(const std::vector<std::string>& run_fns)
+	{
+		for (size_t i = 0; i < run_fns.size(); ++i)
+		{
+			if (run_fns[i].empty())
+			{
+				continue;
+			}
+
+			SRun run;
+			run.file = Server->openFile(run_fns[i], MODE_READ_SEQUENTIAL);
+			if (run.file == NULL)
+			{
+				Server->Log("Error opening files index run file \"" + run_fns[i] + "\". " + os_last_error_str(), LL_ERROR);
+				return false;
+			}
+			run.pos = 0;
+			runs.push_back(run);
+
+			if (!fillBuffer(runs.size() - 1))
+			{
+				return false;
+			}
+
+			if (!runs[runs.size() - 1].buffer.empty())
+			{
+				heap.push_back(runs.size() - 1);
+				std::push_heap(heap.begin(), heap.end(), RunOrder(runs));
+			}
+		}
+
+		return true;
+	}
+
+	virtual bool next(LMDBFileIndex::SCreateEntry& entry)
+	{
+		SSortEntry sort_entry;
+		if (!nextSortEntry(sort_entry))
+		{
+			return false;
+		}
+
+		entry.key = sort_entry.key;
+		entry.id = sort_entry.id;
+		entry.next_entry = sort_entry.next_entry;
+		entry.prev_entry = sort_entry.prev_entry;
+		entry.pointed_to = sort_entry.pointed_to;
+
+		return true;
+	}
+
+	bool nextSortEntry(SSortEntry& sort_entry)
+	{
+		if (heap.empty() || has_error)
+		{
+			return false;
+		}
+
+		std::pop_heap(heap.begin(), heap.end(), RunOrder(runs));
+		size_t run_idx = heap.back();
+		SRun& run = runs[run_idx];
+
+		sort_entry = run.buffer[run.pos];
+
+		++run.pos;
+		if (run.pos >= run.buffer.size())
+		{
+			if (!fillBuffer(run_idx))
+			{
+				has_error = true;
+			}
+		}
+
+		if (run.buffer.empty())
+		{
+			heap.pop_back();
+		}
+		else
+		{
+			std::push_heap(heap.begin(), heap.end(), RunOrder(runs));
+		}
+
+		++n_merged;
+		if (n_merged % 10000 == 0
+			&& status != NULL)
+		{
+			status->processed_file_entries = static_cast<size_t>(n_merged);
+			if (n_total > 0)
+			{
+				update_progress(*status, 0.5 + 0.5*static_cast<double>(n_merged) / n_total, starttime);
+			}
+		}
+
+		return true;
+	}
+
+	bool hasError()
+	{
+		return has_error;
+	}
+
+private:
+	struct SRun
+	{
+		IFile* file;
+		std::vector<SSortEntry> buffer;
+		size_t pos;
+	};
+
+	struct RunOrder
+	{
+		RunOrder(std::vector<SRun>& runs)
+			: runs(runs) {}
+
+		//Inverted, so that the heap top is the smallest entry
+		bool operator()(size_t a, size_t b) const
+		{
+			return runs[b].buffer[runs[b].pos] < runs[a].buffer[runs[a].pos];
+		}
+
+		std::vector<SRun>& runs;
+	};
+
+	bool fillBuffer(size_t run_idx)
+	{
+		SRun& run = runs[run_idx];
+		run.buffer.resize(parallel_merge_buffer_entries);
+		run.pos = 0;
+
+		_u32 toread = static_cast<_u32>(run.buffer.size() * sizeof(SSortEntry));
+		bool has_read_error = false;
+		_u32 read = run.file->Read(reinterpret_cast<char*>(&run.buffer[0]), toread, &has_read_error);
+
+		if (has_read_error
+			|| read % sizeof(SSortEntry) != 0)
+		{
+			Server->Log("Error reading files index run file \"" + run.file->getFilename() + "\". " + os_last_error_str(), LL_ERROR);
+			run.buffer.clear();
+			return false;
+		}
+
+		run.buffer.resize(read / sizeof(SSortEntry));
+		return true;
+	}
+
+	std::vector<SRun> runs;
+	std::vector<size_t> heap;
+	SStartupStatus* status;
+	int64 n_total;
+	int64 n_merged;
+	int64 starttime;
+	bool has_error;
+};
+
+bool merge_runs(const std::vector<std::string>& run_fns, const std::string& merged_fn)
+{
+	RunMergeSource merge_source(NULL, 0, 0);
+	if (!merge_source.init(run_fns))
+	{
+		return false;
+	}
+
+	std::auto_ptr<IFile> merged_file(Server->openFile(merged_fn, MODE_WRITE));
+	if (merged_file.get() == NULL)
+	{
+		Server->Log("Error opening files index run file \"" + merged_fn + "\". " + os_last_error_str(), LL_ERROR);
+		return false;
+	}
+
+	std::vector<SSortEntry> buffer;
+	buffer.reserve(parallel_merge_buffer_entries);
+
+	SSortEntry entry;
+	bool has_more = true;
+	while (has_more)
+	{
+		has_more = merge_source.nextSortEntry(entry);
+		if (has_more)
+		{
+			buffer.push_back(entry);
+		}
+
+		if (!buffer.empty()
+			&& (buffer.size() >= parallel_merge_buffer_entries || !has_more))
+		{
+			_u32 towrite = static_cast<_u32>(buffer.size() * sizeof(SSortEntry));
+			if (merged_file->Write(reinterpret_cast<char*>(&buffer[0]), towrite) != towrite)
+			{
+				Server->Log("Error writing files index run file \"" + merged_fn + "\". " + os_last_error_str(), LL_ERROR);
+				return false;
+			}
+			buffer.clear();
+		}
+	}
+
+	return !merge_source.hasError();
+}
+
+//Merges runs in groups until there are at most parallel_merge_max_runs left,
+//so that the final merge does not open too many files at once
+bool reduce_runs(std::vector<std::string>& run_fns, ParallelScanState& scan_state)
+{
+	while (run_fns.size() > parallel_merge_max_runs)
+	{
+		Server->Log("Merging " + convert(run_fns.size()) + " sorted runs into fewer runs...", LL_INFO);
+
+		std::vector<std::string> merged_fns;
+		for (size_t i = 0; i < run_fns.size(); i += parallel_merge_max_runs)
+		{
+			std::vector<std::string> group(run_fns.begin() + i,
+				run_fns.begin() + (std::min)(i + parallel_merge_max_runs, run_fns.size()));
+
+			if (group.size() == 1)
+			{
+				merged_fns.push_back(group[0]);
+				continue;
+			}
+
+			std::string merged_fn = scan_state.nextRunFn();
+			merged_fns.push_back(merged_fn);
+
+			if (!merge_runs(group, merged_fn))
+			{
+				run_fns.insert(run_fns.end(), merged_fns.begin(), merged_fns.end());
+				return false;
+			}
+		}
+
+		run_fns = merged_fns;
+	}
+
+	return true;
+}
+
+size_t get_parallel_threads()
+{
+	std::string files_index_threads = Server->getServerParameter("files_index_threads");
+	if (!files_index_threads.empty())
+	{
+		return static_cast<size_t>((std::max)(1, watoi(files_index_threads)));
+	}
+
+	return (std::min)(os_get_num_cpus(), parallel_max_threads);
+}
+
+bool create_files_index_parallel(LMDBFileIndex& fileindex, IDatabase* db, SStartupStatus& status, size_t n_threads)
+{
+	db_results res = db->Read("SELECT MAX(id) AS m FROM files");
+
+	int64 max_id = 0;
+	if (!res.empty())
+	{
+		max_id = watoi64(res[0]["m"]);
+	}
+
+	Server->Log("Scanning and sorting files with " + convert(n_threads) + " threads...", LL_INFO);
+
+	ParallelScanState scan_state(max_id, status);
+
+	std::vector<THREADPOOL_TICKET> tickets;
+	std::vector<ParallelScanThread*> scan_threads;
+	for (size_t i = 0; i < n_threads; ++i)
+	{
+		ParallelScanThread* scan_thread = new ParallelScanThread(scan_state);
+		scan_threads.push_back(scan_thread);
+		tickets.push_back(Server->getThreadPool()->execute(scan_thread, "files index scan"));
+	}
+
+	Server->getThreadPool()->waitFor(tickets);
+
+	for (size_t i = 0; i < scan_threads.size(); ++i)
+	{
+		delete scan_threads[i];
+	}
+
+	RunMergeSource merge_source(&status, scan_state.getNRead(), scan_state.getStarttime());
+
+	std::vector<std::string> run_fns = scan_state.getRunFns();
+
+	if (scan_state.hasError()
+		|| !reduce_runs(run_fns, scan_state)
+		|| !merge_source.init(run_fns))
+	{
+		for (size_t i = 0; i < run_fns.size(); ++i)
+		{
+			if (!run_fns[i].empty())
+			{
+				Server->deleteFile(run_fns[i]);
+			}
+		}
+		return false;
+	}
+
+	Server->Log("Merging " + convert(run_fns.size()) + " sorted runs into files index...", LL_INFO);
+
+	fileindex.create(&merge_source);
+
+	return !merge_source.hasError();
+}
+
+bool create_files_index_common(LMDBFileIndex& fileindex, SStartupStatus& status)
 {
 	Server->destroyAllDatabases();
 
@@ -158,17 +719,31 @@ bool create_files_index_common(FileIndex& fileindex, SStartupStatus& status)
 
 	Server->Log("Starting creating files index...", LL_INFO);
 
-	IQuery *q_read=db->Prepare("SELECT id, shahash, filesize, clientid, next_entry, prev_entry, pointed_to FROM files ORDER BY shahash ASC, filesize ASC, clientid ASC, created DESC");
+	size_t n_threads = get_parallel_threads();
 
-	SCallbackData data;
-	data.cur=q_read->Cursor();
-	data.pos=0;
-	data.max_pos=n_files;
-	data.status=&status;
+	bool read_error = false;
 
+	if (n_threads > 1)
 	{
 		DBScopedWriteTransaction write_transaction(db_files_new);
-		fileindex.create(create_callback, &data);
+		read_error = !create_files_index_parallel(fileindex, db, status, n_threads);
+	}
+	else
+	{
+		IQuery *q_read=db->Prepare("SELECT id, shahash, filesize, clientid, next_entry, prev_entry, pointed_to FROM files ORDER BY shahash ASC, filesize ASC, clientid ASC, created DESC");
+
+		SCallbackData data;
+		data.cur=q_read->Cursor();
+		data.pos=0;
+		data.max_pos=n_files;
+		data.status=&status;
+
+		{
+			DBScopedWriteTransaction write_transaction(db_files_new);
+			fileindex.create(create_callback, &data);
+		}
+
+		read_error = data.cur->has_error();
 	}
 
 	if(fileindex.has_error())
@@ -177,7 +752,12 @@ bool create_files_index_common(FileIndex& fileindex, SStartupStatus& status)
 	}
 	else
 	{
-		if (data.cur->has_error())
+		if (!fileindex.create_filter())
+		{
+			Server->Log("Creating file entry index filter failed. Building it on next start.", LL_WARNING);
+		}
+
+		if (read_error)
 		{
 			return false;
 		}
@@ -244,6 +824,7 @@ void delete_file_index(void)
 {
 	Server->deleteFile("urbackup/fileindex/backup_server_files_index.lmdb");
 	Server->deleteFile("urbackup/fileindex/backup_server_files_index.lmdb-lock");
+	Server->deleteFile("urbackup/fileindex/backup_server_files_index.filter");
 }
 
 bool create_files_index(SStartupStatus& status)
@@ -83,6 +83,7 @@ SStartupStatus startup_status;
 #include "create_files_index.h"
 #include "server_dir_links.h"
 #include "server_channel.h"
+#include "ImageBlockIndex.h"
 #include "DataplanDb.h"
 #include "Alerts.h"
 #include "Mailer.h"
@@ -153,6 +154,7 @@ bool verify_hashes(std::string arg);
 void updateRights(int t_userid, std::string s_rights, IDatabase *db);
 int md5sum_check();
 int blockalign();
+int verify_image();
 
 std::string lang="en";
 std::string time_format_str="%Y-%m-%d %H:%M";
@@ -458,6 +460,7 @@ DLLEXPORT void LoadActions(IServer* pServer)
 	ServerLogger::init_mutex();
 	init_dir_link_mutex();
 	WalCheckpointThread::init_mutex();
+	ImageBlockIndex::init_mutex();
 
 	std::string app=Server->getServerParameter("app", "");
 
@@ -526,10 +529,14 @@ DLLEXPORT void LoadActions(IServer* pServer)
 		{
 			rc = blockalign();
 		}
+		else if (app == "verify_image")
+		{
+			rc = verify_image();
+		}
 		else
 		{
 			rc=100;
-			Server->Log("App not found. Available apps: cleanup, remove_unknown, cleanup_database, repair_database, defrag_database, export_auth_log, check_fileindex, skiphash_copy, md5sum_check, hash, blockalign");
+			Server->Log("App not found. Available apps: cleanup, remove_unknown, cleanup_database, repair_database, defrag_database, export_auth_log, check_fileindex, skiphash_copy, md5sum_check, hash, blockalign, verify_image");
 		}
 		exit(rc);
 	}
@@ -43,6 +43,7 @@
 #include "create_files_index.h"
 #include "../urbackupcommon/WalCheckpointThread.h"
 #include "copy_storage.h"
+#include "ImageBlockIndex.h"
 #include <assert.h>
 #include <set>
 
@@ -567,6 +568,7 @@ void ServerCleanupThread::do_remove_unknown(void)
 			{
 				Server->Log("Image backup [id="+convert(res_image_backups[j].id)+" path="+res_image_backups[j].path+" clientname="+clientname+"] does not exist. Deleting it from the database.", LL_WARNING);
 				cleanupdao->removeImage(res_image_backups[j].id);
+				ImageBlockIndex::removeBackup(res_image_backups[j].id);
 			}
 			else
 			{
@@ -1015,6 +1017,7 @@ void ServerCleanupThread::cleanup_images(int64 minspace)
 				ServerLogger::Log(logid, "Deleting incomplete image \"" + incomplete_images[i].path + "\" failed.", LL_WARNING);
 			}
 			cleanupdao->removeImage(incomplete_images[i].id);
+			ImageBlockIndex::removeBackup(incomplete_images[i].id);
 		}
 	}
 
@@ -1161,6 +1164,8 @@ bool ServerCleanupThread::removeImage(int backupid, ServerSettings* settings,
 			cleanupdao->removeImage(backupid);
 			cleanupdao->removeImageSize(backupid);
 			db->EndTransaction();
+
+			ImageBlockIndex::removeBackup(backupid);
 		}
 		else
 		{
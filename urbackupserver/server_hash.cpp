@@ -41,6 +41,7 @@
 
 const size_t freespace_mod=50*1024*1024; //50 MB
 const size_t BUFFER_SIZE=64*1024; //64KB
+const size_t c_fileindex_prefetch_window=500;
 
 IMutex * delete_mutex=NULL;
 
@@ -106,19 +107,41 @@ void BackupServerHash::operator()(void)
 {
 	setupDatabase();
 
+	std::deque<std::string> queued_data;
+
 	while(true)
 	{
-		working=false;
 		std::string data;
-		size_t rc=pipe->Read(&data, static_cast<int>(60000) );
-		if(rc==0)
+		size_t rc;
+		if(queued_data.empty())
 		{
-			link_logcnt=0;
-			space_logcnt=0;
-			continue;
+			working=false;
+			rc=pipe->Read(&data, static_cast<int>(60000) );
+			if(rc==0)
+			{
+				link_logcnt=0;
+				space_logcnt=0;
+				continue;
+			}
+
+			working=true;
+
+			queued_data.push_back(data);
+
+			std::string next_data;
+			while(queued_data.size()<c_fileindex_prefetch_window
+				&& pipe->Read(&next_data, 0)>0)
+			{
+				queued_data.push_back(next_data);
+			}
+
+			prefetchFileIndex(queued_data);
 		}
-		
-		working=true;
+
+		data=queued_data.front();
+		queued_data.pop_front();
+		rc=data.size();
+
 		if(data=="exit")
 		{
 			deinitDatabase();
@@ -142,45 +165,26 @@ void BackupServerHash::operator()(void)
 
 			if(action==EAction_LinkOrCopy)
 			{
-				int64 fileid;
-				rd.getVarInt(&fileid);
-
-				std::string temp_fn;
-				rd.getStr(&temp_fn);
-
-				int backupid;
-				rd.getInt(&backupid);
-
-				int incremental;
-				rd.getInt(&incremental);
-
-				char with_hashes;
-				rd.getChar(&with_hashes);
-
-				std::string tfn;
-				rd.getStr(&tfn);
-
-				std::string hashpath;
-				rd.getStr(&hashpath);
-
-				std::string sha2;
-				if(!rd.getStr(&sha2))
-					ServerLogger::Log(logid, "Reading hash from pipe failed", LL_ERROR);
+				SLinkOrCopyItem item;
+				if(!readLinkOrCopy(rd, item))
+					ServerLogger::Log(logid, "Reading file to link or copy from pipe failed", LL_ERROR);
+
+				int64 fileid = item.fileid;
+				const std::string& temp_fn = item.temp_fn;
+				int backupid = item.backupid;
+				int incremental = item.incremental;
+				char with_hashes = item.with_hashes;
+				const std::string& tfn = item.tfn;
+				const std::string& hashpath = item.hashpath;
+				const std::string& sha2 = item.sha2;
 
 				if(sha2.size()!=SHA_DEF_DIGEST_SIZE)
 					ServerLogger::Log(logid, "SHA length of file hash of \""+tfn+"\" wrong.", LL_ERROR);
 
-				std::string hashoutput_fn;
-				rd.getStr(&hashoutput_fn);
-
-				std::string old_file_fn;
-				rd.getStr(&old_file_fn);
-
-				int64 t_filesize;
-				rd.getInt64(&t_filesize);
-
-				std::string sparse_extents_fn;
-				rd.getStr(&sparse_extents_fn);
+				const std::string& hashoutput_fn = item.hashoutput_fn;
+				const std::string& old_file_fn = item.old_file_fn;
+				int64 t_filesize = item.t_filesize;
+				const std::string& sparse_extents_fn = item.sparse_extents_fn;
 
 				FileMetadata metadata;
 				metadata.read(rd);
@@ -278,6 +282,54 @@ void BackupServerHash::operator()(void)
 	}
 }
 
+bool BackupServerHash::readLinkOrCopy(CRData& rd, SLinkOrCopyItem& item)
+{
+	return rd.getVarInt(&item.fileid)
+		&& rd.getStr(&item.temp_fn)
+		&& rd.getInt(&item.backupid)
+		&& rd.getInt(&item.incremental)
+		&& rd.getChar(&item.with_hashes)
+		&& rd.getStr(&item.tfn)
+		&& rd.getStr(&item.hashpath)
+		&& rd.getStr(&item.sha2)
+		&& rd.getStr(&item.hashoutput_fn)
+		&& rd.getStr(&item.old_file_fn)
+		&& rd.getInt64(&item.t_filesize)
+		&& rd.getStr(&item.sparse_extents_fn);
+}
+
+void BackupServerHash::prefetchFileIndex(const std::deque<std::string>& queued_data)
+{
+	prefetched_entryids.clear();
+
+	std::vector<FileIndex::SIndexKey> keys;
+
+	for(size_t i=0;i<queued_data.size();++i)
+	{
+		CRData rd(queued_data[i].data(), queued_data[i].size());
+
+		int iaction;
+		if(!rd.getInt(&iaction)
+			|| static_cast<EAction>(iaction)!=EAction_LinkOrCopy)
+		{
+			continue;
+		}
+
+		SLinkOrCopyItem item;
+		if(readLinkOrCopy(rd, item)
+			&& item.sha2.size()==SHA_DEF_DIGEST_SIZE
+			&& item.t_filesize>=link_file_min_size)
+		{
+			keys.push_back(FileIndex::SIndexKey(item.sha2.c_str(), item.t_filesize, clientid));
+		}
+	}
+
+	if(keys.size()>1)
+	{
+		fileindex->get_batch_with_cache_prefer_client(keys, prefetched_entryids);
+	}
+}
+
 void BackupServerHash::addFileSQL(int backupid, int clientid, int incremental, const std::string &fp, const std::string &hash_path, const std::string &shahash, _i64 filesize, _i64 rsize, int64 prev_entry, int64 prev_entry_clientid, int64 next_entry, bool update_fileindex)
 {
 	addFileSQL(*filesdao, *fileindex, backupid, clientid, incremental, fp, hash_path, shahash, filesize, rsize, prev_entry, prev_entry_clientid, next_entry, update_fileindex);
@@ -1100,7 +1152,7 @@ ServerFilesDao::SFindFileEntry BackupServerHash::findFileHash(const std::string
 	bool switch_to_next_client=false;
 	if(state.state==0)
 	{
-		entryid = fileindex->get_with_cache_prefer_client(FileIndex::SIndexKey(pHash.c_str(), filesize, clientid));
+		entryid = fileindex->get_with_cache_prefer_client(FileIndex::SIndexKey(pHash.c_str(), filesize, clientid), prefetched_entryids);
 		state.state=1;
 		save_orig=true;
 	}
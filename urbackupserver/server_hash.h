@@ -12,12 +12,14 @@
 #include "dao/ServerFilesDao.h"
 #include <vector>
 #include <map>
+#include <deque>
 #include "../urbackupcommon/chunk_hasher.h"
 #include "server_log.h"
 #include "../urbackupcommon/ExtentIterator.h"
 
 class FileMetadata;
 class MaxFileId;
+class CRData;
 
 const int64 link_file_min_size = 2048;
 
@@ -115,6 +117,31 @@ private:
 
 	ServerFilesDao::SFindFileEntry findFileHash(const std::string &pHash, _i64 filesize, int clientid, SFindState& state);
 
+	struct SLinkOrCopyItem
+	{
+		SLinkOrCopyItem()
+			: fileid(0), backupid(0), incremental(0), with_hashes(0), t_filesize(0)
+		{}
+
+		int64 fileid;
+		std::string temp_fn;
+		int backupid;
+		int incremental;
+		char with_hashes;
+		std::string tfn;
+		std::string hashpath;
+		std::string sha2;
+		std::string hashoutput_fn;
+		std::string old_file_fn;
+		int64 t_filesize;
+		std::string sparse_extents_fn;
+	};
+
+	//Reads an EAction_LinkOrCopy message after the action, up to the file metadata
+	static bool readLinkOrCopy(CRData& rd, SLinkOrCopyItem& item);
+
+	void prefetchFileIndex(const std::deque<std::string>& queued_data);
+
 	bool copyFile(IFile *tf, const std::string &dest, ExtentIterator* extent_iterator);
 	bool copyFileWithHashoutput(IFile *tf, const std::string &dest, const std::string hash_dest, ExtentIterator* extent_iterator);
 	bool freeSpace(int64 fs, const std::string &fp);
@@ -165,6 +192,7 @@ private:
 	_i64 cow_filesize;
 
 	FileIndex *fileindex;
+	std::map<FileIndex::SIndexKey, FileIndex::SPrefetchedEntry> prefetched_entryids;
 
 	std::string backupfolder;
 	bool old_backupfolders_loaded;
@@ -192,7 +192,7 @@ void BackupServerPrepareHash::operator()(void)
 					}
 					else
 					{
-						TreeHash treehash(NULL);
+						TreeHash treehash(NULL, TreeHash::parallelThreads());
 						if (hash_sha(tf, extent_iterator.get(), true, treehash))
 						{
 							h = treehash.finalize();
@@ -218,7 +218,7 @@ void BackupServerPrepareHash::operator()(void)
 					{
 						std::auto_ptr<IFile> l_hashoutput_f(Server->openFile(os_file_prefix(hashoutput_fn), MODE_READ));
 						hashoutput_f = l_hashoutput_f.get();
-						TreeHash treehash(NULL);
+						TreeHash treehash(NULL, TreeHash::parallelThreads());
 						hashf = &treehash;
 						if (hash_with_patch(old_file, tf, extent_iterator.get(), true))
 						{
@@ -301,7 +301,7 @@ std::string BackupServerPrepareHash::calc_hash(IFsFile * f, std::string method)
 	}
 	else
 	{
-		TreeHash treehash(NULL);
+		TreeHash treehash(NULL, TreeHash::parallelThreads());
 		if (hash_sha(f, &extent_iterator, true, treehash))
 		{
 			return treehash.finalize();
@@ -506,6 +506,12 @@ void ServerSettings::readSettingsDefault(ISettingsReader* settings_default,
 	settings->max_running_jobs_per_client = 1;
 	readIntClientSetting(q_get_client_setting, "max_running_jobs_per_client", &settings->max_running_jobs_per_client, false);
 
+	settings->file_download_connections = 1;
+	readIntClientSetting(q_get_client_setting, "file_download_connections", &settings->file_download_connections, false);
+
+	settings->file_download_max_held_back = 1000;
+	readIntClientSetting(q_get_client_setting, "file_download_max_held_back", &settings->file_download_max_held_back, false);
+
 	settings->create_linked_user_views = false;
 	readBoolClientSetting(q_get_client_setting, "create_linked_user_views", &settings->create_linked_user_views, false);
 
@@ -653,6 +659,8 @@ void ServerSettings::readSettingsClient(ISettingsReader* settings_client, IQuery
 	readBoolClientSetting(q_get_client_setting, "internet_readd_file_entries", &settings->internet_readd_file_entries);
 	readBoolClientSetting(q_get_client_setting, "background_backups", &settings->background_backups);
 	readIntClientSetting(q_get_client_setting, "max_running_jobs_per_client", &settings->max_running_jobs_per_client);
+	readIntClientSetting(q_get_client_setting, "file_download_connections", &settings->file_download_connections);
+	readIntClientSetting(q_get_client_setting, "file_download_max_held_back", &settings->file_download_max_held_back);
 	readBoolClientSetting(q_get_client_setting, "create_linked_user_views", &settings->create_linked_user_views);
 
 	readStringClientSetting(q_get_client_setting, "local_incr_image_style", std::string(), &settings->local_incr_image_style, false);
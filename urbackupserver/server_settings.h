@@ -120,6 +120,8 @@ struct SSettings
 	bool internet_readd_file_entries;
 	std::string client_access_key;
 	int max_running_jobs_per_client;
+	int file_download_connections;
+	int file_download_max_held_back;
 	bool background_backups;
 	bool create_linked_user_views;
 	std::string local_incr_image_style;
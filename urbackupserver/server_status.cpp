@@ -406,6 +406,19 @@ void ServerStatus::setProcessPcDone( const std::string &clientname, size_t id, i
 	}
 }
 
+void ServerStatus::setProcessTransferStats(const std::string & clientname, size_t id, int64 rtt_ms, size_t window, size_t in_flight)
+{
+	IScopedLock lock(mutex);
+	SProcess* proc = getProcessInt(clientname, id);
+
+	if (proc != NULL)
+	{
+		proc->transfer_rtt_ms = rtt_ms;
+		proc->transfer_window = window;
+		proc->transfer_in_flight = in_flight;
+	}
+}
+
 void ServerStatus::setProcessTotalBytes(const std::string & clientname, size_t id, int64 total_bytes)
 {
 	IScopedLock lock(mutex);
@@ -58,7 +58,8 @@ struct SProcess
 		 hashqueuesize(0), starttime(0), pcdone(-1), eta_ms(0),
 		 eta_set_time(0), stop(false), details(details),
 		speed_bpms(0), can_stop(false), total_bytes(-1),
-		done_bytes(0), detail_pc(-1), paused(false)
+		done_bytes(0), detail_pc(-1), paused(false),
+		transfer_rtt_ms(-1), transfer_window(0), transfer_in_flight(0)
 	{
 
 	}
@@ -81,6 +82,9 @@ struct SProcess
 	int64 total_bytes;
 	int64 done_bytes;
 	bool paused;
+	int64 transfer_rtt_ms;
+	size_t transfer_window;
+	size_t transfer_in_flight;
 
 	bool operator==(const SProcess& other) const
 	{
@@ -193,6 +197,9 @@ public:
 	static void setProcessPaused(const std::string &clientname, size_t id,
 		bool b);
 
+	static void setProcessTransferStats(const std::string &clientname, size_t id,
+		int64 rtt_ms, size_t window, size_t in_flight);
+
 	static void addRunningJob(const std::string &clientname);
 
 	static void subRunningJob(const std::string &clientname);
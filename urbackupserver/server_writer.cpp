@@ -32,12 +32,15 @@ extern IFSImageFactory *image_fak;
 const size_t free_space_lim=1000*1024*1024; //1000MB
 const uint64 filebuf_lim=1000*1024*1024; //1000MB
 const unsigned int sha_size=32;
+//Compression levels used as the write queue fills up (quarters), so compression never throttles ingest
+const int compression_levels[] = { 0, 5, 3, 1 };
+const size_t max_pending_buffer_files=4;
 
 ServerVHDWriter::ServerVHDWriter(IVHDFile *pVHD, unsigned int blocksize, unsigned int nbufs,
 		int pClientid, bool use_tmpfiles, int64 mbr_offset, IFile* hashfile, int64 vhd_blocksize,
 	logid_t logid, int64 drivesize)
  : mbr_offset(mbr_offset), do_trim(false), hashfile(hashfile), vhd_blocksize(vhd_blocksize), do_make_full(false),
-   logid(logid), drivesize(drivesize)
+   logid(logid), drivesize(drivesize), nbufs(nbufs), compression_level(0)
 {
 	filebuffer=use_tmpfiles;
 
@@ -93,6 +96,7 @@ void ServerVHDWriter::operator()(void)
 			BufferVHDItem item;
 			bool has_item=false;
 			bool do_exit;
+			size_t queue_size;
 			{
 				IScopedLock lock(mutex);
 				if(tqueue.empty() && exit==false)
@@ -106,6 +110,7 @@ void ServerVHDWriter::operator()(void)
 					tqueue.pop();
 					has_item=true;
 				}
+				queue_size=tqueue.size();
 			}
 			if(has_item)
 			{
@@ -113,6 +118,7 @@ void ServerVHDWriter::operator()(void)
 				{
 					if(!filebuffer)
 					{
+						adaptCompressionLevel(queue_size, nbufs);
 						writeVHD(item.pos, item.buf, item.bsize);
 					}
 					else
@@ -521,6 +527,14 @@ void ServerVHDWriter::trimmed(_i64 trim_start, _i64 trim_stop)
 	trimmed_bytes+=trim_stop-trim_start;
 }
 
+void ServerVHDWriter::makeFullProgress(int64 done_bytes, int64 total_bytes, int64 cloned_bytes, int64 copied_bytes)
+{
+	int pc = total_bytes > 0 ? static_cast<int>(done_bytes * 100 / total_bytes) : 100;
+	ServerLogger::Log(logid, "Converting to full image: " + convert(pc) + "% done. Cloned " + PrettyPrintBytes(cloned_bytes)
+		+ " and copied " + PrettyPrintBytes(copied_bytes) + " from previous images",
+		done_bytes >= total_bytes ? LL_INFO : LL_DEBUG);
+}
+
 bool ServerVHDWriter::emptyVHDBlock(int64 empty_start, int64 empty_end)
 {
 	assert(empty_start%vhd_blocksize == 0);
@@ -559,6 +573,23 @@ void ServerVHDWriter::setDoMakeFull( bool b )
 	do_make_full=b;
 }
 
+void ServerVHDWriter::adaptCompressionLevel(size_t queue_size, size_t max_queue_size)
+{
+	const size_t n_levels = sizeof(compression_levels)/sizeof(compression_levels[0]);
+	size_t idx = max_queue_size>0 ? (queue_size*n_levels)/max_queue_size : 0;
+	if(idx>=n_levels)
+	{
+		idx=n_levels-1;
+	}
+
+	if(compression_levels[idx]!=compression_level)
+	{
+		compression_level=compression_levels[idx];
+		IScopedLock lock(vhd_mutex);
+		vhd->setCompressionLevel(compression_level);
+	}
+}
+
 //-------------FilebufferWriter-----------------
 
 ServerFileBufferWriter::ServerFileBufferWriter(ServerVHDWriter *pParent, unsigned int pBlocksize) : parent(pParent), blocksize(pBlocksize)
@@ -591,6 +622,7 @@ void ServerFileBufferWriter::operator()(void)
 		IFile* tmp;
 		bool do_exit;
 		bool has_item=false;
+		size_t queue_size;
 		{
 			IScopedLock lock(mutex);
 			while(fb_queue.empty() && exit==false)
@@ -604,10 +636,13 @@ void ServerFileBufferWriter::operator()(void)
 				tmp=fb_queue.front();
 				fb_queue.pop();
 			}
+			queue_size=fb_queue.size();
 		}
 
 		if(has_item)
 		{
+			parent->adaptCompressionLevel(queue_size, max_pending_buffer_files);
+
 			tmp->Seek(0);
 			uint64 tpos=0;
 			uint64 tsize=tmp->Size();
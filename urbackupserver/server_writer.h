@@ -67,6 +67,10 @@ public:
 
 	virtual bool emptyVHDBlock(int64 empty_start, int64 empty_end);
 
+	virtual void makeFullProgress(int64 done_bytes, int64 total_bytes, int64 cloned_bytes, int64 copied_bytes);
+
+	void adaptCompressionLevel(size_t queue_size, size_t max_queue_size);
+
 private:
 	IVHDFile *vhd;
 
@@ -105,6 +109,9 @@ private:
 	logid_t logid;
 
 	int64 drivesize;
+
+	unsigned int nbufs;
+	int compression_level;
 };
 
 class ServerFileBufferWriter : public IThread
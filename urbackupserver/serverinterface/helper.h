@@ -78,6 +78,7 @@ struct SStartupStatus
 		: upgrading_database(false),
 		  creating_filesindex(false),
 		  pc_done(-1.0),
+		  eta_ms(-1),
 		curr_db_version(0),
 		target_db_version(0),
 		processed_file_entries(0),
@@ -91,6 +92,7 @@ struct SStartupStatus
 	size_t processed_file_entries;
 	
 	double pc_done;
+	int64 eta_ms;
 
 	IMutex *mutex;
 };
\ No newline at end of file
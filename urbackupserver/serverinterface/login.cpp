@@ -119,6 +119,7 @@ ACTION_IMPL(login)
 			ret.set("creating_filescache", startup_status.creating_filesindex);
 			ret.set("processed_file_entries", startup_status.processed_file_entries);
 			ret.set("percent_finished", startup_status.pc_done*100.0);
+			ret.set("eta_ms", startup_status.eta_ms);
             Server->Write( tid, ret.stringify(false) );
 			return;
 		}
@@ -106,6 +106,13 @@ ACTION_IMPL(progress)
 
 					obj.set("past_speed_bpms", past_speed_bpms);
 
+					if (clients[i].processes[j].transfer_window > 0)
+					{
+						obj.set("transfer_rtt_ms", clients[i].processes[j].transfer_rtt_ms);
+						obj.set("transfer_window", static_cast<int64>(clients[i].processes[j].transfer_window));
+						obj.set("transfer_in_flight", static_cast<int64>(clients[i].processes[j].transfer_in_flight));
+					}
+
 					if (clients[i].processes[j].can_stop 
 						&& (all_stop_rights
 							|| std::find(stop_clientids.begin(), stop_clientids.end(), curr_clientid) != stop_clientids.end() ) )
@@ -255,6 +255,8 @@ JSON::Object getJSONClientSettings(IDatabase *db, int t_clientid)
 	SET_SETTING_STR(internet_full_image_style);
 	SET_SETTING_BOOL(create_linked_user_views);
 	SET_SETTING_INT(max_running_jobs_per_client);
+	SET_SETTING_INT(file_download_connections);
+	SET_SETTING_INT(file_download_max_held_back);
 	SET_SETTING_STR(cbt_volumes);
 	SET_SETTING_STR(cbt_crash_persistent_volumes);
 	SET_SETTING_BOOL(ignore_disk_errors);